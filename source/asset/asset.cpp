@@ -5,7 +5,7 @@
 
 
 #define ASSET_PACK_CODE	(((u32)'P' << 0) | ((u32)'A' << 8) | ((u32)'C' << 16) | ((u32)'K' << 24))
-#define ASSET_PACK_VERSION	1
+#define ASSET_PACK_VERSION	2
 
 
 struct CollectedAsset {
@@ -60,6 +60,95 @@ int assetIdComparator(const void* ia, const void* ib) {
 }
 
 
+/**
+ * Fills order with the sorted positions in Eytzinger order by an in-order walk of the implicit
+ * tree, node k has children 2k and 2k+1 counting from 1.
+ * @returns the next sorted position
+ */
+static u32 makeEytzingerOrder(
+	u16* order,
+	u32 n,
+	u32 sorted,
+	u32 k)
+{
+	if (k <= n) {
+		sorted = makeEytzingerOrder(order, n, sorted, 2*k);
+		order[k-1] = (u16)sorted++;
+		sorted = makeEytzingerOrder(order, n, sorted, 2*k + 1);
+	}
+	return sorted;
+}
+
+
+/**
+ * Slots for a load factor of at most 2/3.
+ */
+static u8 getAssetIndexBits(
+	u32 numAssets)
+{
+	u8 bits = 3;
+	while ((1U << bits) < numAssets + numAssets / 2) {
+		++bits;
+	}
+	return bits;
+}
+
+
+/**
+ * Fibonacci hashing spreads the ids over the top bits.
+ */
+inline u32 getAssetIndexHomeSlot(
+	u32 assetId,
+	u8 indexBits)
+{
+	return (assetId * 0x9E3779B1U) >> (32 - indexBits);
+}
+
+
+/**
+ * The slot table lives in the pack's resident buffer, which starts with the header.
+ */
+inline AssetIndexSlot* getAssetIndexSlots(
+	const AssetPack& pack)
+{
+	return (AssetIndexSlot*)((u8*)&pack + pack.assetIndexOffset);
+}
+
+
+/**
+ * Robin Hood insertion, an entry that has probed further than the slot's takes the slot and the
+ * displaced entry carries on probing.
+ */
+static void insertAssetIndexSlot(
+	AssetPack& pack,
+	u32 assetId,
+	u16 index)
+{
+	AssetIndexSlot* slots = getAssetIndexSlots(pack);
+	u32 mask = (1U << pack.assetIndexBits) - 1;
+
+	AssetIndexSlot entry{ assetId, index, 0 };
+	u32 s = getAssetIndexHomeSlot(assetId, pack.assetIndexBits);
+
+	for (;;) {
+		AssetIndexSlot& slot = slots[s];
+		if (slot.index == AssetIndexEmptySlot || slot.probeLength < entry.probeLength) {
+			assert(entry.probeLength < UCHAR_MAX);
+			pack.maxProbeLength = max(pack.maxProbeLength, (u8)entry.probeLength);
+
+			AssetIndexSlot displaced = slot;
+			slot = entry;
+			if (displaced.index == AssetIndexEmptySlot) {
+				break;
+			}
+			entry = displaced;
+		}
+		s = (s + 1) & mask;
+		++entry.probeLength;
+	}
+}
+
+
 AssetPack* buildAssetPackFromDirectory(
 	const char* packDirectory,
 	MemoryArena& taskMem)
@@ -89,87 +178,107 @@ AssetPack* buildAssetPackFromDirectory(
 	
 	if (n > 0 && pakFile)
 	{
-		result = allocType(taskMem, AssetPack);
-		AssetPack& pack = *result;
-
-		pack.PACK = ASSET_PACK_CODE;
-		pack.version = ASSET_PACK_VERSION;
-		
-		pack.numAssets = n;
-		pack.assetInfoOffset = sizeof(AssetPack) + (sizeof(pack.assetIds[0]) * n);
-		pack.assetInfoSize = sizeof(AssetInfo) * n;
-
-		pack.pathStringsOffset = pack.assetInfoOffset + pack.assetInfoSize;
-
 		// create an indexing array to be sorted
 		AssetIndexSort* index = allocArrayOfType(taskMem, AssetIndexSort, n);
-		
-		CollectedAsset& ca = *sentinel.next;
+		u32 pathStringsSize = 0;
+		u32 assetDataSize = 0;
+
+		CollectedAsset* ca = sentinel.next;
 		for (u16 i = 0; i < n; ++i)
 		{
 			index[i].originalIndex = i;
-			index[i].assetId = ca.assetId;
-			index[i].assetInfo.size = ca.sizeBytes;
-			index[i].assetInfo.offset = pack.assetDataSize;
-			index[i].assetInfo.pathStringSize = ca.pathStringSize;
-			index[i].assetInfo.pathStringOffset = pack.pathStringsSize;
-
-			pack.pathStringsSize += ca.pathStringSize + 1; // +1 for null terminating character
-			pack.assetDataSize += ca.sizeBytes;
-			ca = *ca.next;
+			index[i].assetId = ca->assetId;
+			index[i].assetInfo = AssetInfo{};
+			index[i].assetInfo.size = ca->sizeBytes;
+			index[i].assetInfo.offset = assetDataSize;
+			index[i].assetInfo.pathStringSize = ca->pathStringSize;
+			index[i].assetInfo.pathStringOffset = pathStringsSize;
+
+			pathStringsSize += ca->pathStringSize + 1; // +1 for null terminating character
+			assetDataSize += ca->sizeBytes;
+			ca = ca->next;
 		}
 
 		// sort the index array based on assetIds
 		qsort(index, n, sizeof(index[0]), assetIdComparator);
 
-		u32* assetIds = allocArrayOfType(taskMem, u32, n);
-		AssetInfo* assetInfo = allocArrayOfType(taskMem, AssetInfo, n);
-		char* pathStrings = (char*)allocBuffer(taskMem, pack.pathStringsSize, alignof(char));
+		// lay out the resident part of the pack in one buffer, the same as it's loaded
+		AssetPack header{};
+		header.PACK = ASSET_PACK_CODE;
+		header.version = ASSET_PACK_VERSION;
+		header.numAssets = n;
+		header.assetIndexBits = getAssetIndexBits(n);
+		header.assetIndexOffset = (u32)_align(sizeof(AssetPack) + sizeof(u32) * n, alignof(AssetIndexSlot));
+		header.assetInfoOffset = header.assetIndexOffset + (sizeof(AssetIndexSlot) << header.assetIndexBits);
+		header.assetInfoSize = sizeof(AssetInfo) * n;
+		header.pathStringsOffset = header.assetInfoOffset + header.assetInfoSize;
+		header.pathStringsSize = pathStringsSize;
+		header.assetDataOffset = header.pathStringsOffset + header.pathStringsSize;
+		header.assetDataSize = assetDataSize;
+
+		u8* resident = allocBuffer(taskMem, header.assetDataOffset, alignof(AssetPack));
+		memset(resident, 0, header.assetDataOffset);
+
+		result = (AssetPack*)resident;
+		AssetPack& pack = *result;
+		pack = header;
+		pack.assetIds = (u32*)(resident + sizeof(AssetPack));
+		pack.assetInfo = (AssetInfo*)(resident + pack.assetInfoOffset);
+		pack.pathStrings = (char*)(resident + pack.pathStringsOffset);
+
+		// build the final assetIds and corresponding assetInfo arrays in Eytzinger order
+		u16* order = allocArrayOfType(taskMem, u16, n);
+		makeEytzingerOrder(order, n, 0, 1);
 
-		// build the final assetIds and corresponding assetInfo arrays using sorted index
-		// copy path strings to a single buffer in the original order
-		ca = *sentinel.next;
-		char* dst = pathStrings;
-		u32 offsetCheck = 0;
 		for (u16 i = 0; i < n; ++i)
 		{
-			pack.assetIds[i] = index[i].assetId;
-			pack.assetInfo[i] = index[i].assetInfo;
+			pack.assetIds[i] = index[order[i]].assetId;
+			pack.assetInfo[i] = index[order[i]].assetInfo;
+		}
 
-			assert(pack.assetInfo[index[i].originalIndex].pathStringOffset == offsetCheck);
+		AssetIndexSlot* slots = getAssetIndexSlots(pack);
+		for (u32 s = 0; s < (1U << pack.assetIndexBits); ++s) {
+			slots[s].index = AssetIndexEmptySlot;
+		}
+		for (u16 i = 0; i < n; ++i) {
+			insertAssetIndexSlot(pack, pack.assetIds[i], i);
+		}
 
+		// copy path strings to a single buffer in the original order
+		ca = sentinel.next;
+		char* dst = pack.pathStrings;
+		for (u16 i = 0; i < n; ++i)
+		{
 			_strncpy_s(
 				dst,
-				pathStrings+pack.pathStringsSize-dst,
-				ca.pathString,
-				ca.pathStringSize);
+				pack.pathStrings+pack.pathStringsSize-dst,
+				ca->pathString,
+				ca->pathStringSize);
 
-			offsetCheck += ca.pathStringSize + 1;
-			dst += ca.pathStringSize + 1;
-			ca = *ca.next;
+			dst += ca->pathStringSize + 1;
+			ca = ca->next;
 		}
 
-		fwrite(result, sizeof(AssetPack), 1, pakFile);
-		fwrite(assetIds, sizeof(assetIds[0]), n, pakFile);
-		fwrite(assetInfo, sizeof(AssetInfo), n, pakFile);
-		fwrite(pathStrings, sizeof(char), pack.pathStringsSize, pakFile);
+		// the header's pointers are 0 on disk
+		AssetPack diskHeader = pack;
+		diskHeader.assetIds = nullptr;
+		diskHeader.assetInfo = nullptr;
+		diskHeader.pathStrings = nullptr;
 
-		// append all assets to the pakFile
-		pack.assetDataOffset = pack.pathStringsOffset + pack.pathStringsSize;
+		fwrite(&diskHeader, sizeof(AssetPack), 1, pakFile);
+		fwrite(resident + sizeof(AssetPack), 1, pack.assetDataOffset - sizeof(AssetPack), pakFile);
 
+		// append all assets to the pakFile
 		u8* tmpBuf = allocBuffer(taskMem, 64, 64);
-		ca = *sentinel.next;
-		offsetCheck = 0;
+		ca = sentinel.next;
 		for (u16 i = 0;
 			i < n && result;
 			++i)
 		{
-			assert(pack.assetInfo[index[i].originalIndex].offset == offsetCheck);
-
 			FILE* fAsset = nullptr;
-			_fopen_s(&fAsset, ca.pathString, "rb");
+			_fopen_s(&fAsset, ca->pathString, "rb");
 			if (fAsset) {
-				u32 b = ca.sizeBytes;
+				u32 b = ca->sizeBytes;
 				while (b > 0) {
 					u32 xferBytes = min(64U, b);
 					if (fread(tmpBuf, 1, xferBytes, fAsset) != xferBytes) {
@@ -179,21 +288,14 @@ AssetPack* buildAssetPackFromDirectory(
 					fwrite(tmpBuf, 1, xferBytes, pakFile);
 					b -= xferBytes;
 				}
-				assert(feof(fAsset));
 				fclose(fAsset);
-				
-				offsetCheck += ca.sizeBytes;
 			}
 			else {
 				result = nullptr;
 			}
-			ca = *ca.next;
+			ca = ca->next;
 		}
 
-		pack.assetIds = assetIds;
-		pack.assetInfo = assetInfo;
-		pack.pathStrings = pathStrings;
-
 		fclose(pakFile);
 
 		// an error occurred, remove the pakFile
@@ -206,6 +308,93 @@ AssetPack* buildAssetPackFromDirectory(
 }
 
 
+constexpr u8 getAssetOverlayIndexBits(
+	u32 capacity)
+{
+	return (capacity > 1 ? 1 + getAssetOverlayIndexBits(capacity >> 1) : 0);
+}
+
+const u8 AssetOverlayIndexBits = getAssetOverlayIndexBits(ASSET_OVERLAY_INDEX_CAPACITY);
+static_assert((1U << AssetOverlayIndexBits) == ASSET_OVERLAY_INDEX_CAPACITY,
+			  "ASSET_OVERLAY_INDEX_CAPACITY must be a power of 2");
+
+
+/**
+ * @returns the overlay slot of the assetId, or nullptr if no open pack has it
+ */
+static AssetOverlaySlot* findAssetOverlaySlot(
+	AssetOverlayIndex& overlay,
+	u32 assetId)
+{
+	const u32 mask = ASSET_OVERLAY_INDEX_CAPACITY - 1;
+	u32 s = getAssetIndexHomeSlot(assetId, AssetOverlayIndexBits);
+
+	for (u32 probe = 0; probe <= overlay.maxProbeLength; ++probe) {
+		AssetOverlaySlot& slot = overlay.slots[s];
+		if (slot.pack == null_h32 || slot.probeLength < probe) {
+			break;
+		}
+		if (slot.assetId == assetId) {
+			return &slot;
+		}
+		s = (s + 1) & mask;
+	}
+	return nullptr;
+}
+
+
+/**
+ * Adds the assetIds of a newly opened pack to the overlay index, ids that earlier packs have are
+ * pointed to the new pack and the rest are inserted like in a pack's asset index.
+ */
+static void overlayAssetPack(
+	AssetStore& store,
+	h32 pack)
+{
+	AssetOverlayIndex& overlay = store.overlay;
+	const AssetPack& ap = *store.packs[pack]->assetPack;
+	const u32 mask = ASSET_OVERLAY_INDEX_CAPACITY - 1;
+
+	for (u16 i = 0; i < ap.numAssets; ++i) {
+		u32 assetId = ap.assetIds[i];
+
+		AssetOverlaySlot* overridden = findAssetOverlaySlot(overlay, assetId);
+		if (overridden) {
+			overridden->pack = pack;
+			overridden->index = i;
+			continue;
+		}
+
+		if (overlay.numAssetIds >= ASSET_OVERLAY_INDEX_CAPACITY / 3 * 2) {
+			assert(false && "assets of the open packs are full, consider raising ASSET_OVERLAY_INDEX_CAPACITY");
+			logger::critical(logger::Category_Error, "asset overlay index is full, assets of pack %s are missing.",
+							 store.packs[pack]->filename);
+			break;
+		}
+		++overlay.numAssetIds;
+
+		AssetOverlaySlot entry{ assetId, pack, i, 0 };
+		u32 s = getAssetIndexHomeSlot(assetId, AssetOverlayIndexBits);
+
+		for (;;) {
+			AssetOverlaySlot& slot = overlay.slots[s];
+			if (slot.pack == null_h32 || slot.probeLength < entry.probeLength) {
+				overlay.maxProbeLength = max(overlay.maxProbeLength, entry.probeLength);
+
+				AssetOverlaySlot displaced = slot;
+				slot = entry;
+				if (displaced.pack == null_h32) {
+					break;
+				}
+				entry = displaced;
+			}
+			s = (s + 1) & mask;
+			++entry.probeLength;
+		}
+	}
+}
+
+
 h32 openAssetPackFile(
 	AssetStore& store,
 	const char* filename)
@@ -223,11 +412,17 @@ h32 openAssetPackFile(
 		fread(&tmp, sizeof(AssetPack), 1, loadedPack.pakFile);
 		assert(tmp.PACK == ASSET_PACK_CODE && tmp.version == ASSET_PACK_VERSION);
 
-		u16 n = tmp.numAssets;
 		u32 loadSize = tmp.assetDataOffset;
 		
+		// read the resident part, header included so the asset index offset is from the buffer
 		rewind(loadedPack.pakFile);
 		u8* buf = heapAllocBuffer(store.assetHeap, loadSize, false);
+		if (fread(buf, 1, loadSize, loadedPack.pakFile) != loadSize) {
+			logger::critical(logger::Category_Error, "read error in pack file %s.", filename);
+			freeAlloc(buf);
+			fclose(loadedPack.pakFile);
+			return null_h32;
+		}
 		
 		tmp.assetIds = (u32*)(buf + sizeof(AssetPack));
 		tmp.assetInfo = (AssetInfo*)(buf + tmp.assetInfoOffset);
@@ -237,38 +432,93 @@ h32 openAssetPackFile(
 		*loadedPack.assetPack = tmp;
 
 		handle = store.packs.insert(&loadedPack);
+		overlayAssetPack(store, handle);
 	}
 
 	return handle;
 }
 
 
+/**
+ * Robin Hood probe, stops at an empty slot or one closer to its home than this probe.
+ */
+inline u32 findAssetIdInIndex(
+	u32 assetId,
+	const AssetPack& pack)
+{
+	const AssetIndexSlot* slots = getAssetIndexSlots(pack);
+	u32 mask = (1U << pack.assetIndexBits) - 1;
+	u32 s = getAssetIndexHomeSlot(assetId, pack.assetIndexBits);
+
+	for (u32 probe = 0; probe <= pack.maxProbeLength; ++probe) {
+		const AssetIndexSlot& slot = slots[s];
+		if (slot.index == AssetIndexEmptySlot || slot.probeLength < probe) {
+			break;
+		}
+		if (slot.assetId == assetId) {
+			return slot.index;
+		}
+		s = (s + 1) & mask;
+	}
+	return UINT_MAX;
+}
+
+
+/**
+ * Branch free descent of the Eytzinger ordered ids, the fallback for packs written without an
+ * asset index (assetIndexOffset of 0). The descent always ends past a leaf, the match if there is
+ * one is where it last went left.
+ */
+inline u32 findAssetIdEytzinger(
+	u32 assetId,
+	const AssetPack& pack)
+{
+	const u32* ids = pack.assetIds;
+	u32 n = pack.numAssets;
+	u32 k = 1;
+	while (k <= n) {
+		k = 2*k + (ids[k-1] < assetId ? 1 : 0);
+	}
+	u32 rightTurns = 0;
+	BitScanFwd(&rightTurns, ~k);
+	k >>= rightTurns + 1;
+
+	return (k != 0 && ids[k-1] == assetId ? k-1 : UINT_MAX);
+}
+
+
 u32 getAssetInfoIndex(
 	u32 assetId,
 	LoadedAssetPack& pack)
 {
 	assert(pack.pakFile);
-	u32 index = UINT_MAX;
-
-	// TODO: test search by cache line, compare <=> to last element on a cache line
-	// walk backwards if <, jump to end of next cache line if >, repeat
-	// could lead to faster overall performace due to better pre-cache prediction
-	u32* pId = (u32*)
-		bsearch(
-			&assetId,
-			pack.assetPack->assetIds,
-			pack.assetPack->numAssets,
-			sizeof(u32),
-			assetIdComparator);
-	
-	if (pId) {
-		index = (u32)(pId - pack.assetPack->assetIds); // u32 pointer difference with base gives the index
-		assert(index <= USHRT_MAX);
-	}
+	const AssetPack& ap = *pack.assetPack;
+
+	u32 index = (ap.assetIndexOffset != 0
+		? findAssetIdInIndex(assetId, ap)
+		: findAssetIdEytzinger(assetId, ap));
+
+	assert(index == UINT_MAX || index <= USHRT_MAX);
 	return index;
 }
 
 
+bool findAssetInPacks(
+	AssetStore& store,
+	u32 assetId,
+	h32& outPack,
+	u32& outAssetInfoIndex)
+{
+	AssetOverlaySlot* slot = findAssetOverlaySlot(store.overlay, assetId);
+	if (!slot) {
+		return false;
+	}
+	outPack = slot->pack;
+	outAssetInfoIndex = slot->index;
+	return true;
+}
+
+
 // TODO: replace FILE* ops with platform-specific File I/O
 // https://docs.microsoft.com/en-us/windows/desktop/FileIO/i-o-concepts
 AssetStatus loadAssetDataFromPack(
@@ -563,8 +813,19 @@ AssetHnd createAsset(
 	u32 flags,
 	AssetCallbacks* callbacks)
 {
+	u32 idx = UINT_MAX;
+	if (pack == null_h32) {
+		findAssetInPacks(store, assetId, pack, idx);
+	}
+	else {
+		idx = getAssetInfoIndex(assetId, *store.packs[pack]);
+	}
+	if (idx == UINT_MAX) {
+		logger::critical(logger::Category_Error, "asset %u not found in the open packs.", assetId);
+		return null_h32;
+	}
+
 	LoadedAssetPack& lp = *store.packs[pack];
-	u32 idx = getAssetInfoIndex(assetId, lp);
 	AssetInfo& ai = lp.assetPack->assetInfo[idx];
 	assert(ai.handle == null_h32);
 
@@ -15,11 +15,19 @@
  * are always colocated within the same pack, or are references to global resources.
  * 
  * AssetPacks include a 64-byte header, then an assetId table containing crc32 hashes of the
- * original path string sorted ascending for binary search, then AssetInfo data with an index
- * corresponding to the assetId, then a buffer of original path names indexed by an offset within
- * the AssetInfo struct, and finally the large concatenation of asset data indexed by the offset
- * within the AssetInfo struct. When the pak file is loaded into memory, all except for the asset
- * data is resident in memory.
+ * original path string in Eytzinger order (the implicit binary tree of the sorted ids laid out
+ * breadth first) for a fallback search, then the asset index, a Robin Hood hash table mapping
+ * assetId to its position in the assetId table, then AssetInfo data with an index corresponding
+ * to the assetId, then a buffer of original path names indexed by an offset within the AssetInfo
+ * struct, and finally the large concatenation of asset data indexed by the offset within the
+ * AssetInfo struct. When the pak file is loaded into memory, all except for the asset data is
+ * resident in memory, in one buffer starting with the header.
+ *
+ * Open packs are layered in the order they were opened, so patch and DLC packs opened after the
+ * base pack override any asset with the same assetId. The store keeps one overlay index from
+ * assetId to the last opened pack that has it and the asset's index in that pack, added to as
+ * each pack opens, so resolving an assetId takes one hash lookup however many packs are open and
+ * overridden assets are never read.
  */
 
 
@@ -53,6 +61,20 @@ enum AssetType : u8 {
 
 #pragma pack(push, 1)
 
+/**
+ * Slot of the asset index, the table has a power of 2 number of slots and each assetId probes
+ * forward from its home slot. Robin Hood insertion keeps the probe lengths short and even, and
+ * lets a lookup stop at the first slot closer to its home than the probe so far.
+ */
+struct AssetIndexSlot {
+	u32			assetId;
+	u16			index;				// into the assetId table, AssetIndexEmptySlot if unused
+	u16			probeLength;		// slots from the assetId's home slot
+};
+
+const u16 AssetIndexEmptySlot = 0xFFFF;
+
+
 struct AssetInfo {
 	u32			offset;				// offset to asset from base of assetData section
 	u32			size;				// assetData size
@@ -73,13 +95,15 @@ struct alignas(64) AssetPack
 	u32			pathStringsSize;	// total size of path string data including all null terminating characters
 	u32			assetDataOffset;
 	u32			assetDataSize;
-	
-	u32			_padding[2];
+	u32			assetIndexOffset;
+	u8			assetIndexBits;		// log2 of the asset index slots
+	u8			maxProbeLength;		// longest probe of any assetId in the asset index
+	u16			_padding;
 
 	// These pointers are 0 on disk and intitialized on load
 
 	u32*		assetIds;	// crc32 of the asset path/filename relative to the pack's root,
-							// unique id within the pack, array sorted for binary search
+							// unique id within the pack, array in Eytzinger order
 	AssetInfo*	assetInfo;	// array of AssetInfo, index corresponds to assetId index
 	char*		pathStrings;
 };
@@ -102,7 +126,7 @@ struct AssetCallbacks;
 
 struct Asset {
 	AssetStatus		status;
-	u32				assetInfoIndex;	// index into AssetInfo array (from bsearch of assetId)
+	u32				assetInfoIndex;	// index into AssetInfo array (from the pack's asset index)
 	u32				sizeBytes;
 	h32				assetPack;
 	
@@ -153,6 +177,24 @@ SparseHandleMap16TypedWithBuffer(Asset, AssetMap, AssetHnd, 0, ASSET_MAP_CAPACIT
 ConcurrentQueueTypedWithBuffer(AssetHnd, AssetAsyncQueue, ASSET_LOAD_QUEUE_CAPACITY, 0);
 
 
+/**
+ * Slot of the store's overlay index, same Robin Hood scheme as a pack's asset index.
+ */
+struct AssetOverlaySlot {
+	u32			assetId;
+	h32			pack;				// null_h32 if the slot is unused
+	u16			index;				// into the pack's assetId table
+	u16			probeLength;		// slots from the assetId's home slot
+};
+
+struct AssetOverlayIndex {
+	u32					numAssetIds;
+	u16					maxProbeLength;
+	u16					_padding;
+	AssetOverlaySlot	slots[ASSET_OVERLAY_INDEX_CAPACITY];
+};
+
+
 struct AssetCache {
 	AssetHnd		lruFront;
 	AssetHnd		lruBack;
@@ -163,6 +205,7 @@ struct AssetCache {
 
 struct AssetStore {
 	AssetPackMap		packs;
+	AssetOverlayIndex	overlay;		// assetId to the last opened pack that has it
 	
 	AssetMap			assets;
 	
@@ -181,10 +224,25 @@ AssetPack* buildAssetPackFromDirectory(
 	const char* packDirectory,
 	MemoryArena& taskMem);
 
+/**
+ * Opens the pack on top of the packs already open, its assets override those with the same
+ * assetId in earlier packs. Assets already created keep the pack they were created from.
+ */
 h32 openAssetPackFile(
 	AssetStore& store,
 	const char* filename);
 
+/**
+ * Finds the last opened pack that has the asset, in constant time regardless of the number of
+ * packs open.
+ * @returns false if no open pack has the asset
+ */
+bool findAssetInPacks(
+	AssetStore& store,
+	u32 assetId,
+	h32& outPack,
+	u32& outAssetInfoIndex);
+
 /**
  * Starts a thread to process the asset loading queue.
  */
@@ -210,7 +268,8 @@ void maintainAssetCache(
 
 /**
  * To convert path strings to assetId, use CRC32 macro for static strings and crc32 function for
- * runtime strings.
+ * runtime strings. Pass null_h32 for pack to take the asset from the last opened pack that has it.
+ * Returns null_h32 if the asset isn't in the pack, or in any open pack.
  */
 AssetHnd createAsset(
 	AssetStore& store,
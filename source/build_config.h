@@ -2,6 +2,13 @@
 #define QUAGMIRE_SLOWCHECKS		1	// set 1 to run slow code like asserts and other dev-time tasks
 #define QUAGMIRE_LOG_ASSERTS	0	// set 1 to log failed asserts rather than hard stop when SLOWCHECKS is enabled, could be useful during play testing if you prefer not to crash
 #define QUAGMIRE_MEMPROFILE		0	// set 1 to enable memory profiling
+#define QUAGMIRE_CULLING_BENCHMARK	0	// set 1 to check the frustum culling kernels against each other and log their ns per sphere at startup
+#define QUAGMIRE_OCCLUSION_BENCHMARK	0	// set 1 to check occlusion culling against ray casts in a synthetic city and log its timing at startup
+#define QUAGMIRE_SPATIAL_QUERY_BENCHMARK	0	// set 1 to check batched spatial queries against brute force and log the time of 10K queries at startup
+#define QUAGMIRE_HASH_BENCHMARK	0	// set 1 to check the crc and hash kernels against each other and log their throughput in GB/s at startup
+#define QUAGMIRE_STATE_HISTORY	0	// set 1 to checksum the scene's stores every update tick and keep their changes, to find desyncs and rewind
+#define QUAGMIRE_BROADPHASE	0	// set 1 to find the entities whose bspheres overlap every update, for collision systems to narrow down
+#define QUAGMIRE_RECORDING		0	// set 1 to enable record / playback of game memory and input, for instant restores and repeatable profiling captures
 #define QUAGMIRE_DEBUG_LOG		1	// set 1 to enable debug level logging TODO: is this necessary?
 #define QUAGMIRE_ALLOW_MALLOC   0   // set 1 to allow calls to Q_malloc for ease of development, 0 to assert for production readiness 
 
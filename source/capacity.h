@@ -13,9 +13,24 @@
 // Storage first block size
 #define INIT_TRANSIENT_BLOCK_MEGABYTES				64
 #define INIT_FRAMESCOPED_BLOCK_MEGABYTES			64
+#define INIT_WORKER_FRAMESCOPED_BLOCK_MEGABYTES		4
 #define INIT_MIN_ASSETHEAP_BLOCK_MEGABYTES          64
 #define INIT_IDEAL_ASSETHEAP_BLOCK_MEGABYTES        256
 
+// Worker pool
+// maximum number of worker threads, the thread calling runParallel also works on units
+#define WORKER_POOL_MAX_THREADS						15
+
+// Record / playback
+// snapshots of game memory that can be taken along one recording and played back from
+#define RECORD_MAX_SNAPSHOTS						4
+// frames of input one recording holds, 10 minutes at 60 fps
+#define RECORD_MAX_FRAMES							36000
+// input events one recording holds across all of its frames
+#define RECORD_MAX_EVENTS							65536
+// game blocks freed while a snapshot holds them, kept mapped so the snapshot can be restored
+#define RECORD_MAX_RETIRED_BLOCKS					256
+
 // File search recursion
 #define MAX_FILE_RECURSION_DEPTH					10
 
@@ -36,10 +51,18 @@
 #define ASSET_PACKS_CAPACITY						16
 #define ASSET_MAP_CAPACITY                          512
 #define ASSET_LOAD_QUEUE_CAPACITY                   32
+// slots of the merged index of all open packs, a power of 2 holding up to 2/3 as many unique assetIds
+#define ASSET_OVERLAY_INDEX_CAPACITY				131072
 
 // Scene
 // TODO: should these be smaller and we would have multiple spatial stores?
-#define SCENE_MAX_ENTITIES							USHRT_MAX-1
+#define SCENE_MAX_ENTITIES							(USHRT_MAX-1)
+// component ids of entities with more components than fit inline in their component sets
+#define ENTITY_COMPONENT_POOL_CAPACITY				65536
+// queries by component mask kept up to date as components are added and removed
+#define SCENE_MAX_COMPONENT_QUERIES					32
+// components of one prefab template, besides its SceneNode
+#define PREFAB_MAX_COMPONENTS						16
 #define SCENE_MAX_CAMERAS							64
 /**
  * TODO: make multiple active cameras supported
@@ -50,3 +73,20 @@
 #define SCENE_MAX_ACTIVE_CAMERAS					32
 #define SCENE_MAX_LIGHTS							1024
 #define SCENE_MAX_SCREEN_SHAKE_PRODUCERS			1024
+// number of pooled chunks backing the spatial grid cell buckets, each chunk holds 8 entities,
+// enough for every entity in a cell of its own plus the null chunk 0, which still fits a u16 index
+#define SPATIAL_CHUNKS_CAPACITY						(SCENE_MAX_ENTITIES+1)
+// maximum number of grid cells holding entities at once, must be a power of 2
+#define SPATIAL_MAX_OCCUPIED_CELLS					65536
+#define SCENE_MAX_OCCLUDERS							256
+// distinct occluder meshes registered with the scene, occluders sharing a mesh reference it by index
+#define SCENE_MAX_OCCLUDER_MESHES					256
+// resolution of the software depth buffer occluders are rasterized into, multiples of the 8x4 tile
+#define OCCLUSION_BUFFER_WIDTH						256
+#define OCCLUSION_BUFFER_HEIGHT						128
+// maximum number of overlapping entity pairs the broadphase keeps across updates, must be a power of 2
+#define BROADPHASE_MAX_PAIRS						262144
+// update ticks the scene history keeps checksums of and can rewind, 30 seconds at 60 ticks per second
+#define SCENE_HISTORY_MAX_TICKS						1800
+// ring buffer of the scene history's store changes, the oldest ticks are dropped when it's full
+#define SCENE_HISTORY_BUFFER_MEGABYTES				64
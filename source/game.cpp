@@ -7,6 +7,7 @@
 #include <SDL_render.h>
 #include <SDL_video.h>
 #include <SDL_syswm.h>
+#include <SDL_cpuinfo.h>
 #include "platform/platform_api.h"
 #include "game.h"
 #include "input/platform_input.h"
@@ -34,14 +35,26 @@ static Game* _game = nullptr;
 
 
 #include "utility/memory_arena.cpp"
+#include "utility/worker_pool.cpp"
 #include "utility/memory_heap.cpp"
 #include "utility/logger.cpp"
+#include "utility/hash_benchmark.cpp"
 #include "math/noise.cpp"
 #include "input/game_input.cpp"
 #include "asset/asset.cpp"
 #include "scene/camera.cpp"
 #include "scene/scene.cpp"
+#include "scene/intersection_benchmark.cpp"
 #include "scene/scene_api.cpp"
+#include "scene/scene_commands.cpp"
+#include "scene/prefab.cpp"
+#include "scene/scene_snapshot.cpp"
+#include "scene/scene_history.cpp"
+#include "scene/occlusion.cpp"
+#include "scene/occlusion_benchmark.cpp"
+#include "scene/spatial_query.cpp"
+#include "scene/spatial_query_benchmark.cpp"
+#include "scene/broadphase.cpp"
 
 #include "render/texture_gl.cpp" // eventually replace with just renderer_gl.cpp
 
@@ -70,6 +83,10 @@ void gameUpdateFrameTick(
 	// if some systems operate on 1(+) frame-old-data, can they be run in parallel?
 	// should part of this list become a task flow?
 
+	// systems record entity and component creation and removal here, instead of changing the
+	// scene's handle maps while others may be iterating them
+	SceneCommandBuffer sceneCommands{};
+
 	game.gameInput.updateFrameTick(
 			ui,
 			simContext.input,
@@ -83,6 +100,17 @@ void gameUpdateFrameTick(
 	//	ResourcePredictionSystem
 	//	etc.
 
+	#if defined(QUAGMIRE_BROADPHASE) && QUAGMIRE_BROADPHASE != 0
+	// find the entities whose bspheres overlap, the pairs stay in the frame arena for the narrowphase
+	if (game.gameScene.broadphase) {
+		updateBroadphase(
+			game.gameScene.spatial,
+			*game.gameScene.broadphase,
+			game.workers,
+			simContext.gameMemory->frameScoped);
+	}
+	#endif
+
 //	game.player.updateFrameTick(game, engine, ui);
 
 //	game.devCamera.updateFrameTick(game, engine, ui);
@@ -93,7 +121,27 @@ void gameUpdateFrameTick(
 	//	don't run every frame by offsetting the frame that it runs on
 //	game.sky.updateFrameTick(game, engine, ui);
 
-	game.screenShaker.updateFrameTick(game, game.gameScene, ui);
+	game.screenShaker.updateFrameTick(
+			game,
+			game.gameScene,
+			ui,
+			sceneCommands,
+			simContext.gameMemory->frameScoped);
+
+	// the one sync point for structural changes recorded by the systems this tick
+	playbackSceneCommands(
+			game.gameScene,
+			&sceneCommands,
+			1,
+			simContext.gameMemory->frameScoped);
+
+	#if defined(QUAGMIRE_STATE_HISTORY) && QUAGMIRE_STATE_HISTORY != 0
+	// checksum the stores as this tick left them and keep what changed
+	recordSceneHistory(
+			game.gameScene,
+			game.workers,
+			simContext.gameMemory->frameScoped);
+	#endif
 	
 //	engine.sceneManager->updateActiveScenes();
 
@@ -142,6 +190,12 @@ void gameRenderFrameTick(
 	
 	// traverse scene graph, update world positions and orientations
 	updateNodeTransforms(
+		game.gameScene,
+		game.workers,
+		gameMemory->frameScoped);
+
+	// move entities whose nodes were transformed to their new spatial grid cells
+	updateSpatialMap(
 		game.gameScene,
 		gameMemory->frameScoped);
 
@@ -157,12 +211,20 @@ void startWorkerThreads(
 	GameMemory* gameMemory)
 {
 	startAsyncLoadAssets(gameMemory);
+
+	// leave a core for this thread and one for asset loading
+	int numCores = SDL_GetCPUCount();
+	startWorkerPool(
+		gameMemory->game->workers,
+		(numCores > 2) ? (u32)(numCores - 2) : 0);
 }
 
 
 void stopWorkerThreads(
 	GameMemory* gameMemory)
 {
+	stopWorkerPool(gameMemory->game->workers);
+
 	stopAsyncLoadAssets(gameMemory);
 }
 
@@ -367,6 +429,16 @@ Game* makeGame(
 		// set up positionalEffect systems
 		game.screenShaker.init(game);
 
+		#if defined(QUAGMIRE_BROADPHASE) && QUAGMIRE_BROADPHASE != 0
+		// set up the collision broadphase, nothing consumes its pairs yet so it's opt in
+		game.gameScene.broadphase = allocType(gameMemory.gameState, BroadphaseStorage);
+		#endif
+
+		#if defined(QUAGMIRE_STATE_HISTORY) && QUAGMIRE_STATE_HISTORY != 0
+		// checksum and keep the changes of the scene's stores every update tick
+		makeSceneHistory(game.gameScene, gameMemory.gameState);
+		#endif
+
 		// ...
 	}
 
@@ -468,6 +540,11 @@ extern "C" {
 		_platformApi = platformApi;
 		logger::_log = platformApi->log;
 
+		// select runtime dispatched simd kernels, function pointers are reset on each module load
+		intersection_selectKernels(cpu_detectFeatures());
+		selectSceneKernels(cpuFeatures);
+		hash_selectKernels(cpuFeatures);
+
 		// on initial load
 		if (!gameMemory->initialized) {
 			gameMemory->gameState = makeMemoryArena();
@@ -478,6 +555,30 @@ extern "C" {
 			gameMemory->frameScoped = makeMemoryArena();
 			_allocSize(gameMemory->frameScoped, megabytes(INIT_FRAMESCOPED_BLOCK_MEGABYTES), 16);
 
+			#if defined(QUAGMIRE_CULLING_BENCHMARK) && QUAGMIRE_CULLING_BENCHMARK != 0
+			if (!intersection_runBenchmark(gameMemory->transient, cpuFeatures)) {
+				logger::error("culling kernels don't match, see the log above");
+			}
+			#endif
+
+			#if defined(QUAGMIRE_OCCLUSION_BENCHMARK) && QUAGMIRE_OCCLUSION_BENCHMARK != 0
+			if (!occlusion_runBenchmark(gameMemory->transient)) {
+				logger::error("occlusion culling hid a visible prop, see the log above");
+			}
+			#endif
+
+			#if defined(QUAGMIRE_SPATIAL_QUERY_BENCHMARK) && QUAGMIRE_SPATIAL_QUERY_BENCHMARK != 0
+			if (!spatialQuery_runBenchmark(gameMemory->transient)) {
+				logger::error("spatial queries don't match brute force, see the log above");
+			}
+			#endif
+
+			#if defined(QUAGMIRE_HASH_BENCHMARK) && QUAGMIRE_HASH_BENCHMARK != 0
+			if (!hash_runBenchmark(gameMemory->transient, cpuFeatures)) {
+				logger::error("hash kernels don't match, see the log above");
+			}
+			#endif
+
 			_game = makeGame(*gameMemory, *app);
 			
 			gameMemory->initialized = true;
@@ -8,6 +8,7 @@
 #include "utility/dense_handle_map_32.h"
 #include "utility/dense_queue.h"
 #include "utility/concurrent_queue.h"
+#include "utility/worker_pool.h"
 #include "utility/logger.h"
 #include "utility/fixed_timestep.h"
 #include "input/game_input.h"
@@ -47,7 +48,7 @@ struct Game {
 
 	FixedTimestep				simulationUpdate = {};
 
-	//ThreadPoolPtr					threadPool		= nullptr;
+	WorkerPool					workers;
 	input::GameInput			gameInput;
 	AssetStore					assetStore;
 	render::RenderAssets		renderAssets;
@@ -4,7 +4,9 @@
 void game::ScreenShakeSystem::updateFrameTick(
 	Game& game,
 	Scene& scene,
-	const UpdateInfo& ui)
+	const UpdateInfo& ui,
+	SceneCommandBuffer& sceneCommands,
+	MemoryArena& frameScoped)
 {
 	// for each ScreenShakeNode (receiver)
 	for (u16 n = 0;
@@ -62,8 +64,9 @@ void game::ScreenShakeSystem::updateFrameTick(
 	}
 
 	// for each ScreenShakeProducer component
-	u16 p = 0;
-	while (p < game.components.shakeProducers.length())
+	for (u16 p = 0;
+		p < game.components.shakeProducers.length();
+		++p)
 	{
 		Game::Components::ScreenShakeProducerComponent& cmp =
 			game.components.shakeProducers.item(p);
@@ -77,15 +80,16 @@ void game::ScreenShakeSystem::updateFrameTick(
 
 		producer.turbulence -= turbulenceFalloff;
 
-		// remove expired components (consider adding an autoremove flag to control this)
+		// remove expired components (consider adding an autoremove flag to control this), erasing
+		// is deferred to the end of the tick so the iteration isn't disturbed
 		if (producer.turbulence <= 0.0f) {
-			ComponentId thisCmpId = game.components.shakeProducers.getHandleForInnerIndex(p);
-			game.components.shakeProducers.erase(thisCmpId);
-			Entity& entity = *scene.entities[cmp.entityId];
-			entity_removeComponent(entity.gameComponents, thisCmpId);
-		}
-		else {
-			++p;
+			recordRemoveComponent(
+				sceneCommands,
+				frameScoped,
+				game.components.shakeProducers._map,
+				ComponentSet_Game,
+				cmp.entityId,
+				game.components.shakeProducers.getHandleForInnerIndex(p));
 		}
 	}
 }
@@ -122,9 +126,7 @@ void game::ScreenShakeSystem::renderFrameTick(
 		
 		dvec3 angles{ (r64)pitchAngle, (r64)yawAngle, (r64)rollAngle };
 		
-		SceneNode& shakeSceneNode = scene.components.sceneNodes[shakeNode.sceneNodeId]->data;
-		shakeSceneNode.rotationLocal = dquat_fromEulerAngles(angles);
-		shakeSceneNode.orientationDirty = 1;
+		scene_setRotation(scene, shakeNode.sceneNodeId, dquat_fromEulerAngles(angles));
 	}
 }
 
@@ -132,6 +134,14 @@ void game::ScreenShakeSystem::renderFrameTick(
 void game::ScreenShakeSystem::init(
 	Game& game)
 {
+	// so destroying an entity erases its shake components too
+	scene_registerComponentStore(
+		game.gameScene, ComponentSet_Game,
+		Game::Components::ScreenShakeNodeStoreTypeId, game.components.shakeNodes._map);
+	scene_registerComponentStore(
+		game.gameScene, ComponentSet_Game,
+		Game::Components::ScreenShakeProducerStoreTypeId, game.components.shakeProducers._map);
+
 	//playerfpsInputContextId = game.player.playerfpsInputContextId;
 
 /*
@@ -198,7 +208,7 @@ ComponentId game::addScreenShakeNodeToCamera(
 	shakeNode.data.baseSceneNodeId = camInst.sceneNodeId;
 	ComponentId shakeNodeId = game.components.shakeNodes.insert(&shakeNode);
 	
-	entity_addComponent(entity.gameComponents, shakeNodeId);
+	entity_addComponent(entity.gameComponents, scene.componentSets, shakeNodeId);
 
 	// put the camera onto the new shakable scene node, the camera's movement component remains
 	// unchanged and still points to the original scene node
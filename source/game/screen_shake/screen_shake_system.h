@@ -2,6 +2,7 @@
 #define _GAME_SCREEN_SHAKE_SYSTEM_H
 
 #include "../../game.h"
+#include "../../scene/scene_commands.h"
 #include "screen_shake_components.h"
 
 
@@ -9,10 +10,16 @@ namespace game {
 
 	struct ScreenShakeSystem {
 
+		/**
+		 * Expired ScreenShakeProducer components are removed through sceneCommands, recorded
+		 * with the frameScoped arena.
+		 */
 		void updateFrameTick(
 			Game& game,
 			Scene& scene,
-			const UpdateInfo& ui);
+			const UpdateInfo& ui,
+			SceneCommandBuffer& sceneCommands,
+			MemoryArena& frameScoped);
 		
 		void renderFrameTick(
 			Game& game,
@@ -25,6 +25,11 @@ static PlatformApi* _platformApi = nullptr;
 #include "utility/memory_arena.cpp"
 #include "utility/memory_heap.cpp"
 
+#if defined(QUAGMIRE_RECORDING) && QUAGMIRE_RECORDING != 0
+#include "platform/record_playback.cpp"
+static GameRecorder recorder;
+#endif
+
 
 bool initApplication()
 {
@@ -261,6 +266,10 @@ int gameProcess(void* ctx)
 	// gl context made current on the main loop thread
 	SDL_GL_MakeCurrent(app.windowData.window, app.windowData.glContext);
 	
+	#if defined(QUAGMIRE_RECORDING) && QUAGMIRE_RECORDING != 0
+	initRecorder(recorder, gameContext, platformMemory, *_platformApi);
+	#endif
+
 	FixedTimestep gameCodeHotLoad;
 
 	i64 realTime = timer.start();
@@ -271,16 +280,26 @@ int gameProcess(void* ctx)
 		realTime = timer.stopCounts;
 
 		if (gameContext.gameCode.isValid) {
+			input::PlatformInput* frameInput = &gameContext.input;
+			i64 gameRealTime = realTime;
+			i64 gameCountsPassed = countsPassed;
+			u64 gameFrame = frame;
+
+			#if defined(QUAGMIRE_RECORDING) && QUAGMIRE_RECORDING != 0
+			// in playback the recorder replaces the input and timing with the logged frame
+			frameInput = recorder_beginFrame(recorder, gameContext.input, gameRealTime, gameCountsPassed, gameFrame);
+			#endif
+
 			gameContext.done =
 				gameContext.gameCode.updateAndRender(
 						&gameContext.gameMemory,
 						_platformApi,
-						&gameContext.input,
+						frameInput,
 						gameContext.app,
-						realTime,
-						countsPassed,
+						gameRealTime,
+						gameCountsPassed,
 						timer.countsPerMs,
-						frame);
+						gameFrame);
 		}
 
 		SDL_GL_SwapWindow(app.windowData.window);
@@ -290,6 +309,11 @@ int gameProcess(void* ctx)
 		gameCodeHotLoad.tick(500.0f, realTime, countsPassed, timer.countsPerMs, frame, 1.0f,
 			[](UpdateInfo& ui, void* ctx) {
 				if (loadGameCode(gameContext.gameCode)) {
+					#if defined(QUAGMIRE_RECORDING) && QUAGMIRE_RECORDING != 0
+					// snapshots hold pointers into the old game code
+					recorder_stop(recorder);
+					#endif
+
 					if (!gameContext.gameCode.onLoad(
 							&gameContext.gameMemory,
 							_platformApi,
@@ -304,6 +328,10 @@ int gameProcess(void* ctx)
 		yieldThread();
 	}
 
+	#if defined(QUAGMIRE_RECORDING) && QUAGMIRE_RECORDING != 0
+	deinitRecorder(recorder, *_platformApi);
+	#endif
+
 	gameContext.gameCode.onExit(
 			&gameContext.gameMemory,
 			_platformApi,
@@ -387,9 +415,17 @@ int main(int argc, char *argv[])
 	while (!gameContext.done) {
 		SDL_Event event;
 		while (SDL_PollEvent(&event)) {
+			bool handled = false;
+
+			#if defined(QUAGMIRE_RECORDING) && QUAGMIRE_RECORDING != 0
+			handled = recorder_handleHotkey(recorder, event);
+			#endif
+
 			// send to the input system to handle the event
-			i64 eventTimestamp = timer_queryCounts();
-			bool handled = input::handleMessage(event, eventTimestamp);
+			if (!handled) {
+				i64 eventTimestamp = timer_queryCounts();
+				handled = input::handleMessage(event, eventTimestamp);
+			}
 			
 			if (!handled) {
 				switch (event.type) {
@@ -535,8 +535,6 @@ dmat4 lookAlongRH(
 
 	assert(length2(viewDir) != 0.0 && "viewDir must be normalized");
 	dvec3 B(-viewDir);
-	dvec3 S(normalize(cross(up, B)));
-	dvec3 U(cross(B, S));
 
 	// ensure that the target direction is non-zero.
 	if (B.x == 0.0 && B.y == 0.0 && B.z == 0.0)
@@ -544,17 +542,15 @@ dmat4 lookAlongRH(
 		B = zAxis;
 	}
 
-	// Ensure that the up direction is non-zero.
-	if (U.x == 0.0 && U.y == 0.0 && U.z == 0.0)
-	{
-		U = yAxis;
-	}
-
-	// if view dir and up are parallel or opposite, then compute a new,
-	// arbitrary up that is not parallel or opposite to view dir
-	if (dot(B, U) == 0.0) {
-		U = (B != xAxis) ? cross(B, xAxis) : cross(B, zAxis);
+	// if view dir and up are parallel or opposite, then use an arbitrary up that is not parallel
+	// or opposite to view dir. U is always perpendicular to B, so test the side vector before
+	// normalizing instead, otherwise the axes stop being orthonormal.
+	dvec3 S(cross(up, B));
+	if (length2(S) <= 1e-12 * length2(up)) {
+		S = cross((fabs(B.x) < 0.9 ? xAxis : yAxis), B);
 	}
+	S = normalize(S);
+	dvec3 U(cross(B, S));
 
 	return dmat4(
 		S.x, U.x, B.x, 0.0,
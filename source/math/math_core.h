@@ -38,6 +38,8 @@
 
 #define SQRT_2						1.4142135623730950488016887242097
 #define SQRT_2f						1.4142135623730950488016887242097f
+#define SQRT_3						1.7320508075688772935274463415059
+#define SQRT_3f						1.7320508075688772935274463415059f
 
 
 struct _vec2 {
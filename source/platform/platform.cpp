@@ -449,6 +449,61 @@ int platformRunDirectoryWatchLoop(
 }
 
 
+PlatformMappedFile platformMapFile(
+	const char* filename)
+{
+	PlatformMappedFile result{};
+
+	HANDLE file = CreateFileA(
+		filename,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return result;
+	}
+
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return result;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) {
+		CloseHandle(file);
+		return result;
+	}
+
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return result;
+	}
+
+	result.data = data;
+	result.size = (u64)size.QuadPart;
+	result._file = (u64)file;
+	result._mapping = (u64)mapping;
+	return result;
+}
+
+void platformUnmapFile(
+	PlatformMappedFile& mappedFile)
+{
+	if (mappedFile.data) {
+		UnmapViewOfFile(mappedFile.data);
+		CloseHandle((HANDLE)mappedFile._mapping);
+		CloseHandle((HANDLE)mappedFile._file);
+	}
+	mappedFile = {};
+}
+
+
 // NOT _WIN32
 #else
 
@@ -457,6 +512,7 @@ int platformRunDirectoryWatchLoop(
 #include <sys/types.h>
 #include <sys/resource.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <dlfcn.h>
 #include <ctime>
 
@@ -764,6 +820,48 @@ void platformDeallocate(
 	assert(result == 0);
 }
 
+PlatformMappedFile platformMapFile(
+	const char* filename)
+{
+	PlatformMappedFile result{};
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return result;
+	}
+
+	struct stat st{};
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return result;
+	}
+
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE; // fault the pages in now, the file is usually read whole
+#endif
+
+	void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+	close(fd); // the mapping keeps its own reference to the file
+	if (data == MAP_FAILED) {
+		return result;
+	}
+
+	result.data = data;
+	result.size = (u64)st.st_size;
+	return result;
+}
+
+void platformUnmapFile(
+	PlatformMappedFile& mappedFile)
+{
+	if (mappedFile.data) {
+		int result = munmap((void*)mappedFile.data, (size_t)mappedFile.size);
+		assert(result == 0);
+	}
+	mappedFile = {};
+}
+
 // END NOT WIN32
 #endif
 
@@ -858,6 +956,8 @@ PlatformApi createPlatformApi()
 	api.deallocate = &platformDeallocate;
 	api.findAllFiles = nullptr;//&platformFindAllFiles;
 	api.watchDirectory = nullptr;//&platformRunDirectoryWatchLoop;
+	api.mapFile = &platformMapFile;
+	api.unmapFile = &platformUnmapFile;
 
 	return api;
 }
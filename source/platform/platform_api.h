@@ -118,6 +118,19 @@ struct PlatformFileInfo {
 };
 
 
+// Map a file read-only into memory
+
+struct PlatformMappedFile {
+	const void*	data;		// nullptr if the file couldn't be mapped
+	u64			size;
+	u64			_file;		// platform handles of the open file and its mapping
+	u64			_mapping;
+};
+
+typedef PlatformMappedFile PlatformMapFileFunc(const char* filename);
+typedef void PlatformUnmapFileFunc(PlatformMappedFile& mappedFile);
+
+
 // Watch for file / directory changes
 
 typedef u64 PlatformFileChangeHandle;
@@ -151,6 +164,8 @@ struct PlatformApi {
 	PlatformDeallocateFunc*			deallocate;
 	PlatformFindAllFilesFunc*		findAllFiles;
 	PlatformRunDirectoryWatchLoop*	watchDirectory;
+	PlatformMapFileFunc*			mapFile;
+	PlatformUnmapFileFunc*			unmapFile;
 };
 
 struct Game;
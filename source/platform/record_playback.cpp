@@ -0,0 +1,527 @@
+#include "record_playback.h"
+#include "../utility/logger.h"
+
+
+// the recorder whose snapshots recorderDeallocate checks
+static GameRecorder* _recorder = nullptr;
+
+
+static bool isRecorderBlock(
+	GameRecorder& recorder,
+	PlatformBlock* block)
+{
+	const MemoryBlock& memoryBlock = block->memoryBlock;
+	if (memoryBlock.blockType != MemoryBlock::ArenaBlock) {
+		return false;
+	}
+	if (memoryBlock.arena == recorder.platformArena
+		|| memoryBlock.arena == &recorder.logMemory)
+	{
+		return true;
+	}
+	for (u32 s = 0; s < RECORD_MAX_SNAPSHOTS; ++s) {
+		if (memoryBlock.arena == &recorder.snapshots[s].memory) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static bool snapshotHoldsBlock(
+	const RecordedSnapshot& snapshot,
+	PlatformBlock* block)
+{
+	for (u32 b = 0; b < snapshot.numBlocks; ++b) {
+		if (snapshot.blocks[b].block == block) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static bool anySnapshotHoldsBlock(
+	GameRecorder& recorder,
+	PlatformBlock* block)
+{
+	for (u32 s = 0; s < RECORD_MAX_SNAPSHOTS; ++s) {
+		if (recorder.snapshots[s].taken && snapshotHoldsBlock(recorder.snapshots[s], block)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static i32 findRetiredBlock(
+	GameRecorder& recorder,
+	PlatformBlock* block)
+{
+	for (u32 r = 0; r < recorder.numRetiredBlocks; ++r) {
+		if (recorder.retiredBlocks[r] == block) {
+			return (i32)r;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Replaces api.deallocate while the recorder runs. Blocks a snapshot holds stay mapped and in the
+ * tracked list, retired, so the snapshot can put them back.
+ */
+static void recorderDeallocate(
+	PlatformBlock* block)
+{
+	GameRecorder& recorder = *_recorder;
+
+	if (anySnapshotHoldsBlock(recorder, block)) {
+		// blocks may be freed on worker threads
+		SDL_LockMutex(recorder.platformMemory->lock);
+		assert(recorder.numRetiredBlocks < RECORD_MAX_RETIRED_BLOCKS
+				&& "too many blocks held by snapshots, consider raising RECORD_MAX_RETIRED_BLOCKS");
+		recorder.retiredBlocks[recorder.numRetiredBlocks++] = block;
+		SDL_UnlockMutex(recorder.platformMemory->lock);
+		return;
+	}
+	recorder.deallocate(block);
+}
+
+
+/**
+ * Frees the retired blocks no snapshot holds anymore.
+ */
+static void freeRetiredBlocks(
+	GameRecorder& recorder)
+{
+	u32 r = 0;
+	while (r < recorder.numRetiredBlocks) {
+		PlatformBlock* block = recorder.retiredBlocks[r];
+		if (!anySnapshotHoldsBlock(recorder, block)) {
+			recorder.retiredBlocks[r] = recorder.retiredBlocks[--recorder.numRetiredBlocks];
+			recorder.deallocate(block);
+		}
+		else {
+			++r;
+		}
+	}
+}
+
+
+static void releaseSnapshot(
+	GameRecorder& recorder,
+	RecordedSnapshot& snapshot)
+{
+	if (!snapshot.taken) {
+		return;
+	}
+	snapshot.taken = 0;
+	snapshot.blocks = nullptr;
+	snapshot.numBlocks = 0;
+	clearArena(snapshot.memory);
+	freeRetiredBlocks(recorder);
+}
+
+
+/**
+ * Arenas hand out memory from the front of the block and keep the rest zeroed, heap allocations
+ * may be anywhere in the block.
+ */
+inline u32 getBlockExtent(
+	const MemoryBlock& memoryBlock)
+{
+	return (memoryBlock.blockType == MemoryBlock::ArenaBlock ? memoryBlock.used : memoryBlock.size);
+}
+
+
+static bool takeSnapshot(
+	GameRecorder& recorder,
+	RecordedSnapshot& snapshot)
+{
+	releaseSnapshot(recorder, snapshot);
+
+	PlatformBlock& sentinel = recorder.platformMemory->sentinel;
+
+	u32 numBlocks = 0;
+	u64 totalSize = 64;
+	for (PlatformBlock* block = sentinel.next; block != &sentinel; block = block->next) {
+		if (!isRecorderBlock(recorder, block) && findRetiredBlock(recorder, block) == -1) {
+			++numBlocks;
+			totalSize += _align((u64)getBlockExtent(block->memoryBlock), 64ULL);
+		}
+	}
+	totalSize += numBlocks * sizeof(RecordedBlock);
+
+	if (totalSize >= UINT_MAX) {
+		logger::error(logger::Category_System, "game memory is too large to snapshot");
+		return false;
+	}
+
+	pushBlock(snapshot.memory, (u32)totalSize);
+	snapshot.blocks = allocArrayOfType(snapshot.memory, RecordedBlock, numBlocks);
+
+	// the snapshot's own block was pushed to the end of the list, and is skipped as a recorder block
+	u32 b = 0;
+	for (PlatformBlock* block = sentinel.next; block != &sentinel; block = block->next) {
+		if (isRecorderBlock(recorder, block) || findRetiredBlock(recorder, block) != -1) {
+			continue;
+		}
+		RecordedBlock& recorded = snapshot.blocks[b++];
+		recorded.block = block;
+		recorded.header = block->memoryBlock;
+		recorded.extent = getBlockExtent(block->memoryBlock);
+		recorded.data = (u8*)allocBuffer(snapshot.memory, recorded.extent, 64);
+		memcpy(recorded.data, block->memoryBlock.base, recorded.extent);
+	}
+	assert(b == numBlocks);
+
+	snapshot.numBlocks = numBlocks;
+	snapshot.gameMemory = *recorder.gameMemory;
+	snapshot.taken = 1;
+	return true;
+}
+
+
+static void restoreSnapshot(
+	GameRecorder& recorder,
+	RecordedSnapshot& snapshot)
+{
+	assert(snapshot.taken);
+
+	// blocks allocated since the snapshot go, blocks freed since come back
+	PlatformBlock& sentinel = recorder.platformMemory->sentinel;
+	PlatformBlock* block = sentinel.next;
+	while (block != &sentinel) {
+		PlatformBlock* next = block->next;
+		if (!isRecorderBlock(recorder, block)) {
+			bool held = snapshotHoldsBlock(snapshot, block);
+			i32 r = findRetiredBlock(recorder, block);
+			if (r != -1) {
+				if (held) {
+					recorder.retiredBlocks[r] = recorder.retiredBlocks[--recorder.numRetiredBlocks];
+				}
+			}
+			else if (!held) {
+				recorderDeallocate(block);
+			}
+		}
+		block = next;
+	}
+
+	for (u32 b = 0; b < snapshot.numBlocks; ++b) {
+		const RecordedBlock& recorded = snapshot.blocks[b];
+		MemoryBlock& memoryBlock = recorded.block->memoryBlock;
+
+		// zero what the arena used past the snapshot, so it stays zeroed past the restored extent
+		u32 extentNow = getBlockExtent(memoryBlock);
+
+		memoryBlock = recorded.header;
+		memcpy(memoryBlock.base, recorded.data, recorded.extent);
+		if (extentNow > recorded.extent) {
+			memset((u8*)memoryBlock.base + recorded.extent, 0, extentNow - recorded.extent);
+		}
+	}
+
+	*recorder.gameMemory = snapshot.gameMemory;
+}
+
+
+/**
+ * push_n takes runs of more than one event.
+ */
+static void pushInputEvents(
+	input::ConcurrentQueue_InputEvent& queue,
+	input::InputEvent* events,
+	u32 numEvents)
+{
+	if (numEvents == 1) {
+		queue.push(events);
+	}
+	else if (numEvents > 1) {
+		queue.push_n(events, numEvents);
+	}
+}
+
+
+void initRecorder(
+	GameRecorder& recorder,
+	GameContext& gameContext,
+	MemoryArena& platformArena,
+	PlatformApi& api)
+{
+	recorder = {};
+	recorder.platformMemory = &gameContext.platformMemory;
+	recorder.platformArena = &platformArena;
+	recorder.gameMemory = &gameContext.gameMemory;
+	recorder.deallocate = api.deallocate;
+
+	recorder.logMemory = makeMemoryArena();
+	recorder.inputMemory = makeMemoryArena();
+	for (u32 s = 0; s < RECORD_MAX_SNAPSHOTS; ++s) {
+		recorder.snapshots[s].memory = makeMemoryArena();
+	}
+
+	recorder.frames = allocArrayOfType(recorder.logMemory, RecordedFrame, RECORD_MAX_FRAMES);
+	recorder.events = allocArrayOfType(recorder.logMemory, input::InputEvent, RECORD_MAX_EVENTS);
+	recorder.scratchEvents = allocArrayOfType(recorder.logMemory, input::InputEvent,
+		PLATFORMINPUT_EVENTSQUEUE_CAPACITY + PLATFORMINPUT_MOTIONEVENTSQUEUE_CAPACITY);
+
+	// same queues as the live input, in memory the snapshots take
+	input::PlatformInput& recorderInput = *allocType(recorder.inputMemory, input::PlatformInput);
+	recorderInput.eventsQueue.init(
+			PLATFORMINPUT_EVENTSQUEUE_CAPACITY,
+			allocArrayOfType(recorder.inputMemory, input::InputEvent, PLATFORMINPUT_EVENTSQUEUE_CAPACITY),
+			0);
+	recorderInput.motionEventsQueue.init(
+			PLATFORMINPUT_MOTIONEVENTSQUEUE_CAPACITY,
+			allocArrayOfType(recorder.inputMemory, input::InputEvent, PLATFORMINPUT_MOTIONEVENTSQUEUE_CAPACITY),
+			0);
+	recorderInput.popEvents.init(
+			PLATFORMINPUT_EVENTSPOPQUEUE_CAPACITY,
+			allocArrayOfType(recorder.inputMemory, input::InputEvent, PLATFORMINPUT_EVENTSPOPQUEUE_CAPACITY));
+	recorderInput.popMotionEvents.init(
+			PLATFORMINPUT_MOTIONEVENTSPOPQUEUE_CAPACITY,
+			allocArrayOfType(recorder.inputMemory, input::InputEvent, PLATFORMINPUT_MOTIONEVENTSPOPQUEUE_CAPACITY));
+	recorder.input = &recorderInput;
+
+	_recorder = &recorder;
+	api.deallocate = &recorderDeallocate;
+}
+
+
+void deinitRecorder(
+	GameRecorder& recorder,
+	PlatformApi& api)
+{
+	recorder_stop(recorder);
+
+	api.deallocate = recorder.deallocate;
+	_recorder = nullptr;
+
+	recorder.input->eventsQueue.deinit();
+	recorder.input->motionEventsQueue.deinit();
+	clearArena(recorder.inputMemory);
+	clearArena(recorder.logMemory);
+}
+
+
+void recorder_request(
+	GameRecorder& recorder,
+	RecorderRequest request)
+{
+	SDL_AtomicSet(&recorder.request, request);
+}
+
+
+bool recorder_handleHotkey(
+	GameRecorder& recorder,
+	const SDL_Event& event)
+{
+	if (event.type != SDL_KEYDOWN) {
+		return false;
+	}
+	RecorderRequest request = RecorderRequest_None;
+	switch (event.key.keysym.sym) {
+		case SDLK_F5: request = RecorderRequest_ToggleRecording; break;
+		case SDLK_F6: request = RecorderRequest_Snapshot; break;
+		case SDLK_F7: request = RecorderRequest_TogglePlayback; break;
+		default: return false;
+	}
+	if (event.key.repeat == 0) {
+		recorder_request(recorder, request);
+	}
+	return true;
+}
+
+
+bool recorder_beginRecording(
+	GameRecorder& recorder)
+{
+	recorder_stop(recorder);
+
+	recorder.numFrames = 0;
+	recorder.numEvents = 0;
+
+	RecordedSnapshot& snapshot = recorder.snapshots[0];
+	if (!takeSnapshot(recorder, snapshot)) {
+		return false;
+	}
+	snapshot.logFrame = 0;
+	recorder.numSnapshots = 1;
+	recorder.mode = Recorder_Recording;
+
+	logger::info(logger::Category_System, "recording started");
+	return true;
+}
+
+
+void recorder_endRecording(
+	GameRecorder& recorder)
+{
+	if (recorder.mode == Recorder_Recording) {
+		recorder.mode = Recorder_Idle;
+		logger::info(logger::Category_System, "recording stopped, %u frames", recorder.numFrames);
+	}
+}
+
+
+bool recorder_takeSnapshot(
+	GameRecorder& recorder)
+{
+	if (recorder.mode != Recorder_Recording) {
+		return false;
+	}
+	if (recorder.numSnapshots == RECORD_MAX_SNAPSHOTS) {
+		logger::warn(logger::Category_System,
+			"recording snapshots are full, consider raising RECORD_MAX_SNAPSHOTS");
+		return false;
+	}
+
+	RecordedSnapshot& snapshot = recorder.snapshots[recorder.numSnapshots];
+	if (!takeSnapshot(recorder, snapshot)) {
+		return false;
+	}
+	snapshot.logFrame = recorder.numFrames;
+	++recorder.numSnapshots;
+	return true;
+}
+
+
+bool recorder_beginPlayback(
+	GameRecorder& recorder,
+	u32 snapshot)
+{
+	recorder_endRecording(recorder);
+
+	if (snapshot >= recorder.numSnapshots
+		|| recorder.snapshots[snapshot].logFrame >= recorder.numFrames)
+	{
+		logger::warn(logger::Category_System, "no recorded frames to play back from snapshot %u", snapshot);
+		return false;
+	}
+
+	RecordedSnapshot& recorded = recorder.snapshots[snapshot];
+	restoreSnapshot(recorder, recorded);
+	recorder.playbackFrame = recorded.logFrame;
+	recorder.playbackSnapshot = (u8)snapshot;
+	recorder.mode = Recorder_PlayingBack;
+
+	logger::info(logger::Category_System, "playback started from snapshot %u", snapshot);
+	return true;
+}
+
+
+void recorder_endPlayback(
+	GameRecorder& recorder)
+{
+	if (recorder.mode == Recorder_PlayingBack) {
+		recorder.mode = Recorder_Idle;
+		logger::info(logger::Category_System, "playback stopped");
+	}
+}
+
+
+void recorder_stop(
+	GameRecorder& recorder)
+{
+	recorder_endRecording(recorder);
+	recorder_endPlayback(recorder);
+
+	for (u32 s = 0; s < RECORD_MAX_SNAPSHOTS; ++s) {
+		releaseSnapshot(recorder, recorder.snapshots[s]);
+	}
+	recorder.numSnapshots = 0;
+	assert(recorder.numRetiredBlocks == 0);
+}
+
+
+input::PlatformInput* recorder_beginFrame(
+	GameRecorder& recorder,
+	input::PlatformInput& liveInput,
+	i64& realTime,
+	i64& countsPassed,
+	u64& frame)
+{
+	switch (SDL_AtomicSet(&recorder.request, RecorderRequest_None)) {
+		case RecorderRequest_ToggleRecording:
+			if (recorder.mode == Recorder_Recording) {
+				recorder_endRecording(recorder);
+			}
+			else if (recorder.mode == Recorder_Idle) {
+				recorder_beginRecording(recorder);
+			}
+			break;
+		case RecorderRequest_Snapshot:
+			recorder_takeSnapshot(recorder);
+			break;
+		case RecorderRequest_TogglePlayback:
+			if (recorder.mode == Recorder_PlayingBack) {
+				recorder_endPlayback(recorder);
+			}
+			else if (recorder.numSnapshots > 0) {
+				recorder_beginPlayback(recorder, recorder.numSnapshots - 1);
+			}
+			break;
+		default:;
+	}
+
+	input::PlatformInput& recorderInput = *recorder.input;
+	const u32 maxFrameEvents = PLATFORMINPUT_EVENTSQUEUE_CAPACITY + PLATFORMINPUT_MOTIONEVENTSQUEUE_CAPACITY;
+
+	if (recorder.mode == Recorder_Recording
+		&& (recorder.numFrames == RECORD_MAX_FRAMES
+			|| recorder.numEvents + maxFrameEvents > RECORD_MAX_EVENTS))
+	{
+		logger::warn(logger::Category_System,
+			"recording is full, consider raising RECORD_MAX_FRAMES or RECORD_MAX_EVENTS");
+		recorder_endRecording(recorder);
+	}
+
+	if (recorder.mode == Recorder_PlayingBack) {
+		if (recorder.playbackFrame == recorder.numFrames) {
+			RecordedSnapshot& snapshot = recorder.snapshots[recorder.playbackSnapshot];
+			restoreSnapshot(recorder, snapshot);
+			recorder.playbackFrame = snapshot.logFrame;
+		}
+
+		// live input is dropped while the logged input plays
+		liveInput.eventsQueue.clear();
+		liveInput.motionEventsQueue.clear();
+
+		const RecordedFrame& recorded = recorder.frames[recorder.playbackFrame++];
+		input::InputEvent* events = recorder.events + recorded.firstEvent;
+		pushInputEvents(recorderInput.eventsQueue, events, recorded.numEvents);
+		pushInputEvents(recorderInput.motionEventsQueue, events + recorded.numEvents, recorded.numMotionEvents);
+		realTime = recorded.realTime;
+		countsPassed = recorded.countsPassed;
+		frame = recorded.frame;
+	}
+	else {
+		// recording pops the live events straight into the log
+		bool recording = (recorder.mode == Recorder_Recording);
+		input::InputEvent* events = (recording
+			? recorder.events + recorder.numEvents
+			: recorder.scratchEvents);
+
+		u32 numEvents = liveInput.eventsQueue.try_pop_all(events, PLATFORMINPUT_EVENTSQUEUE_CAPACITY);
+		u32 numMotionEvents = liveInput.motionEventsQueue.try_pop_all(
+			events + numEvents, PLATFORMINPUT_MOTIONEVENTSQUEUE_CAPACITY);
+
+		pushInputEvents(recorderInput.eventsQueue, events, numEvents);
+		pushInputEvents(recorderInput.motionEventsQueue, events + numEvents, numMotionEvents);
+
+		if (recording) {
+			RecordedFrame& recorded = recorder.frames[recorder.numFrames++];
+			recorded.realTime = realTime;
+			recorded.countsPassed = countsPassed;
+			recorded.frame = frame;
+			recorded.firstEvent = recorder.numEvents;
+			recorded.numEvents = (u16)numEvents;
+			recorded.numMotionEvents = (u16)numMotionEvents;
+			recorder.numEvents += numEvents + numMotionEvents;
+		}
+	}
+
+	return &recorderInput;
+}
@@ -0,0 +1,190 @@
+#ifndef _RECORD_PLAYBACK_H
+#define _RECORD_PLAYBACK_H
+
+#include <SDL_atomic.h>
+#include <SDL_events.h>
+#include "../capacity.h"
+#include "../utility/common.h"
+#include "../utility/memory.h"
+#include "../input/platform_input.h"
+#include "platform.h"
+
+/**
+ * Record / playback captures the whole game at a frame boundary and the input that follows it, so
+ * a stretch of gameplay can be replayed from the same state over and over, for repeatable
+ * profiling captures and instant restarts.
+ *
+ * A snapshot copies every PlatformBlock in the tracked list, except the platform's own and the
+ * recorder's, along with GameMemory, whose arenas point into those blocks. Only the used part of
+ * arena blocks is copied, arenas keep everything past it zeroed. Restoring puts the blocks back at
+ * the same addresses: blocks allocated since are freed, and blocks the game frees while a snapshot
+ * holds them stay mapped, retired, until no snapshot holds them.
+ *
+ * While the recorder runs, the game reads its input from a PlatformInput owned by the recorder in
+ * snapshotted memory, so events the game hasn't consumed yet are part of the snapshot. Each frame
+ * the live events are moved over, and logged along with the frame's timing when recording. Playing
+ * back restores a snapshot and feeds the logged frames that followed it in place of the live ones,
+ * looping back to the snapshot at the end of the recording.
+ *
+ * Snapshots are taken and restored between frames, with the worker threads idle. State outside of
+ * game memory isn't captured: GPU resources, files and the asset streaming thread keep their
+ * current state, and reloading the game code stops the recorder and drops its snapshots.
+ *
+ * Development hotkeys: F5 starts and stops recording, F6 takes another snapshot while recording,
+ * F7 starts and stops playback from the latest snapshot.
+ */
+
+enum RecorderMode : u8 {
+	Recorder_Idle = 0,
+	Recorder_Recording,
+	Recorder_PlayingBack
+};
+
+enum RecorderRequest : int {
+	RecorderRequest_None = 0,
+	RecorderRequest_ToggleRecording,
+	RecorderRequest_Snapshot,
+	RecorderRequest_TogglePlayback
+};
+
+
+/**
+ * Input and timing passed to the game for one frame.
+ */
+struct RecordedFrame {
+	i64		realTime;
+	i64		countsPassed;
+	u64		frame;
+	u32		firstEvent;			// index into the recorder's events, motion events follow the others
+	u16		numEvents;
+	u16		numMotionEvents;
+};
+
+
+struct RecordedBlock {
+	PlatformBlock*	block;
+	MemoryBlock		header;		// the block's MemoryBlock when the snapshot was taken
+	u8*				data;		// copy of the block's used extent
+	u32				extent;
+	u32				_padding;
+};
+
+
+struct RecordedSnapshot {
+	MemoryArena		memory;		// holds the block table and the data copies
+	GameMemory		gameMemory;
+	RecordedBlock*	blocks;
+	u32				numBlocks;
+	u32				logFrame;	// first logged frame played after restoring the snapshot
+	u8				taken;
+	u8				_padding[7];
+};
+
+
+struct GameRecorder {
+	input::PlatformInput*	input;				// what the game reads while the recorder runs
+	PlatformMemory*			platformMemory;
+	MemoryArena*			platformArena;		// blocks of the platform, never snapshotted
+	GameMemory*				gameMemory;
+	PlatformDeallocateFunc*	deallocate;			// the platform's, wrapped to keep held blocks mapped
+
+	MemoryArena				logMemory;			// frames, events and the scratch events
+	MemoryArena				inputMemory;		// holds input, snapshotted with the game
+	RecordedFrame*			frames;
+	input::InputEvent*		events;
+	input::InputEvent*		scratchEvents;		// live events of a frame that isn't logged
+	u32						numFrames;
+	u32						numEvents;
+	u32						playbackFrame;
+	u32						numRetiredBlocks;
+	u8						mode;				// RecorderMode
+	u8						playbackSnapshot;
+	u8						numSnapshots;		// snapshots taken along the current recording
+	u8						_padding;
+	SDL_atomic_t			request;			// RecorderRequest, set from any thread
+
+	PlatformBlock*			retiredBlocks[RECORD_MAX_RETIRED_BLOCKS];
+	RecordedSnapshot		snapshots[RECORD_MAX_SNAPSHOTS];
+};
+
+
+/**
+ * Call on the game thread once the game is loaded. Wraps api.deallocate so blocks held by
+ * snapshots aren't unmapped.
+ * @param platformArena	arena of the platform's own allocations, left out of snapshots
+ */
+void initRecorder(
+	GameRecorder& recorder,
+	GameContext& gameContext,
+	MemoryArena& platformArena,
+	PlatformApi& api);
+
+void deinitRecorder(
+	GameRecorder& recorder,
+	PlatformApi& api);
+
+
+/**
+ * Sets the request handled at the start of the next frame, safe to call from any thread.
+ */
+void recorder_request(
+	GameRecorder& recorder,
+	RecorderRequest request);
+
+/**
+ * Sets a request for the development hotkeys, called by the input thread.
+ * @returns true if the event was a recorder hotkey
+ */
+bool recorder_handleHotkey(
+	GameRecorder& recorder,
+	const SDL_Event& event);
+
+
+/**
+ * Starts a new recording with a snapshot of the current state in slot 0.
+ */
+bool recorder_beginRecording(
+	GameRecorder& recorder);
+
+void recorder_endRecording(
+	GameRecorder& recorder);
+
+/**
+ * Takes a snapshot of the current state in the next slot of the recording, playback from it
+ * starts with the frames logged after it.
+ */
+bool recorder_takeSnapshot(
+	GameRecorder& recorder);
+
+/**
+ * Restores the snapshot and plays back the frames logged after it, looping until
+ * recorder_endPlayback. The game continues live from wherever playback ends.
+ */
+bool recorder_beginPlayback(
+	GameRecorder& recorder,
+	u32 snapshot);
+
+void recorder_endPlayback(
+	GameRecorder& recorder);
+
+/**
+ * Ends recording or playback and releases every snapshot.
+ */
+void recorder_stop(
+	GameRecorder& recorder);
+
+
+/**
+ * Call on the game thread before each updateAndRender. Handles the pending request and moves the
+ * frame's input over, or in playback replaces the input and timing with the logged frame.
+ * @returns the PlatformInput to pass to the game
+ */
+input::PlatformInput* recorder_beginFrame(
+	GameRecorder& recorder,
+	input::PlatformInput& liveInput,
+	i64& realTime,
+	i64& countsPassed,
+	u64& frame);
+
+
+#endif
@@ -0,0 +1,713 @@
+#include "broadphase.h"
+#include "scene.h"
+#include "../utility/intrinsics.h"
+#include "../utility/memory.h"
+#include "../utility/worker_pool.h"
+#include <algorithm>
+
+
+// entities in the home cells of each work unit, units end on a cell boundary so may hold more
+const u32 BroadphaseUnitEntities = 512;
+
+// gathered sets larger than this are sorted and swept along x, smaller ones test every pair
+const u32 BroadphaseSweepThreshold = 32;
+
+// cells a home cell can reach, 13 forward neighbors, at most 3x2x3 cells of each coarser level
+// and the bucket outside of the grid
+const u32 BroadphaseMaxReachedCells = 13 + (SpatialGridLevels - 1) * 18 + 1;
+
+const u32 BroadphasePairHashBits = log2_u32(BroadphasePairHashCapacity);
+
+
+// Pair cache
+
+inline u32 hashBroadphasePair(
+	const BroadphasePair& pair)
+{
+	// fibonacci hashing of both ids, take the high bits of the product
+	u64 key = ((u64)pair.a.value << 32) | pair.b.value;
+	return (u32)((key * 0x9E3779B97F4A7C15ULL) >> (64 - BroadphasePairHashBits));
+}
+
+
+/**
+ * Position of the pair in the hash table, or UINT32_MAX if it isn't cached.
+ */
+u32 findBroadphasePair(
+	const BroadphaseStorage& bps,
+	const BroadphasePair& pair)
+{
+	const u32 mask = BroadphasePairHashCapacity - 1;
+
+	for (u32 i = hashBroadphasePair(pair);; i = (i + 1) & mask) {
+		u32 slot = bps.pairHash[i];
+		if (slot == 0) {
+			return UINT32_MAX;
+		}
+		const BroadphasePair& p = bps.pairs[slot - 1].pair;
+		if (p.a == pair.a && p.b == pair.b) {
+			return i;
+		}
+	}
+}
+
+
+/**
+ * Caches a pair that started overlapping, returns false without caching it when the cache is full.
+ */
+bool insertBroadphasePair(
+	BroadphaseStorage& bps,
+	const BroadphasePair& pair,
+	u32 frame)
+{
+	const u32 mask = BroadphasePairHashCapacity - 1;
+	if (bps.numPairs >= BROADPHASE_MAX_PAIRS) {
+		return false;
+	}
+
+	u32 i = hashBroadphasePair(pair);
+	while (bps.pairHash[i] != 0) {
+		i = (i + 1) & mask;
+	}
+	bps.pairs[bps.numPairs] = BroadphaseCachedPair{ pair, frame };
+	bps.pairHash[i] = ++bps.numPairs;
+	return true;
+}
+
+
+/**
+ * Removes the pair at a position in the hash table with the same backward shift deletion as
+ * eraseSpatialCell, and moves the last cached pair into its place in the dense array.
+ */
+void eraseBroadphasePair(
+	BroadphaseStorage& bps,
+	u32 pos)
+{
+	const u32 mask = BroadphasePairHashCapacity - 1;
+	u32 slot = bps.pairHash[pos];
+	assert(slot != 0);
+
+	u32 hole = pos;
+	for (u32 j = (pos + 1) & mask; bps.pairHash[j] != 0; j = (j + 1) & mask) {
+		u32 home = hashBroadphasePair(bps.pairs[bps.pairHash[j] - 1].pair);
+		// move j into the hole unless its home lies cyclically within (hole, j]
+		bool homeBetween = (hole <= j)
+			? (home > hole && home <= j)
+			: (home > hole || home <= j);
+		if (!homeBetween) {
+			bps.pairHash[hole] = bps.pairHash[j];
+			hole = j;
+		}
+	}
+	bps.pairHash[hole] = 0;
+
+	if (slot != bps.numPairs) {
+		const BroadphaseCachedPair& last = bps.pairs[bps.numPairs - 1];
+		bps.pairHash[findBroadphasePair(bps, last.pair)] = slot;
+		bps.pairs[slot - 1] = last;
+	}
+	--bps.numPairs;
+}
+
+
+// Pair finding
+
+/**
+ * An occupied cell in key order, the bucket outside of the grid comes last.
+ */
+struct BroadphaseCell {
+	const SpatialBucket*	bucket;
+	u32						cellKey;	// SpatialGridKeySpace for the bucket outside of the grid
+	u8						level;
+	u8						moved;		// an entity in the cell moved since the last update
+	u16						_padding;
+};
+
+
+enum BroadphaseEntryFlags : u8 {
+	BroadphaseEntry_Home  = 1,	// entity of the cell being tested
+	BroadphaseEntry_Moved = 2,
+	BroadphaseEntry_Test  = BroadphaseEntry_Home | BroadphaseEntry_Moved
+};
+
+
+/**
+ * Entities gathered for one home cell in SoA format, relative to the home cell's origin. Home
+ * entities come first. A pair is only tested when one of its entities is in the home cell and
+ * one has moved, so the flags of the two or'ed together must be BroadphaseEntry_Test.
+ */
+struct BroadphaseSet {
+	r32*			x;
+	r32*			y;
+	r32*			z;
+	r32*			r;
+	ComponentId*	ids;
+	u8*				flags;
+	u32				numHome;
+	u32				length;
+};
+
+
+/**
+ * Pairs are written up to capacity and counted past it, so a unit that runs out of room can be
+ * run again with enough.
+ */
+struct BroadphasePairOutput {
+	BroadphasePair*	pairs;
+	u32				length;
+	u32				capacity;
+};
+
+
+struct BroadphaseJob {
+	const SpatialPersistentStorage*	sps;
+	const BroadphaseStorage*		bps;
+	const BroadphaseCell*			cells;
+	const u64*						movedCells;		// bit per cell key, cells holding a moved entity
+	const u32*						unitCells;		// numUnits + 1 offsets into cells
+	const u32*						unitOffsets;	// numUnits + 1 offsets into pairs
+	BroadphasePair*					pairs;
+	u32*							unitLengths;	// pairs found by each unit
+	u8								outsideMoved;
+};
+
+
+inline void addBroadphasePair(
+	BroadphasePairOutput& out,
+	ComponentId a,
+	ComponentId b)
+{
+	if (out.length < out.capacity) {
+		out.pairs[out.length] = (a < b) ? BroadphasePair{ a, b } : BroadphasePair{ b, a };
+	}
+	++out.length;
+}
+
+
+inline void testBroadphaseEntries(
+	const BroadphaseSet& set,
+	u32 i,
+	u32 j,
+	BroadphasePairOutput& out)
+{
+	r32 dx = set.x[j] - set.x[i];
+	r32 dy = set.y[j] - set.y[i];
+	r32 dz = set.z[j] - set.z[i];
+	r32 rr = set.r[i] + set.r[j];
+	if (dx*dx + dy*dy + dz*dz <= rr*rr) {
+		addBroadphasePair(out, set.ids[i], set.ids[j]);
+	}
+}
+
+
+/**
+ * Appends the entities of a bucket to the set. offset moves the bucket's bspheres relative to the
+ * home cell. Entities of other cells are only kept if they overlap the bounds of the home
+ * entities, and if onlyMoved is set, if they moved.
+ */
+void gatherBroadphaseBucket(
+	const SpatialBucket& bucket,
+	const vec3& offset,
+	bool home,
+	bool onlyMoved,
+	const vec3& boundsMin,
+	const vec3& boundsMax,
+	const SpatialPersistentStorage& sps,
+	const BroadphaseStorage& bps,
+	BroadphaseSet& set)
+{
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		const SpatialChunk& chunk = sps.chunks[c];
+
+		for (u32 l = 0; l < chunkLength; ++l) {
+			ComponentId id = chunk.spatialInfoIds[l];
+			bool moved = (bps.proxies[id.index].movedFrame == bps.frame);
+			r32 x = chunk.x[l] + offset.x;
+			r32 y = chunk.y[l] + offset.y;
+			r32 z = chunk.z[l] + offset.z;
+			r32 r = chunk.r[l];
+
+			if (!home
+				&& ((onlyMoved && !moved)
+					|| x + r < boundsMin.x || x - r > boundsMax.x
+					|| y + r < boundsMin.y || y - r > boundsMax.y
+					|| z + r < boundsMin.z || z - r > boundsMax.z))
+			{
+				continue;
+			}
+
+			u32 e = set.length++;
+			set.x[e] = x;
+			set.y[e] = y;
+			set.z[e] = z;
+			set.r[e] = r;
+			set.ids[e] = id;
+			set.flags[e] = (home ? BroadphaseEntry_Home : 0) | (moved ? BroadphaseEntry_Moved : 0);
+		}
+
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+}
+
+
+/**
+ * Sorts the set by the low end of each bsphere along x and sweeps it, each entity is only tested
+ * against those that start before it ends.
+ */
+void sweepBroadphaseSet(
+	const BroadphaseSet& set,
+	BroadphasePairOutput& out,
+	MemoryArena& scratch)
+{
+	struct SweepKey {
+		r32		minX;
+		u32		entry;
+	};
+
+	u32 n = set.length;
+	SweepKey* keys = allocArrayOfType(scratch, SweepKey, n);
+	for (u32 e = 0; e < n; ++e) {
+		keys[e] = SweepKey{ set.x[e] - set.r[e], e };
+	}
+	std::sort(keys, keys + n, [](const SweepKey& a, const SweepKey& b) {
+		return (a.minX < b.minX || (a.minX == b.minX && a.entry < b.entry));
+	});
+
+	// sorted copy so the sweep reads memory in order
+	BroadphaseSet sorted{};
+	sorted.x = allocArrayOfType(scratch, r32, n);
+	sorted.y = allocArrayOfType(scratch, r32, n);
+	sorted.z = allocArrayOfType(scratch, r32, n);
+	sorted.r = allocArrayOfType(scratch, r32, n);
+	sorted.ids = allocArrayOfType(scratch, ComponentId, n);
+	sorted.flags = allocArrayOfType(scratch, u8, n);
+	sorted.length = n;
+	for (u32 s = 0; s < n; ++s) {
+		u32 e = keys[s].entry;
+		sorted.x[s] = set.x[e];
+		sorted.y[s] = set.y[e];
+		sorted.z[s] = set.z[e];
+		sorted.r[s] = set.r[e];
+		sorted.ids[s] = set.ids[e];
+		sorted.flags[s] = set.flags[e];
+	}
+
+	for (u32 i = 0; i < n; ++i) {
+		r32 maxX = sorted.x[i] + sorted.r[i];
+		u8 flags = sorted.flags[i];
+		for (u32 j = i + 1; j < n && keys[j].minX <= maxX; ++j) {
+			if ((flags | sorted.flags[j]) == BroadphaseEntry_Test) {
+				testBroadphaseEntries(sorted, i, j, out);
+			}
+		}
+	}
+}
+
+
+/**
+ * Finds the pairs between the entities of a home cell and those of every cell they can reach. An
+ * entity's bsphere center lies in its cell and its radius is at most half of the cell's xz size,
+ * so entities of the same level can only overlap entities of neighboring cells. Of each two
+ * neighbors only the one that comes first tests the other, and entities of finer levels are
+ * tested by their own cell, so each pair of cells is visited once.
+ */
+void findBroadphaseCellPairs(
+	const BroadphaseJob& job,
+	const BroadphaseCell& home,
+	BroadphasePairOutput& out,
+	MemoryArena& scratch)
+{
+	const SpatialPersistentStorage& sps = *job.sps;
+	const BroadphaseStorage& bps = *job.bps;
+	const SpatialOccupancy& occ = sps.occupancy;
+
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(scratch);
+
+	struct ReachedCell {
+		const SpatialBucket*	bucket;
+		dvec3					origin;
+	};
+	ReachedCell reached[BroadphaseMaxReachedCells];
+	u32 numReached = 0;
+
+	bool outsideHome = (home.cellKey == SpatialGridKeySpace);
+	dvec3 homeOrigin{ 0.0, 0.0, 0.0 };
+
+	// entities that didn't move only need to be tested against other cells' moved entities
+	auto reachCell = [&](u32 cellKey, u32 level, const SpatialCell& cell) {
+		if ((occ.cells[cellKey >> 6] & (1ULL << (cellKey & 63))) == 0
+			|| (!home.moved && (job.movedCells[cellKey >> 6] & (1ULL << (cellKey & 63))) == 0))
+		{
+			return;
+		}
+		assert(numReached < BroadphaseMaxReachedCells);
+		reached[numReached++] = ReachedCell{
+			&sps.cells[findSpatialCell(sps, cellKey)].bucket,
+			getSpatialCellOrigin(cell, level)
+		};
+	};
+
+	if (!outsideHome) {
+		u32 level = home.level;
+		SpatialCell cell = getSpatialCellFromKey(home.cellKey, level);
+		homeOrigin = getSpatialCellOrigin(cell, level);
+
+		i32 dimX = gridSizeX >> (2 * level);
+		i32 dimY = max(gridSizeY >> (2 * level), 1);
+		i32 dimZ = gridSizeZ >> (2 * level);
+
+		// forward half of the neighbors on the same level
+		for (i32 dz = 0; dz <= 1; ++dz) {
+			for (i32 dy = (dz > 0 ? -1 : 0); dy <= 1; ++dy) {
+				for (i32 dx = (dz > 0 || dy > 0 ? -1 : 1); dx <= 1; ++dx) {
+					i32 x = cell.x + dx;
+					i32 y = cell.y + dy;
+					i32 z = cell.z + dz;
+					if (x < 0 || y < 0 || z < 0 || x >= dimX || y >= dimY || z >= dimZ) {
+						continue;
+					}
+					SpatialCell n{ (u8)x, (u8)y, (u8)z };
+					reachCell(getSpatialCellKey(n, level), level, n);
+				}
+			}
+		}
+
+		// cells of coarser levels whose entities can reach the loose bounds of this cell
+		r64 scale = (r64)(1 << (2 * level));
+		r64 halfCell = spatialGridSizeXZ * 0.5 * scale;
+		dvec3 homeSize{ spatialGridSizeXZ * scale, spatialGridSizeY * scale, spatialGridSizeXZ * scale };
+
+		for (u32 coarse = level + 1; coarse < SpatialGridLevels; ++coarse) {
+			r64 coarseScale = (r64)(1 << (2 * coarse));
+			r64 cellSizeXZ = spatialGridSizeXZ * coarseScale;
+			r64 cellSizeY = spatialGridSizeY * coarseScale;
+			// a little past both half cells, so rounding can't drop a cell
+			r64 margin = halfCell + cellSizeXZ * 0.5 + 0.01;
+			dvec3 lo = homeOrigin - margin;
+			dvec3 hi = homeOrigin + homeSize + margin;
+
+			i32 bounds[6] = {
+				(i32)max(lo.x / cellSizeXZ, 0.0), (i32)min(hi.x / cellSizeXZ, (r64)((gridSizeX >> (2 * coarse)) - 1)),
+				(i32)max(lo.y / cellSizeY,  0.0), (i32)min(hi.y / cellSizeY,  (r64)(max(gridSizeY >> (2 * coarse), 1) - 1)),
+				(i32)max(lo.z / cellSizeXZ, 0.0), (i32)min(hi.z / cellSizeXZ, (r64)((gridSizeZ >> (2 * coarse)) - 1))
+			};
+			for (i32 z = bounds[4]; z <= bounds[5]; ++z) {
+				for (i32 y = bounds[2]; y <= bounds[3]; ++y) {
+					for (i32 x = bounds[0]; x <= bounds[1]; ++x) {
+						SpatialCell n{ (u8)x, (u8)y, (u8)z };
+						reachCell(getSpatialCellKey(n, coarse), coarse, n);
+					}
+				}
+			}
+		}
+
+		// entities outside of the grid are stored relative to the world origin
+		if (sps.outsideGrid.length > 0 && (home.moved || job.outsideMoved)) {
+			assert(numReached < BroadphaseMaxReachedCells);
+			reached[numReached++] = ReachedCell{ &sps.outsideGrid, dvec3{ 0.0, 0.0, 0.0 } };
+		}
+	}
+
+	if (!home.moved && numReached == 0) {
+		return;
+	}
+
+	u32 maxEntries = home.bucket->length;
+	for (u32 n = 0; n < numReached; ++n) {
+		maxEntries += reached[n].bucket->length;
+	}
+
+	BroadphaseSet set{};
+	set.x = allocArrayOfType(scratch, r32, maxEntries);
+	set.y = allocArrayOfType(scratch, r32, maxEntries);
+	set.z = allocArrayOfType(scratch, r32, maxEntries);
+	set.r = allocArrayOfType(scratch, r32, maxEntries);
+	set.ids = allocArrayOfType(scratch, ComponentId, maxEntries);
+	set.flags = allocArrayOfType(scratch, u8, maxEntries);
+
+	gatherBroadphaseBucket(
+		*home.bucket, vec3{ 0.0f, 0.0f, 0.0f }, true, false,
+		vec3{}, vec3{}, sps, bps, set);
+	set.numHome = set.length;
+
+	// other cells' entities are only kept if they reach the home entities' bounds
+	vec3 boundsMin{ FLT_MAX, FLT_MAX, FLT_MAX };
+	vec3 boundsMax{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (u32 e = 0; e < set.numHome; ++e) {
+		boundsMin.x = min(boundsMin.x, set.x[e] - set.r[e]);
+		boundsMin.y = min(boundsMin.y, set.y[e] - set.r[e]);
+		boundsMin.z = min(boundsMin.z, set.z[e] - set.r[e]);
+		boundsMax.x = max(boundsMax.x, set.x[e] + set.r[e]);
+		boundsMax.y = max(boundsMax.y, set.y[e] + set.r[e]);
+		boundsMax.z = max(boundsMax.z, set.z[e] + set.r[e]);
+	}
+
+	for (u32 n = 0; n < numReached; ++n) {
+		gatherBroadphaseBucket(
+			*reached[n].bucket, make_vec3(reached[n].origin - homeOrigin), false, !home.moved,
+			boundsMin, boundsMax, sps, bps, set);
+	}
+
+	if (set.length > BroadphaseSweepThreshold) {
+		sweepBroadphaseSet(set, out, scratch);
+		return;
+	}
+
+	// other cells' entities come after the home entities, so those pairs are never tested
+	for (u32 i = 0; i < set.numHome; ++i) {
+		u8 flags = set.flags[i];
+		for (u32 j = i + 1; j < set.length; ++j) {
+			if ((flags | set.flags[j]) == BroadphaseEntry_Test) {
+				testBroadphaseEntries(set, i, j, out);
+			}
+		}
+	}
+}
+
+
+void findBroadphaseRangePairs(
+	const BroadphaseJob& job,
+	u32 cellBegin,
+	u32 cellEnd,
+	BroadphasePairOutput& out,
+	MemoryArena& scratch)
+{
+	for (u32 c = cellBegin; c < cellEnd; ++c) {
+		findBroadphaseCellPairs(job, job.cells[c], out, scratch);
+	}
+}
+
+
+void findBroadphaseUnitPairs(
+	void* jobData,
+	u32 unit,
+	MemoryArena& frameScoped)
+{
+	BroadphaseJob& job = *(BroadphaseJob*)jobData;
+
+	BroadphasePairOutput out{
+		job.pairs + job.unitOffsets[unit],
+		0,
+		job.unitOffsets[unit + 1] - job.unitOffsets[unit]
+	};
+	findBroadphaseRangePairs(job, job.unitCells[unit], job.unitCells[unit + 1], out, frameScoped);
+	job.unitLengths[unit] = out.length;
+}
+
+
+/**
+ * Compares each entity's bsphere in the grid with its proxy from the last update, marking the
+ * entity moved when it changed and the cell when any of its entities did.
+ */
+bool refreshBroadphaseProxies(
+	const SpatialBucket& bucket,
+	u32 cellKey,
+	const SpatialPersistentStorage& sps,
+	BroadphaseStorage& bps)
+{
+	bool cellMoved = false;
+
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		const SpatialChunk& chunk = sps.chunks[c];
+
+		for (u32 l = 0; l < chunkLength; ++l) {
+			ComponentId id = chunk.spatialInfoIds[l];
+			BroadphaseProxy& proxy = bps.proxies[id.index];
+
+			if (proxy.spatialInfoId != id || proxy.cellKey != cellKey
+				|| proxy.x != chunk.x[l] || proxy.y != chunk.y[l]
+				|| proxy.z != chunk.z[l] || proxy.r != chunk.r[l])
+			{
+				proxy = BroadphaseProxy{
+					id, cellKey,
+					chunk.x[l], chunk.y[l], chunk.z[l], chunk.r[l],
+					bps.frame, bps.frame };
+				cellMoved = true;
+			}
+			proxy.seenFrame = bps.frame;
+		}
+
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+	return cellMoved;
+}
+
+
+BroadphaseResults updateBroadphase(
+	const SpatialPersistentStorage& sps,
+	BroadphaseStorage& bps,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
+{
+	const u32 frame = ++bps.frame;
+	const SpatialOccupancy& occ = sps.occupancy;
+
+	BroadphaseJob job{};
+	job.sps = &sps;
+	job.bps = &bps;
+
+	// occupied cells in key order, refreshing the proxies of their entities
+	BroadphaseCell* cells = allocArrayOfType(frameScoped, BroadphaseCell, sps.numOccupiedCells + 1);
+	u64* movedCells = allocArrayOfType(frameScoped, u64, SpatialGridKeySpace / 64);
+	u32 numCells = 0;
+	u32 numEntities = 0;
+
+	const u32 numRegionWords = countof(occ.regions);
+	for (u32 rw = 0; rw < numRegionWords; ++rw) {
+		u64 regionBits = occ.regions[rw];
+		while (regionBits) {
+			u32 rb = 0;
+			BitScanFwd64(&rb, regionBits);
+			regionBits &= regionBits - 1;
+
+			u32 blockWord = (rw << 6) | rb;
+			u64 blockBits = occ.blocks[blockWord];
+			while (blockBits) {
+				u32 bb = 0;
+				BitScanFwd64(&bb, blockBits);
+				blockBits &= blockBits - 1;
+
+				u32 cellWord = (blockWord << 6) | bb;
+				u64 cellBits = occ.cells[cellWord];
+				while (cellBits) {
+					u32 cb = 0;
+					BitScanFwd64(&cb, cellBits);
+					cellBits &= cellBits - 1;
+
+					u32 cellKey = (cellWord << 6) | cb;
+					const SpatialBucket& bucket = sps.cells[findSpatialCell(sps, cellKey)].bucket;
+					bool moved = refreshBroadphaseProxies(bucket, cellKey, sps, bps);
+					if (moved) {
+						movedCells[cellWord] |= 1ULL << cb;
+					}
+					cells[numCells++] = BroadphaseCell{
+						&bucket, cellKey, (u8)getSpatialLevelFromKey(cellKey), (u8)moved, 0 };
+					numEntities += bucket.length;
+				}
+			}
+		}
+	}
+	assert(numCells == sps.numOccupiedCells);
+
+	if (sps.outsideGrid.length > 0) {
+		job.outsideMoved = refreshBroadphaseProxies(sps.outsideGrid, SpatialGridKeySpace, sps, bps);
+		cells[numCells++] = BroadphaseCell{
+			&sps.outsideGrid, SpatialGridKeySpace, (u8)SpatialGridOutsideLevel, job.outsideMoved, 0 };
+		numEntities += sps.outsideGrid.length;
+	}
+
+	// split the cells into units of about the same number of entities, and give each unit room
+	// for a few pairs per entity
+	u32 maxUnits = numEntities / BroadphaseUnitEntities + 1;
+	u32* unitCells = allocArrayOfType(frameScoped, u32, maxUnits + 1);
+	u32* unitOffsets = allocArrayOfType(frameScoped, u32, maxUnits + 1);
+	u32 numUnits = 0;
+	{
+		u32 unitEntities = 0;
+		u32 offset = 0;
+		unitCells[0] = 0;
+		unitOffsets[0] = 0;
+		for (u32 c = 0; c < numCells; ++c) {
+			unitEntities += cells[c].bucket->length;
+			if (unitEntities >= BroadphaseUnitEntities || c == numCells - 1) {
+				offset += unitEntities * 4 + 64;
+				++numUnits;
+				unitCells[numUnits] = c + 1;
+				unitOffsets[numUnits] = offset;
+				unitEntities = 0;
+			}
+		}
+	}
+	assert(numUnits <= maxUnits);
+
+	job.cells = cells;
+	job.movedCells = movedCells;
+	job.unitCells = unitCells;
+	job.unitOffsets = unitOffsets;
+	job.pairs = allocArrayOfType(frameScoped, BroadphasePair, max(unitOffsets[numUnits], 1U));
+	job.unitLengths = allocArrayOfType(frameScoped, u32, max(numUnits, 1U));
+
+	runParallel(workers, findBroadphaseUnitPairs, &job, numUnits, frameScoped);
+
+	// units that ran out of room run again on this thread, now that their count is known
+	BroadphasePair** unitPairs = allocArrayOfType(frameScoped, BroadphasePair*, max(numUnits, 1U));
+	u32 numFound = 0;
+	for (u32 u = 0; u < numUnits; ++u) {
+		unitPairs[u] = job.pairs + unitOffsets[u];
+		if (job.unitLengths[u] > unitOffsets[u + 1] - unitOffsets[u]) {
+			BroadphasePairOutput out{
+				allocArrayOfType(frameScoped, BroadphasePair, job.unitLengths[u]),
+				0,
+				job.unitLengths[u]
+			};
+			findBroadphaseRangePairs(job, unitCells[u], unitCells[u + 1], out, frameScoped);
+			assert(out.length == job.unitLengths[u]);
+			unitPairs[u] = out.pairs;
+		}
+		numFound += job.unitLengths[u];
+	}
+
+	BroadphaseResults results{};
+	results.pairs = allocArrayOfType(frameScoped, BroadphasePair, max(bps.numPairs + numFound, 1U));
+	results.addedPairs = allocArrayOfType(frameScoped, BroadphasePair, max(numFound, 1U));
+	results.removedPairs = allocArrayOfType(frameScoped, BroadphasePair, max(bps.numPairs, 1U));
+
+	// cached pairs of two entities that are still in the grid and didn't move still overlap
+	auto isStatic = [&bps, frame](ComponentId id) {
+		const BroadphaseProxy& proxy = bps.proxies[id.index];
+		return (proxy.spatialInfoId == id && proxy.seenFrame == frame && proxy.movedFrame != frame);
+	};
+	for (u32 p = 0; p < bps.numPairs; ++p) {
+		BroadphaseCachedPair& cached = bps.pairs[p];
+		if (isStatic(cached.pair.a) && isStatic(cached.pair.b)) {
+			cached.frame = frame;
+			results.pairs[results.numPairs++] = cached.pair;
+		}
+	}
+
+	// every pair found has a moved entity, so none of them were kept above
+	for (u32 u = 0; u < numUnits; ++u) {
+		for (u32 f = 0; f < job.unitLengths[u]; ++f) {
+			const BroadphasePair& pair = unitPairs[u][f];
+			u32 pos = findBroadphasePair(bps, pair);
+			if (pos != UINT32_MAX) {
+				bps.pairs[bps.pairHash[pos] - 1].frame = frame;
+			}
+			else {
+				results.addedPairs[results.numAdded++] = pair;
+			}
+			results.pairs[results.numPairs++] = pair;
+		}
+	}
+
+	// the rest of the cache stopped overlapping
+	for (u32 p = 0; p < bps.numPairs; ++p) {
+		const BroadphaseCachedPair& cached = bps.pairs[p];
+		if (cached.frame != frame) {
+			results.removedPairs[results.numRemoved++] = cached.pair;
+		}
+	}
+	for (u32 r = 0; r < results.numRemoved; ++r) {
+		eraseBroadphasePair(bps, findBroadphasePair(bps, results.removedPairs[r]));
+	}
+	// pairs that don't fit aren't cached, so they are reported as added again next update
+	for (u32 a = 0; a < results.numAdded; ++a) {
+		if (!insertBroadphasePair(bps, results.addedPairs[a], frame)) {
+			logger::warn("broadphase pair cache is full, %u new pairs aren't cached, consider raising "
+						 "BROADPHASE_MAX_PAIRS", results.numAdded - a);
+			break;
+		}
+	}
+
+	return results;
+}
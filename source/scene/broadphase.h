@@ -0,0 +1,98 @@
+#ifndef _BROADPHASE_H
+#define _BROADPHASE_H
+
+#include "../capacity.h"
+#include "../utility/common.h"
+#include "entity.h"
+
+
+struct SpatialPersistentStorage;
+struct WorkerPool;
+struct MemoryArena;
+
+
+/**
+ * Two entities whose cached bspheres overlap, ordered so a.value < b.value.
+ */
+struct BroadphasePair {
+	ComponentId	a;	// SpatialInfo components
+	ComponentId	b;
+};
+
+
+/**
+ * A pair found overlapping in a previous update, in the pair cache.
+ */
+struct BroadphaseCachedPair {
+	BroadphasePair	pair;
+	u32				frame;	// last update the pair was found overlapping
+};
+
+
+/**
+ * The bsphere an entity had in the grid at the last update, so entities whose bsphere didn't
+ * change keep their pairs without being tested again.
+ */
+struct BroadphaseProxy {
+	ComponentId	spatialInfoId;
+	u32			cellKey;
+	r32			x, y, z, r;		// cached bsphere relative to the cell origin
+	u32			seenFrame;		// last update the entity was in the grid
+	u32			movedFrame;		// last update its bsphere or cell changed
+};
+
+
+/**
+ * Cached pairs are kept dense so each update only scans the pairs there are. They are found by
+ * both ids through an open addressing hash table of indices, with linear probing and backward
+ * shift deletion like the spatial cell table.
+ */
+const u32 BroadphasePairHashCapacity = BROADPHASE_MAX_PAIRS * 2; // load factor <= 0.5
+static_assert((BroadphasePairHashCapacity & (BroadphasePairHashCapacity - 1)) == 0,
+			  "BroadphasePairHashCapacity must be a power of 2");
+
+
+/**
+ * @struct BroadphaseStorage
+ *	State the broadphase keeps across updates. Zeroed memory is a valid empty storage.
+ */
+struct BroadphaseStorage {
+	u32						pairHash[BroadphasePairHashCapacity];	// index into pairs + 1, 0 means empty
+	BroadphaseCachedPair	pairs[BROADPHASE_MAX_PAIRS];
+	u32						numPairs;
+	u32						frame;									// incremented by each update
+	BroadphaseProxy			proxies[SCENE_MAX_ENTITIES];			// indexed by spatialInfoId.index
+};
+
+
+/**
+ * Pairs of one update, allocated from the frame arena for the narrowphase.
+ */
+struct BroadphaseResults {
+	BroadphasePair*	pairs;			// every overlapping pair
+	BroadphasePair*	addedPairs;		// pairs that started overlapping this update
+	BroadphasePair*	removedPairs;	// pairs that stopped overlapping, or lost one of their entities
+	u32				numPairs;
+	u32				numAdded;
+	u32				numRemoved;
+	u32				_padding;
+};
+
+
+/**
+ * Finds every pair of entities in the spatial grid whose cached bspheres overlap. Each occupied
+ * cell is tested against the cells its entities can reach, the forward half of its neighbors on
+ * the same level, the overlapping cells of coarser levels and the bucket outside of the grid, with
+ * sort-and-sweep along x when there are many entities. Entities live in exactly one cell, so each
+ * pair of cells, and so each pair of entities, is visited once. Pairs where neither entity moved
+ * since the last update are kept from the pair cache without being tested. Cells are split into
+ * ranges tested on the worker threads, and the results don't depend on the number of workers.
+ */
+BroadphaseResults updateBroadphase(
+	const SpatialPersistentStorage& sps,
+	BroadphaseStorage& bps,
+	WorkerPool& workers,
+	MemoryArena& frameScoped);
+
+
+#endif
@@ -124,6 +124,17 @@ r32 getFovDegreesHorizontal(
 	return RAD_TO_DEGf * (2.0f * atanf(tanf(fovDegreesVertical * DEG_TO_RADf * 0.5f) * aspectRatio));
 }
 
+vec3 getCameraRayDirection(
+	const Camera& cam,
+	r32 u,
+	r32 v)
+{
+	// unproject the point on the near plane, the eye is at the view space origin
+	vec4 p = cam.frame.inverseProjection * vec4{ u * 2.0f - 1.0f, v * 2.0f - 1.0f, -1.0f, 1.0f };
+	dvec4 dir = cam.frame.inverseView * make_dvec4(make_dvec3(make_vec3(p) / p.w), 0.0);
+	return make_vec3(normalize(make_dvec3(dir)));
+}
+
 
 /*void Camera::getNearClipCoordinates(dvec3 *topLeft, dvec3 *topRight, dvec3 *bottomLeft, dvec3 *bottomRight)
 {
@@ -93,6 +93,15 @@ r32 getFovDegreesHorizontal(
 	r32 fovDegreesVertical,
 	r32 aspectRatio);
 
+/**
+ * World space direction of the ray from the eye through a point on the viewport, for picking.
+ * u and v go from 0 to 1 starting at the bottom left corner.
+ */
+vec3 getCameraRayDirection(
+	const Camera& cam,
+	r32 u,
+	r32 v);
+
 /**
  * get forward up right vectors from the rows of a column-major, right handed view matrix
  */
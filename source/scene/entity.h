@@ -1,10 +1,16 @@
 #ifndef _ENTITY_H
 #define _ENTITY_H
 
+#include "../capacity.h"
 #include "../utility/types.h"
+#include "../utility/intrinsics.h"
 #include "../utility/dense_queue.h"
 
 #define MAX_ENTITY_COMPONENTS	64
+// ids held in the ComponentSet itself, entities with more spill into the ComponentSetStorage pool
+#define ENTITY_INLINE_COMPONENTS	4
+// component types a ComponentQuery resolves for each matching entity
+#define COMPONENT_QUERY_MAX_TYPES	8
 
 
 typedef h32 EntityId;
@@ -18,10 +24,11 @@ DenseQueueTyped(EntityId, EntityIdQueue);
  * Macro to create a ComponentType value for use with component masks, a *Component and
  * DenseMap to store the component along with its parent EntityId.
  * TypeId should be unique and sequential, starting at 0. This is converted into a pwr-2
- * ComponentType value for use with component masks.
+ * ComponentType value for use with component masks, Type##StoreTypeId keeps it for reserving ids.
  */
 #define ComponentStore(Type, StoreTypeName, HndType, TypeId, StoreName, _capacity) \
 	static const ComponentType Type##ComponentType = 1UL << TypeId;\
+	static const u8 Type##StoreTypeId = TypeId;\
 	struct Type##Component {\
 		Type		data;\
 		EntityId	entityId;\
@@ -30,11 +37,76 @@ DenseQueueTyped(EntityId, EntityIdQueue);
 	StoreTypeName StoreName;
 
 
+/**
+ * Which of the entity's sets a ComponentSet is, type ids are only unique within one of them.
+ */
+enum ComponentSetType : u8 {
+	ComponentSet_Scene = 0,
+	ComponentSet_Render,
+	ComponentSet_Game
+};
+
+
+/**
+ * A registered query keeps the entities whose set of setType has every component type of the
+ * mask in a dense list, along with the component of each type with the lowest index, the one
+ * entity_getFirstComponent returns. The list is updated by entity_addComponent and
+ * entity_removeComponent*, so iterating it is a linear scan with no per entity mask tests. Order
+ * is not stable, an entity leaving the query is replaced by the last one. Register with
+ * scene_registerComponentQuery.
+ */
+struct ComponentQuery {
+	u64				mask;
+	u8				setType;
+	u8				numTypes;								// component types in the mask
+	u8				typeIds[COMPONENT_QUERY_MAX_TYPES];		// ascending, the order of each row's components
+	u16				_padding;
+	u32				length;									// matching entities
+	EntityId*		entityIds;								// [SCENE_MAX_ENTITIES]
+	ComponentId*	componentIds;							// [SCENE_MAX_ENTITIES * numTypes], numTypes per row
+	u16*			rows;									// [SCENE_MAX_ENTITIES] row + 1 by entity index, 0 if not matching
+};
+
+
+/**
+ * Scene wide storage of the component sets. Ids of a ComponentSet that outgrew its inline storage
+ * live in blocks of the pool. Blocks come in power of 2 size classes from 8 up to
+ * MAX_ENTITY_COMPONENTS ids, carved from the front of one array and recycled through a free list
+ * per class, linked through the first id of each free block. Changes to the sets are forwarded to
+ * the registered queries. Zeroed memory is a valid empty storage.
+ */
+const u32 ComponentSetPoolClasses = 4; // blocks of 8, 16, 32 and 64 ids
+static_assert((8 << (ComponentSetPoolClasses - 1)) == MAX_ENTITY_COMPONENTS,
+			  "the largest block must hold MAX_ENTITY_COMPONENTS ids");
+static_assert(ENTITY_COMPONENT_POOL_CAPACITY <= 65536,
+			  "ComponentSet::spillOffset must hold offsets into the pool");
+
+struct ComponentSetStorage {
+	ComponentId		ids[ENTITY_COMPONENT_POOL_CAPACITY];
+	u32				used;										// ids carved from the front of the array
+	u32				freeBlocks[ComponentSetPoolClasses];		// offset + 1 of the first free block per class, 0 if none
+	u32				numQueries;
+	ComponentQuery*	queries[SCENE_MAX_COMPONENT_QUERIES];
+};
+
+
+/**
+ * Component ids of an entity, sorted by type and then index so lookups by type are a binary search
+ * and the mask tells which types are present. Up to ENTITY_INLINE_COMPONENTS ids are held inline,
+ * beyond that they move to a block of the ComponentSetStorage pool, and back when the set shrinks
+ * again. The set knows its entity so changes reach the registered queries, sets without one are
+ * left out of queries. Zeroed memory is a valid empty set.
+ */
 struct ComponentSet {
 	u64			mask;
-	u32			componentsSize;
-	ComponentId	components[MAX_ENTITY_COMPONENTS];
+	EntityId	entityId;		// owner, set by entity_initComponentSets
+	u8			componentsSize;
+	u8			spillClass : 4;	// 0 when the ids are inline, or the size class + 1 of the pool block
+	u8			setType : 4;	// ComponentSetType
+	u16			spillOffset;	// offset of the pool block in ComponentSetStorage::ids when spilled
+	ComponentId	inlineComponents[ENTITY_INLINE_COMPONENTS];
 };
+static_assert(MAX_ENTITY_COMPONENTS <= UINT8_MAX, "componentsSize must hold MAX_ENTITY_COMPONENTS");
 
 
 // TODO: Entity can be a messaging (event) hub, both sending and handling events, allowing for direct
@@ -46,11 +118,37 @@ struct Entity {
 };
 
 
+/**
+ * Ties the entity's sets to it so their changes reach the registered queries. Call once when the
+ * entity is created.
+ */
+inline void entity_initComponentSets(Entity& entity, EntityId entityId)
+{
+	entity.sceneComponents.entityId = entityId;
+	entity.sceneComponents.setType = ComponentSet_Scene;
+	entity.renderComponents.entityId = entityId;
+	entity.renderComponents.setType = ComponentSet_Render;
+	entity.gameComponents.entityId = entityId;
+	entity.gameComponents.setType = ComponentSet_Game;
+}
+
+
+/**
+ * @return the entity's set of the type
+ */
+inline ComponentSet& entity_getComponentSet(Entity& entity, ComponentSetType setType)
+{
+	return (setType == ComponentSet_Scene ? entity.sceneComponents
+			: setType == ComponentSet_Render ? entity.renderComponents
+			: entity.gameComponents);
+}
+
+
 /**
  * Uses a component mask to quickly see if all components in the mask exist in this entity
  * @return true if all component types exist at least once, false if not
  */
-inline bool entity_hasAllComponents(ComponentSet& set, u64 mask)
+inline bool entity_hasAllComponents(const ComponentSet& set, u64 mask)
 {
 	return ((set.mask & mask) == mask);
 }
@@ -59,7 +157,7 @@ inline bool entity_hasAllComponents(ComponentSet& set, u64 mask)
  * Uses a component mask to quickly see if any components in the mask exist in this entity
  * @return true if any component type exists at least once, false if not
  */
-inline bool entity_hasAnyComponents(ComponentSet& set, u64 mask)
+inline bool entity_hasAnyComponents(const ComponentSet& set, u64 mask)
 {
 	return ((set.mask & mask) != 0);
 }
@@ -68,9 +166,124 @@ inline bool entity_hasAnyComponents(ComponentSet& set, u64 mask)
  * Quickly check if any components of a single type exist in this entity
  * @return true if any component type exists at least once, false if not
  */
-inline bool entity_hasComponentType(ComponentSet& set, ComponentType ct)
+inline bool entity_hasComponentType(const ComponentSet& set, ComponentType ct)
 {
-	return ((set.mask >> ct) & 1UL);
+	return ((set.mask & ct) != 0);
+}
+
+
+/**
+ * The ids of the set in sorted order, componentsSize of them.
+ */
+inline ComponentId* entity_getComponents(
+	ComponentSet& set,
+	ComponentSetStorage& storage)
+{
+	return (set.spillClass ? storage.ids + set.spillOffset : set.inlineComponents);
+}
+
+inline const ComponentId* entity_getComponents(
+	const ComponentSet& set,
+	const ComponentSetStorage& storage)
+{
+	return (set.spillClass ? storage.ids + set.spillOffset : set.inlineComponents);
+}
+
+
+// ids sort by type and then index, the generation is left out
+inline u32 entity_componentSortKey(ComponentId id)
+{
+	return ((u32)id.typeId << 16) | id.index;
+}
+
+
+/**
+ * @return position of the first id with a sort key not less than key
+ */
+inline u32 entity_lowerBound(
+	const ComponentId* ids,
+	u32 size,
+	u32 key)
+{
+	u32 first = 0;
+	while (size > 0) {
+		u32 half = size >> 1;
+		if (entity_componentSortKey(ids[first + half]) < key) {
+			first += half + 1;
+			size -= half + 1;
+		}
+		else {
+			size = half;
+		}
+	}
+	return first;
+}
+
+
+u32 allocComponentSetBlock(
+	ComponentSetStorage& storage,
+	u32 sizeClass)
+{
+	u32 offset = 0;
+	if (storage.freeBlocks[sizeClass] != 0) {
+		offset = storage.freeBlocks[sizeClass] - 1;
+		storage.freeBlocks[sizeClass] = storage.ids[offset].value;
+	}
+	else {
+		u32 blockSize = 8U << sizeClass;
+		assert(storage.used + blockSize <= ENTITY_COMPONENT_POOL_CAPACITY
+				&& "component set pool is full, consider raising ENTITY_COMPONENT_POOL_CAPACITY");
+		offset = storage.used;
+		storage.used += blockSize;
+	}
+	return offset;
+}
+
+
+void freeComponentSetBlock(
+	ComponentSetStorage& storage,
+	u32 sizeClass,
+	u32 offset)
+{
+	storage.ids[offset].value = storage.freeBlocks[sizeClass];
+	storage.freeBlocks[sizeClass] = offset + 1;
+}
+
+
+/**
+ * Moves the ids to storage that fits capacity ids, inline when they fit, otherwise the smallest
+ * pool block that holds them.
+ */
+void resizeComponentSet(
+	ComponentSet& set,
+	ComponentSetStorage& storage,
+	u32 capacity)
+{
+	u32 spillClass = 0;
+	if (capacity > ENTITY_INLINE_COMPONENTS) {
+		while ((8U << spillClass) < capacity) {
+			++spillClass;
+		}
+		++spillClass;
+	}
+	if (spillClass == set.spillClass) {
+		return;
+	}
+
+	ComponentId* from = entity_getComponents(set, storage);
+	ComponentId* to = set.inlineComponents;
+	u32 offset = 0;
+	if (spillClass) {
+		offset = allocComponentSetBlock(storage, spillClass - 1);
+		to = storage.ids + offset;
+	}
+	memmove(to, from, set.componentsSize * sizeof(ComponentId));
+
+	if (set.spillClass) {
+		freeComponentSetBlock(storage, set.spillClass - 1, set.spillOffset);
+	}
+	set.spillClass = (u8)spillClass;
+	set.spillOffset = (u16)offset;
 }
 
 
@@ -78,41 +291,133 @@ inline bool entity_hasComponentType(ComponentSet& set, ComponentType ct)
  * Returns true if the component exists in the entity.
  */
 bool entity_hasComponent(
-	ComponentSet& set,
+	const ComponentSet& set,
+	const ComponentSetStorage& storage,
 	ComponentId id)
 {
-	for (u32 c = 0;
-		c < set.componentsSize;
-		++c)
-	{
-		if (set.components[c] == id) {
-			return true;
-		}
+	if (!entity_hasComponentType(set, 1ULL << id.typeId)) {
+		return false;
 	}
-	return false;
+	const ComponentId* ids = entity_getComponents(set, storage);
+	u32 c = entity_lowerBound(ids, set.componentsSize, entity_componentSortKey(id));
+	return (c < set.componentsSize && ids[c] == id);
 }
 
 
+/**
+ * @return the component of the type with the lowest index, or null_h32 if there are none
+ */
 ComponentId entity_getFirstComponent(
-	ComponentSet& set,
+	const ComponentSet& set,
+	const ComponentSetStorage& storage,
 	ComponentType ct)
 {
 	if (entity_hasComponentType(set, ct))
 	{
-		for (u32 c = 0;
-			c < set.componentsSize;
-			++c)
-		{
-			ComponentId cmpId = set.components[c];
-			if (ct == 1ULL << cmpId.typeId) {
-				return cmpId;
-			}
-		}
+		u32 typeId = 0;
+		BitScanFwd64(&typeId, ct);
+		const ComponentId* ids = entity_getComponents(set, storage);
+		u32 c = entity_lowerBound(ids, set.componentsSize, typeId << 16);
+		assert(c < set.componentsSize && ids[c].typeId == typeId);
+		return ids[c];
 	}
 	return null_h32;
 }
 
 
+/**
+ * @return component t, in the order of query.typeIds, of the entity in row
+ */
+inline ComponentId entity_getQueryComponent(
+	const ComponentQuery& query,
+	u32 row,
+	u32 t)
+{
+	assert(row < query.length && t < query.numTypes);
+	return query.componentIds[row * query.numTypes + t];
+}
+
+
+/**
+ * Stores the first component of each of the query's types into row, the set must match.
+ */
+void resolveComponentQueryRow(
+	ComponentQuery& query,
+	const ComponentSet& set,
+	const ComponentSetStorage& storage,
+	u32 row)
+{
+	const ComponentId* ids = entity_getComponents(set, storage);
+	ComponentId* rowIds = query.componentIds + row * query.numTypes;
+
+	// typeIds ascend like the ids of the set, so one forward pass finds them all
+	u32 c = 0;
+	for (u32 t = 0; t < query.numTypes; ++t) {
+		while (ids[c].typeId < query.typeIds[t]) {
+			++c;
+		}
+		assert(c < set.componentsSize && ids[c].typeId == query.typeIds[t]);
+		rowIds[t] = ids[c];
+	}
+}
+
+
+/**
+ * Adds the set's entity to the query, removes it, or resolves its row again so the query agrees
+ * with the set after a change.
+ */
+void updateComponentQuery(
+	ComponentQuery& query,
+	const ComponentSet& set,
+	const ComponentSetStorage& storage)
+{
+	u32 row = query.rows[set.entityId.index];
+
+	if (entity_hasAllComponents(set, query.mask)) {
+		if (row == 0) {
+			assert(query.length < SCENE_MAX_ENTITIES);
+			query.entityIds[query.length] = set.entityId;
+			row = ++query.length;
+			query.rows[set.entityId.index] = (u16)row;
+		}
+		resolveComponentQueryRow(query, set, storage, row - 1);
+	}
+	else if (row != 0) {
+		// the last row takes the place of the removed one
+		u32 last = --query.length;
+		if (row - 1 != last) {
+			EntityId moved = query.entityIds[last];
+			query.entityIds[row - 1] = moved;
+			memcpy(query.componentIds + (row - 1) * query.numTypes,
+				   query.componentIds + last * query.numTypes,
+				   query.numTypes * sizeof(ComponentId));
+			query.rows[moved.index] = (u16)row;
+		}
+		query.rows[set.entityId.index] = 0;
+	}
+}
+
+
+/**
+ * Updates the registered queries over the set that involve any of the changed component types.
+ */
+void updateComponentQueries(
+	const ComponentSet& set,
+	ComponentSetStorage& storage,
+	u64 changedMask)
+{
+	if (set.entityId == null_h32) {
+		return;
+	}
+	for (u32 q = 0; q < storage.numQueries; ++q) {
+		ComponentQuery& query = *storage.queries[q];
+		if (query.setType == set.setType && (query.mask & changedMask) != 0) {
+			updateComponentQuery(query, set, storage);
+		}
+	}
+}
+
+
 /**
  * Adds a scene component id to the set. The corresponding component should already exist in
  * the component store.
@@ -120,21 +425,92 @@ ComponentId entity_getFirstComponent(
  */
 bool entity_addComponent(
 	ComponentSet& set,
+	ComponentSetStorage& storage,
 	ComponentId id)
 {
 	assert(set.componentsSize < MAX_ENTITY_COMPONENTS
 			&& "max entity components reached, consider raising the limit and expanding the bit mask, or combine components");
 
-	if (!entity_hasComponent(set, id)) {
-		ComponentType ct = 1ULL << id.typeId;
-		set.mask |= ct;
+	u32 key = entity_componentSortKey(id);
+	u32 c = entity_lowerBound(entity_getComponents(set, storage), set.componentsSize, key);
+	if (c < set.componentsSize && entity_getComponents(set, storage)[c] == id) {
+		return false;
+	}
 
-		set.components[set.componentsSize] = id;
-		++set.componentsSize;
-		
-		return true;
+	resizeComponentSet(set, storage, set.componentsSize + 1);
+
+	ComponentId* ids = entity_getComponents(set, storage);
+	memmove(ids + c + 1, ids + c, (set.componentsSize - c) * sizeof(ComponentId));
+	ids[c] = id;
+	++set.componentsSize;
+	set.mask |= 1ULL << id.typeId;
+
+	updateComponentQueries(set, storage, 1ULL << id.typeId);
+	return true;
+}
+
+
+/**
+ * Adds several ids at once, merging them into the set with one resize and one update of the
+ * registered queries. The corresponding components should already exist in their stores.
+ * @return number of ids added, ids already present are skipped
+ */
+u32 entity_addComponents(
+	ComponentSet& set,
+	ComponentSetStorage& storage,
+	const ComponentId* newIds,
+	u32 count)
+{
+	// sort the new ids by insertion, leaving out the ones the set has and repeats
+	ComponentId added[MAX_ENTITY_COMPONENTS];
+	u32 numAdded = 0;
+	u64 changedMask = 0;
+	for (u32 i = 0; i < count; ++i) {
+		ComponentId id = newIds[i];
+		if (entity_hasComponent(set, storage, id)) {
+			continue;
+		}
+		u32 key = entity_componentSortKey(id);
+		u32 a = numAdded;
+		while (a > 0 && entity_componentSortKey(added[a-1]) > key) {
+			added[a] = added[a-1];
+			--a;
+		}
+		if (a > 0 && added[a-1] == id) {
+			memmove(added + a, added + a + 1, (numAdded - a) * sizeof(ComponentId));
+			continue;
+		}
+		assert(set.componentsSize + numAdded < MAX_ENTITY_COMPONENTS
+				&& "max entity components reached, consider raising the limit and expanding the bit mask, or combine components");
+		added[a] = id;
+		++numAdded;
+		changedMask |= 1ULL << id.typeId;
 	}
-	return false;
+	if (numAdded == 0) {
+		return 0;
+	}
+
+	resizeComponentSet(set, storage, set.componentsSize + numAdded);
+
+	// merge from the back, so ids of the set move up before their slots are written
+	ComponentId* ids = entity_getComponents(set, storage);
+	u32 a = set.componentsSize;
+	u32 b = numAdded;
+	while (b > 0) {
+		if (a > 0 && entity_componentSortKey(ids[a-1]) > entity_componentSortKey(added[b-1])) {
+			ids[a + b - 1] = ids[a-1];
+			--a;
+		}
+		else {
+			ids[a + b - 1] = added[b-1];
+			--b;
+		}
+	}
+	set.componentsSize = (u8)(set.componentsSize + numAdded);
+	set.mask |= changedMask;
+
+	updateComponentQueries(set, storage, changedMask);
+	return numAdded;
 }
 
 
@@ -144,36 +520,31 @@ bool entity_addComponent(
  */
 bool entity_removeComponent(
 	ComponentSet& set,
+	ComponentSetStorage& storage,
 	ComponentId id)
 {
-	ComponentType ct = 1ULL << id.typeId;
-	bool hasAnotherMatchingComponentType = false;
-	bool removed = false;
-
-	for (u32 c = 0;
-		c < set.componentsSize;
-		++c)
-	{
-		// remove by swap and pop
-		if (set.components[c] == id) {
-			if (c != set.componentsSize - 1) {
-				set.components[c] = set.components[set.componentsSize - 1];
-			}
-			--set.componentsSize;
-			removed = true;
-		}
-		
-		if (set.components[c].typeId == id.typeId) {
-			hasAnotherMatchingComponentType = true;
-		}
+	ComponentId* ids = entity_getComponents(set, storage);
+	u32 c = entity_lowerBound(ids, set.componentsSize, entity_componentSortKey(id));
+	if (c >= set.componentsSize || ids[c] != id) {
+		return false;
 	}
 
-	// if no more components of this type, clear it in the mask
-	if (removed && !hasAnotherMatchingComponentType) {
-		set.mask &= ~(1ULL << ct);
+	memmove(ids + c, ids + c + 1, (set.componentsSize - c - 1) * sizeof(ComponentId));
+	--set.componentsSize;
+
+	// ids of a type are adjacent, if neither neighbor shares the type it was the last one
+	bool hasAnotherMatchingComponentType =
+		(c > 0 && ids[c-1].typeId == id.typeId)
+		|| (c < set.componentsSize && ids[c].typeId == id.typeId);
+
+	if (!hasAnotherMatchingComponentType) {
+		set.mask &= ~(1ULL << id.typeId);
 	}
 
-	return removed;
+	resizeComponentSet(set, storage, set.componentsSize);
+
+	updateComponentQueries(set, storage, 1ULL << id.typeId);
+	return true;
 }
 
 
@@ -183,28 +554,25 @@ bool entity_removeComponent(
  */
 bool entity_removeComponentsByType(
 	ComponentSet& set,
+	ComponentSetStorage& storage,
 	ComponentType mask)
 {
 	if (entity_hasAnyComponents(set, mask)) {
-		u32 c = 0;
-		while (c < set.componentsSize)
-		{
-			ComponentType ct = 1ULL << set.components[c].typeId;
-			// remove by swap and pop
-			if ((ct & mask) != 0ULL) {
-				if (c != set.componentsSize - 1) {
-					set.components[c] = set.components[set.componentsSize - 1];
-				}
-				--set.componentsSize;
-			}
-			else {
-				++c;
+		ComponentId* ids = entity_getComponents(set, storage);
+		u32 kept = 0;
+		for (u32 c = 0; c < set.componentsSize; ++c) {
+			if (((1ULL << ids[c].typeId) & mask) == 0ULL) {
+				ids[kept++] = ids[c];
 			}
 		}
+		set.componentsSize = (u8)kept;
 
 		// clear bits for removed component types
 		set.mask &= ~mask;
 
+		resizeComponentSet(set, storage, set.componentsSize);
+
+		updateComponentQueries(set, storage, mask);
 		return true;
 	}
 	return false;
@@ -22,6 +22,22 @@ struct Sphere {
 };
 
 
+/**
+ * Represent a batch of spheres in SoA format, used for testing frustum intersection of many
+ * spheres at once with the frustumSoA_intersectSpheresSoA functions. Capacity is a multiple of the
+ * widest kernel (8 lanes) so a partially filled last iteration can safely read whole lanes.
+ */
+const u32 SphereBatchCapacity = 256;
+
+struct alignas(32) SphereBatchSoA {
+	r32		x[SphereBatchCapacity];
+	r32		y[SphereBatchCapacity];
+	r32		z[SphereBatchCapacity];
+	r32		r[SphereBatchCapacity];
+	u32		length;
+};
+
+
 // Plane
 
 struct Plane {
@@ -53,7 +69,7 @@ void plane_normalize(
 }
 
 /**
- * nx, ny, nz and d arrays must be 16-byte aligned
+ * nx, ny, nz and d arrays need not be aligned, this is called with planes 2-5 of a FrustumSoA
  */
 void plane_normalize_4_sse(
 	r32 nx[4],
@@ -61,10 +77,10 @@ void plane_normalize_4_sse(
 	r32 nz[4],
 	r32 d[4])
 {
-	const __m128 mm_nx = _mm_load_ps(nx);
-	const __m128 mm_ny = _mm_load_ps(ny);
-	const __m128 mm_nz = _mm_load_ps(nz);
-	const __m128 mm_d  = _mm_load_ps(d);
+	const __m128 mm_nx = _mm_loadu_ps(nx);
+	const __m128 mm_ny = _mm_loadu_ps(ny);
+	const __m128 mm_nz = _mm_loadu_ps(nz);
+	const __m128 mm_d  = _mm_loadu_ps(d);
 
 	// n*n
 	__m128 mm_dx = _mm_mul_ps(mm_nx, mm_nx); // dx = nx * nx
@@ -79,10 +95,10 @@ void plane_normalize_4_sse(
 	mm_dz        = _mm_div_ps(mm_nz, lens); // dz = nz / len(n)
 	__m128 mm_dd = _mm_div_ps(mm_d,  lens); // a0 = d  / len(n)
 
-	_mm_store_ps(nx, mm_dx);
-	_mm_store_ps(ny, mm_dy);
-	_mm_store_ps(nz, mm_dz);
-	_mm_store_ps(d, mm_dd);
+	_mm_storeu_ps(nx, mm_dx);
+	_mm_storeu_ps(ny, mm_dy);
+	_mm_storeu_ps(nz, mm_dz);
+	_mm_storeu_ps(d, mm_dd);
 }
 
 Plane plane_fromPoints(
@@ -106,14 +122,15 @@ enum FrustumPlane : u8
 
 
 /**
- * planes stored as SoA instead of AoS
+ * planes stored as SoA instead of AoS, each array is 16-byte aligned so planes 0-3 can be loaded
+ * with aligned loads (planes 2-5 start 8 bytes in and need unaligned loads)
  */
 struct alignas(16) FrustumSoA
 {
-	r32 nx[6];
-	r32 ny[6];
-	r32 nz[6];
-	r32 d[6];
+	alignas(16) r32 nx[6];
+	alignas(16) r32 ny[6];
+	alignas(16) r32 nz[6];
+	alignas(16) r32 d[6];
 };
 
 
@@ -195,9 +212,9 @@ void frustum_getPoints(
 	dvec3 cFar  = eyePoint + (f * farClip);
 	// get up and right vectors scaled by near and far planes
 	dvec3 uNear = u * hNear;
-	dvec3 rNear = r * hNear;
+	dvec3 rNear = r * wNear;
 	dvec3 uFar  = u * hFar;
-	dvec3 rFar  = r * hFar;
+	dvec3 rFar  = r * wFar;
 
 	outPoints.eye = eyePoint;
 	outPoints.ftl = cFar  + uFar  - rFar;	// Far Top Left
@@ -207,7 +224,7 @@ void frustum_getPoints(
 	outPoints.ntl = cNear + uNear - rNear;	// Near Top Left
 	outPoints.ntr = cNear + uNear + rNear;	// Near Top Right
 	outPoints.nbl = cNear - uNear - rNear;	// Near Bottom Left
-	outPoints.nbr = cNear + uNear + rNear;	// Near Bottom Right
+	outPoints.nbr = cNear - uNear + rNear;	// Near Bottom Right
 }
 
 /**
@@ -224,35 +241,38 @@ FrustumSoA frustum_extractFromMatrixGL(
 	FrustumSoA f;
 	const MatrixColumnMajor& m = *(MatrixColumnMajor*)matrix;
 				
+	// Gribb/Hartmann extraction gives planes in the form n*p + D >= 0 for points inside, our plane
+	// equation is n*p - d = 0, so d = -D
+
 	f.nx[Near]   = m._41 + m._31;
 	f.ny[Near]   = m._42 + m._32;
 	f.nz[Near]   = m._43 + m._33;
-	f.d[Near]    = m._44 + m._34;
+	f.d[Near]    = -(m._44 + m._34);
 
-	f.nx[Far]    = m._41 + m._31;
-	f.ny[Far]    = m._42 + m._32;
-	f.nz[Far]    = m._43 + m._33;
-	f.d[Far]     = m._44 + m._34;
+	f.nx[Far]    = m._41 - m._31;
+	f.ny[Far]    = m._42 - m._32;
+	f.nz[Far]    = m._43 - m._33;
+	f.d[Far]     = -(m._44 - m._34);
 
 	f.nx[Left]   = m._41 + m._11;
 	f.ny[Left]   = m._42 + m._12;
 	f.nz[Left]   = m._43 + m._13;
-	f.d[Left]    = m._44 + m._14;
+	f.d[Left]    = -(m._44 + m._14);
 
 	f.nx[Right]  = m._41 - m._11;
 	f.ny[Right]  = m._42 - m._12;
 	f.nz[Right]  = m._43 - m._13;
-	f.d[Right]   = m._44 - m._14;
+	f.d[Right]   = -(m._44 - m._14);
 
 	f.nx[Top]    = m._41 - m._21;
 	f.ny[Top]    = m._42 - m._22;
 	f.nz[Top]    = m._43 - m._23;
-	f.d[Top]     = m._44 - m._24;
+	f.d[Top]     = -(m._44 - m._24);
 
 	f.nx[Bottom] = m._41 + m._21;
 	f.ny[Bottom] = m._42 + m._22;
 	f.nz[Bottom] = m._43 + m._23;
-	f.d[Bottom]  = m._44 + m._24;
+	f.d[Bottom]  = -(m._44 + m._24);
 
 	if (normalize) {
 		plane_normalize_4_sse(f.nx, f.ny, f.nz, f.d);
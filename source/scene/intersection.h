@@ -2,6 +2,7 @@
 #define _INTERSECTION_H
 
 #include "../utility/types.h"
+#include "../utility/common.h"
 #include "../utility/intrinsics.h"
 #include "../scene/geometry.h"
 
@@ -90,8 +91,8 @@ void frustumSoA_intersectSpheres_sse(
 {
 	assert(resultsSize * 4 >= length);
 
-	// TODO: this algorithm wastes 2 lanes of 8 for every sphere, we could instead try splatting the planes and
-	// intersecting 1 plane with 4 spheres at a time
+	// note: this algorithm wastes 2 lanes of 8 for every sphere, for batches of spheres prefer the
+	// frustumSoA_intersectSpheresSoA kernels which splat the planes and test 4 or 8 spheres at a time
 
 	// we use this formula to determine outside:
 	//   dot(p.n, s.center) - p.d < -s.radius
@@ -103,16 +104,17 @@ void frustumSoA_intersectSpheres_sse(
 	const __m128 plane_0123_y = _mm_load_ps(f.ny);
 	const __m128 plane_0123_z = _mm_load_ps(f.nz);
 	const __m128 plane_0123_d = _mm_mul_ps(_mm_load_ps(f.d), invert);
-	const __m128 plane_2345_x = _mm_load_ps(f.nx+2);
-	const __m128 plane_2345_y = _mm_load_ps(f.ny+2);
-	const __m128 plane_2345_z = _mm_load_ps(f.nz+2);
-	const __m128 plane_2345_d = _mm_mul_ps(_mm_load_ps(f.d+2), invert);
+	// planes 2-5 start 8 bytes into each array, so these loads are unaligned
+	const __m128 plane_2345_x = _mm_loadu_ps(f.nx+2);
+	const __m128 plane_2345_y = _mm_loadu_ps(f.ny+2);
+	const __m128 plane_2345_z = _mm_loadu_ps(f.nz+2);
+	const __m128 plane_2345_d = _mm_mul_ps(_mm_loadu_ps(f.d+2), invert);
 
 	
 	for (u32 i = 0; i < length; ++i)
 	{
 		// Load sphere into SSE register
-		const __m128 s = _mm_load_ps((const float*)(spheres+i));
+		const __m128 s = _mm_loadu_ps((const float*)(spheres+i));
 		const __m128 xxxx = simd_splat_x(s);
 		const __m128 yyyy = simd_splat_y(s);
 		const __m128 zzzz = simd_splat_z(s);
@@ -136,32 +138,33 @@ void frustumSoA_intersectSpheres_sse(
 		v = simd_madd(yyyy, plane_2345_y, v);
 		v = simd_madd(zzzz, plane_2345_z, v);
 
-		// 0123 | 2345
+		// 0123 | 2345 for outside, 0123 & 2345 for inside since it must be in front of every plane
 		r_outside = _mm_or_ps(r_outside, _mm_cmplt_ps(v, rrrr_inv));
-		r_inside  = _mm_or_ps(r_inside,  _mm_cmpgt_ps(v, rrrr));
+		r_inside  = _mm_and_ps(r_inside, _mm_cmpgt_ps(v, rrrr));
 		
 		// Shuffle and extract the result:
 		// 1. movehl(r, r) does this (we're interested in 2 lower floats):
 		//     a  b  c  d -> c  d  c  d
 		//    02 13 24 35 -> 24 35 24 35
-		// 2. then we OR it with the existing value (ignoring 2 upper floats)
+		// 2. then we OR (AND for inside) it with the existing value (ignoring 2 upper floats)
 		//     a  b | c  d  =  A  B
 		//    02 13 | 24 35 = 024 135
 		r_outside = _mm_or_ps(r_outside, _mm_movehl_ps(r_outside, r_outside));
-		r_inside  = _mm_or_ps(r_inside,  _mm_movehl_ps(r_inside, r_inside));
-		// 3. and then we OR it again ignoring all but 1 lowest float:
+		r_inside  = _mm_and_ps(r_inside, _mm_movehl_ps(r_inside, r_inside));
+		// 3. and then we OR (AND) it again ignoring all but 1 lowest float:
 		//     A  |  B  =  R
 		//    024 | 135 = 012345
 		// Result is written in the lowest float
 		r_outside = _mm_or_ps(r_outside, simd_splat_y(r_outside));
-		r_inside  = _mm_or_ps(r_inside,  simd_splat_y(r_inside));
+		r_inside  = _mm_and_ps(r_inside, simd_splat_y(r_inside));
 
 		u32 result_outside, result_inside;
 		_mm_store_ss((float*)&result_outside, r_outside);
 		_mm_store_ss((float*)&result_inside, r_inside);
 
 		// flip outside bit to represent intersecting bit, combine with the fully inside bit shifted left by 1
-		u32 result = (~result_outside) | (result_inside << 1);
+		// the results are full 32-bit masks, so only keep the low bit of each
+		u32 result = (~result_outside & 1) | ((result_inside & 1) << 1);
 		// write the 2-bit result
 		const u32 ri = i / 4;
 		const u32 shift = (i * 2) & 7;
@@ -170,6 +173,152 @@ void frustumSoA_intersectSpheres_sse(
 }
 
 
+/**
+ * Tests a batch of SoA spheres against the frustum 4 spheres at a time. Each plane is splatted
+ * across all lanes, so unlike frustumSoA_intersectSpheres_sse no lanes are wasted. Results are
+ * written as one IntersectionResult byte per sphere.
+ * x, y, z, r must be 16-byte aligned and readable up to length rounded up to a multiple of 4,
+ * results must have room for the rounded up length as well.
+ */
+void frustumSoA_intersectSpheresSoA_sse(
+	const FrustumSoA& f,
+	u32 length,				// number of spheres passed
+	const r32* x,
+	const r32* y,
+	const r32* z,
+	const r32* r,
+	u8* results)
+{
+	assert(is_aligned(x, 16) && is_aligned(y, 16) && is_aligned(z, 16) && is_aligned(r, 16));
+
+	// splat the planes once, d is negated so the signed distance is a chain of madds
+	__m128 pnx[6], pny[6], pnz[6], pnd[6];
+	for (u32 p = 0; p < 6; ++p) {
+		pnx[p] = _mm_set1_ps(f.nx[p]);
+		pny[p] = _mm_set1_ps(f.ny[p]);
+		pnz[p] = _mm_set1_ps(f.nz[p]);
+		pnd[p] = _mm_set1_ps(-f.d[p]);
+	}
+	const __m128i intersectingBit = _mm_set1_epi32(Intersecting);
+	const __m128i insideBits = _mm_set1_epi32(Inside);
+
+	for (u32 i = 0; i < length; i += 4)
+	{
+		const __m128 sx = _mm_load_ps(x+i);
+		const __m128 sy = _mm_load_ps(y+i);
+		const __m128 sz = _mm_load_ps(z+i);
+		const __m128 sr = _mm_load_ps(r+i);
+		const __m128 sr_inv = _mm_sub_ps(_mm_setzero_ps(), sr);
+
+		__m128 r_outside = _mm_setzero_ps();
+		__m128 r_inside  = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+		for (u32 p = 0; p < 6; ++p) {
+			// dot(p.n, s.center) - p.d
+			__m128 v = simd_madd(sx, pnx[p], pnd[p]);
+			v = simd_madd(sy, pny[p], v);
+			v = simd_madd(sz, pnz[p], v);
+
+			// outside if behind any plane, inside only if in front of all planes
+			r_outside = _mm_or_ps(r_outside, _mm_cmplt_ps(v, sr_inv));
+			r_inside  = _mm_and_ps(r_inside, _mm_cmpgt_ps(v, sr));
+		}
+
+		// per lane: outside ? 0 : (inside ? 3 : 1), then narrow 32-bit lanes to bytes
+		__m128i result = _mm_or_si128(
+			intersectingBit,
+			_mm_and_si128(_mm_castps_si128(r_inside), insideBits));
+		result = _mm_andnot_si128(_mm_castps_si128(r_outside), result);
+		result = _mm_packs_epi32(result, result);
+		result = _mm_packus_epi16(result, result);
+
+		*(u32*)(results+i) = (u32)_mm_cvtsi128_si32(result);
+	}
+}
+
+/**
+ * AVX2 version of frustumSoA_intersectSpheresSoA_sse testing 8 spheres at a time. Only call when
+ * cpuFeatures.avx2 is set. x, y, z, r must be 32-byte aligned and readable up to length rounded up
+ * to a multiple of 8, results must have room for the rounded up length as well.
+ */
+SIMD_TARGET("avx2")
+void frustumSoA_intersectSpheresSoA_avx2(
+	const FrustumSoA& f,
+	u32 length,				// number of spheres passed
+	const r32* x,
+	const r32* y,
+	const r32* z,
+	const r32* r,
+	u8* results)
+{
+	assert(is_aligned(x, 32) && is_aligned(y, 32) && is_aligned(z, 32) && is_aligned(r, 32));
+
+	__m256 pnx[6], pny[6], pnz[6], pnd[6];
+	for (u32 p = 0; p < 6; ++p) {
+		pnx[p] = _mm256_set1_ps(f.nx[p]);
+		pny[p] = _mm256_set1_ps(f.ny[p]);
+		pnz[p] = _mm256_set1_ps(f.nz[p]);
+		pnd[p] = _mm256_set1_ps(-f.d[p]);
+	}
+	const __m256i intersectingBit = _mm256_set1_epi32(Intersecting);
+	const __m256i insideBits = _mm256_set1_epi32(Inside);
+
+	for (u32 i = 0; i < length; i += 8)
+	{
+		const __m256 sx = _mm256_load_ps(x+i);
+		const __m256 sy = _mm256_load_ps(y+i);
+		const __m256 sz = _mm256_load_ps(z+i);
+		const __m256 sr = _mm256_load_ps(r+i);
+		const __m256 sr_inv = _mm256_sub_ps(_mm256_setzero_ps(), sr);
+
+		__m256 r_outside = _mm256_setzero_ps();
+		__m256 r_inside  = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+		// mul+add rather than fma keeps results identical to the sse kernel
+		for (u32 p = 0; p < 6; ++p) {
+			__m256 v = _mm256_add_ps(_mm256_mul_ps(sx, pnx[p]), pnd[p]);
+			v = _mm256_add_ps(_mm256_mul_ps(sy, pny[p]), v);
+			v = _mm256_add_ps(_mm256_mul_ps(sz, pnz[p]), v);
+
+			r_outside = _mm256_or_ps(r_outside, _mm256_cmp_ps(v, sr_inv, _CMP_LT_OQ));
+			r_inside  = _mm256_and_ps(r_inside, _mm256_cmp_ps(v, sr, _CMP_GT_OQ));
+		}
+
+		__m256i result = _mm256_or_si256(
+			intersectingBit,
+			_mm256_and_si256(_mm256_castps_si256(r_inside), insideBits));
+		result = _mm256_andnot_si256(_mm256_castps_si256(r_outside), result);
+
+		__m128i packed = _mm_packs_epi32(
+			_mm256_castsi256_si128(result),
+			_mm256_extracti128_si256(result, 1));
+		packed = _mm_packus_epi16(packed, packed);
+
+		_mm_storel_epi64((__m128i*)(results+i), packed);
+	}
+}
+
+
+typedef void FrustumIntersectSpheresSoAFunc(
+	const FrustumSoA&, u32,
+	const r32*, const r32*, const r32*, const r32*,
+	u8*);
+
+/**
+ * Runtime dispatched SoA sphere test, points to the widest kernel supported by the cpu once
+ * intersection_selectKernels is called.
+ */
+static FrustumIntersectSpheresSoAFunc* frustumSoA_intersectSpheresSoA = frustumSoA_intersectSpheresSoA_sse;
+
+void intersection_selectKernels(
+	const CpuFeatures& cf)
+{
+	frustumSoA_intersectSpheresSoA = (cf.avx2
+		? frustumSoA_intersectSpheresSoA_avx2
+		: frustumSoA_intersectSpheresSoA_sse);
+}
+
+
 /**
  * uses the "radar" approach
  * see http://www.lighthouse3d.com/tutorials/view-frustum-culling/radar-approach-testing-points/
@@ -0,0 +1,185 @@
+#include "intersection.h"
+#include "../utility/logger.h"
+#include "../utility/memory.h"
+#include <SDL_timer.h>
+#include <cstring>
+
+
+struct CullingBenchmarkData {
+	FrustumSoA	frustum;
+	u32			length;
+	Sphere*		spheres;	// AoS copy for the 1 sphere per call kernel
+	r32*		x;
+	r32*		y;
+	r32*		z;
+	r32*		r;
+	u8*			results;	// one IntersectionResult per sphere
+};
+
+typedef void CullingBenchmarkFunc(CullingBenchmarkData& data);
+
+struct CullingBenchmarkKernel {
+	const char*				name;
+	CullingBenchmarkFunc*	func;
+	bool					supported;
+};
+
+
+/**
+ * Portable reference the kernels must match, the signed distance is accumulated in the same order
+ * as the kernels (x*nx - d, + y*ny, + z*nz) so the results are bit identical.
+ */
+static void benchCullReference(CullingBenchmarkData& data)
+{
+	const FrustumSoA& f = data.frustum;
+	for (u32 i = 0; i < data.length; ++i) {
+		bool outside = false;
+		bool inside = true;
+		for (u32 p = 0; p < 6; ++p) {
+			r32 v = data.x[i] * f.nx[p] + -f.d[p];
+			v = data.y[i] * f.ny[p] + v;
+			v = data.z[i] * f.nz[p] + v;
+			outside = outside || (v < -data.r[i]);
+			inside = inside && (v > data.r[i]);
+		}
+		data.results[i] = (outside ? Outside : (inside ? Inside : Intersecting));
+	}
+}
+
+/**
+ * The path culling took per entity before the SoA kernels, one call with a single sphere
+ */
+static void benchCullPerSphereSse(CullingBenchmarkData& data)
+{
+	for (u32 i = 0; i < data.length; ++i) {
+		u8 result = 0;
+		frustumSoA_intersectSpheres_sse(data.frustum, 1, &data.spheres[i], 1, &result);
+		data.results[i] = result;
+	}
+}
+
+static void benchCullSoASse(CullingBenchmarkData& data)
+{
+	frustumSoA_intersectSpheresSoA_sse(data.frustum, data.length, data.x, data.y, data.z, data.r, data.results);
+}
+
+static void benchCullSoAAvx2(CullingBenchmarkData& data)
+{
+	frustumSoA_intersectSpheresSoA_avx2(data.frustum, data.length, data.x, data.y, data.z, data.r, data.results);
+}
+
+
+/**
+ * Tests 64K random camera space spheres against a 60 degree frustum with every culling kernel the
+ * cpu supports, checks each against the portable reference, then logs the ns per sphere of each.
+ * Development only, takes about a quarter second.
+ * @param scratch	needs 3 MB free
+ * @returns false if any kernel's results differ from the reference
+ */
+bool intersection_runBenchmark(
+	MemoryArena& scratch,
+	const CpuFeatures& cf)
+{
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(scratch);
+
+	const u32 numSpheres = 65536;
+
+	CullingBenchmarkData data{};
+	data.length  = numSpheres;
+	data.spheres = allocArrayOfType(scratch, Sphere, numSpheres);
+	data.x       = (r32*)allocBuffer(scratch, numSpheres * sizeof(r32), 32);
+	data.y       = (r32*)allocBuffer(scratch, numSpheres * sizeof(r32), 32);
+	data.z       = (r32*)allocBuffer(scratch, numSpheres * sizeof(r32), 32);
+	data.r       = (r32*)allocBuffer(scratch, numSpheres * sizeof(r32), 32);
+	data.results = allocBuffer(scratch, numSpheres, 32);
+	u8* expected = allocBuffer(scratch, numSpheres, 32);
+
+	// camera at the origin looking down -z, planes as { nx, ny, nz, d } in n*p - d form with the
+	// normals facing inward
+	const r32 c = cosf(30.0f * PIf / 180.0f);
+	const r32 s = sinf(30.0f * PIf / 180.0f);
+	const r32 planes[6][4] = {
+		{  0.0f, 0.0f, -1.0f,     1.0f },	// Near
+		{  0.0f, 0.0f,  1.0f, -1500.0f },	// Far
+		{     c, 0.0f,    -s,     0.0f },	// Left
+		{    -c, 0.0f,    -s,     0.0f },	// Right
+		{  0.0f,   -c,    -s,     0.0f },	// Top
+		{  0.0f,    c,    -s,     0.0f }	// Bottom
+	};
+	for (u32 p = 0; p < 6; ++p) {
+		data.frustum.nx[p] = planes[p][0];
+		data.frustum.ny[p] = planes[p][1];
+		data.frustum.nz[p] = planes[p][2];
+		data.frustum.d[p]  = planes[p][3];
+	}
+
+	// spheres spread over a box around the frustum give a mix of all three results
+	u64 rnd = 0x2545F4914F6CDD1DULL;
+	auto next = [&rnd]() {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 7;
+		rnd ^= rnd << 17;
+		return (r32)(rnd >> 40) / (r32)(1 << 24);
+	};
+	for (u32 i = 0; i < numSpheres; ++i) {
+		Sphere& sp = data.spheres[i];
+		sp.center = vec3{ next() * 2000.0f - 1000.0f, next() * 2000.0f - 1000.0f, next() * -1600.0f + 50.0f };
+		sp.radius = 1.0f + next() * 49.0f;
+		data.x[i] = sp.center.x;
+		data.y[i] = sp.center.y;
+		data.z[i] = sp.center.z;
+		data.r[i] = sp.radius;
+	}
+
+	CullingBenchmarkKernel kernels[] = {
+		{ "scalar reference",	benchCullReference,		true },
+		{ "per sphere sse",		benchCullPerSphereSse,	true },
+		{ "soa sse",			benchCullSoASse,		true },
+		{ "soa avx2",			benchCullSoAAvx2,		cf.avx2 != 0 }
+	};
+	const u32 numKernels = countof(kernels);
+
+	u8* results = data.results;
+	data.results = expected;
+	benchCullReference(data);
+	data.results = results;
+
+	u32 counts[4] = {};
+	for (u32 i = 0; i < numSpheres; ++i) {
+		++counts[expected[i]];
+	}
+	logger::test("culling %u spheres: %u outside, %u intersecting, %u inside",
+				 numSpheres, counts[Outside], counts[Intersecting], counts[Inside]);
+
+	bool match = true;
+	const u64 frequency = SDL_GetPerformanceFrequency();
+
+	for (u32 k = 0; k < numKernels; ++k) {
+		CullingBenchmarkKernel& kernel = kernels[k];
+		if (!kernel.supported) {
+			continue;
+		}
+
+		kernel.func(data);
+		if (memcmp(data.results, expected, numSpheres) != 0) {
+			logger::error("%s doesn't match the reference", kernel.name);
+			match = false;
+		}
+
+		// repeat for at least 40ms
+		u64 spheres = 0;
+		u64 start = SDL_GetPerformanceCounter();
+		u64 elapsed = 0;
+		do {
+			kernel.func(data);
+			spheres += numSpheres;
+			elapsed = SDL_GetPerformanceCounter() - start;
+		}
+		while (elapsed * 25 < frequency);
+
+		double nsPerSphere = (double)elapsed * 1.0e9 / frequency / spheres;
+		logger::test("%-16s %6.2f ns/sphere", kernel.name, nsPerSphere);
+	}
+
+	return match;
+}
@@ -0,0 +1,466 @@
+#include "occlusion.h"
+#include "scene.h"
+#include "../utility/intrinsics.h"
+#include "../utility/worker_pool.h"
+
+
+// rows of the buffer each raster work unit fills, a whole number of tile rows
+const u32 OcclusionBandRows = OcclusionTileHeight * 2;
+const u32 OcclusionNumBands = OCCLUSION_BUFFER_HEIGHT / OcclusionBandRows;
+static_assert(OCCLUSION_BUFFER_HEIGHT % OcclusionBandRows == 0, "bands must cover the buffer");
+
+// entities tested per work unit
+const u32 OcclusionTestUnitSize = 256;
+
+
+OcclusionView makeOcclusionView(
+	const CameraInstance& camInst)
+{
+	OcclusionView view{};
+
+	// same camera space as frustum culling, the view rotation without the translation
+	view.viewRotation = make_mat4(camInst.camera.frame.view);
+	view.viewRotation[3] = vec4{ 0.0f, 0.0f, 0.0f, 1.0f };
+	view.viewProjection = camInst.camera.frame.projection * view.viewRotation;
+	view.nearClip = camInst.camera.nearClip;
+
+	// ndc.x = P[0][0] * x/d - P[2][0] for the right handed projection looking down -z
+	const mat4& projection = camInst.camera.frame.projection;
+	view.screenScaleX = projection[0][0] * 0.5f * OCCLUSION_BUFFER_WIDTH;
+	view.screenScaleY = projection[1][1] * 0.5f * OCCLUSION_BUFFER_HEIGHT;
+	view.screenOffsetX = (1.0f - projection[2][0]) * 0.5f * OCCLUSION_BUFFER_WIDTH;
+	view.screenOffsetY = (1.0f - projection[2][1]) * 0.5f * OCCLUSION_BUFFER_HEIGHT;
+
+	return view;
+}
+
+
+/**
+ * Projects a triangle with all vertices on or in front of the near plane to pixel coordinates and
+ * sets up its edge functions and 1/w plane. Setup is done in double precision since clipped
+ * vertices can land far outside the buffer. Returns 0 if the triangle's bounds contain no pixel
+ * centers.
+ */
+u32 setupOcclusionTriangle(
+	const vec4& c0,
+	const vec4& c1,
+	const vec4& c2,
+	OcclusionTriangle& tri)
+{
+	const r64 halfWidth = 0.5 * OCCLUSION_BUFFER_WIDTH;
+	const r64 halfHeight = 0.5 * OCCLUSION_BUFFER_HEIGHT;
+	const vec4* c[3] = { &c0, &c1, &c2 };
+
+	r64 x[3], y[3], invW[3];
+	for (u32 v = 0; v < 3; ++v) {
+		invW[v] = 1.0 / (r64)c[v]->w;
+		x[v] = ((r64)c[v]->x * invW[v] + 1.0) * halfWidth;
+		y[v] = ((r64)c[v]->y * invW[v] + 1.0) * halfHeight;
+	}
+
+	r64 area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if (!(abs(area) > 1.0e-4)) {
+		return 0;
+	}
+	// orient counter clockwise so the inside of every edge is positive
+	if (area < 0.0) {
+		r64 t;
+		t = x[1]; x[1] = x[2]; x[2] = t;
+		t = y[1]; y[1] = y[2]; y[2] = t;
+		t = invW[1]; invW[1] = invW[2]; invW[2] = t;
+		area = -area;
+	}
+
+	// pixels whose centers fall within the bounds, clamped before converting to int
+	r64 minX = max(min(min(x[0], x[1]), x[2]) - 0.5, 0.0);
+	r64 maxX = min(max(max(x[0], x[1]), x[2]) - 0.5, (r64)(OCCLUSION_BUFFER_WIDTH - 1));
+	r64 minY = max(min(min(y[0], y[1]), y[2]) - 0.5, 0.0);
+	r64 maxY = min(max(max(y[0], y[1]), y[2]) - 0.5, (r64)(OCCLUSION_BUFFER_HEIGHT - 1));
+	tri.minX = (i32)ceil(minX);
+	tri.maxX = (i32)floor(maxX);
+	tri.minY = (i32)ceil(minY);
+	tri.maxY = (i32)floor(maxY);
+	if (tri.minX > tri.maxX || tri.minY > tri.maxY) {
+		return 0;
+	}
+
+	// the rasterizer samples at pixel centers, so each edge is pulled in by the most it can vary
+	// toward a corner, half a pixel in x and y, leaving it positive only where the whole pixel is
+	// inside. The 1/w plane is lowered the same way to the farthest depth within the pixel
+	for (u32 e = 0; e < 3; ++e) {
+		u32 a = e;
+		u32 b = (e + 1) % 3;
+		r64 edgeA = y[a] - y[b];
+		r64 edgeB = x[b] - x[a];
+		tri.edgeA[e] = (r32)edgeA;
+		tri.edgeB[e] = (r32)edgeB;
+		tri.edgeC[e] = (r32)(x[a] * y[b] - y[a] * x[b] - 0.5 * (abs(edgeA) + abs(edgeB)));
+	}
+
+	r64 dw1 = invW[1] - invW[0];
+	r64 dw2 = invW[2] - invW[0];
+	r64 invWA = (dw1 * (y[2] - y[0]) - dw2 * (y[1] - y[0])) / area;
+	r64 invWB = (dw2 * (x[1] - x[0]) - dw1 * (x[2] - x[0])) / area;
+	tri.invWA = (r32)invWA;
+	tri.invWB = (r32)invWB;
+	tri.invWC = (r32)(invW[0] - invWA * x[0] - invWB * y[0] - 0.5 * (abs(invWA) + abs(invWB)));
+
+	return 1;
+}
+
+
+u32 setupOcclusionTriangles(
+	const OcclusionView& view,
+	const mat4& model,
+	const vec3* vertices,
+	const u16* indices,
+	u32 numIndices,
+	OcclusionTriangle* outTriangles)
+{
+	mat4 modelViewProjection = view.viewProjection * model;
+	r32 nearClip = view.nearClip;
+	u32 numTriangles = 0;
+
+	for (u32 i = 0; i + 2 < numIndices; i += 3) {
+		vec4 clip[3];
+		u32 numBehind = 0;
+		for (u32 v = 0; v < 3; ++v) {
+			const vec3& p = vertices[indices[i + v]];
+			clip[v] = modelViewProjection * vec4{ p.x, p.y, p.z, 1.0f };
+			numBehind += (clip[v].w < nearClip) ? 1 : 0;
+		}
+
+		if (numBehind == 3) {
+			continue;
+		}
+		if (numBehind == 0) {
+			numTriangles += setupOcclusionTriangle(clip[0], clip[1], clip[2], outTriangles[numTriangles]);
+			continue;
+		}
+
+		// clip against the near plane, leaving a triangle or a quad to split in two
+		vec4 poly[4];
+		u32 numPoly = 0;
+		for (u32 v = 0; v < 3; ++v) {
+			const vec4& a = clip[v];
+			const vec4& b = clip[(v + 1) % 3];
+			bool aInside = (a.w >= nearClip);
+			bool bInside = (b.w >= nearClip);
+			if (aInside) {
+				poly[numPoly++] = a;
+			}
+			if (aInside != bInside) {
+				r32 t = (nearClip - a.w) / (b.w - a.w);
+				vec4 p = a + (b - a) * t;
+				p.w = nearClip;
+				poly[numPoly++] = p;
+			}
+		}
+		for (u32 v = 2; v < numPoly; ++v) {
+			numTriangles += setupOcclusionTriangle(poly[0], poly[v - 1], poly[v], outTriangles[numTriangles]);
+		}
+	}
+
+	return numTriangles;
+}
+
+
+/**
+ * Rasterizes the rows of each triangle falling in [rowBegin, rowEnd), 4 pixels at a time. A pixel
+ * takes the triangle's 1/w where it is entirely inside all 3 edges (the edges are biased in setup,
+ * so this is tested at the pixel center) and the triangle is nearer than what is already there.
+ * Each pixel is written by the triangles in order, and max is order independent, so the result
+ * doesn't depend on how rows are split.
+ */
+void rasterizeOcclusionRows(
+	OcclusionBuffer& ob,
+	const OcclusionTriangle* triangles,
+	u32 numTriangles,
+	i32 rowBegin,
+	i32 rowEnd)
+{
+	const __m128 laneCenters = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (u32 t = 0; t < numTriangles; ++t) {
+		const OcclusionTriangle& tri = triangles[t];
+		i32 y0 = max(tri.minY, rowBegin);
+		i32 y1 = min(tri.maxY, rowEnd - 1);
+		if (y0 > y1) {
+			continue;
+		}
+		i32 x0 = tri.minX & ~3;
+
+		__m128 a0 = _mm_set1_ps(tri.edgeA[0]);
+		__m128 a1 = _mm_set1_ps(tri.edgeA[1]);
+		__m128 a2 = _mm_set1_ps(tri.edgeA[2]);
+		__m128 wa = _mm_set1_ps(tri.invWA);
+		__m128 a0Step = _mm_set1_ps(tri.edgeA[0] * 4.0f);
+		__m128 a1Step = _mm_set1_ps(tri.edgeA[1] * 4.0f);
+		__m128 a2Step = _mm_set1_ps(tri.edgeA[2] * 4.0f);
+		__m128 waStep = _mm_set1_ps(tri.invWA * 4.0f);
+		__m128 px = _mm_add_ps(_mm_set1_ps((r32)x0), laneCenters);
+
+		for (i32 y = y0; y <= y1; ++y) {
+			r32 py = (r32)y + 0.5f;
+			__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), _mm_set1_ps(tri.edgeB[0] * py + tri.edgeC[0]));
+			__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), _mm_set1_ps(tri.edgeB[1] * py + tri.edgeC[1]));
+			__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), _mm_set1_ps(tri.edgeB[2] * py + tri.edgeC[2]));
+			__m128 w  = _mm_add_ps(_mm_mul_ps(wa, px), _mm_set1_ps(tri.invWB * py + tri.invWC));
+
+			r32* row = ob.depth[y];
+			for (i32 x = x0; x <= tri.maxX; x += 4) {
+				__m128 inside = _mm_cmpge_ps(_mm_min_ps(_mm_min_ps(e0, e1), e2), zero);
+				__m128 d = _mm_load_ps(row + x);
+				__m128 nearer = _mm_max_ps(d, w);
+				_mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, d)));
+
+				e0 = _mm_add_ps(e0, a0Step);
+				e1 = _mm_add_ps(e1, a1Step);
+				e2 = _mm_add_ps(e2, a2Step);
+				w  = _mm_add_ps(w, waStep);
+			}
+		}
+	}
+}
+
+
+/**
+ * Sets tileMin for the tiles in [rowBegin, rowEnd), which must be tile aligned.
+ */
+void updateOcclusionTileMin(
+	OcclusionBuffer& ob,
+	u32 rowBegin,
+	u32 rowEnd)
+{
+	for (u32 ty = rowBegin / OcclusionTileHeight; ty < rowEnd / OcclusionTileHeight; ++ty) {
+		for (u32 tx = 0; tx < OcclusionTilesX; ++tx) {
+			u32 x = tx * OcclusionTileWidth;
+			__m128 m = _mm_load_ps(&ob.depth[ty * OcclusionTileHeight][x]);
+			for (u32 r = 0; r < OcclusionTileHeight; ++r) {
+				const r32* row = ob.depth[ty * OcclusionTileHeight + r];
+				m = _mm_min_ps(m, _mm_min_ps(_mm_load_ps(row + x), _mm_load_ps(row + x + 4)));
+			}
+			m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+			m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+			ob.tileMin[ty][tx] = _mm_cvtss_f32(m);
+		}
+	}
+}
+
+
+struct OcclusionRasterJob {
+	OcclusionBuffer*			ob;
+	const OcclusionTriangle*	triangles;
+	u32							numTriangles;
+	u32							_padding;
+};
+
+void rasterizeOcclusionBand(
+	void* jobData,
+	u32 band,
+	MemoryArena& frameScoped)
+{
+	OcclusionRasterJob& job = *(OcclusionRasterJob*)jobData;
+	u32 rowBegin = band * OcclusionBandRows;
+	u32 rowEnd = rowBegin + OcclusionBandRows;
+
+	memset(job.ob->depth[rowBegin], 0, OcclusionBandRows * sizeof(job.ob->depth[0]));
+	rasterizeOcclusionRows(*job.ob, job.triangles, job.numTriangles, (i32)rowBegin, (i32)rowEnd);
+	updateOcclusionTileMin(*job.ob, rowBegin, rowEnd);
+}
+
+
+void rasterizeOccluders(
+	OcclusionBuffer& ob,
+	const OcclusionTriangle* triangles,
+	u32 numTriangles,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
+{
+	OcclusionRasterJob job{ &ob, triangles, numTriangles, 0 };
+	runParallel(workers, rasterizeOcclusionBand, &job, OcclusionNumBands, frameScoped);
+}
+
+
+bool isSphereOccluded(
+	const OcclusionBuffer& ob,
+	const OcclusionView& view,
+	const vec3& center,
+	r32 radius)
+{
+	vec4 c = view.viewRotation * vec4{ center.x, center.y, center.z, 1.0f };
+	r32 nearDist = -c.z - radius;
+	r32 farDist = -c.z + radius;
+	if (nearDist <= view.nearClip) {
+		return false;
+	}
+
+	// the sphere projects inside of its view space box, whose x/d and y/d are extreme at the corners
+	r32 invNear = 1.0f / nearDist;
+	r32 invFar = 1.0f / farDist;
+	r32 xs[4] = { (c.x - radius) * invNear, (c.x - radius) * invFar, (c.x + radius) * invNear, (c.x + radius) * invFar };
+	r32 ys[4] = { (c.y - radius) * invNear, (c.y - radius) * invFar, (c.y + radius) * invNear, (c.y + radius) * invFar };
+	r32 minXd = min(min(xs[0], xs[1]), min(xs[2], xs[3]));
+	r32 maxXd = max(max(xs[0], xs[1]), max(xs[2], xs[3]));
+	r32 minYd = min(min(ys[0], ys[1]), min(ys[2], ys[3]));
+	r32 maxYd = max(max(ys[0], ys[1]), max(ys[2], ys[3]));
+
+	r32 left   = minXd * view.screenScaleX + view.screenOffsetX;
+	r32 right  = maxXd * view.screenScaleX + view.screenOffsetX;
+	r32 bottom = minYd * view.screenScaleY + view.screenOffsetY;
+	r32 top    = maxYd * view.screenScaleY + view.screenOffsetY;
+	if (right < 0.0f || top < 0.0f
+		|| left >= (r32)OCCLUSION_BUFFER_WIDTH || bottom >= (r32)OCCLUSION_BUFFER_HEIGHT)
+	{
+		return false;
+	}
+
+	// every pixel the bounds touch
+	i32 x0 = (i32)max(left, 0.0f);
+	i32 x1 = (i32)min(right, (r32)(OCCLUSION_BUFFER_WIDTH - 1));
+	i32 y0 = (i32)max(bottom, 0.0f);
+	i32 y1 = (i32)min(top, (r32)(OCCLUSION_BUFFER_HEIGHT - 1));
+
+	r32 sphereInvW = invNear;
+	const __m128 sphereInvW4 = _mm_set1_ps(sphereInvW);
+	const __m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i first = _mm_set1_epi32(x0 - 1);
+	const __m128i last = _mm_set1_epi32(x1 + 1);
+
+	for (i32 ty = y0 / (i32)OcclusionTileHeight; ty <= y1 / (i32)OcclusionTileHeight; ++ty) {
+		for (i32 tx = x0 / (i32)OcclusionTileWidth; tx <= x1 / (i32)OcclusionTileWidth; ++tx) {
+			// the farthest occluder in the tile is still in front of the sphere
+			if (ob.tileMin[ty][tx] > sphereInvW) {
+				continue;
+			}
+
+			i32 py0 = max(y0, ty * (i32)OcclusionTileHeight);
+			i32 py1 = min(y1, ty * (i32)OcclusionTileHeight + (i32)OcclusionTileHeight - 1);
+			for (i32 g = tx * (i32)OcclusionTileWidth; g < (tx + 1) * (i32)OcclusionTileWidth; g += 4) {
+				if (g + 3 < x0 || g > x1) {
+					continue;
+				}
+				__m128i lanes = _mm_add_epi32(_mm_set1_epi32(g), laneIndex);
+				__m128 inBounds = _mm_castsi128_ps(_mm_and_si128(
+					_mm_cmpgt_epi32(lanes, first),
+					_mm_cmplt_epi32(lanes, last)));
+
+				for (i32 py = py0; py <= py1; ++py) {
+					__m128 notOccluded = _mm_cmple_ps(_mm_load_ps(&ob.depth[py][g]), sphereInvW4);
+					if (_mm_movemask_ps(_mm_and_ps(notOccluded, inBounds))) {
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+
+struct OcclusionTestJob {
+	Scene*						scene;
+	const SpatialTransientStorage*	sts;
+	const OcclusionBuffer*		ob;
+	const OcclusionView*		view;
+	dvec3						eye;
+	u8*							occluded;
+};
+
+void testOccludedEntities(
+	void* jobData,
+	u32 unit,
+	MemoryArena& frameScoped)
+{
+	OcclusionTestJob& job = *(OcclusionTestJob*)jobData;
+	Scene& scene = *job.scene;
+	u32 begin = unit * OcclusionTestUnitSize;
+	u32 end = min(begin + OcclusionTestUnitSize, job.sts->numVisibleEntities);
+
+	for (u32 e = begin; e < end; ++e) {
+		const SpatialInfo& si = scene.components.spatialInfo[job.sts->visibleSpatialInfoIds[e]]->data;
+		const SceneNode& node = scene.components.sceneNodes[si.sceneNodeId]->data;
+
+		dvec3 center = node.positionWorld + node.orientationWorld * make_dvec3(si.localBSphere.center);
+		job.occluded[e] = isSphereOccluded(
+			*job.ob, *job.view,
+			make_vec3(center - job.eye),
+			si.localBSphere.radius) ? 1 : 0;
+	}
+}
+
+
+void cullOccludedEntities(
+	Scene& scene,
+	const CameraInstance& camInst,
+	u8 cameraIndex,
+	SpatialTransientStorage& sts,
+	OcclusionBuffer& ob,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
+{
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	OcclusionView view = makeOcclusionView(camInst);
+	dvec3 eye = camInst.camera.eyePoint;
+	auto& occluders = scene.components.occluders;
+
+	u32 maxTriangles = 0;
+	for (u32 o = 0; o < occluders.length(); ++o) {
+		u32 meshIndex = occluders.item(o).data.meshIndex;
+		if (meshIndex < scene.numOccluderMeshes) {
+			maxTriangles += (scene.occluderMeshes[meshIndex].numIndices / 3) * 2;
+		}
+	}
+	OcclusionTriangle* triangles = allocArrayOfType(frameScoped, OcclusionTriangle, max(maxTriangles, 1U));
+
+	// occluders are positioned in camera space, like the frustum, so floats keep their precision
+	u32 numTriangles = 0;
+	for (u32 o = 0; o < occluders.length(); ++o) {
+		const Occluder& occ = occluders.item(o).data;
+		if (occ.meshIndex >= scene.numOccluderMeshes) {
+			continue; // restored from a snapshot before its mesh was registered
+		}
+		const OccluderMesh& mesh = scene.occluderMeshes[occ.meshIndex];
+		const SceneNode& node = scene.components.sceneNodes[occ.sceneNodeId]->data;
+
+		const dquat& q = node.orientationWorld;
+		mat4 model = mat4_cast(quat{ (r32)q.w, (r32)q.x, (r32)q.y, (r32)q.z });
+		model[3] = make_vec4(make_vec3(node.positionWorld - eye), 1.0f);
+
+		numTriangles += setupOcclusionTriangles(
+			view, model,
+			mesh.vertices, mesh.indices, mesh.numIndices,
+			&triangles[numTriangles]);
+	}
+
+	rasterizeOccluders(ob, triangles, numTriangles, workers, frameScoped);
+
+	// test in parallel, then compact the list in order on this thread
+	u32 numEntities = sts.numVisibleEntities;
+	OcclusionTestJob job{};
+	job.scene = &scene;
+	job.sts = &sts;
+	job.ob = &ob;
+	job.view = &view;
+	job.eye = eye;
+	job.occluded = allocArrayOfType(frameScoped, u8, max(numEntities, 1U));
+
+	u32 numUnits = (numEntities + OcclusionTestUnitSize - 1) / OcclusionTestUnitSize;
+	runParallel(workers, testOccludedEntities, &job, numUnits, frameScoped);
+
+	u32 visibleBit = 1UL << cameraIndex;
+	u32 numVisible = 0;
+	for (u32 e = 0; e < numEntities; ++e) {
+		if (job.occluded[e]) {
+			scene.components.spatialInfo[sts.visibleSpatialInfoIds[e]]->data.visibleFrustumBits &= ~visibleBit;
+			continue;
+		}
+		sts.visibleEntities[numVisible] = sts.visibleEntities[e];
+		sts.visibleSpatialInfoIds[numVisible] = sts.visibleSpatialInfoIds[e];
+		++numVisible;
+	}
+	sts.numVisibleEntities = numVisible;
+}
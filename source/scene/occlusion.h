@@ -0,0 +1,128 @@
+#ifndef _OCCLUSION_H
+#define _OCCLUSION_H
+
+#include "../capacity.h"
+#include "../utility/common.h"
+#include "../math/qmath.h"
+
+
+struct Scene;
+struct CameraInstance;
+struct SpatialTransientStorage;
+struct WorkerPool;
+struct MemoryArena;
+
+
+const u32 OcclusionTileWidth = 8;
+const u32 OcclusionTileHeight = 4;
+const u32 OcclusionTilesX = OCCLUSION_BUFFER_WIDTH / OcclusionTileWidth;
+const u32 OcclusionTilesY = OCCLUSION_BUFFER_HEIGHT / OcclusionTileHeight;
+
+static_assert(OCCLUSION_BUFFER_WIDTH % OcclusionTileWidth == 0
+			  && OCCLUSION_BUFFER_HEIGHT % OcclusionTileHeight == 0,
+			  "occlusion buffer must be a whole number of tiles");
+
+
+/**
+ * @struct OcclusionBuffer
+ *	Low resolution depth buffer that occluder meshes are rasterized into on the CPU. Each pixel holds
+ *	1/w of the nearest occluder, which is linear in screen space and grows toward the camera, or 0
+ *	where no occluder covers the whole pixel. Partly covered pixels are left empty so the buffer
+ *	never hides more than the occluders do. The second level holds the smallest value in each
+ *	8x4 tile, the farthest occluder depth in the tile, so most tests reject or accept a whole tile
+ *	with one compare.
+ */
+struct alignas(16) OcclusionBuffer {
+	r32		depth[OCCLUSION_BUFFER_HEIGHT][OCCLUSION_BUFFER_WIDTH];
+	r32		tileMin[OcclusionTilesY][OcclusionTilesX];
+};
+
+
+/**
+ * Camera values needed to project occluders and bounding spheres into the occlusion buffer. Inputs
+ * are in camera space, world axes with the eye at the origin, the same space frustum culling uses.
+ */
+struct OcclusionView {
+	mat4	viewProjection;		// camera space to clip space
+	mat4	viewRotation;		// camera space to view space
+	r32		nearClip;
+	r32		screenScaleX;		// view space x/d and y/d to pixels, d being the distance along -z
+	r32		screenScaleY;
+	r32		screenOffsetX;
+	r32		screenOffsetY;
+	r32		_padding[3];
+};
+
+
+/**
+ * Projected occluder triangle with its edge functions and 1/w plane set up in pixel coordinates.
+ * Edges are oriented so the inside of the triangle is positive, and biased so that evaluated at a
+ * pixel center they are positive only when the whole pixel is inside. The 1/w plane is biased to
+ * the smallest 1/w within the pixel.
+ */
+struct OcclusionTriangle {
+	r32		edgeA[3];
+	r32		edgeB[3];
+	r32		edgeC[3];
+	r32		invWA;
+	r32		invWB;
+	r32		invWC;
+	i32		minX, maxX;
+	i32		minY, maxY;
+};
+
+
+OcclusionView makeOcclusionView(
+	const CameraInstance& camInst);
+
+/**
+ * Projects an occluder mesh into triangles ready for rasterization, clipping them to the near
+ * plane and dropping those off screen or facing edge on. model transforms mesh vertices into
+ * camera space. outTriangles must have room for 2 triangles per input triangle.
+ * @return number of triangles written
+ */
+u32 setupOcclusionTriangles(
+	const OcclusionView& view,
+	const mat4& model,
+	const vec3* vertices,
+	const u16* indices,
+	u32 numIndices,
+	OcclusionTriangle* outTriangles);
+
+/**
+ * Clears the buffer and rasterizes the triangles, splitting the rows into bands that are filled
+ * in parallel. The result doesn't depend on the number of workers.
+ */
+void rasterizeOccluders(
+	OcclusionBuffer& ob,
+	const OcclusionTriangle* triangles,
+	u32 numTriangles,
+	WorkerPool& workers,
+	MemoryArena& frameScoped);
+
+/**
+ * Tests a bounding sphere given in camera space against the buffer. Returns true only if every
+ * pixel its screen bounds touch has an occluder nearer than the nearest point of the sphere.
+ * Spheres crossing the near plane are never occluded.
+ */
+bool isSphereOccluded(
+	const OcclusionBuffer& ob,
+	const OcclusionView& view,
+	const vec3& center,
+	r32 radius);
+
+/**
+ * Rasterizes the scene's occluders for the camera and removes the entities hidden behind them from
+ * sts.visibleEntities, keeping the order of those left. Entities are tested on the worker threads.
+ */
+void cullOccludedEntities(
+	Scene& scene,
+	const CameraInstance& camInst,
+	u8 cameraIndex,
+	SpatialTransientStorage& sts,
+	OcclusionBuffer& ob,
+	WorkerPool& workers,
+	MemoryArena& frameScoped);
+
+
+#endif
@@ -0,0 +1,223 @@
+#include "occlusion.h"
+#include "scene_components.h"
+#include "../utility/logger.h"
+#include "../utility/memory.h"
+#include <SDL_timer.h>
+#include <cstring>
+
+
+const u32 OcclusionCityBlocks = 8;			// city is OcclusionCityBlocks^2 buildings
+const r64 OcclusionCityBlockPitch = 100.0;	// building footprint [10,90] in each block, 20m streets
+const u32 OcclusionCityProps = 8000;
+const u32 OcclusionCitySamples = 32;		// rays cast to each sphere reported occluded
+
+struct OcclusionCityBox {
+	dvec3	lo;
+	dvec3	hi;
+};
+
+
+static u64 occlusionCityNext(u64& rnd)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return rnd;
+}
+
+static r64 occlusionCityRandom(u64& rnd)
+{
+	return (r64)(occlusionCityNext(rnd) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * Slab test of the segment from o to p against the box
+ */
+static bool segmentHitsBox(
+	const dvec3& o,
+	const dvec3& p,
+	const OcclusionCityBox& b)
+{
+	r64 t0 = 0.0;
+	r64 t1 = 1.0;
+	for (u32 a = 0; a < 3; ++a) {
+		r64 d = p.E[a] - o.E[a];
+		if (abs(d) < 1.0e-12) {
+			if (o.E[a] < b.lo.E[a] || o.E[a] > b.hi.E[a]) {
+				return false;
+			}
+			continue;
+		}
+		r64 ta = (b.lo.E[a] - o.E[a]) / d;
+		r64 tb = (b.hi.E[a] - o.E[a]) / d;
+		t0 = max(t0, min(ta, tb));
+		t1 = min(t1, max(ta, tb));
+		if (t0 > t1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Builds a city of box buildings with small props in the streets, rasterizes the buildings as
+ * occluders for a few street level and rooftop views, and tests every prop against the buffer. For
+ * each prop reported occluded, rays are cast from the eye to points on its bounding sphere, and
+ * any ray that misses every building means a visible prop was culled. Logs the number of props
+ * culled and the time taken to rasterize and to test. Development only, takes about a second.
+ * @param scratch	needs 1 MB free
+ * @returns false if a visible prop was reported occluded
+ */
+bool occlusion_runBenchmark(
+	MemoryArena& scratch)
+{
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(scratch);
+
+	const u32 numBoxes = OcclusionCityBlocks * OcclusionCityBlocks;
+	const r64 citySize = OcclusionCityBlocks * OcclusionCityBlockPitch;
+
+	OcclusionCityBox* boxes = allocArrayOfType(scratch, OcclusionCityBox, numBoxes);
+	vec3* vertices = allocArrayOfType(scratch, vec3, numBoxes * 8);
+	OcclusionTriangle* triangles = allocArrayOfType(scratch, OcclusionTriangle, numBoxes * 12 * 2);
+	dvec3* propCenters = allocArrayOfType(scratch, dvec3, OcclusionCityProps);
+	r32* propRadii = allocArrayOfType(scratch, r32, OcclusionCityProps);
+	OcclusionBuffer* ob = (OcclusionBuffer*)allocBuffer(scratch, sizeof(OcclusionBuffer), alignof(OcclusionBuffer));
+
+	static const u16 boxIndices[36] = {
+		0,1,2, 0,2,3,  4,6,5, 4,7,6,  0,4,5, 0,5,1,
+		3,2,6, 3,6,7,  0,3,7, 0,7,4,  1,5,6, 1,6,2
+	};
+
+	u64 rnd = 0x2545F4914F6CDD1DULL;
+
+	for (u32 j = 0; j < OcclusionCityBlocks; ++j) {
+		for (u32 i = 0; i < OcclusionCityBlocks; ++i) {
+			OcclusionCityBox& b = boxes[j * OcclusionCityBlocks + i];
+			r64 height = 30.0 + 90.0 * occlusionCityRandom(rnd);
+			b.lo = dvec3{ i * OcclusionCityBlockPitch + 10.0, 0.0, j * OcclusionCityBlockPitch + 10.0 };
+			b.hi = b.lo + dvec3{ 80.0, height, 80.0 };
+		}
+	}
+
+	// props go in the streets, never touching a building
+	for (u32 p = 0; p < OcclusionCityProps; ++p) {
+		dvec3 c;
+		r32 r;
+		for (;;) {
+			c.x = occlusionCityRandom(rnd) * citySize;
+			c.z = occlusionCityRandom(rnd) * citySize;
+			c.y = 0.5 + occlusionCityRandom(rnd) * 8.0;
+			r = (r32)(0.3 + occlusionCityRandom(rnd) * 2.0);
+
+			r64 bx = fmod(c.x, OcclusionCityBlockPitch);
+			r64 bz = fmod(c.z, OcclusionCityBlockPitch);
+			r64 dx = max(max(10.0 - bx, bx - 90.0), 0.0);
+			r64 dz = max(max(10.0 - bz, bz - 90.0), 0.0);
+			if (dx * dx + dz * dz > (r + 0.01) * (r + 0.01)) {
+				break;
+			}
+		}
+		propCenters[p] = c;
+		propRadii[p] = r;
+	}
+
+	struct OcclusionCityView {
+		const char*	name;
+		dvec3		eye;
+		dvec3		target;
+	};
+	const OcclusionCityView views[] = {
+		{ "street level, down a street",	dvec3{   5.0,   2.0, -50.0 },	dvec3{   5.0, 2.0, citySize } },
+		{ "street level, diagonal",			dvec3{ -30.0,   3.0, -30.0 },	dvec3{ citySize, 3.0, citySize } },
+		{ "rooftop, looking across",		dvec3{ citySize, 140.0, -100.0 },	dvec3{ citySize, 0.0, citySize } }
+	};
+
+	bool correct = true;
+	const u64 frequency = SDL_GetPerformanceFrequency();
+
+	for (u32 v = 0; v < countof(views); ++v) {
+		const OcclusionCityView& cv = views[v];
+
+		CameraInstance camInst{};
+		calcPerspProjection(camInst.camera, 60.0f, 16.0f / 9.0f, 1.0f, 3000.0f);
+		lookAt(camInst.camera, cv.eye, cv.target, dvec3{ 0.0, 1.0, 0.0 });
+		calcView(camInst.camera);
+		OcclusionView view = makeOcclusionView(camInst);
+
+		// occluders are positioned in camera space like cullOccludedEntities does
+		u64 start = SDL_GetPerformanceCounter();
+
+		u32 numTriangles = 0;
+		for (u32 b = 0; b < numBoxes; ++b) {
+			const OcclusionCityBox& box = boxes[b];
+			vec3 lo = make_vec3(box.lo - cv.eye);
+			vec3 hi = make_vec3(box.hi - cv.eye);
+			vec3* bv = &vertices[b * 8];
+			bv[0] = vec3{ lo.x, lo.y, lo.z };
+			bv[1] = vec3{ hi.x, lo.y, lo.z };
+			bv[2] = vec3{ hi.x, hi.y, lo.z };
+			bv[3] = vec3{ lo.x, hi.y, lo.z };
+			bv[4] = vec3{ lo.x, lo.y, hi.z };
+			bv[5] = vec3{ hi.x, lo.y, hi.z };
+			bv[6] = vec3{ hi.x, hi.y, hi.z };
+			bv[7] = vec3{ lo.x, hi.y, hi.z };
+
+			numTriangles += setupOcclusionTriangles(
+				view, mat4(),
+				bv, boxIndices, countof(boxIndices),
+				&triangles[numTriangles]);
+		}
+
+		memset(ob->depth, 0, sizeof(ob->depth));
+		rasterizeOcclusionRows(*ob, triangles, numTriangles, 0, OCCLUSION_BUFFER_HEIGHT);
+		updateOcclusionTileMin(*ob, 0, OCCLUSION_BUFFER_HEIGHT);
+
+		u64 rasterized = SDL_GetPerformanceCounter();
+
+		u32 numOccluded = 0;
+		u8* occluded = allocArrayOfType(scratch, u8, OcclusionCityProps);
+		for (u32 p = 0; p < OcclusionCityProps; ++p) {
+			occluded[p] = isSphereOccluded(*ob, view, make_vec3(propCenters[p] - cv.eye), propRadii[p]) ? 1 : 0;
+			numOccluded += occluded[p];
+		}
+
+		u64 tested = SDL_GetPerformanceCounter();
+
+		// any unblocked ray from the eye to a point on the sphere reaches the sphere's surface
+		u32 numWrong = 0;
+		for (u32 p = 0; p < OcclusionCityProps; ++p) {
+			if (!occluded[p]) {
+				continue;
+			}
+			for (u32 s = 0; s < OcclusionCitySamples; ++s) {
+				r64 u = occlusionCityRandom(rnd) * 2.0 - 1.0;
+				r64 phi = occlusionCityRandom(rnd) * 2.0 * PI;
+				r64 ring = sqrt(1.0 - u * u);
+				dvec3 point = propCenters[p] + dvec3{ ring * cos(phi), u, ring * sin(phi) } * (r64)propRadii[p];
+
+				bool blocked = false;
+				for (u32 b = 0; b < numBoxes && !blocked; ++b) {
+					blocked = segmentHitsBox(cv.eye, point, boxes[b]);
+				}
+				if (!blocked) {
+					++numWrong;
+					break;
+				}
+			}
+		}
+
+		logger::test("%-28s %u triangles, %u of %u props occluded, %u of those visible",
+					 cv.name, numTriangles, numOccluded, OcclusionCityProps, numWrong);
+		logger::test("%-28s rasterize %.1f us, test %.1f us", "",
+					 (r64)(rasterized - start) * 1.0e6 / frequency,
+					 (r64)(tested - rasterized) * 1.0e6 / frequency);
+
+		if (numWrong > 0) {
+			correct = false;
+		}
+	}
+
+	return correct;
+}
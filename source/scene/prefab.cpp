@@ -0,0 +1,156 @@
+#include "prefab.h"
+#include "../utility/memory.h"
+
+
+void prefab_addSceneNode(
+	Prefab& prefab,
+	const dvec3& translationLocal,
+	const dquat& rotationLocal)
+{
+	prefab.hasSceneNode = 1;
+	prefab.translationLocal = translationLocal;
+	prefab.rotationLocal = rotationLocal;
+}
+
+
+void prefab_addComponent(
+	Prefab& prefab,
+	DenseHandleMap16& store,
+	u8 typeId,
+	ComponentSetType setType,
+	const void* data,
+	u16 entityIdOffset,
+	u16 sceneNodeIdOffset)
+{
+	assert(prefab.numComponents < PREFAB_MAX_COMPONENTS
+			&& "prefab components are full, consider raising PREFAB_MAX_COMPONENTS");
+	assert(entityIdOffset + sizeof(EntityId) <= store.elementSizeB);
+	assert((sceneNodeIdOffset == PrefabNoSceneNode
+			|| sceneNodeIdOffset + sizeof(SceneNodeId) <= store.elementSizeB)
+			&& "sceneNodeIdOffset is outside of the store item");
+
+	PrefabComponent& component = prefab.components[prefab.numComponents++];
+	component.store = &store;
+	component.data = data;
+	component.entityIdOffset = entityIdOffset;
+	component.sceneNodeIdOffset = sceneNodeIdOffset;
+	component.typeId = typeId;
+	component.setType = (u8)setType;
+}
+
+
+void scene_instantiatePrefab(
+	Scene& scene,
+	const Prefab& prefab,
+	u32 count,
+	SceneNodeId parentNodeId,
+	EntityId* outEntityIds,
+	MemoryArena& frameScoped)
+{
+	if (count == 0) {
+		return;
+	}
+	assert(prefab.hasSceneNode || parentNodeId == null_h32);
+
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	u16 firstEntity = scene.entities.insertN(count, nullptr, outEntityIds);
+	for (u32 i = 0; i < count; ++i) {
+		entity_initComponentSets(scene.entities.item((u16)(firstEntity + i)), outEntityIds[i]);
+	}
+
+	// the new nodes go in front of the parent's children as one run of siblings
+	SceneNodeId* nodeIds = nullptr;
+	if (prefab.hasSceneNode) {
+		nodeIds = allocArrayOfType(frameScoped, SceneNodeId, count);
+
+		SceneNode& parentNode = (parentNodeId == null_h32)
+			? scene.root
+			: scene.components.sceneNodes[parentNodeId]->data;
+
+		Scene::Components::SceneNodeComponent snc{};
+		snc.data.translationLocal = prefab.translationLocal;
+		snc.data.rotationLocal = prefab.rotationLocal;
+		snc.data.positionWorld = parentNode.positionWorld + prefab.translationLocal;
+		snc.data.orientationWorld = normalize(parentNode.orientationWorld * prefab.rotationLocal);
+		snc.data.parent = parentNodeId;
+
+		// inserting appends to the inner array, so parentNode stays in place
+		u16 firstNode = scene.components.sceneNodes.insertN(count, &snc, nodeIds);
+		for (u32 i = 0; i < count; ++i) {
+			Scene::Components::SceneNodeComponent& node =
+				scene.components.sceneNodes.item((u16)(firstNode + i));
+			node.entityId = outEntityIds[i];
+			node.data.prevSibling = (i > 0 ? nodeIds[i-1] : null_h32);
+			node.data.nextSibling = (i + 1 < count ? nodeIds[i+1] : parentNode.firstChild);
+		}
+
+		if (parentNode.firstChild != null_h32) {
+			scene.components.sceneNodes[parentNode.firstChild]->data.prevSibling = nodeIds[count-1];
+		}
+		parentNode.firstChild = nodeIds[0];
+		parentNode.numChildren += count;
+
+		scene.hierarchy.topologyChanged = 1;
+	}
+
+	// one store at a time, ids of component c are componentIds[c*count] up to count
+	ComponentId* componentIds = allocArrayOfType(frameScoped, ComponentId, prefab.numComponents * count);
+	for (u32 c = 0; c < prefab.numComponents; ++c) {
+		const PrefabComponent& component = prefab.components[c];
+		ComponentId* ids = componentIds + c * count;
+
+		u16 first = component.store->insertN(count, component.data, ids, component.typeId);
+		for (u32 i = 0; i < count; ++i) {
+			u8* item = (u8*)component.store->item((u16)(first + i));
+			memcpy(item + component.entityIdOffset, &outEntityIds[i], sizeof(EntityId));
+			if (component.sceneNodeIdOffset != PrefabNoSceneNode) {
+				assert(prefab.hasSceneNode && "component points at a SceneNode the prefab doesn't have");
+				memcpy(item + component.sceneNodeIdOffset, &nodeIds[i], sizeof(SceneNodeId));
+			}
+		}
+	}
+
+	// write each set whole, sorted like entity_addComponent keeps it
+	ComponentSetStorage& storage = scene.componentSets;
+	for (u32 i = 0; i < count; ++i) {
+		Entity& entity = scene.entities.item((u16)(firstEntity + i));
+
+		for (u32 setType = ComponentSet_Scene; setType <= ComponentSet_Game; ++setType) {
+			ComponentId ids[PREFAB_MAX_COMPONENTS + 1];
+			u32 numIds = 0;
+			if (setType == ComponentSet_Scene && prefab.hasSceneNode) {
+				ids[numIds++] = nodeIds[i];
+			}
+			for (u32 c = 0; c < prefab.numComponents; ++c) {
+				if (prefab.components[c].setType == setType) {
+					ids[numIds++] = componentIds[c * count + i];
+				}
+			}
+			if (numIds == 0) {
+				continue;
+			}
+
+			u64 mask = 0;
+			for (u32 a = 0; a < numIds; ++a) {
+				ComponentId id = ids[a];
+				u32 key = entity_componentSortKey(id);
+				u32 b = a;
+				while (b > 0 && entity_componentSortKey(ids[b-1]) > key) {
+					ids[b] = ids[b-1];
+					--b;
+				}
+				ids[b] = id;
+				mask |= 1ULL << id.typeId;
+			}
+
+			ComponentSet& set = entity_getComponentSet(entity, (ComponentSetType)setType);
+			resizeComponentSet(set, storage, numIds);
+			memcpy(entity_getComponents(set, storage), ids, numIds * sizeof(ComponentId));
+			set.componentsSize = (u8)numIds;
+			set.mask = mask;
+
+			updateComponentQueries(set, storage, mask);
+		}
+	}
+}
@@ -0,0 +1,97 @@
+#ifndef _PREFAB_H
+#define _PREFAB_H
+
+#include "../capacity.h"
+#include "../utility/common.h"
+#include "scene.h"
+
+
+struct MemoryArena;
+
+
+// sceneNodeIdOffset of components that don't point at their entity's SceneNode
+const u16 PrefabNoSceneNode = USHRT_MAX;
+
+
+/**
+ * A component of the prefab, copied from data into its store for each instance. The instance's
+ * EntityId, and SceneNodeId if the component points at the entity's node, are written over the
+ * copy at the given byte offsets.
+ */
+struct PrefabComponent {
+	DenseHandleMap16*	store;
+	const void*			data;				// the whole store item, like MovementComponent
+	u16					entityIdOffset;		// offsetof the entityId in the store item
+	u16					sceneNodeIdOffset;	// offsetof a SceneNodeId in the store item, or PrefabNoSceneNode
+	u8					typeId;				// Type##StoreTypeId of the store
+	u8					setType;			// ComponentSetType the component goes into
+	u16					_padding;
+};
+
+
+/**
+ * @struct Prefab
+ *	Template of an entity, the layout of its components with their default data, from which
+ *	scene_instantiatePrefab creates any number of entities at once. The component data is
+ *	referenced, not copied, it must outlive the prefab. Zeroed memory is a valid empty prefab.
+ */
+struct Prefab {
+	dvec3			translationLocal;		// of the SceneNode, relative to the parent of the instances
+	dquat			rotationLocal;
+	PrefabComponent	components[PREFAB_MAX_COMPONENTS];
+	u32				numComponents;
+	u8				hasSceneNode;
+	u8				_padding[3];
+};
+
+
+/**
+ * Gives the prefab's entities a SceneNode, linked under the parent node they're instantiated to.
+ */
+void prefab_addSceneNode(
+	Prefab& prefab,
+	const dvec3& translationLocal,
+	const dquat& rotationLocal);
+
+
+/**
+ * Adds a component to the prefab's layout.
+ *
+ *	Scene::Components::MovementComponent movement{};
+ *	prefab_addComponent(prefab, scene.components.movement._map,
+ *		Scene::Components::MovementStoreTypeId, ComponentSet_Scene, &movement,
+ *		offsetof(Scene::Components::MovementComponent, entityId),
+ *		offsetof(Scene::Components::MovementComponent, data.sceneNodeId));
+ *
+ * @param data	default store item, referenced until the prefab is no longer used
+ * @param sceneNodeIdOffset	PrefabNoSceneNode if the component doesn't point at the node
+ */
+void prefab_addComponent(
+	Prefab& prefab,
+	DenseHandleMap16& store,
+	u8 typeId,
+	ComponentSetType setType,
+	const void* data,
+	u16 entityIdOffset,
+	u16 sceneNodeIdOffset);
+
+
+/**
+ * Creates count entities from the prefab in one pass. The handles of each store are taken in
+ * bulk and the new items, contiguous in the store, are copied from the default data and patched
+ * with their entity and node. Each entity's component sets are written whole, with one update of
+ * the registered queries. The SceneNodes become the first children of parentNodeId, in
+ * instance order.
+ * @param parentNodeId	SceneNode the instances are children of, null_h32 for the root
+ * @param outEntityIds	count ids of the new entities, in instance order
+ */
+void scene_instantiatePrefab(
+	Scene& scene,
+	const Prefab& prefab,
+	u32 count,
+	SceneNodeId parentNodeId,
+	EntityId* outEntityIds,
+	MemoryArena& frameScoped);
+
+
+#endif
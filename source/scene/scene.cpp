@@ -1,80 +1,352 @@
 #include "scene.h"
 #include "../utility/intrinsics.h"
+#include "../utility/worker_pool.h"
 #include "geometry.h"
 #include "intersection.h"
 
 
-void addToSpatialCell(
-	const SpatialCell& cell,
-	ComponentId spatialInfoId,
+u16 allocSpatialChunk(
 	SpatialPersistentStorage& sps)
 {
-	SpatialValue val;
-	val.spatialInfoId = spatialInfoId;
-	val.cell = cell;
-	u32 idx = getSpatialIndex(cell);
-	SpatialHandle front = sps.cells[idx];
-	
-	val.next = front;
-	SpatialHandle newFront = sps.valueMap.insert(&val);
-	sps.cells[idx] = newFront;
+	u16 c = sps.freeChunk;
+	if (c != 0) {
+		sps.freeChunk = sps.chunks[c].next;
+	}
+	else {
+		assert(sps.numChunks < SPATIAL_CHUNKS_CAPACITY-1 && "spatial chunk pool is exhausted");
+		if (sps.numChunks < SPATIAL_CHUNKS_CAPACITY-1) {
+			c = ++sps.numChunks; // chunk 0 is reserved as null
+		}
+	}
+	return c;
 }
 
 
-void addToSpatialMap(
-	const SpatialKey& key,
+void freeSpatialChunk(
+	u16 c,
+	SpatialPersistentStorage& sps)
+{
+	assert(c != 0);
+	sps.chunks[c].next = sps.freeChunk;
+	sps.freeChunk = c;
+}
+
+
+inline u32 hashSpatialCellKey(
+	u32 cellKey)
+{
+	// fibonacci hashing, take the high bits of the product
+	return (cellKey * 0x9E3779B1u) >> (32 - SpatialCellHashBits);
+}
+
+
+void setSpatialOccupancy(
+	SpatialOccupancy& occ,
+	u32 cellKey)
+{
+	occ.cells[cellKey >> 6]    |= 1ULL << (cellKey & 63);
+	occ.blocks[cellKey >> 12]  |= 1ULL << ((cellKey >> 6) & 63);
+	occ.regions[cellKey >> 18] |= 1ULL << ((cellKey >> 12) & 63);
+}
+
+
+void clearSpatialOccupancy(
+	SpatialOccupancy& occ,
+	u32 cellKey)
+{
+	// clear the bit up the hierarchy only when the word below it empties
+	if ((occ.cells[cellKey >> 6] &= ~(1ULL << (cellKey & 63))) == 0) {
+		if ((occ.blocks[cellKey >> 12] &= ~(1ULL << ((cellKey >> 6) & 63))) == 0) {
+			occ.regions[cellKey >> 18] &= ~(1ULL << ((cellKey >> 12) & 63));
+		}
+	}
+}
+
+
+u32 findSpatialCell(
+	const SpatialPersistentStorage& sps,
+	u32 cellKey)
+{
+	const u32 mask = SpatialCellHashCapacity - 1;
+	const u32 storedKey = cellKey + 1;
+
+	for (u32 i = hashSpatialCellKey(cellKey);; i = (i + 1) & mask) {
+		u32 k = sps.cells[i].key;
+		if (k == storedKey) {
+			return i;
+		}
+		if (k == 0) {
+			return UINT32_MAX;
+		}
+	}
+}
+
+
+/**
+ * Finds the cell in the hash table, inserting an empty bucket for it and marking it occupied if
+ * it isn't there yet. Returns the position in the hash table.
+ */
+u32 insertSpatialCell(
+	SpatialPersistentStorage& sps,
+	u32 cellKey)
+{
+	const u32 mask = SpatialCellHashCapacity - 1;
+	const u32 storedKey = cellKey + 1;
+
+	for (u32 i = hashSpatialCellKey(cellKey);; i = (i + 1) & mask) {
+		u32 k = sps.cells[i].key;
+		if (k == storedKey) {
+			return i;
+		}
+		if (k == 0) {
+			assert(sps.numOccupiedCells < SPATIAL_MAX_OCCUPIED_CELLS && "too many occupied spatial cells");
+			sps.cells[i] = SpatialCellEntry{ storedKey, {} };
+			++sps.numOccupiedCells;
+			++sps.occupancyVersion;
+			setSpatialOccupancy(sps.occupancy, cellKey);
+			return i;
+		}
+	}
+}
+
+
+/**
+ * Removes an emptied cell from the hash table. Entries after it in the probe chain are shifted
+ * back into the hole when their home position allows, so no tombstones are needed.
+ */
+void eraseSpatialCell(
+	SpatialPersistentStorage& sps,
+	u32 pos)
+{
+	const u32 mask = SpatialCellHashCapacity - 1;
+	assert(sps.cells[pos].key != 0 && sps.cells[pos].bucket.length == 0);
+
+	clearSpatialOccupancy(sps.occupancy, sps.cells[pos].key - 1);
+
+	u32 hole = pos;
+	for (u32 j = (pos + 1) & mask; sps.cells[j].key != 0; j = (j + 1) & mask) {
+		u32 home = hashSpatialCellKey(sps.cells[j].key - 1);
+		// move j into the hole unless its home lies cyclically within (hole, j]
+		bool homeBetween = (hole <= j)
+			? (home > hole && home <= j)
+			: (home > hole || home <= j);
+		if (!homeBetween) {
+			sps.cells[hole] = sps.cells[j];
+			hole = j;
+		}
+	}
+	sps.cells[hole].key = 0;
+	--sps.numOccupiedCells;
+	++sps.occupancyVersion;
+}
+
+
+void setSpatialEntrySphere(
+	SpatialChunk& chunk,
+	u32 lane,
+	const vec3& cellLocalCenter,
+	r32 radius)
+{
+	chunk.x[lane] = cellLocalCenter.x;
+	chunk.y[lane] = cellLocalCenter.y;
+	chunk.z[lane] = cellLocalCenter.z;
+	chunk.r[lane] = radius;
+}
+
+
+/**
+ * Appends an entry to the front chunk of the bucket, pushing a new front chunk when it is full.
+ * Returns false when the chunk pool is exhausted, leaving the entity's slot invalid.
+ */
+bool addToSpatialBucket(
+	SpatialBucket& bucket,
+	u32 cellKey,
 	ComponentId spatialInfoId,
+	const vec3& cellLocalCenter,
+	r32 radius,
 	SpatialPersistentStorage& sps)
 {
-	if (key.cs == key.ce) {
-		addToSpatialCell(key.cs, spatialInfoId, sps);
+	u32 lane = bucket.length % SpatialChunkCapacity;
+	if (lane == 0) {
+		u16 c = allocSpatialChunk(sps);
+		if (c == 0) {
+			return false;
+		}
+		sps.chunks[c].next = bucket.front;
+		bucket.front = c;
 	}
-	else {
-		for (u8 y = key.cs.y; y <= key.ce.y; ++y) {
-			for (u8 z = key.cs.z; z <= key.ce.z; ++z) {
-				for (u8 x = key.cs.x; x <= key.ce.x; ++x) {
-					addToSpatialCell(
-						SpatialCell{ x, y, z },
-						spatialInfoId,
-						sps);
-				}
+
+	SpatialChunk& chunk = sps.chunks[bucket.front];
+	setSpatialEntrySphere(chunk, lane, cellLocalCenter, radius);
+	chunk.spatialInfoIds[lane] = spatialInfoId;
+	++bucket.length;
+
+	sps.slots[spatialInfoId.index] = SpatialSlot{ cellKey, bucket.front, (u8)lane, 0 };
+	return true;
+}
+
+
+/**
+ * Finds the chunk and lane of an entity's entry in the bucket, using the entity's slot when it
+ * points into this cell, otherwise scanning the bucket's chunks.
+ */
+bool findInSpatialBucket(
+	const SpatialBucket& bucket,
+	u32 cellKey,
+	ComponentId spatialInfoId,
+	SpatialPersistentStorage& sps,
+	u16& outChunk,
+	u32& outLane)
+{
+	SpatialSlot& slot = sps.slots[spatialInfoId.index];
+	if (slot.chunk != 0 && slot.cellKey == cellKey) {
+		assert(sps.chunks[slot.chunk].spatialInfoIds[slot.lane] == spatialInfoId);
+		outChunk = slot.chunk;
+		outLane = slot.lane;
+		return true;
+	}
+
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		SpatialChunk& chunk = sps.chunks[c];
+		for (u32 l = 0; l < chunkLength; ++l) {
+			if (chunk.spatialInfoIds[l] == spatialInfoId) {
+				outChunk = c;
+				outLane = l;
+				return true;
 			}
 		}
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
 	}
+	return false;
 }
 
 
-void removeFromSpatialCell(
-	const SpatialCell& cell,
-	ComponentId spatialInfoId,
+/**
+ * Swap-removes the entry at chunk/lane by moving the last entry of the front chunk into the
+ * hole, and releases the front chunk when it empties.
+ */
+void removeFromSpatialBucket(
+	SpatialBucket& bucket,
+	u32 cellKey,
+	u16 chunk,
+	u32 lane,
 	SpatialPersistentStorage& sps)
 {
-	u32 idx = getSpatialIndex(cell);
-	SpatialHandle curr = sps.cells[idx];
+	assert(bucket.length > 0);
+	SpatialChunk& front = sps.chunks[bucket.front];
+	u32 lastLane = (bucket.length - 1) % SpatialChunkCapacity;
 
-	SpatialHandle prev = null_h32;
-	SpatialValue* prevVal = nullptr;
+	SpatialSlot& removedSlot = sps.slots[sps.chunks[chunk].spatialInfoIds[lane].index];
+	if (removedSlot.cellKey == cellKey) {
+		removedSlot = {};
+	}
 
-	while (curr != null_h32) {
-		SpatialValue* val = sps.valueMap[curr];
-		
-		if (val->spatialInfoId == spatialInfoId)
+	if (chunk != bucket.front || lane != lastLane) {
+		SpatialChunk& dst = sps.chunks[chunk];
+		ComponentId movedId = front.spatialInfoIds[lastLane];
+		dst.x[lane] = front.x[lastLane];
+		dst.y[lane] = front.y[lastLane];
+		dst.z[lane] = front.z[lastLane];
+		dst.r[lane] = front.r[lastLane];
+		dst.spatialInfoIds[lane] = movedId;
+
+		SpatialSlot& movedSlot = sps.slots[movedId.index];
+		if (movedSlot.cellKey == cellKey
+			&& movedSlot.chunk == bucket.front
+			&& movedSlot.lane == lastLane)
 		{
-			if (prevVal) {
-				prevVal->next = val->next;
-			}
-			else {
-				sps.cells[idx] = val->next;
-			}
+			movedSlot.chunk = chunk;
+			movedSlot.lane = (u8)lane;
+		}
+	}
 
-			sps.valueMap.erase(curr);
-			break;
+	--bucket.length;
+	if (lastLane == 0) {
+		u16 next = front.next;
+		freeSpatialChunk(bucket.front, sps);
+		bucket.front = next;
+	}
+}
+
+
+/**
+ * Bucket holding entities with the given key, the cell key that their slots refer to, and the
+ * position of the cell in the hash table (UINT32_MAX for the outsideGrid bucket). Returns nullptr
+ * if the cell is not occupied.
+ */
+SpatialBucket* findSpatialBucket(
+	const SpatialKey& key,
+	SpatialPersistentStorage& sps,
+	u32& outCellKey,
+	u32& outPos)
+{
+	outPos = UINT32_MAX;
+	if (key.level == SpatialGridOutsideLevel) {
+		outCellKey = SpatialGridKeySpace;
+		return &sps.outsideGrid;
+	}
+
+	outCellKey = getSpatialCellKey(key.cell, key.level);
+	outPos = findSpatialCell(sps, outCellKey);
+	return (outPos != UINT32_MAX ? &sps.cells[outPos].bucket : nullptr);
+}
+
+
+/**
+ * Origin that cached bspheres in the key's bucket are relative to, entities outside of the grid
+ * are relative to the world origin.
+ */
+inline dvec3 getSpatialKeyOrigin(
+	const SpatialKey& key)
+{
+	return (key.level == SpatialGridOutsideLevel
+			? dvec3{ 0.0, 0.0, 0.0 }
+			: getSpatialCellOrigin(key.cell, key.level));
+}
+
+
+/**
+ * Inverse of getSpatialCellKey, the outsideGrid bucket uses SpatialGridKeySpace as its cell key.
+ */
+inline SpatialKey getSpatialKeyFromCellKey(
+	u32 cellKey)
+{
+	if (cellKey == SpatialGridKeySpace) {
+		return SpatialKey{ {}, (u8)SpatialGridOutsideLevel };
+	}
+	u32 level = getSpatialLevelFromKey(cellKey);
+	return SpatialKey{ getSpatialCellFromKey(cellKey, level), (u8)level };
+}
+
+
+bool addToSpatialMap(
+	const SpatialKey& key,
+	ComponentId spatialInfoId,
+	const dvec3& center,
+	r32 radius,
+	SpatialPersistentStorage& sps)
+{
+	vec3 cellLocalCenter = make_vec3(center - getSpatialKeyOrigin(key));
+
+	if (key.level == SpatialGridOutsideLevel) {
+		return addToSpatialBucket(sps.outsideGrid, SpatialGridKeySpace, spatialInfoId, cellLocalCenter, radius, sps);
+	}
+
+	u32 cellKey = getSpatialCellKey(key.cell, key.level);
+	u32 pos = insertSpatialCell(sps, cellKey);
+	if (!addToSpatialBucket(sps.cells[pos].bucket, cellKey, spatialInfoId, cellLocalCenter, radius, sps)) {
+		// don't leave a cell inserted just for this entity behind empty
+		if (sps.cells[pos].bucket.length == 0) {
+			eraseSpatialCell(sps, pos);
 		}
-		
-		prev = curr;
-		prevVal = val;
-		curr = val->next;
+		return false;
 	}
+	return true;
 }
 
 
@@ -83,19 +355,20 @@ void removeFromSpatialMap(
 	ComponentId spatialInfoId,
 	SpatialPersistentStorage& sps)
 {
-	if (key.cs == key.ce) {
-		removeFromSpatialCell(key.cs, spatialInfoId, sps);
+	u32 cellKey = 0;
+	u32 pos = 0;
+	SpatialBucket* bucket = findSpatialBucket(key, sps, cellKey, pos);
+	if (!bucket) {
+		return;
 	}
-	else {
-		for (u8 y = key.cs.y; y <= key.ce.y; ++y) {
-			for (u8 z = key.cs.z; z <= key.ce.z; ++z) {
-				for (u8 x = key.cs.x; x <= key.ce.x; ++x) {
-					removeFromSpatialCell(
-						SpatialCell{ x, y, z },
-						spatialInfoId,
-						sps);
-				}
-			}
+
+	u16 chunk = 0;
+	u32 lane = 0;
+	if (findInSpatialBucket(*bucket, cellKey, spatialInfoId, sps, chunk, lane)) {
+		removeFromSpatialBucket(*bucket, cellKey, chunk, lane, sps);
+
+		if (pos != UINT32_MAX && bucket->length == 0) {
+			eraseSpatialCell(sps, pos);
 		}
 	}
 }
@@ -105,44 +378,31 @@ void updateSpatialKey(
 	const SpatialKey& prevKey,
 	const SpatialKey& newKey,
 	ComponentId spatialInfoId,
+	const dvec3& center,
+	r32 radius,
 	SpatialPersistentStorage& sps)
 {
-	if (prevKey.cs == prevKey.ce &&
-		!(prevKey.cs >= newKey.cs && prevKey.cs <= newKey.ce))
-	{
-		removeFromSpatialCell(prevKey.cs, spatialInfoId, sps);
-	}
-	else {
-		for (u8 y = prevKey.cs.y; y <= prevKey.ce.y; ++y) {
-			for (u8 z = prevKey.cs.z; z <= prevKey.ce.z; ++z) {
-				for (u8 x = prevKey.cs.x; x <= prevKey.ce.x; ++x) {
-					SpatialCell cell{ x, y, z };
-					// remove from cell if the cell isn't also in the new key
-					if (!(cell >= newKey.cs && cell <= newKey.ce)) {
-						removeFromSpatialCell(cell, spatialInfoId, sps);
-					}
-				}
-			}
-		}
+	if (!(prevKey == newKey)) {
+		removeFromSpatialMap(prevKey, spatialInfoId, sps);
+		addToSpatialMap(newKey, spatialInfoId, center, radius, sps);
+		return;
 	}
 
-	if (newKey.cs == newKey.ce &&
-		!(newKey.cs >= prevKey.cs && newKey.cs <= prevKey.ce))
-	{
-		addToSpatialCell(newKey.cs, spatialInfoId, sps);
+	// the entity stays in its cell, refresh the cached bsphere in place
+	u32 cellKey = 0;
+	u32 pos = 0;
+	SpatialBucket* bucket = findSpatialBucket(newKey, sps, cellKey, pos);
+	if (!bucket) {
+		return;
 	}
-	else {
-		for (u8 y = newKey.cs.y; y <= newKey.ce.y; ++y) {
-			for (u8 z = newKey.cs.z; z <= newKey.ce.z; ++z) {
-				for (u8 x = newKey.cs.x; x <= newKey.ce.x; ++x) {
-					SpatialCell cell{ x, y, z };
-					// add to cell if the cell isn't also in the prev key
-					if (!(cell >= prevKey.cs && cell <= prevKey.ce)) {
-						addToSpatialCell(cell, spatialInfoId, sps);
-					}
-				}
-			}
-		}
+
+	u16 chunk = 0;
+	u32 lane = 0;
+	if (findInSpatialBucket(*bucket, cellKey, spatialInfoId, sps, chunk, lane)) {
+		setSpatialEntrySphere(
+			sps.chunks[chunk], lane,
+			make_vec3(center - getSpatialKeyOrigin(newKey)),
+			radius);
 	}
 }
 
@@ -158,6 +418,10 @@ void updateSpatialKey(
  *   /..''  <=S2
  *  L_e == S2_e
  * 
+ * Each row y covers the triangle between y and y+1, not just along the line y, so the low and
+ * high x of a row come from clipping all three edges to the row and taking the x at both ends of
+ * each clipped edge. Every cell the triangle touches gets its bit set, however steep or flat it is.
+ *
  * sets lowest and highest bit set for both x and y over the whole triangle into outLowX, outLowY
  */
 void scanConvertTriangle(
@@ -166,72 +430,85 @@ void scanConvertTriangle(
 	vec2& S,   // short side intersection
 	u64* plane,
 	i16 planeSizeX, i16 planeSizeY,
+	r32 looseX, r32 looseY,
 	i16& outLowX, i16& outHighX,
 	i16& outLowY, i16& outHighY)
 {
-	i16 Ly_s = (i16)L_s.y;
-	i16 Ly_e = (i16)L_e.y;
-	i16 S1y_s = Ly_s;
-	i16 S1y_e = (i16)S.y;
-	i16 S2y_s = S1y_e;
-	i16 S2y_e = Ly_e;
-	r32 Lx_step  = (L_e.x - L_s.x) / (Ly_e - Ly_s);
-	r32 S1x_step = (S.x - L_s.x) / (S1y_e - S1y_s);
-	r32 S2x_step = (L_e.x - S.x) / (S2y_e - S2y_s);
-
-	// for each y row, find low and high x, fill bits between them inclusive
-	r32 Lx  = L_s.x + (Ly_s < 0 ? -Ly_s * Lx_step : 0.0f);
-	r32 S1x = L_s.x + (S1y_s < 0 ? -S1y_s * S1x_step : 0.0f);
-	r32 S2x = S.x + (S2y_s < 0 ? -S2y_s * S2x_step : 0.0f);
+	const vec2* edges[3][2] = {
+		{ &L_s, &L_e },	// L
+		{ &L_s, &S },	// S1
+		{ &S, &L_e }	// S2
+	};
+	r32 steps[3];
+	for (u32 e = 0; e < 3; ++e) {
+		const vec2& a = *edges[e][0];
+		const vec2& b = *edges[e][1];
+		steps[e] = (b.y > a.y ? (b.x - a.x) / (b.y - a.y) : 0.0f);
+	}
+
+	// the loose bounds of cells along the edges of the grid reach past it, so the triangle within
+	// the looseness outside of the plane is folded into the edge cells
+	const r32 edgeLowX = -looseX;
+	const r32 edgeLowY = -looseY;
+	const r32 edgeHighX = planeSizeX + looseX;
+	const r32 edgeHighY = planeSizeY + looseY;
+
+	i32 yBegin = max((i32)floorf(L_s.y), -1);
+	i32 yEnd = min((i32)floorf(L_e.y), (i32)planeSizeY);
 	
-	for (i16 y = max(Ly_s, (i16)0);
-		y <= min(Ly_e, (i16)(planeSizeY-1));
-		++y)
+	for (i32 y = yBegin; y <= yEnd; ++y)
 	{
-		i16 x1 = (i16)Lx;
-		Lx += Lx_step;
-		
-		i16 x2 = x1;
-		if (y < S1y_e) {
-			x2 = (i16)S1x;
-			S1x += S1x_step;
+		r32 rowTop = max(max((r32)y, L_s.y), edgeLowY);
+		r32 rowBottom = min(min((r32)(y + 1), L_e.y), edgeHighY);
+		if (rowTop > rowBottom) {
+			continue;
 		}
-		else {
-			x2 = (i16)S2x;
-			S2x += S2x_step;
+
+		r32 minX = FLT_MAX;
+		r32 maxX = -FLT_MAX;
+		for (u32 e = 0; e < 3; ++e) {
+			const vec2& a = *edges[e][0];
+			const vec2& b = *edges[e][1];
+			if (b.y < rowTop || a.y > rowBottom) {
+				continue;
+			}
+			r32 x0 = a.x;
+			r32 x1 = b.x;
+			if (b.y > a.y) {
+				x0 = a.x + (max(rowTop, a.y) - a.y) * steps[e];
+				x1 = a.x + (min(rowBottom, b.y) - a.y) * steps[e];
+			}
+			minX = min(minX, min(x0, x1));
+			maxX = max(maxX, max(x0, x1));
 		}
-		
-		i16 lowX = (x1 < x2 ? x1 : x2);
-		i16 highX = (x1 < x2 ? x2 : x1);
 
-		i16 planeIndex = y * planeSizeX / 64;
+		if (maxX < edgeLowX || minX > edgeHighX) {
+			continue; // the row is off the side of the plane
+		}
+		i32 lowX = min(max((i32)floorf(minX), 0), (i32)planeSizeX - 1);
+		i32 highX = min(max((i32)floorf(maxX), 0), (i32)planeSizeX - 1);
+		i32 rowY = min(max(y, 0), (i32)planeSizeY - 1);
+
+		u64* row = plane + rowY * (planeSizeX / 64);
 
-		for (i16 xBits = 0;
-			xBits < planeSizeX;
-			xBits += 64)
+		for (i32 w = lowX / 64; w <= highX / 64; ++w)
 		{
-			if (highX >= xBits
-				&& lowX < xBits + 64)
-			{
-				// set all bits between low and high bit index
-				// example using u8 bytes:
-				//              13-8    20-16
-				// |--------|-----***|*****---|--------|
-				//                5 7|0   4
-				u16 lowBit = max((i16)(lowX - xBits), (i16)0);
-				u16 highBit = min((i16)(highX - xBits), (i16)63);
-				u64 bitset = (2UL << highBit) - (1UL << lowBit);
-				
-				plane[planeIndex] |= bitset;
-				++planeIndex; 
-			}
+			// set all bits between low and high bit index
+			// example using u8 bytes:
+			//              13-8    20-16
+			// |--------|-----***|*****---|--------|
+			//                5 7|0   4
+			i32 xBits = w * 64;
+			u32 lowBit = (u32)(max(lowX, xBits) - xBits);
+			u32 highBit = (u32)(min(highX, xBits + 63) - xBits);
+			row[w] |= (2ULL << highBit) - (1ULL << lowBit);
 		}
 
-		outLowX  = min(outLowX, lowX);
-		outHighX = max(outHighX, highX);
+		outLowX  = min(outLowX, (i16)lowX);
+		outHighX = max(outHighX, (i16)highX);
+		outLowY  = min(outLowY, (i16)rowY);
+		outHighY = max(outHighY, (i16)rowY);
 	}
-	outLowY  = min(outLowY, Ly_s);
-	outHighY = max(outHighY, Ly_e);
 }
 
 
@@ -241,6 +518,7 @@ void rasterizeTriangle(
 	vec2 C,
 	u64* plane,
 	i16 planeSizeX, i16 planeSizeY,
+	r32 looseX, r32 looseY,
 	i16& outLowX, i16& outHighX,
 	i16& outLowY, i16& outHighY)
 {
@@ -255,13 +533,13 @@ void rasterizeTriangle(
 		if (A.y < B.y) {
 			scanConvertTriangle(
 				A, B, C,
-				plane, planeSizeX, planeSizeY,
+				plane, planeSizeX, planeSizeY, looseX, looseY,
 				outLowX, outHighX, outLowY, outHighY);
 		}
 		else {
 			scanConvertTriangle(
 				B, A, C,
-				plane, planeSizeX, planeSizeY,
+				plane, planeSizeX, planeSizeY, looseX, looseY,
 				outLowX, outHighX, outLowY, outHighY);
 		}
 	}
@@ -270,13 +548,13 @@ void rasterizeTriangle(
 		if (B.y < C.y) {
 			scanConvertTriangle(
 				B, C, A,
-				plane, planeSizeX, planeSizeY,
+				plane, planeSizeX, planeSizeY, looseX, looseY,
 				outLowX, outHighX, outLowY, outHighY);
 		}
 		else {
 			scanConvertTriangle(
 				C, B, A,
-				plane, planeSizeX, planeSizeY,
+				plane, planeSizeX, planeSizeY, looseX, looseY,
 				outLowX, outHighX, outLowY, outHighY);
 		}
 	}
@@ -285,13 +563,13 @@ void rasterizeTriangle(
 		if (C.y < A.y) {
 			scanConvertTriangle(
 				C, A, B,
-				plane, planeSizeX, planeSizeY,
+				plane, planeSizeX, planeSizeY, looseX, looseY,
 				outLowX, outHighX, outLowY, outHighY);
 		}
 		else {
 			scanConvertTriangle(
 				A, C, B,
-				plane, planeSizeX, planeSizeY,
+				plane, planeSizeX, planeSizeY, looseX, looseY,
 				outLowX, outHighX, outLowY, outHighY);
 		}
 	}
@@ -299,8 +577,9 @@ void rasterizeTriangle(
 
 
 /**
- * Takes frustum points in world space and projects the top, right and left triangles onto the
- * three axis-aligned planes xz, xy and zy. The triangle vertices are divided into grid space
+ * Takes frustum points in world space and projects the top, left, right and bottom triangles onto
+ * the three axis-aligned planes xz, xy and zy, which together cover the projection of the whole
+ * frustum. The triangle vertices are divided into grid space
  * but kept in floating point. Then, each triangle is rasterized in grid space integer coords 
  * and clipped to grid boundaries. The resulting bits are stored in the xz, xy and zy planes of a
  * SpatialCellProjections object.
@@ -328,368 +607,1830 @@ void scanConvertFrustum(
 	vec3 tr = make_vec3(fp.ftr *= invSpatialGridSizeXYZ);
 	vec3 bl = make_vec3(fp.fbl *= invSpatialGridSizeXYZ);
 	vec3 br = make_vec3(fp.fbr *= invSpatialGridSizeXYZ);
+
+	// loose bounds reach half an xz cell past each cell, in cells of each axis
+	const r32 looseXZ = 0.5f;
+	const r32 looseY = (r32)(spatialGridSizeXZ * 0.5 / spatialGridSizeY);
 	
 	// xz plane
 	rasterizeTriangle( // frustum top
 		fo.xz, tr.xz, tl.xz,
-		cp.xz, gridSizeX, gridSizeZ,
+		cp.xz, gridSizeX, gridSizeZ, looseXZ, looseXZ,
 		cp.lowX, cp.highX, cp.lowZ, cp.highZ);
 
 	rasterizeTriangle( // frustum left
 		fo.xz, tl.xz, bl.xz,
-		cp.xz, gridSizeX, gridSizeZ,
+		cp.xz, gridSizeX, gridSizeZ, looseXZ, looseXZ,
 		cp.lowX, cp.highX, cp.lowZ, cp.highZ);
 
 	rasterizeTriangle( // frustum right
 		fo.xz, br.xz, tr.xz,
-		cp.xz, gridSizeX, gridSizeZ,
+		cp.xz, gridSizeX, gridSizeZ, looseXZ, looseXZ,
 		cp.lowX, cp.highX, cp.lowZ, cp.highZ);
 
-	// TODO: we should need bottom on all of these too
+	rasterizeTriangle( // frustum bottom
+		fo.xz, bl.xz, br.xz,
+		cp.xz, gridSizeX, gridSizeZ, looseXZ, looseXZ,
+		cp.lowX, cp.highX, cp.lowZ, cp.highZ);
 
 	// xy plane
 	rasterizeTriangle(
 		fo.xy, tr.xy, tl.xy,
-		cp.xy, gridSizeX, gridSizeY,
+		cp.xy, gridSizeX, gridSizeY, looseXZ, looseY,
 		cp.lowX, cp.highX, cp.lowY, cp.highY);
 
 	rasterizeTriangle(
 		fo.xy, tl.xy, bl.xy,
-		cp.xy, gridSizeX, gridSizeY,
+		cp.xy, gridSizeX, gridSizeY, looseXZ, looseY,
 		cp.lowX, cp.highX, cp.lowY, cp.highY);
 
 	rasterizeTriangle(
 		fo.xy, br.xy, tr.xy,
-		cp.xy, gridSizeX, gridSizeY,
+		cp.xy, gridSizeX, gridSizeY, looseXZ, looseY,
+		cp.lowX, cp.highX, cp.lowY, cp.highY);
+
+	rasterizeTriangle(
+		fo.xy, bl.xy, br.xy,
+		cp.xy, gridSizeX, gridSizeY, looseXZ, looseY,
 		cp.lowX, cp.highX, cp.lowY, cp.highY);
 
 	// zy plane
 	rasterizeTriangle(
 		fo.zy, tr.zy, tl.zy,
-		cp.zy, gridSizeZ, gridSizeY,
+		cp.zy, gridSizeZ, gridSizeY, looseXZ, looseY,
 		cp.lowZ, cp.highZ, cp.lowY, cp.highY);
 
 	rasterizeTriangle(
 		fo.zy, tl.zy, bl.zy,
-		cp.zy, gridSizeZ, gridSizeY,
+		cp.zy, gridSizeZ, gridSizeY, looseXZ, looseY,
 		cp.lowZ, cp.highZ, cp.lowY, cp.highY);
 
 	rasterizeTriangle(
 		fo.zy, br.zy, tr.zy,
-		cp.zy, gridSizeZ, gridSizeY,
+		cp.zy, gridSizeZ, gridSizeY, looseXZ, looseY,
+		cp.lowZ, cp.highZ, cp.lowY, cp.highY);
+
+	rasterizeTriangle(
+		fo.zy, bl.zy, br.zy,
+		cp.zy, gridSizeZ, gridSizeY, looseXZ, looseY,
 		cp.lowZ, cp.highZ, cp.lowY, cp.highY);
 }
 
 
 /**
- * Once the three axis aligned buffers contain the rasterized frustum, the bits must be tested for
- * intersection to be determined visible. A cell x,y,z must have its bit set in all three of the
- * orthogonal projections. To do this, we loop over pixels in yz, and if set, bitwise AND the rows
- * of xz and xy together to test 64 cells at a time. We only loop over the box of cells ranging
- * from low to high coords determined during rasterization, to touch as little memory as needed.
- * Cells within the projected region that contain entities are added to the cellPVS.
+ * Grows the set bits of a projection plane by one cell in each direction, within the rows of the
+ * rasterized bounds. Each row is planeSizeX bits long, stored in 64 bit words.
  */
-void getCellPVSFromProjections(
-	SpatialTransientStorage& sts,
-	SpatialPersistentStorage& sps)
+void dilateProjectionPlane(
+	u64* plane,
+	i16 planeSizeX,
+	i16 lowY, i16 highY)
 {
-	SpatialCellProjections& cp = sts.cellProj;
-	sts.cellPVSLength = 0;
+	const i16 rowWords = planeSizeX / 64;
+	assert(rowWords <= 4);
+
+	// dilate along x, carrying bits across the words of a row
+	for (i16 y = lowY; y <= highY; ++y) {
+		u64* row = plane + y*rowWords;
+		u64 carryIn = 0;
+		for (i16 w = 0; w < rowWords; ++w) {
+			u64 bits = row[w];
+			u64 next = (w + 1 < rowWords ? row[w+1] : 0);
+			row[w] = bits | (bits << 1) | (bits >> 1) | carryIn | (next << 63);
+			carryIn = bits >> 63;
+		}
+	}
 
-	for (i16 y = max(cp.lowY, (i16)0);
-		y <= min(cp.highY, (i16)(gridSizeY-1));
-		++y)
-	{
-		for (i16 z = max(cp.lowZ, (i16)0);
-			z <= min(cp.highZ, (i16)(gridSizeZ-1));
-			++z)
-		{
-			// if bit is set in the zy plane
-			i16 zyBit = ((cp.zy[y*4+z/64] >> (z & 63)) & 0x01);
-			if (zyBit) {
-				for (i16 xBits = max(cp.lowX, (i16)0) / 64;
-					xBits <= min(cp.highX, (i16)(gridSizeX-1)) / 64;
-					++xBits)
-				{
-					// test xz,xy intersection with bitwise AND
-					u64 bitset = cp.xz[z*4+xBits] & cp.xy[y*4+xBits];
-					
-					u32 lowX = 0;
-					u32 highX = 0;
-					
-					u8 set = BitScanFwd64(&lowX, bitset)
-						  && BitScanRev64(&highX, bitset);
-					
-					if (set) {
-						for (u32 x = lowX + (xBits*64);
-							x <= highX + (xBits*64);
-							++x)
-						{
-							SpatialCell cell{ (u8)x, (u8)y, (u8)z };
-							u32 idx = getSpatialIndex(cell);
-							
-							SpatialHandle hnd = sps.cells[idx];
-							// if the cell contains objects, add it to the cell PVS
-							if (hnd != null_h32)
-							{
-								sts.cellPVS[sts.cellPVSLength++] = cell;
-							}
-						}
-					}
-				}
-			}
+	// dilate along y by ORing in the neighboring rows, keeping a copy of the previous row since
+	// it has already been overwritten
+	u64 prev[4] = {};
+	for (i16 y = lowY; y <= highY; ++y) {
+		u64* row = plane + y*rowWords;
+		const u64* next = (y + 1 <= highY ? row + rowWords : nullptr);
+		for (i16 w = 0; w < rowWords; ++w) {
+			u64 bits = row[w];
+			row[w] = bits | prev[w] | (next ? next[w] : 0);
+			prev[w] = bits;
 		}
 	}
 }
 
 
 /**
- * Each cell in the cellPVS (determined by projection/rasterization algorithm) is then bsphere
- * tested against the frustum to see if it intersects the boundary, or is fully contained. If fully
- * contained, the cell's entities are added to the entityPVS. If the cell's bsphere intersects,
- * entities are individually bsphere tested and added to the entityPVS. If the cell's bsphere does
- * not intersect, assert since that indicates a bug in the projection code.
+ * Level 0 cells are loose, so an entity in a cell neighboring the frustum can still reach into
+ * it. Growing each projection by one cell in every direction (and the bounds to match) makes the
+ * projection test conservative for the loose bounds.
  */
-void cullEntitiesInCellPVS(
-	Scene& scene,
-	const CameraInstance& camInst,
-	u8 cameraIndex,
-	SpatialTransientStorage& sts,
-	SpatialPersistentStorage& sps)
+void dilateSpatialCellProjections(
+	SpatialCellProjections& cp)
 {
-	sts.numVisibleEntities = 0;
+	cp.lowX  = max((i16)(cp.lowX - 1), (i16)0);
+	cp.highX = min((i16)(cp.highX + 1), (i16)(gridSizeX-1));
+	cp.lowY  = max((i16)(cp.lowY - 1), (i16)0);
+	cp.highY = min((i16)(cp.highY + 1), (i16)(gridSizeY-1));
+	cp.lowZ  = max((i16)(cp.lowZ - 1), (i16)0);
+	cp.highZ = min((i16)(cp.highZ + 1), (i16)(gridSizeZ-1));
+
+	dilateProjectionPlane(cp.xz, gridSizeX, cp.lowZ, cp.highZ);
+	dilateProjectionPlane(cp.xy, gridSizeX, cp.lowY, cp.highY);
+	dilateProjectionPlane(cp.zy, gridSizeZ, cp.lowY, cp.highY);
+}
 
-	// get view projection matrix in camera space, which is halfway between world and view space
-	// (world space rotation with camera at origin)
-	mat4 viewProj_camera = camInst.camera.frame.viewProjection;
-	
-	// TODO: temporary, just trying to see if the logic is sound, subtracting eyePoint from translation in viewMatrix should yield 0,0,0
-	assert(length2(vec3{ viewProj_camera[0][3], viewProj_camera[1][3], viewProj_camera[2][3] }
-					- make_vec3(camInst.camera.eyePoint)) < FLT_EPSILON);
-	
-	viewProj_camera[0][3] = 0.0f;
-	viewProj_camera[1][3] = 0.0f;
-	viewProj_camera[2][3] = 0.0f;
 
-	FrustumSoA frustum = frustum_extractFromMatrixGL(viewProj_camera.E);
+/**
+ * Swaps the bits selected by mask with the bits shift places above them.
+ */
+inline u64 deltaSwap(
+	u64 w,
+	u64 mask,
+	u32 shift)
+{
+	u64 t = ((w >> shift) ^ w) & mask;
+	return w ^ t ^ (t << shift);
+}
 
-	// transform the frustum planes into a "homogeneous grid space" which has a scaled Y axis so
-	// the grid cell is a cube
-	FrustumSoA f_hgs = frustum;
-	for (int p = 0; p < 6; ++p) {
-		f_hgs.ny[p] *= spatialGridSize_XZ_Y_ratio;
+
+/**
+ * Packs the 4 bit runs a brick covers in each projection into 16 bits, one nibble per row: the
+ * xz runs per z, and the xy and zy runs per y. The brick origin is a multiple of 4 so each run
+ * never straddles a 64 bit word of the projections.
+ */
+inline void packSpatialBrickRows(
+	const SpatialCellProjections& cp,
+	const SpatialCell& o,
+	u64& xzRows,
+	u64& xyRows,
+	u64& zyRows)
+{
+	xzRows = 0;
+	xyRows = 0;
+	zyRows = 0;
+	for (u32 i = 0; i < 4; ++i) {
+		xzRows |= ((cp.xz[(o.z+i)*4 + o.x/64] >> (o.x & 63)) & 0xF) << (4*i);
+		xyRows |= ((cp.xy[(o.y+i)*4 + o.x/64] >> (o.x & 63)) & 0xF) << (4*i);
+		zyRows |= ((cp.zy[(o.y+i)*4 + o.z/64] >> (o.z & 63)) & 0xF) << (4*i);
 	}
-	plane_normalize_4_sse(f_hgs.nx, f_hgs.ny, f_hgs.nz, f_hgs.d);
-	plane_normalize_4_sse(f_hgs.nx+2, f_hgs.ny+2, f_hgs.nz+2, f_hgs.d+2);
+}
 
-	for (u32 c = 0; c < sts.cellPVSLength; ++c)
-	{
-		SpatialCell& cell = sts.cellPVS[c];
-		u32 idx = getSpatialIndex(cell);
-		SpatialHandle hnd = sps.cells[idx];
-		assert(hnd != null_h32);
-
-		// Test the spatial cell's world space bounding sphere, if it is
-		// fully contained we can skip testing individual objects in the
-		// cell. The y scaling factor is applied to transform the world
-		// space cell into a homogeneous xyz grid space. The volume to test
-		// against is now a sphere containing the cell's AABB.
-							
-		dvec3 cellCenter{ (r64)cell.x, (r64)cell.y, (r64)cell.z };
-		cellCenter *= spatialGridSizeXZ;
-		cellCenter += (spatialGridSizeXZ * 0.5);
-		cellCenter -= camInst.camera.eyePoint; // translate cell into camera space, same as frustum
-		Sphere cellBSphere{ make_vec3(cellCenter), spatialGridCellRadius };
-
-		u8 cellResult = 0;
-		frustumSoA_intersectSpheres_sse(f_hgs, 1, &cellBSphere, 1, &cellResult);
-		assert(cellResult != Outside);
-
-		if (cellResult == Inside)
-		{
-			// add all objects in cell to the PVS
-			do {
-				SpatialValue* sv = sps.valueMap[hnd];
-				assert(sv);
-
-				Scene::Components::SpatialInfoComponent& si =
-					*scene.components.spatialInfo[sv->spatialInfoId];
-				
-				u32 visibleBit = 1UL << cameraIndex;
-
-				if (!(si.data.visibleFrustumBits & visibleBit)) {
-					si.data.visibleFrustumBits |= visibleBit;
-					sts.visibleEntities[sts.numVisibleEntities++] = si.entityId;
-				}
 
-				hnd = sv->next;
-			}
-			while (hnd != null_h32);
-		}
-		else { // Intersecting
-			// for intersecting cells, test bspheres of all objects and add to the PVS if not outside
-			// for these tests we use the real world-space frustum, not the y-scaled one used for the cell
-			do {
-				SpatialValue* sv = sps.valueMap[hnd];
-				assert(sv);
-				
-				Scene::Components::SpatialInfoComponent& si =
-					*scene.components.spatialInfo[sv->spatialInfoId];
-
-				SceneNode& node = scene.components.sceneNodes[si.data.sceneNodeId]->data;
-				Sphere cameraSpaceBSphere = si.data.localBSphere;
-				cameraSpaceBSphere.center += make_vec3(node.positionWorld - camInst.camera.eyePoint);
-
-				u8 objResult = 0;
-				frustumSoA_intersectSpheres_sse(frustum, 1, &cameraSpaceBSphere, 1, &objResult);
-				
-				u32 visibleBit = ((objResult != Outside) & 1UL) << cameraIndex;
-				
-				if (!(si.data.visibleFrustumBits & visibleBit)) {
-					si.data.visibleFrustumBits |= visibleBit;
-					sts.visibleEntities[sts.numVisibleEntities++] = si.entityId;
-				}
+/**
+ * Builds the 64 bit visibility mask of a 4x4x4 brick of cells in Morton order, where a cell's bit
+ * is set when its bit is set in all three projections. The packed rows are spread into a word
+ * indexed by x + 4y + 16z: the xz nibbles repeat across y, the xy nibbles across z, and the zy
+ * bits are transposed to z major and each widened to a whole nibble. After ANDing the three, delta
+ * swaps permute the index bits x0 x1 y0 y1 z0 z1 into the Morton order x0 y0 z0 x1 y1 z1.
+ */
+inline u64 getSpatialBrickVisibility(
+	u64 xzRows,
+	u64 xyRows,
+	u64 zyRows)
+{
+	u64 a = xzRows;
+	a = (a | (a << 24)) & 0x000000FF000000FFULL;
+	a = (a | (a << 12)) & 0x000F000F000F000FULL;
+	a |= a << 4;
+	a |= a << 8;
+
+	u64 b = xyRows;
+	b |= b << 16;
+	b |= b << 32;
+
+	u64 c = deltaSwap(deltaSwap(zyRows, 0x0A0A, 3), 0x00CC, 6);
+	c = (c | (c << 24)) & 0x000000FF000000FFULL;
+	c = (c | (c << 12)) & 0x000F000F000F000FULL;
+	c = (c | (c << 6))  & 0x0303030303030303ULL;
+	c = (c | (c << 3))  & 0x1111111111111111ULL;
+	c |= c << 1;
+	c |= c << 2;
+
+	u64 w = a & b & c;
+	w = deltaSwap(w, 0x0C0C0C0C0C0C0C0CULL, 2);
+	w = deltaSwap(w, 0x0000F0F00000F0F0ULL, 12);
+	w = deltaSwap(w, 0x0000FF000000FF00ULL, 8);
+	return w;
+}
 
-				hnd = sv->next;
-			}
-			while (hnd != null_h32);
-		}
+
+/**
+ * ANDs the occupancy word of each brick with its visibility mask, leaving the cells that are both
+ * visible and occupied.
+ */
+void maskSpatialBricks_scalar(
+	const SpatialCellProjections& cp,
+	const SpatialCell* origins,
+	u64* cellWords,
+	u32 count)
+{
+	for (u32 i = 0; i < count; ++i) {
+		u64 xzRows, xyRows, zyRows;
+		packSpatialBrickRows(cp, origins[i], xzRows, xyRows, zyRows);
+		cellWords[i] &= getSpatialBrickVisibility(xzRows, xyRows, zyRows);
 	}
 }
 
 
-void interpolateSceneNodes(
-	Scene& scene,
-    r32 interpolation)
+SIMD_TARGET("avx2")
+inline __m256i deltaSwap_avx2(
+	__m256i w,
+	__m256i mask,
+	int shift)
 {
-	for (u16 m = 0;
-		m < scene.components.movement.length();
-		++m)
-	{
-		Movement& move = scene.components.movement.item(m).data;
-		if (move.rotationDirty == 0 && move.prevRotationDirty == 0 &&
-			move.translationDirty == 0 && move.prevTranslationDirty == 0)
-		{
-			continue;
-		}
-
-		SceneNode& node = scene.components.sceneNodes[move.sceneNodeId]->data;
+	__m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(w, shift), w), mask);
+	return _mm256_xor_si256(_mm256_xor_si256(w, t), _mm256_slli_epi64(t, shift));
+}
 
-		// nlerp the rotation
-		if (move.rotationDirty == 1) {
-			node.rotationLocal = 
-				normalize(
-					lerp(move.prevRotation,
-						 move.nextRotation,
-						 (r64)interpolation));
-			node.orientationDirty = 1;
-		}
-		// This is needed when rotation stops to ensure the orientation isn't left where the last
-		// interpolation step put it, which is most likely approaching but not quite reaching the
-		// target "next" orientation. We continue interpolating for one frame beyond movement
-		// stopping so the orientation can be set to the exact simulated value.
-		else if (move.prevRotationDirty == 1) {
-			node.rotationLocal = move.nextRotation;
-			node.orientationDirty = 1;
-			move.prevRotationDirty = 0;
+/**
+ * Same as the scalar version with 4 bricks in the 64 bit lanes of each register, the occupancy
+ * words are loaded and ANDed 4 at a time. Only call when cpuFeatures.avx2 is set.
+ */
+SIMD_TARGET("avx2")
+void maskSpatialBricks_avx2(
+	const SpatialCellProjections& cp,
+	const SpatialCell* origins,
+	u64* cellWords,
+	u32 count)
+{
+	const __m256i byteMask   = _mm256_set1_epi64x(0x000000FF000000FFLL);
+	const __m256i nibbleMask = _mm256_set1_epi64x(0x000F000F000F000FLL);
+	const __m256i pairMask   = _mm256_set1_epi64x(0x0303030303030303LL);
+	const __m256i bitMask    = _mm256_set1_epi64x(0x1111111111111111LL);
+
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		// gather the 4 rows of each projection for the 4 bricks, shifting each brick's run down
+		__m256i ox = _mm256_set_epi64x(origins[i+3].x, origins[i+2].x, origins[i+1].x, origins[i].x);
+		__m256i oy = _mm256_set_epi64x(origins[i+3].y, origins[i+2].y, origins[i+1].y, origins[i].y);
+		__m256i oz = _mm256_set_epi64x(origins[i+3].z, origins[i+2].z, origins[i+1].z, origins[i].z);
+		__m256i xWord = _mm256_srli_epi64(ox, 6);
+		__m256i zWord = _mm256_srli_epi64(oz, 6);
+		__m256i xShift = _mm256_and_si256(ox, _mm256_set1_epi64x(63));
+		__m256i zShift = _mm256_and_si256(oz, _mm256_set1_epi64x(63));
+		__m256i xzRow = _mm256_add_epi64(_mm256_slli_epi64(oz, 2), xWord);
+		__m256i xyRow = _mm256_add_epi64(_mm256_slli_epi64(oy, 2), xWord);
+		__m256i zyRow = _mm256_add_epi64(_mm256_slli_epi64(oy, 2), zWord);
+		const __m256i nibble = _mm256_set1_epi64x(0xF);
+		const __m256i rowStep = _mm256_set1_epi64x(4);
+
+		__m256i a = _mm256_setzero_si256();
+		__m256i b = _mm256_setzero_si256();
+		__m256i c = _mm256_setzero_si256();
+		for (int r = 0; r < 4; ++r) {
+			__m256i xzBits = _mm256_i64gather_epi64((const long long*)cp.xz, xzRow, 8);
+			__m256i xyBits = _mm256_i64gather_epi64((const long long*)cp.xy, xyRow, 8);
+			__m256i zyBits = _mm256_i64gather_epi64((const long long*)cp.zy, zyRow, 8);
+			a = _mm256_or_si256(a, _mm256_slli_epi64(_mm256_and_si256(_mm256_srlv_epi64(xzBits, xShift), nibble), 4*r));
+			b = _mm256_or_si256(b, _mm256_slli_epi64(_mm256_and_si256(_mm256_srlv_epi64(xyBits, xShift), nibble), 4*r));
+			c = _mm256_or_si256(c, _mm256_slli_epi64(_mm256_and_si256(_mm256_srlv_epi64(zyBits, zShift), nibble), 4*r));
+			xzRow = _mm256_add_epi64(xzRow, rowStep);
+			xyRow = _mm256_add_epi64(xyRow, rowStep);
+			zyRow = _mm256_add_epi64(zyRow, rowStep);
 		}
 
-		if (move.translationDirty == 1) {
-			node.translationLocal =
-				mix(move.prevTranslation,
-					move.nextTranslation,
-					(r64)interpolation);
-			node.positionDirty = 1;
-		}
-		else if (move.prevTranslationDirty == 1) {
-			node.translationLocal = move.nextTranslation;
-			node.positionDirty = 1;
-			move.prevTranslationDirty = 0;
-		}
+		a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 24)), byteMask);
+		a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 12)), nibbleMask);
+		a = _mm256_or_si256(a, _mm256_slli_epi64(a, 4));
+		a = _mm256_or_si256(a, _mm256_slli_epi64(a, 8));
+
+		b = _mm256_or_si256(b, _mm256_slli_epi64(b, 16));
+		b = _mm256_or_si256(b, _mm256_slli_epi64(b, 32));
+
+		c = deltaSwap_avx2(c, _mm256_set1_epi64x(0x0A0A), 3);
+		c = deltaSwap_avx2(c, _mm256_set1_epi64x(0x00CC), 6);
+		c = _mm256_and_si256(_mm256_or_si256(c, _mm256_slli_epi64(c, 24)), byteMask);
+		c = _mm256_and_si256(_mm256_or_si256(c, _mm256_slli_epi64(c, 12)), nibbleMask);
+		c = _mm256_and_si256(_mm256_or_si256(c, _mm256_slli_epi64(c, 6)), pairMask);
+		c = _mm256_and_si256(_mm256_or_si256(c, _mm256_slli_epi64(c, 3)), bitMask);
+		c = _mm256_or_si256(c, _mm256_slli_epi64(c, 1));
+		c = _mm256_or_si256(c, _mm256_slli_epi64(c, 2));
+
+		__m256i w = _mm256_and_si256(_mm256_and_si256(a, b), c);
+		w = deltaSwap_avx2(w, _mm256_set1_epi64x(0x0C0C0C0C0C0C0C0CLL), 2);
+		w = deltaSwap_avx2(w, _mm256_set1_epi64x(0x0000F0F00000F0F0LL), 12);
+		w = deltaSwap_avx2(w, _mm256_set1_epi64x(0x0000FF000000FF00LL), 8);
+
+		__m256i occupied = _mm256_loadu_si256((const __m256i*)(cellWords + i));
+		_mm256_storeu_si256((__m256i*)(cellWords + i), _mm256_and_si256(occupied, w));
 	}
+
+	maskSpatialBricks_scalar(cp, origins + i, cellWords + i, count - i);
 }
 
 
+typedef void MaskSpatialBricksFunc(
+	const SpatialCellProjections&,
+	const SpatialCell*,
+	u64*,
+	u32);
+
 /**
- * Traverse the scene graph starting at root node and calculate new world positions in
- * breadth-first order. Progress down a branch only when a dirty flag is set.
+ * Runtime dispatched, points to the widest version supported by the cpu once selectSceneKernels
+ * is called.
  */
-void updateNodeTransforms(
-	Scene& scene,
-	MemoryArena& frameScoped)
-{
-	/**
-	 * BFSQueueItem is used for traversal of the scene graph by breadth-first search without recursion.
-	 */
-	struct BFSQueueItem {
-		SceneNode*	sceneNode;
-		u8			ancestorPositionDirty;
-		u8			ancestorOrientationDirty;
-		dvec3		translationToWorld;
-		dquat		rotationToWorld;
-	};
-	DenseQueueTyped(BFSQueueItem, BFSQueue);
-
-	// get some temporary storage for the traversal queue
-	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
-
-	const u16 bfsQueueSize = scene.components.sceneNodes.length() + 1; // add 1 for root node
-	BFSQueueItem* bfsQueueBuffer = allocArrayOfType(frameScoped, BFSQueueItem, bfsQueueSize);
-	BFSQueue bfsQueue(bfsQueueSize, bfsQueueBuffer);
+static MaskSpatialBricksFunc* maskSpatialBricks = maskSpatialBricks_scalar;
 
-	// start traversal at the root node
-	bfsQueue.push({
-		&scene.root,
-		0, 0,
-		{ 0.0, 0.0, 0.0 },
-		{ 0.0, 0.0, 0.0, 1.0 }
-	});
 
-	// traverse the scene graph and calculate new world positions if needed
-	while (!bfsQueue.empty()) {
-		const BFSQueueItem& bfs = *bfsQueue.front();
+/**
+ * Walks the occupancy hierarchy over the key range of one grid level and adds the occupied cells
+ * within the bounds to the cellPVS. Level 0 bricks are also masked by the projections, coarser
+ * levels hold few cells so they are left to the bsphere tests.
+ */
+void getLevelCellPVS(
+	u32 level,
+	const i32 bounds[6],
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	const SpatialOccupancy& occ = sps.occupancy;
+	const u32 blockWordBegin = spatialLevelKeyBase[level] >> 12;
+	const u32 blockWordEnd = spatialLevelKeyBase[level + 1] >> 12;
 
-		SceneNode& node = *bfs.sceneNode;
+	// bricks of one block in bounds, their occupancy words are masked together
+	SpatialCell brickOrigins[64];
+	u64 brickCells[64];
+	u32 brickWords[64];
 
-		// recalc world position if this, or any ancestors have moved since last frame
-		bool positionDirty = (node.positionDirty == 1) || (bfs.ancestorPositionDirty == 1);
-		if (positionDirty) {
-			node.positionWorld = bfs.translationToWorld + node.translationLocal;
-			node.positionDirty = 0;
-		}
+	for (u32 r = blockWordBegin >> 6; r <= (blockWordEnd - 1) >> 6; ++r)
+	{
+		// mask off the region bits of blocks belonging to other levels
+		u32 first = max(blockWordBegin, r << 6) - (r << 6);
+		u32 last = min(blockWordEnd, (r + 1) << 6) - (r << 6);
+		u64 levelMask = (last - first == 64 ? ~0ULL : ((1ULL << (last - first)) - 1) << first);
 
-		// recalc world orientation if this, or any ancestors have rotated since last frame
-		bool orientationDirty = (node.orientationDirty == 1) || (bfs.ancestorOrientationDirty == 1);
-		if (orientationDirty) {
-			node.orientationWorld = normalize(bfs.rotationToWorld * node.rotationLocal);
-			node.orientationDirty = 0;
-		}
+		u64 regionBits = occ.regions[r] & levelMask;
+		while (regionBits)
+		{
+			u32 rb = 0;
+			BitScanFwd64(&rb, regionBits);
+			regionBits &= regionBits - 1;
 
-		if (node.numChildren > 0) {
-			// add all children to the traversal queue
-			SceneNodeId childId = node.firstChild;
-			for (uint32_t c = 0; c < node.numChildren; ++c) {
-				assert(childId != null_h32 && "expected scene node is null, broken linked list or numChildren out of sync");
-				SceneNode& child = scene.components.sceneNodes[childId]->data;
+			u32 blockWord = (r << 6) | rb;
+			if (!spatialCellBoxInBounds(getSpatialCellFromKey(blockWord << 12, level), 16, bounds)) {
+				continue;
+			}
 
-				bfsQueue.push({
-					&child,
-					positionDirty, orientationDirty,
-					node.positionWorld,
-					node.orientationWorld
-				});
+			u32 numBricks = 0;
+			u64 blockBits = occ.blocks[blockWord];
+			while (blockBits)
+			{
+				u32 bb = 0;
+				BitScanFwd64(&bb, blockBits);
+				blockBits &= blockBits - 1;
+
+				u32 cellWord = (blockWord << 6) | bb;
+				SpatialCell o = getSpatialCellFromKey(cellWord << 6, level);
+				if (!spatialCellBoxInBounds(o, 4, bounds)) {
+					continue;
+				}
+				brickOrigins[numBricks] = o;
+				brickCells[numBricks] = occ.cells[cellWord];
+				brickWords[numBricks] = cellWord;
+				++numBricks;
+			}
 
-				childId = child.nextSibling;
+			// AND the bricks' occupied cells with their visibility masks, only visible cells that
+			// contain entities are left to add to the PVS
+			if (level == 0) {
+				maskSpatialBricks(sts.cellProj, brickOrigins, brickCells, numBricks);
 			}
-		}
 
-		bfsQueue.pop_fifo();
+			for (u32 b = 0; b < numBricks; ++b)
+			{
+				u64 cellBits = brickCells[b];
+				while (cellBits)
+				{
+					u32 cb = 0;
+					BitScanFwd64(&cb, cellBits);
+					cellBits &= cellBits - 1;
+
+					sts.cellPVS[sts.cellPVSLength++] = findSpatialCell(sps, (brickWords[b] << 6) | cb);
+				}
+			}
+		}
 	}
 }
 
 
-void frustumCullScene(
+/**
+ * Once the three axis aligned buffers contain the rasterized frustum, the bits must be tested for
+ * intersection to be determined visible. A cell x,y,z must have its bit set in all three of the
+ * orthogonal projections. Rather than scanning the whole projected box, we walk the occupancy
+ * hierarchy so only bricks that contain entities are visited. Each region bit covers a 16x16x16
+ * block and each block bit a 4x4x4 brick of cells in Morton order, both are rejected against the
+ * low to high coords determined during rasterization before descending. The occupied bricks of a
+ * block have their occupancy words ANDed with their visibility masks to test 64 cells at a time,
+ * 4 bricks per register with AVX2, and the surviving cells have their hash table position added to
+ * the cellPVS. Levels are traversed coarse to fine, with the bounds
+ * of coarser levels grown by the half cell of looseness.
+ */
+void getCellPVSFromProjections(
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	SpatialCellProjections& cp = sts.cellProj;
+	sts.cellPVSLength = 0;
+
+	if (cp.lowX > cp.highX || cp.lowY > cp.highY || cp.lowZ > cp.highZ
+		|| cp.highX < 0 || cp.highY < 0 || cp.highZ < 0
+		|| cp.lowX >= gridSizeX || cp.lowY >= gridSizeY || cp.lowZ >= gridSizeZ)
+	{
+		return;
+	}
+	dilateSpatialCellProjections(cp);
+
+	for (i32 level = SpatialGridLevels - 1; level >= 0; --level)
+	{
+		i32 size = 1 << (2 * level);
+		i32 loose = size / 2;
+		i32 bounds[6] = {
+			max(cp.lowX - loose, 0) / size, min(cp.highX + loose, gridSizeX-1) / size,
+			max(cp.lowY - loose, 0) / size, min(cp.highY + loose, gridSizeY-1) / size,
+			max(cp.lowZ - loose, 0) / size, min(cp.highZ + loose, gridSizeZ-1) / size
+		};
+		getLevelCellPVS(level, bounds, sts, sps);
+	}
+}
+
+
+inline void markSpatialEntityVisible(
+	Scene& scene,
+	ComponentId spatialInfoId,
+	u32 visibleBit,
+	SpatialTransientStorage& sts)
+{
+	Scene::Components::SpatialInfoComponent& si = *scene.components.spatialInfo[spatialInfoId];
+
+	if (!(si.data.visibleFrustumBits & visibleBit)) {
+		si.data.visibleFrustumBits |= visibleBit;
+		sts.visibleEntities[sts.numVisibleEntities] = si.entityId;
+		sts.visibleSpatialInfoIds[sts.numVisibleEntities] = spatialInfoId;
+		++sts.numVisibleEntities;
+	}
+}
+
+
+/**
+ * Adds every entity in the bucket to the entityPVS.
+ */
+void markSpatialBucketVisible(
+	Scene& scene,
+	const SpatialBucket& bucket,
+	u32 visibleBit,
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		SpatialChunk& chunk = sps.chunks[c];
+		for (u32 l = 0; l < chunkLength; ++l) {
+			markSpatialEntityVisible(scene, chunk.spatialInfoIds[l], visibleBit, sts);
+		}
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+}
+
+
+/**
+ * Tests the cached bspheres of all entities in the bucket and adds those not outside to the
+ * entityPVS. The real world-space frustum (not the y-scaled one used for cells) is translated
+ * into the bucket's local space where the bspheres are stored:
+ * n*(p + offset) - d = n*p - (d - n*offset)
+ */
+void cullSpatialBucket(
+	Scene& scene,
+	const SpatialBucket& bucket,
+	const FrustumSoA& frustum,
+	const vec3& offset,
+	u32 visibleBit,
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	alignas(16) u8 objResults[SpatialChunkCapacity];
+
+	FrustumSoA f_local = frustum;
+	for (int p = 0; p < 6; ++p) {
+		f_local.d[p] -= frustum.nx[p] * offset.x
+					  + frustum.ny[p] * offset.y
+					  + frustum.nz[p] * offset.z;
+	}
+
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		SpatialChunk& chunk = sps.chunks[c];
+
+		frustumSoA_intersectSpheresSoA(
+			f_local, chunkLength,
+			chunk.x, chunk.y, chunk.z, chunk.r,
+			objResults);
+
+		for (u32 l = 0; l < chunkLength; ++l) {
+			if (objResults[l] != Outside) {
+				markSpatialEntityVisible(scene, chunk.spatialInfoIds[l], visibleBit, sts);
+			}
+		}
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+}
+
+
+/**
+ * Frustum planes in camera space, which is halfway between world and view space (world space
+ * rotation with camera at origin), from the view projection matrix with the translation column of
+ * the view matrix dropped.
+ */
+FrustumSoA getCameraSpaceFrustum(
+	const CameraInstance& camInst)
+{
+	mat4 viewRotation = make_mat4(camInst.camera.frame.view);
+	viewRotation[3] = vec4{ 0.0f, 0.0f, 0.0f, 1.0f };
+	mat4 viewProj_camera = camInst.camera.frame.projection * viewRotation;
+
+	// copy out of the union, reading E right after writing col isn't safe once this is inlined
+	r32 m[16];
+	memcpy(m, viewProj_camera.E, sizeof(m));
+	return frustum_extractFromMatrixGL(m);
+}
+
+
+/**
+ * Each cell in the cellPVS (determined by projection/rasterization algorithm) is then bsphere
+ * tested against the frustum to see if it intersects the boundary, or is fully contained. Cell
+ * bspheres contain the cell's loose bounds, they are gathered into SoA batches and tested 4 or 8
+ * at a time. If fully contained, the cell's entities are added to the entityPVS. If the cell's
+ * bsphere intersects, the cached bspheres in each of the cell's chunks are tested in place, those
+ * not outside are added to the entityPVS. Cells found outside are skipped, the PVS is conservative
+ * since it is dilated for the loose bounds. Entities in the outsideGrid bucket are always tested.
+ */
+void cullEntitiesInCellPVS(
+	Scene& scene,
+	const CameraInstance& camInst,
+	u8 cameraIndex,
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	sts.numVisibleEntities = 0;
+
+	FrustumSoA frustum = getCameraSpaceFrustum(camInst);
+
+	// transform the frustum planes into a "homogeneous grid space" which has a scaled Y axis so
+	// the grid cell is a cube, y_hgs = y * ratio so the plane's y coefficient is divided by ratio
+	FrustumSoA f_hgs = frustum;
+	for (int p = 0; p < 6; ++p) {
+		f_hgs.ny[p] /= (r32)spatialGridSize_XZ_Y_ratio;
+	}
+	plane_normalize_4_sse(f_hgs.nx, f_hgs.ny, f_hgs.nz, f_hgs.d);
+	plane_normalize_4_sse(f_hgs.nx+2, f_hgs.ny+2, f_hgs.nz+2, f_hgs.d+2);
+
+	dvec3 eye = camInst.camera.eyePoint;
+	dvec3 eye_hgs{ eye.x, eye.y * spatialGridSize_XZ_Y_ratio, eye.z };
+
+	u32 visibleBit = 1UL << cameraIndex;
+
+	SphereBatchSoA cellBatch;
+	alignas(16) u8 cellResults[SphereBatchCapacity];
+
+	for (u32 c0 = 0; c0 < sts.cellPVSLength; c0 += SphereBatchCapacity)
+	{
+		// Test the spatial cells' bounding spheres in batches, if a cell is fully contained we
+		// can skip testing individual objects in the cell. The y scaling factor is applied to
+		// transform the world space cell into a homogeneous xyz grid space. The volume to test
+		// against is now a sphere containing the cell's loose AABB.
+		cellBatch.length = min(SphereBatchCapacity, sts.cellPVSLength - c0);
+		for (u32 b = 0; b < cellBatch.length; ++b) {
+			u32 key = sps.cells[sts.cellPVS[c0 + b]].key - 1;
+			u32 level = getSpatialLevelFromKey(key);
+			SpatialCell cell = getSpatialCellFromKey(key, level);
+			r64 cellSize = spatialGridSizeXZ * (r64)(1 << (2 * level));
+
+			dvec3 cellCenter{ (r64)cell.x, (r64)cell.y, (r64)cell.z };
+			cellCenter *= cellSize;
+			cellCenter += (cellSize * 0.5);
+			cellCenter -= eye_hgs; // translate cell into camera space, same as frustum
+			
+			cellBatch.x[b] = (r32)cellCenter.x;
+			cellBatch.y[b] = (r32)cellCenter.y;
+			cellBatch.z[b] = (r32)cellCenter.z;
+			cellBatch.r[b] = (r32)(spatialGridCellRadius * (r64)(1 << (2 * level)));
+		}
+		// zero the lanes past the end so the kernel never reads uninitialized spheres
+		for (u32 b = cellBatch.length; b < ((cellBatch.length + 7) & ~7U); ++b) {
+			cellBatch.x[b] = cellBatch.y[b] = cellBatch.z[b] = cellBatch.r[b] = 0.0f;
+		}
+
+		frustumSoA_intersectSpheresSoA(
+			f_hgs, cellBatch.length,
+			cellBatch.x, cellBatch.y, cellBatch.z, cellBatch.r,
+			cellResults);
+
+		for (u32 b = 0; b < cellBatch.length; ++b)
+		{
+			SpatialCellEntry& entry = sps.cells[sts.cellPVS[c0 + b]];
+			assert(entry.bucket.length > 0);
+
+			if (cellResults[b] == Inside) {
+				markSpatialBucketVisible(scene, entry.bucket, visibleBit, sts, sps);
+			}
+			else if (cellResults[b] == Intersecting) {
+				u32 key = entry.key - 1;
+				u32 level = getSpatialLevelFromKey(key);
+				SpatialCell cell = getSpatialCellFromKey(key, level);
+
+				cullSpatialBucket(
+					scene, entry.bucket, frustum,
+					make_vec3(getSpatialCellOrigin(cell, level) - eye),
+					visibleBit, sts, sps);
+			}
+		}
+	}
+
+	// entities that don't fit in the grid are stored relative to the world origin
+	if (sps.outsideGrid.length > 0) {
+		cullSpatialBucket(
+			scene, sps.outsideGrid, frustum,
+			make_vec3(-eye),
+			visibleBit, sts, sps);
+	}
+}
+
+
+// Temporal culling
+
+enum SpatialCullingCellClass : u8 {
+	SpatialCullingCell_Outside = 0,
+	SpatialCullingCell_Boundary,
+	SpatialCullingCell_Core
+};
+
+
+/**
+ * Sorts a cell by its loose bounds against the cache's frustum. Each plane is tested against the
+ * box's nearest and farthest points from it, boxes more than the margin outside of any plane
+ * can't reach the frustum until the cache is rebuilt.
+ */
+SpatialCullingCellClass classifySpatialCullingCell(
+	const SpatialCullingCache& cache,
+	u32 cellKey)
+{
+	u32 level = getSpatialLevelFromKey(cellKey);
+	SpatialCell cell = getSpatialCellFromKey(cellKey, level);
+	r64 scale = (r64)(1 << (2 * level));
+	r64 loose = spatialGridSizeXZ * 0.5 * scale;
+	dvec3 halfCell{ spatialGridSizeXZ * 0.5 * scale, spatialGridSizeY * 0.5 * scale, spatialGridSizeXZ * 0.5 * scale };
+
+	vec3 c = make_vec3(getSpatialCellOrigin(cell, level) + halfCell - cache.eyePoint);
+	vec3 h = make_vec3(halfCell + loose);
+	const FrustumSoA& f = cache.frustum;
+
+	SpatialCullingCellClass result = SpatialCullingCell_Core;
+	for (u32 p = 0; p < 6; ++p) {
+		r32 dist = f.nx[p] * c.x + f.ny[p] * c.y + f.nz[p] * c.z - f.d[p];
+		r32 extent = fabs(f.nx[p]) * h.x + fabs(f.ny[p]) * h.y + fabs(f.nz[p]) * h.z;
+		if (dist + extent < -SpatialCullingCacheMargin) {
+			return SpatialCullingCell_Outside;
+		}
+		if (dist - extent < SpatialCullingCacheMargin) {
+			result = SpatialCullingCell_Boundary;
+		}
+	}
+	return result;
+}
+
+
+inline void addSpatialCullingCell(
+	SpatialCullingCache& cache,
+	u32 cellKey)
+{
+	switch (classifySpatialCullingCell(cache, cellKey)) {
+		case SpatialCullingCell_Core:
+			cache.coreCells[cache.numCoreCells++] = cellKey;
+			break;
+		case SpatialCullingCell_Boundary:
+			cache.boundaryCells[cache.numBoundaryCells++] = cellKey;
+			break;
+		default:
+			break;
+	}
+}
+
+
+/**
+ * Bounds how far any plane of the frustum has moved from the cache's, over the points either one
+ * can contain. A plane n*(p - eye) - d moves by at most |n' - n| * |p - eye'| + |eye' - eye| +
+ * |d' - d|.
+ */
+r64 getSpatialCullingCacheDrift(
+	const SpatialCullingCache& cache,
+	const FrustumSoA& frustum,
+	const dvec3& eye)
+{
+	r64 eyeMoved = length(eye - cache.eyePoint);
+	r64 reach = cache.extent + eyeMoved;
+
+	r64 drift = 0.0;
+	for (u32 p = 0; p < 6; ++p) {
+		r64 dx = frustum.nx[p] - cache.frustum.nx[p];
+		r64 dy = frustum.ny[p] - cache.frustum.ny[p];
+		r64 dz = frustum.nz[p] - cache.frustum.nz[p];
+		r64 planeMoved = sqrt(dx*dx + dy*dy + dz*dz) * reach
+					   + eyeMoved
+					   + fabs((r64)frustum.d[p] - (r64)cache.frustum.d[p]);
+		drift = max(drift, planeMoved);
+	}
+	return drift;
+}
+
+
+/**
+ * Sorts the cells of the PVS of the frustum grown by the margin into core and boundary cells. The
+ * grown frustum has its apex moved back, which pushes each side plane out by the distance moved
+ * times the sine of its half angle, and its far plane pushed out to match.
+ */
+void rebuildSpatialCullingCache(
+	const CameraInstance& camInst,
+	const FrustumSoA& frustum,
+	SpatialCullingCache& cache,
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	const Camera& cam = camInst.camera;
+	r64 tanV = tan(cam.fovDegreesVertical * DEG_TO_RAD * 0.5);
+	r64 tanH = tanV * cam.aspectRatio;
+	r64 back = SpatialCullingCacheMargin / sin(atan(min(tanV, tanH)));
+
+	dvec3 f, u, r;
+	getForwardUpRight(cam.frame.view, f, u, r);
+	f.normalize();
+
+	CameraInstance grown = camInst;
+	grown.camera.eyePoint = cam.eyePoint - f * back;
+	grown.camera.farClip = (r32)(cam.farClip + back + SpatialCullingCacheMargin);
+
+	scanConvertFrustum(grown, sts.cellProj);
+	getCellPVSFromProjections(sts, sps);
+
+	cache.frustum = frustum;
+	cache.eyePoint = cam.eyePoint;
+	cache.extent = cam.farClip * sqrt(1.0 + tanV*tanV + tanH*tanH);
+	cache.fovDegreesVertical = cam.fovDegreesVertical;
+	cache.aspectRatio = cam.aspectRatio;
+	cache.nearClip = cam.nearClip;
+	cache.farClip = cam.farClip;
+	cache.occupancyVersion = sps.occupancyVersion;
+	cache.valid = 1;
+	memcpy(cache.occupiedCells, sps.occupancy.cells, sizeof(cache.occupiedCells));
+
+	cache.numCoreCells = 0;
+	cache.numBoundaryCells = 0;
+	for (u32 c = 0; c < sts.cellPVSLength; ++c) {
+		addSpatialCullingCell(cache, sps.cells[sts.cellPVS[c]].key - 1);
+	}
+}
+
+
+/**
+ * Brings the cell lists up to date with cells that became occupied or empty since the cache last
+ * saw the grid, without walking the cells that didn't change.
+ */
+void updateSpatialCullingCacheCells(
+	SpatialCullingCache& cache,
+	const SpatialPersistentStorage& sps)
+{
+	bool anyEmptied = false;
+
+	for (u32 w = 0; w < countof(cache.occupiedCells); ++w) {
+		u64 cur = sps.occupancy.cells[w];
+		u64 prev = cache.occupiedCells[w];
+		if (cur == prev) {
+			continue;
+		}
+		anyEmptied |= ((prev & ~cur) != 0);
+
+		u64 entered = cur & ~prev;
+		while (entered) {
+			u32 b = 0;
+			BitScanFwd64(&b, entered);
+			entered &= entered - 1;
+			addSpatialCullingCell(cache, (w << 6) | b);
+		}
+		cache.occupiedCells[w] = cur;
+	}
+
+	if (anyEmptied) {
+		auto keepOccupied = [&sps](u32* cellKeys, u32& length) {
+			u32 kept = 0;
+			for (u32 c = 0; c < length; ++c) {
+				u32 key = cellKeys[c];
+				if (sps.occupancy.cells[key >> 6] & (1ULL << (key & 63))) {
+					cellKeys[kept++] = key;
+				}
+			}
+			length = kept;
+		};
+		keepOccupied(cache.coreCells, cache.numCoreCells);
+		keepOccupied(cache.boundaryCells, cache.numBoundaryCells);
+	}
+	cache.occupancyVersion = sps.occupancyVersion;
+}
+
+
+/**
+ * Culls with the camera's cache, rebuilding it first when the frustum drifted past the margin or
+ * the projection changed. Entities of core cells are visible without a test, even those that moved
+ * within their cell since its loose bounds hold them. Only the entities of boundary cells and of
+ * the outsideGrid bucket are tested against the frustum.
+ */
+void cullEntitiesWithCullingCache(
+	Scene& scene,
+	const CameraInstance& camInst,
+	u8 cameraIndex,
+	SpatialCullingCache& cache,
+	SpatialTransientStorage& sts,
+	SpatialPersistentStorage& sps)
+{
+	const Camera& cam = camInst.camera;
+	FrustumSoA frustum = getCameraSpaceFrustum(camInst);
+	dvec3 eye = cam.eyePoint;
+
+	if (!cache.valid
+		|| cache.fovDegreesVertical != cam.fovDegreesVertical
+		|| cache.aspectRatio != cam.aspectRatio
+		|| cache.nearClip != cam.nearClip
+		|| cache.farClip != cam.farClip
+		|| getSpatialCullingCacheDrift(cache, frustum, eye) > SpatialCullingCacheMargin)
+	{
+		rebuildSpatialCullingCache(camInst, frustum, cache, sts, sps);
+	}
+	else if (cache.occupancyVersion != sps.occupancyVersion) {
+		updateSpatialCullingCacheCells(cache, sps);
+	}
+
+	sts.numVisibleEntities = 0;
+	u32 visibleBit = 1UL << cameraIndex;
+
+	for (u32 c = 0; c < cache.numCoreCells; ++c) {
+		u32 pos = findSpatialCell(sps, cache.coreCells[c]);
+		assert(pos != UINT32_MAX);
+		markSpatialBucketVisible(scene, sps.cells[pos].bucket, visibleBit, sts, sps);
+	}
+
+	for (u32 c = 0; c < cache.numBoundaryCells; ++c) {
+		u32 key = cache.boundaryCells[c];
+		u32 pos = findSpatialCell(sps, key);
+		assert(pos != UINT32_MAX);
+		u32 level = getSpatialLevelFromKey(key);
+
+		cullSpatialBucket(
+			scene, sps.cells[pos].bucket, frustum,
+			make_vec3(getSpatialCellOrigin(getSpatialCellFromKey(key, level), level) - eye),
+			visibleBit, sts, sps);
+	}
+
+	if (sps.outsideGrid.length > 0) {
+		cullSpatialBucket(
+			scene, sps.outsideGrid, frustum,
+			make_vec3(-eye),
+			visibleBit, sts, sps);
+	}
+}
+
+
+SpatialCullingCache* enableCullingCache(
+	Scene& scene,
+	u8 cameraIndex,
+	MemoryArena& arena)
+{
+	assert(cameraIndex < SCENE_MAX_ACTIVE_CAMERAS);
+	SpatialCullingCache*& cache = scene.cullingCaches[cameraIndex];
+	if (!cache) {
+		cache = allocType(arena, SpatialCullingCache);
+		cache->valid = 0;
+	}
+	return cache;
+}
+
+
+void setSceneNodeDirty(
+	Scene& scene,
+	SceneNodeId sceneNodeId,
+	u8 positionDirty,
+	u8 orientationDirty)
+{
+	auto& sceneNodes = scene.components.sceneNodes;
+	SceneNode& node = sceneNodes[sceneNodeId]->data;
+
+	// ancestors of a node that is already dirty, or has dirty descendants, are already flagged
+	bool flagged = node.positionDirty || node.orientationDirty || node.descendantDirty;
+	node.positionDirty |= positionDirty;
+	node.orientationDirty |= orientationDirty;
+	if (flagged) {
+		return;
+	}
+
+	// flag ancestors up to the first one already on a dirty path, or queue the subtree under root
+	SceneNodeId subtreeId = sceneNodeId;
+	SceneNodeId parentId = node.parent;
+	while (parentId != null_h32) {
+		SceneNode& parent = sceneNodes[parentId]->data;
+		if (parent.positionDirty || parent.orientationDirty || parent.descendantDirty) {
+			parent.descendantDirty = 1;
+			return;
+		}
+		parent.descendantDirty = 1;
+		subtreeId = parentId;
+		parentId = parent.parent;
+	}
+
+	SceneHierarchy& hierarchy = scene.hierarchy;
+	hierarchy.dirtySubtrees[hierarchy.numDirtySubtrees++] = subtreeId;
+}
+
+
+void setMovementDirty(
+	Scene& scene,
+	ComponentId movementId,
+	u8 translationDirty,
+	u8 rotationDirty)
+{
+	Movement& move = scene.components.movement[movementId]->data;
+
+	// a flag that was set stays set in prev until the node has been snapped to its next value
+	move.prevTranslationDirty |= move.translationDirty;
+	move.prevRotationDirty |= move.rotationDirty;
+	move.translationDirty = translationDirty;
+	move.rotationDirty = rotationDirty;
+
+	if (translationDirty || rotationDirty || move.prevTranslationDirty || move.prevRotationDirty) {
+		u16 m = scene.components.movement.getInnerIndex(movementId);
+		scene.activeMovements[m >> 6] |= (1ULL << (m & 63));
+	}
+}
+
+
+/**
+ * Interpolation kernels for the movements gathered by interpolateSceneNodes, writing node local
+ * rotations and translations. Every version gives bit identical results to the dquat/dvec3
+ * normalize(lerp()) and mix() functions.
+ */
+typedef void InterpolateRotationsFunc(
+	u32 length,
+	Movement* const* moves,
+	SceneNode* const* nodes,
+	r64 t);
+
+typedef void InterpolateTranslationsFunc(
+	u32 length,
+	Movement* const* moves,
+	SceneNode* const* nodes,
+	r64 t);
+
+
+void interpolateRotations_scalar(
+	u32 length,
+	Movement* const* moves,
+	SceneNode* const* nodes,
+	r64 t)
+{
+	for (u32 i = 0; i < length; ++i) {
+		nodes[i]->rotationLocal = normalize(lerp(moves[i]->prevRotation, moves[i]->nextRotation, t));
+	}
+}
+
+void interpolateTranslations_scalar(
+	u32 length,
+	Movement* const* moves,
+	SceneNode* const* nodes,
+	r64 t)
+{
+	for (u32 i = 0; i < length; ++i) {
+		nodes[i]->translationLocal = mix(moves[i]->prevTranslation, moves[i]->nextTranslation, t);
+	}
+}
+
+
+/**
+ * Transposes 4 rows of 4 doubles to columns, and back again.
+ */
+SIMD_TARGET("avx")
+inline void transpose4x4_avx(
+	__m256d& r0,
+	__m256d& r1,
+	__m256d& r2,
+	__m256d& r3)
+{
+	__m256d t0 = _mm256_unpacklo_pd(r0, r1);
+	__m256d t1 = _mm256_unpackhi_pd(r0, r1);
+	__m256d t2 = _mm256_unpacklo_pd(r2, r3);
+	__m256d t3 = _mm256_unpackhi_pd(r2, r3);
+	r0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+	r1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+	r2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+	r3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+/**
+ * Nlerps 4 rotations at a time. The lerp is done on whole quaternions, which are then transposed
+ * to w,x,y,z columns so the length and normalize run across 4 quaternions in the same order of
+ * operations as the scalar normalize. Only call when cpuFeatures.avx is set.
+ */
+SIMD_TARGET("avx")
+void interpolateRotations_avx(
+	u32 length,
+	Movement* const* moves,
+	SceneNode* const* nodes,
+	r64 t)
+{
+	const __m256d a = _mm256_set1_pd(t);
+	const __m256d oneMinusA = _mm256_set1_pd(1.0 - t);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1.0);
+
+	u32 i = 0;
+	for (; i + 4 <= length; i += 4) {
+		__m256d q[4];
+		for (u32 j = 0; j < 4; ++j) {
+			__m256d prev = _mm256_loadu_pd(moves[i+j]->prevRotation.E);
+			__m256d next = _mm256_loadu_pd(moves[i+j]->nextRotation.E);
+			q[j] = _mm256_add_pd(_mm256_mul_pd(prev, oneMinusA), _mm256_mul_pd(next, a));
+		}
+		transpose4x4_avx(q[0], q[1], q[2], q[3]); // now w, x, y, z
+
+		__m256d len = _mm256_mul_pd(q[1], q[1]);
+		len = _mm256_add_pd(len, _mm256_mul_pd(q[2], q[2]));
+		len = _mm256_add_pd(len, _mm256_mul_pd(q[3], q[3]));
+		len = _mm256_add_pd(len, _mm256_mul_pd(q[0], q[0]));
+		len = _mm256_sqrt_pd(len);
+		__m256d invLen = _mm256_div_pd(one, len);
+
+		// zero length quaternions become dquat_default
+		__m256d isZero = _mm256_cmp_pd(len, zero, _CMP_LE_OQ);
+		q[0] = _mm256_blendv_pd(_mm256_mul_pd(q[0], invLen), one, isZero);
+		q[1] = _mm256_andnot_pd(isZero, _mm256_mul_pd(q[1], invLen));
+		q[2] = _mm256_andnot_pd(isZero, _mm256_mul_pd(q[2], invLen));
+		q[3] = _mm256_andnot_pd(isZero, _mm256_mul_pd(q[3], invLen));
+
+		transpose4x4_avx(q[0], q[1], q[2], q[3]);
+		for (u32 j = 0; j < 4; ++j) {
+			_mm256_storeu_pd(nodes[i+j]->rotationLocal.E, q[j]);
+		}
+	}
+
+	interpolateRotations_scalar(length - i, moves + i, nodes + i, t);
+}
+
+/**
+ * Lerps translations one per register, the dvec3 fits in the low 3 lanes. The loads read 8 bytes
+ * past each dvec3 into the following Movement member, the store is masked. Only call when
+ * cpuFeatures.avx is set.
+ */
+SIMD_TARGET("avx")
+void interpolateTranslations_avx(
+	u32 length,
+	Movement* const* moves,
+	SceneNode* const* nodes,
+	r64 t)
+{
+	static_assert(offsetof(Movement, prevTranslation) + sizeof(r64)*4 <= sizeof(Movement)
+				  && offsetof(Movement, nextTranslation) + sizeof(r64)*4 <= sizeof(Movement),
+				  "translation loads must stay within Movement");
+
+	const __m256d a = _mm256_set1_pd(t);
+	const __m256d oneMinusA = _mm256_set1_pd(1.0 - t);
+	const __m256i xyzMask = _mm256_set_epi64x(0, -1, -1, -1);
+
+	for (u32 i = 0; i < length; ++i) {
+		__m256d prev = _mm256_loadu_pd(&moves[i]->prevTranslation.x);
+		__m256d next = _mm256_loadu_pd(&moves[i]->nextTranslation.x);
+		__m256d v = _mm256_add_pd(_mm256_mul_pd(prev, oneMinusA), _mm256_mul_pd(next, a));
+		_mm256_maskstore_pd(&nodes[i]->translationLocal.x, xyzMask, v);
+	}
+}
+
+
+/**
+ * Runtime dispatched interpolation kernels, point to the widest version supported by the cpu once
+ * selectSceneKernels is called.
+ */
+static InterpolateRotationsFunc* interpolateRotations = interpolateRotations_scalar;
+static InterpolateTranslationsFunc* interpolateTranslations = interpolateTranslations_scalar;
+
+void selectSceneKernels(
+	const CpuFeatures& cf)
+{
+	interpolateRotations = (cf.avx ? interpolateRotations_avx : interpolateRotations_scalar);
+	interpolateTranslations = (cf.avx ? interpolateTranslations_avx : interpolateTranslations_scalar);
+	maskSpatialBricks = (cf.avx2 ? maskSpatialBricks_avx2 : maskSpatialBricks_scalar);
+}
+
+
+/**
+ * Interpolates the local transforms of nodes with an active Movement between the prev and next
+ * simulated values. Only movements set in scene.activeMovements are visited, so the cost follows
+ * the number of moving entities. Flags are handled and stopped movements snapped to their next
+ * values while gathering batches for the lerp kernels, small enough that the gathered movements
+ * and nodes are still in L1 when the kernels run. Movements with no flags left are cleared from
+ * the active set until setMovementDirty marks them again.
+ */
+void interpolateSceneNodes(
+	Scene& scene,
+    r32 interpolation)
+{
+	const u32 batchSize = 64;
+	Movement*	rotationMoves[batchSize];
+	SceneNode*	rotationNodes[batchSize];
+	Movement*	translationMoves[batchSize];
+	SceneNode*	translationNodes[batchSize];
+	u32 numRotations = 0;
+	u32 numTranslations = 0;
+
+	auto flushBatch = [&]() {
+		interpolateRotations(numRotations, rotationMoves, rotationNodes, (r64)interpolation);
+		interpolateTranslations(numTranslations, translationMoves, translationNodes, (r64)interpolation);
+		numRotations = 0;
+		numTranslations = 0;
+	};
+
+	auto& movement = scene.components.movement;
+	auto& sceneNodes = scene.components.sceneNodes;
+	const u32 numWords = (movement.length() + 63) / 64;
+
+	for (u32 w = 0; w < numWords; ++w) {
+		u64 bits = scene.activeMovements[w];
+		u64 stillActive = bits;
+		u32 b = 0;
+
+		while (BitScanFwd64(&b, bits)) {
+			bits &= bits - 1;
+
+			Movement& move = movement.item(w * 64 + b).data;
+			SceneNode& node = sceneNodes[move.sceneNodeId]->data;
+			u8 positionDirty = 0;
+			u8 orientationDirty = 0;
+
+			// nlerp the rotation
+			if (move.rotationDirty == 1) {
+				rotationMoves[numRotations] = &move;
+				rotationNodes[numRotations] = &node;
+				++numRotations;
+				orientationDirty = 1;
+			}
+			// This is needed when rotation stops to ensure the orientation isn't left where the last
+			// interpolation step put it, which is most likely approaching but not quite reaching the
+			// target "next" orientation. We continue interpolating for one frame beyond movement
+			// stopping so the orientation can be set to the exact simulated value.
+			else if (move.prevRotationDirty == 1) {
+				node.rotationLocal = move.nextRotation;
+				orientationDirty = 1;
+				move.prevRotationDirty = 0;
+			}
+
+			if (move.translationDirty == 1) {
+				translationMoves[numTranslations] = &move;
+				translationNodes[numTranslations] = &node;
+				++numTranslations;
+				positionDirty = 1;
+			}
+			else if (move.prevTranslationDirty == 1) {
+				node.translationLocal = move.nextTranslation;
+				positionDirty = 1;
+				move.prevTranslationDirty = 0;
+			}
+
+			if (positionDirty || orientationDirty) {
+				setSceneNodeDirty(scene, move.sceneNodeId, positionDirty, orientationDirty);
+			}
+
+			// stopped and snapped to the next values
+			if (move.rotationDirty == 0 && move.prevRotationDirty == 0 &&
+				move.translationDirty == 0 && move.prevTranslationDirty == 0)
+			{
+				stillActive &= ~(1ULL << b);
+			}
+
+			if (numRotations == batchSize || numTranslations == batchSize) {
+				flushBatch();
+			}
+		}
+
+		scene.activeMovements[w] = stillActive;
+	}
+
+	flushBatch();
+}
+
+
+/**
+ * Flattens the scene graph into scene.hierarchy in depth-first pre-order. Walks the intrusive
+ * child/sibling links without a stack by climbing parent links once a subtree is finished.
+ */
+void rebuildSceneHierarchy(
 	Scene& scene)
+{
+	SceneHierarchy& hierarchy = scene.hierarchy;
+	auto& sceneNodes = scene.components.sceneNodes;
+
+	hierarchy.length = 0;
+
+	SceneNodeId nodeId = scene.root.firstChild;
+	while (nodeId != null_h32) {
+		assert(hierarchy.length < sceneNodes.length() && "scene graph has a cycle");
+
+		SceneNode& node = sceneNodes[nodeId]->data;
+		u16 nodeIndex = sceneNodes.getInnerIndex(nodeId);
+		hierarchy.position[nodeIndex] = (u16)hierarchy.length;
+		hierarchy.entries[hierarchy.length++] = SceneHierarchyEntry{
+			nodeIndex,
+			(node.parent == null_h32) ? SceneHierarchyRoot : sceneNodes.getInnerIndex(node.parent),
+			0, 0
+		};
+
+		if (node.firstChild != null_h32) {
+			nodeId = node.firstChild;
+			continue;
+		}
+		// subtree done, close it and each ancestor it was the last descendant of, then continue
+		// with the next sibling of the nearest ancestor that has one
+		while (nodeId != null_h32) {
+			SceneNode& done = sceneNodes[nodeId]->data;
+			hierarchy.entries[hierarchy.position[sceneNodes.getInnerIndex(nodeId)]].subtreeEnd = (u16)hierarchy.length;
+			if (done.nextSibling != null_h32) {
+				nodeId = done.nextSibling;
+				break;
+			}
+			nodeId = done.parent;
+		}
+	}
+	assert(hierarchy.length == sceneNodes.length() && "scene nodes not reachable from root");
+
+	hierarchy.topologyChanged = 0;
+}
+
+
+/**
+ * Sweeps hierarchy entries [begin, end), recalculating nodes that are dirty or whose parent
+ * changed this frame. Unless visitAll is set, a clean node under an unchanged parent is passed
+ * over, along with its whole subtree when descendantDirty shows nothing below it is dirty.
+ * Writes the inner index of each node flagged worldTransformChanged to outChanged, returns the
+ * number written.
+ */
+u32 updateNodeTransformRange(
+	const SceneHierarchy& hierarchy,
+	Scene::Components::SceneNodeComponent* nodes,
+	const SceneNode& root,
+	u32 begin,
+	u32 end,
+	bool visitAll,
+	u16* outChanged)
+{
+	u32 numChanged = 0;
+	for (u32 e = begin; e < end;) {
+		SceneHierarchyEntry entry = hierarchy.entries[e];
+		SceneNode& node = nodes[entry.node].data;
+		const SceneNode& parent = (entry.parent == SceneHierarchyRoot)
+			? root
+			: nodes[entry.parent].data;
+
+		if (!visitAll && !node.positionDirty && !node.orientationDirty && !parent.worldTransformChanged) {
+			e = node.descendantDirty ? e + 1 : entry.subtreeEnd;
+			node.descendantDirty = 0;
+			continue;
+		}
+
+		u8 changed = 0;
+
+		// recalc world position if this, or any ancestors have moved since last frame
+		if (node.positionDirty == 1 || (parent.worldTransformChanged & WorldPositionChanged)) {
+			node.positionWorld = parent.positionWorld + node.translationLocal;
+			node.positionDirty = 0;
+			changed |= WorldPositionChanged;
+		}
+
+		// recalc world orientation if this, or any ancestors have rotated since last frame
+		if (node.orientationDirty == 1 || (parent.worldTransformChanged & WorldOrientationChanged)) {
+			node.orientationWorld = normalize(parent.orientationWorld * node.rotationLocal);
+			node.orientationDirty = 0;
+			changed |= WorldOrientationChanged;
+		}
+
+		node.worldTransformChanged = changed;
+		node.descendantDirty = 0;
+		if (changed) {
+			outChanged[numChanged++] = entry.node;
+		}
+		++e;
+	}
+	return numChanged;
+}
+
+
+// sweeps smaller than this stay on the calling thread
+const u32 SceneParallelTransformMinEntries = 4096;
+
+/**
+ * A run of hierarchy entries swept by one thread. A head is the root of a subtree too big for one
+ * work unit, it is swept alone before the units holding its descendants run.
+ */
+struct SceneTransformPiece {
+	u16		begin;
+	u16		end;
+	u16		numChanged;
+	u8		head;
+	u8		_padding;
+};
+
+struct SceneTransformJob {
+	const SceneHierarchy*					hierarchy;
+	Scene::Components::SceneNodeComponent*	nodes;
+	const SceneNode*						root;
+	SceneTransformPiece*					pieces;
+	u32*									unitFirstPiece;	// unit u owns [unitFirstPiece[u], unitFirstPiece[u+1])
+	u16*									changedScratch;	// changed nodes of each piece, at the piece's begin
+	bool									visitAll;
+};
+
+void sweepTransformPiece(
+	SceneTransformJob& job,
+	SceneTransformPiece& piece)
+{
+	piece.numChanged = (u16)updateNodeTransformRange(
+		*job.hierarchy, job.nodes, *job.root,
+		piece.begin, piece.end, job.visitAll,
+		&job.changedScratch[piece.begin]);
+}
+
+void sweepTransformUnit(
+	void* jobData,
+	u32 unit,
+	MemoryArena& frameScoped)
+{
+	SceneTransformJob& job = *(SceneTransformJob*)jobData;
+	for (u32 p = job.unitFirstPiece[unit]; p < job.unitFirstPiece[unit + 1]; ++p) {
+		if (!job.pieces[p].head) {
+			sweepTransformPiece(job, job.pieces[p]);
+		}
+	}
+}
+
+
+/**
+ * Splits the hierarchy ranges into pieces of whole subtrees and groups consecutive pieces into
+ * balanced work units. Subtrees larger than a unit are split below their head node, so one deep
+ * or wide branch still spreads over the workers. Heads are swept on this thread first, in depth
+ * first order, then the units run in parallel since no unit reads a node written by another.
+ * Changed lists are gathered in piece order, so the result doesn't depend on the thread count.
+ */
+void updateNodeTransformsParallel(
+	Scene& scene,
+	const u16* rangeBegin,
+	const u16* rangeEnd,
+	u32 numRanges,
+	u32 numEntries,
+	bool visitAll,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
+{
+	SceneHierarchy& hierarchy = scene.hierarchy;
+
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	SceneTransformJob job{};
+	job.hierarchy = &hierarchy;
+	job.nodes = scene.components.sceneNodes.items();
+	job.root = &scene.root;
+	job.pieces = allocArrayOfType(frameScoped, SceneTransformPiece, numEntries);
+	job.unitFirstPiece = allocArrayOfType(frameScoped, u32, numEntries + 1);
+	job.changedScratch = allocArrayOfType(frameScoped, u16, hierarchy.length);
+	job.visitAll = visitAll;
+
+	const u32 unitTarget = max(numEntries / ((workers.numWorkers + 1) * 4), 256U);
+
+	u32 numPieces = 0;
+	u32 numUnits = 0;
+	u32 unitSize = 0;
+	for (u32 r = 0; r < numRanges; ++r) {
+		for (u32 e = rangeBegin[r]; e < rangeEnd[r];) {
+			u32 subtreeEnd = hierarchy.entries[e].subtreeEnd;
+			if (subtreeEnd - e > unitTarget) {
+				job.pieces[numPieces++] = SceneTransformPiece{ (u16)e, (u16)(e + 1), 0, 1, 0 };
+				++e;
+				continue;
+			}
+			if (unitSize == 0) {
+				job.unitFirstPiece[numUnits++] = numPieces;
+				job.pieces[numPieces++] = SceneTransformPiece{ (u16)e, (u16)subtreeEnd, 0, 0, 0 };
+			}
+			else if (!job.pieces[numPieces - 1].head && job.pieces[numPieces - 1].end == e) {
+				// sibling subtrees in one unit are contiguous, sweep them as one piece
+				job.pieces[numPieces - 1].end = (u16)subtreeEnd;
+			}
+			else {
+				job.pieces[numPieces++] = SceneTransformPiece{ (u16)e, (u16)subtreeEnd, 0, 0, 0 };
+			}
+			unitSize += subtreeEnd - e;
+			if (unitSize >= unitTarget) {
+				unitSize = 0;
+			}
+			e = subtreeEnd;
+		}
+	}
+	job.unitFirstPiece[numUnits] = numPieces;
+
+	for (u32 p = 0; p < numPieces; ++p) {
+		if (job.pieces[p].head) {
+			sweepTransformPiece(job, job.pieces[p]);
+		}
+	}
+
+	runParallel(workers, sweepTransformUnit, &job, numUnits, frameScoped);
+
+	for (u32 p = 0; p < numPieces; ++p) {
+		const SceneTransformPiece& piece = job.pieces[p];
+		memcpy(&hierarchy.changed[hierarchy.numChanged],
+			   &job.changedScratch[piece.begin],
+			   piece.numChanged * sizeof(u16));
+		hierarchy.numChanged += piece.numChanged;
+	}
+}
+
+
+/**
+ * Calculate new world transforms from scene.hierarchy, where parents precede their children so
+ * each node reads an already updated parent. After a topology change the hierarchy is rebuilt
+ * and every node is visited. Otherwise only the subtrees queued by setSceneNodeDirty are swept,
+ * so the cost follows the number of moving nodes rather than the scene size. Large sweeps are
+ * split over the worker pool. Nodes whose world transform was recalculated are flagged with
+ * worldTransformChanged until the next call.
+ */
+void updateNodeTransforms(
+	Scene& scene,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
+{
+	SceneHierarchy& hierarchy = scene.hierarchy;
+	Scene::Components::SceneNodeComponent* nodes = scene.components.sceneNodes.items();
+
+	bool visitAll = (hierarchy.topologyChanged == 1);
+	if (visitAll) {
+		rebuildSceneHierarchy(scene);
+	}
+	else {
+		// flags from last frame on nodes that won't be visited again
+		for (u32 c = 0; c < hierarchy.numChanged; ++c) {
+			nodes[hierarchy.changed[c]].data.worldTransformChanged = 0;
+		}
+	}
+	hierarchy.numChanged = 0;
+
+	// the root has no parent, so its local transform is its world transform
+	SceneNode& root = scene.root;
+	root.worldTransformChanged = 0;
+	if (root.positionDirty == 1) {
+		root.positionWorld = root.translationLocal;
+		root.positionDirty = 0;
+		root.worldTransformChanged |= WorldPositionChanged;
+	}
+	if (root.orientationDirty == 1) {
+		root.orientationWorld = normalize(root.rotationLocal);
+		root.orientationDirty = 0;
+		root.worldTransformChanged |= WorldOrientationChanged;
+	}
+
+	// ranges to sweep, either everything or each queued subtree under root
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	bool sweepAll = visitAll || root.worldTransformChanged;
+	u32 numRanges = sweepAll ? (hierarchy.length > 0 ? 1 : 0) : hierarchy.numDirtySubtrees;
+	u16* rangeBegin = allocArrayOfType(frameScoped, u16, max(numRanges, 1U));
+	u16* rangeEnd = allocArrayOfType(frameScoped, u16, max(numRanges, 1U));
+	u32 numEntries = 0;
+
+	if (sweepAll) {
+		rangeBegin[0] = 0;
+		rangeEnd[0] = (u16)hierarchy.length;
+		numEntries = hierarchy.length;
+	}
+	else {
+		for (u32 d = 0; d < numRanges; ++d) {
+			u16 begin = hierarchy.position[scene.components.sceneNodes.getInnerIndex(hierarchy.dirtySubtrees[d])];
+			rangeBegin[d] = begin;
+			rangeEnd[d] = hierarchy.entries[begin].subtreeEnd;
+			numEntries += rangeEnd[d] - begin;
+		}
+	}
+	hierarchy.numDirtySubtrees = 0;
+
+	if (workers.numWorkers > 0 && numEntries >= SceneParallelTransformMinEntries) {
+		updateNodeTransformsParallel(scene, rangeBegin, rangeEnd, numRanges, numEntries, visitAll, workers, frameScoped);
+		return;
+	}
+
+	for (u32 r = 0; r < numRanges; ++r) {
+		hierarchy.numChanged += updateNodeTransformRange(
+			hierarchy, nodes, root,
+			rangeBegin[r], rangeEnd[r], visitAll,
+			&hierarchy.changed[hierarchy.numChanged]);
+	}
+}
+
+
+/**
+ * Computes the cell keys of bspheres 2 at a time, matching getSpatialKeyForSphere. Each lane
+ * picks the finest level its radius fits in, scales its center by that level's inverse cell size and
+ * checks the result is within the level's grid. Entities outside of the grid get
+ * SpatialGridKeySpace, the key of the outsideGrid bucket. Arrays are padded to a multiple of 2.
+ */
+void getSpatialCellKeysForSpheres_sse(
+	u32 length,
+	const r64* cx,
+	const r64* cy,
+	const r64* cz,
+	const r64* cr,
+	u32* outCellKeys)
+{
+	static_assert(SpatialGridLevels == 3, "kernel selects between 3 levels");
+
+	auto select = [](__m128d mask, __m128d a, __m128d b) {
+		return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+	};
+	auto levelValue = [&select](__m128d fit0, __m128d fit1, r64 v0, r64 v1, r64 v2) {
+		return select(fit0, _mm_set1_pd(v0), select(fit1, _mm_set1_pd(v1), _mm_set1_pd(v2)));
+	};
+
+	const __m128d zero = _mm_setzero_pd();
+
+	for (u32 i = 0; i < length; i += 2) {
+		__m128d r = _mm_loadu_pd(cr + i);
+		__m128d fit0 = _mm_cmple_pd(r, _mm_set1_pd(spatialGridSizeXZ * 0.5));
+		__m128d fit1 = _mm_cmple_pd(r, _mm_set1_pd(spatialGridSizeXZ * 0.5 * 4.0));
+		__m128d fit2 = _mm_cmple_pd(r, _mm_set1_pd(spatialGridSizeXZ * 0.5 * 16.0));
+
+		__m128d invSizeXZ = levelValue(fit0, fit1,
+			(1.0 / spatialGridSizeXZ), (1.0 / spatialGridSizeXZ) * 0.25, (1.0 / spatialGridSizeXZ) * 0.0625);
+		__m128d invSizeY  = levelValue(fit0, fit1,
+			(1.0 / spatialGridSizeY), (1.0 / spatialGridSizeY) * 0.25, (1.0 / spatialGridSizeY) * 0.0625);
+		__m128d dimXZ  = levelValue(fit0, fit1, gridSizeX, gridSizeX >> 2, gridSizeX >> 4);
+		__m128d dimY   = levelValue(fit0, fit1, gridSizeY, max(gridSizeY >> 2, 1), max(gridSizeY >> 4, 1));
+
+		__m128d gx = _mm_mul_pd(_mm_loadu_pd(cx + i), invSizeXZ);
+		__m128d gy = _mm_mul_pd(_mm_loadu_pd(cy + i), invSizeY);
+		__m128d gz = _mm_mul_pd(_mm_loadu_pd(cz + i), invSizeXZ);
+
+		__m128d inGrid = _mm_and_pd(
+			_mm_and_pd(_mm_and_pd(_mm_cmpge_pd(gx, zero), _mm_cmpge_pd(gy, zero)), _mm_cmpge_pd(gz, zero)),
+			_mm_and_pd(_mm_and_pd(_mm_cmplt_pd(gx, dimXZ), _mm_cmplt_pd(gy, dimY)), _mm_cmplt_pd(gz, dimXZ)));
+		inGrid = _mm_and_pd(inGrid, fit2);
+
+		alignas(16) i32 ix[4], iy[4], iz[4];
+		_mm_store_si128((__m128i*)ix, _mm_cvttpd_epi32(gx));
+		_mm_store_si128((__m128i*)iy, _mm_cvttpd_epi32(gy));
+		_mm_store_si128((__m128i*)iz, _mm_cvttpd_epi32(gz));
+
+		int m0 = _mm_movemask_pd(fit0);
+		int m1 = _mm_movemask_pd(fit1);
+		int mIn = _mm_movemask_pd(inGrid);
+
+		for (u32 l = 0; l < 2; ++l) {
+			u32 level = 2 - ((m1 >> l) & 1) - ((m0 >> l) & 1);
+			outCellKeys[i + l] = ((mIn >> l) & 1)
+				? getSpatialCellKey(SpatialCell{ (u8)ix[l], (u8)iy[l], (u8)iz[l] }, level)
+				: SpatialGridKeySpace;
+		}
+	}
+}
+
+
+/**
+ * A pending move in the spatial grid, cellKey is the sort key.
+ */
+struct SpatialEdit {
+	u32		cellKey;
+	u16		move;		// index into the SpatialMove array
+	u16		slot;		// index into sps.slots, so removal doesn't go through the move
+};
+
+
+/**
+ * An entity leaving its cell, with the bsphere it is re-added with.
+ */
+struct SpatialMove {
+	dvec3		center;
+	r32			radius;
+	u32			cellKey;			// new cell key
+	ComponentId	spatialInfoId;
+	u16			spatialInfoIndex;	// inner index, to write back gridKey
+	u16			_padding;
+};
+
+
+/**
+ * LSD radix sort of grid edits by cell key, 11 bits per pass. Two passes leave the result back in
+ * edits.
+ */
+void radixSortSpatialEdits(
+	SpatialEdit* edits,
+	SpatialEdit* buffer,
+	u32 length)
+{
+	static_assert(SpatialGridKeySpace < (1U << 22), "cell keys must fit in two radix passes");
+
+	SpatialEdit* src = edits;
+	SpatialEdit* dst = buffer;
+	for (u32 shift = 0; shift < 22; shift += 11) {
+		u32 offsets[2048] = {};
+		for (u32 e = 0; e < length; ++e) {
+			++offsets[(src[e].cellKey >> shift) & 2047];
+		}
+		u32 sum = 0;
+		for (u32 b = 0; b < 2048; ++b) {
+			u32 count = offsets[b];
+			offsets[b] = sum;
+			sum += count;
+		}
+		for (u32 e = 0; e < length; ++e) {
+			dst[offsets[(src[e].cellKey >> shift) & 2047]++] = src[e];
+		}
+		SpatialEdit* tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+}
+
+
+/**
+ * Moves entities in the spatial grid whose scene node was transformed this frame, run after
+ * updateNodeTransforms. Moved entities are gathered in batches of SoA bspheres that stay in L1,
+ * and each batch has its cell keys computed with SIMD. Entities that stay in their cell only have
+ * their cached bsphere refreshed in place through their slot. The rest become grid edits, which
+ * are removed in order of their previous cell key and added in order of their new cell key, so
+ * each run of edits to the same cell does one hash lookup and touches the cell's chunks together.
+ * Entities that were never added to the spatial map are left alone.
+ */
+void updateSpatialMap(
+	Scene& scene,
+	MemoryArena& frameScoped)
+{
+	constexpr const u32 batchSize = 256;
+
+	SpatialPersistentStorage& sps = scene.spatial;
+	const u16 numSpatialInfo = scene.components.spatialInfo.length();
+	if (numSpatialInfo == 0) {
+		return;
+	}
+
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	SpatialMove* moves = allocArrayOfType(frameScoped, SpatialMove, numSpatialInfo);
+	SpatialEdit* edits = allocArrayOfType(frameScoped, SpatialEdit, numSpatialInfo);
+	u32 numEdits = 0;
+
+	alignas(16) r64 cx[batchSize];
+	alignas(16) r64 cy[batchSize];
+	alignas(16) r64 cz[batchSize];
+	alignas(16) r64 cr[batchSize];
+	u32 cellKeys[batchSize];
+	u16 batchIndex[batchSize];
+	u32 batchLength = 0;
+
+	// refresh entities that stay in their cell, collect edits for the rest
+	auto flushBatch = [&]() {
+		if (batchLength & 1) {
+			cx[batchLength] = cy[batchLength] = cz[batchLength] = cr[batchLength] = 0.0;
+		}
+		getSpatialCellKeysForSpheres_sse(batchLength, cx, cy, cz, cr, cellKeys);
+
+		for (u32 b = 0; b < batchLength; ++b) {
+			ComponentId spatialInfoId = scene.components.spatialInfo.getHandleForInnerIndex(batchIndex[b]);
+			const SpatialSlot& slot = sps.slots[spatialInfoId.index];
+			if (slot.chunk == 0) {
+				continue;
+			}
+
+			if (slot.cellKey == cellKeys[b]) {
+				dvec3 origin = getSpatialKeyOrigin(getSpatialKeyFromCellKey(cellKeys[b]));
+				setSpatialEntrySphere(
+					sps.chunks[slot.chunk], slot.lane,
+					vec3{ (r32)(cx[b] - origin.x), (r32)(cy[b] - origin.y), (r32)(cz[b] - origin.z) },
+					(r32)cr[b]);
+			}
+			else {
+				moves[numEdits] = SpatialMove{
+					dvec3{ cx[b], cy[b], cz[b] }, (r32)cr[b],
+					cellKeys[b], spatialInfoId, batchIndex[b], 0 };
+				edits[numEdits] = SpatialEdit{ slot.cellKey, (u16)numEdits, spatialInfoId.index };
+				++numEdits;
+			}
+		}
+		batchLength = 0;
+	};
+
+	// gather the world space bspheres of entities whose node moved this frame
+	for (u16 i = 0; i < numSpatialInfo; ++i) {
+		SpatialInfo& si = scene.components.spatialInfo.item(i).data;
+		SceneNode& node = scene.components.sceneNodes[si.sceneNodeId]->data;
+		if (!node.worldTransformChanged) {
+			continue;
+		}
+
+		dvec3 center = node.positionWorld + node.orientationWorld * make_dvec3(si.localBSphere.center);
+		cx[batchLength] = center.x;
+		cy[batchLength] = center.y;
+		cz[batchLength] = center.z;
+		cr[batchLength] = si.localBSphere.radius;
+		batchIndex[batchLength] = i;
+		if (++batchLength == batchSize) {
+			flushBatch();
+		}
+	}
+	if (batchLength > 0) {
+		flushBatch();
+	}
+	if (numEdits == 0) {
+		return;
+	}
+
+	// remove grouped by previous cell
+	SpatialEdit* sortBuffer = allocArrayOfType(frameScoped, SpatialEdit, numEdits);
+	radixSortSpatialEdits(edits, sortBuffer, numEdits);
+
+	// edits are sorted by cell, not by slot or hash position, so fetch those a few edits ahead
+	const u32 prefetchDistance = 8;
+	auto prefetchEdit = [&sps](const SpatialEdit& edit) {
+		_mm_prefetch((const char*)&sps.slots[edit.slot], _MM_HINT_T0);
+		_mm_prefetch((const char*)&sps.cells[hashSpatialCellKey(edit.cellKey)], _MM_HINT_T0);
+	};
+
+	for (u32 e = 0; e < numEdits;) {
+		u32 cellKey = edits[e].cellKey;
+		SpatialKey key = getSpatialKeyFromCellKey(cellKey);
+		u32 pos = 0;
+		SpatialBucket* bucket = findSpatialBucket(key, sps, cellKey, pos);
+		assert(bucket);
+
+		for (; e < numEdits && edits[e].cellKey == cellKey; ++e) {
+			if (e + prefetchDistance < numEdits) {
+				prefetchEdit(edits[e + prefetchDistance]);
+			}
+			SpatialSlot slot = sps.slots[edits[e].slot];
+			removeFromSpatialBucket(*bucket, cellKey, slot.chunk, slot.lane, sps);
+		}
+		if (pos != UINT32_MAX && bucket->length == 0) {
+			eraseSpatialCell(sps, pos);
+		}
+	}
+
+	// add grouped by new cell
+	for (u32 e = 0; e < numEdits; ++e) {
+		edits[e].cellKey = moves[edits[e].move].cellKey;
+	}
+	radixSortSpatialEdits(edits, sortBuffer, numEdits);
+
+	for (u32 e = 0; e < numEdits;) {
+		u32 cellKey = edits[e].cellKey;
+		SpatialKey key = getSpatialKeyFromCellKey(cellKey);
+		dvec3 origin = getSpatialKeyOrigin(key);
+		u32 pos = (key.level == SpatialGridOutsideLevel)
+			? UINT32_MAX
+			: insertSpatialCell(sps, cellKey);
+		SpatialBucket& bucket = (pos == UINT32_MAX ? sps.outsideGrid : sps.cells[pos].bucket);
+
+		for (; e < numEdits && edits[e].cellKey == cellKey; ++e) {
+			if (e + prefetchDistance < numEdits) {
+				prefetchEdit(edits[e + prefetchDistance]);
+				_mm_prefetch((const char*)&moves[edits[e + prefetchDistance].move], _MM_HINT_T0);
+			}
+			const SpatialMove& move = moves[edits[e].move];
+			// an entity that doesn't fit in the pool has an invalid slot, so it's left alone like
+			// one that was never added
+			addToSpatialBucket(
+				bucket, cellKey, move.spatialInfoId,
+				make_vec3(move.center - origin),
+				move.radius,
+				sps);
+
+			scene.components.spatialInfo.item(move.spatialInfoIndex).data.gridKey = key;
+		}
+		if (pos != UINT32_MAX && bucket.length == 0) {
+			eraseSpatialCell(sps, pos);
+		}
+	}
+}
+
+
+/**
+ * Culls the scene for each active camera, leaving the entities left after frustum culling, and
+ * occlusion culling when scene.occlusion is set, in scene.culling. Cameras with a culling cache
+ * reuse their cells from earlier frames while they move less than the cache margin.
+ */
+void frustumCullScene(
+	Scene& scene,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
 {
 	assert(scene.culling);
 	SpatialTransientStorage& sts = *scene.culling;
@@ -700,20 +2441,42 @@ void frustumCullScene(
 	{
 		CameraInstance& camInst = scene.components.cameraInstances.item(ac).data;
 
-		scanConvertFrustum(
-			camInst,
-			sts.cellProj);
-	
-		getCellPVSFromProjections(
-			sts,
-			scene.spatial);
-
-		cullEntitiesInCellPVS(
-			scene,
-			camInst,
-			ac,
-			sts,
-			scene.spatial);
+		if (scene.cullingCaches[ac]) {
+			cullEntitiesWithCullingCache(
+				scene,
+				camInst,
+				ac,
+				*scene.cullingCaches[ac],
+				sts,
+				scene.spatial);
+		}
+		else {
+			scanConvertFrustum(
+				camInst,
+				sts.cellProj);
+		
+			getCellPVSFromProjections(
+				sts,
+				scene.spatial);
+
+			cullEntitiesInCellPVS(
+				scene,
+				camInst,
+				ac,
+				sts,
+				scene.spatial);
+		}
+
+		if (scene.occlusion && scene.components.occluders.length() > 0) {
+			cullOccludedEntities(
+				scene,
+				camInst,
+				ac,
+				sts,
+				*scene.occlusion,
+				workers,
+				frameScoped);
+		}
 	}
 }
 
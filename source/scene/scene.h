@@ -9,6 +9,10 @@
 #include "geometry.h"
 #include "entity.h"
 #include "scene_components.h"
+#include "occlusion.h"
+#include "broadphase.h"
+
+struct SceneHistory;
 
 
 const i16 gridSizeX = 256;
@@ -20,8 +24,9 @@ const r64 spatialGridSizeXZ = 1000.0;
 
 // scalar for Y axis into XZ space (used for frustum-sphere culling of spatial grid cells)
 const r64 spatialGridSize_XZ_Y_ratio = spatialGridSizeXZ / spatialGridSizeY;
-// radius for the bounding sphere containing a grid cell
-const r64 spatialGridCellRadius = SQRT_2 * spatialGridSizeXZ * 0.5;
+// radius for the bounding sphere containing a level 0 loose grid cell (in the y-scaled homogeneous
+// grid space the cell is a cube of side spatialGridSizeXZ, loose bounds double that)
+const r64 spatialGridCellRadius = SQRT_3 * spatialGridSizeXZ;
 
 const dvec3 invSpatialGridSizeXYZ = dvec3{
 	1.0 / spatialGridSizeXZ,
@@ -32,18 +37,92 @@ const dvec3 invSpatialGridSizeXYZ = dvec3{
 const int SpatialGridSize = gridSizeX * gridSizeY * gridSizeZ;
 
 /**
- * SpatialHandle represents an entry into a single cell of the SpatialMap. Each cell of SpatialMap
- * holds an embedded linked list of SpatialValue. The front of the list is stored in the
- * spatialCells array.
+ * The grid is loose, cells at level L are 4^L level 0 cells on a side and their loose bounds
+ * extend half a cell (in XZ units) past each face. An entity is stored in the cell containing its
+ * bsphere center at the finest level where the radius is no more than that half cell. Entities
+ * too large for the coarsest level, or centered outside of the grid, go in the outsideGrid bucket.
+ * Each level's morton codes take 4 fewer bits than the level below it, the levels are laid out
+ * one after another in a single key space.
+ */
+const u32 SpatialGridLevels = 3;
+const u32 SpatialGridOutsideLevel = SpatialGridLevels;
+
+constexpr u32 spatialLevelKeyBase[SpatialGridLevels + 1] = {
+	0,
+	SpatialGridSize,
+	SpatialGridSize + (SpatialGridSize >> 4),
+	SpatialGridSize + (SpatialGridSize >> 4) + (SpatialGridSize >> 8)
+};
+const u32 SpatialGridKeySpace = spatialLevelKeyBase[SpatialGridLevels];
+static_assert(SpatialGridKeySpace % 4096 == 0, "each level must start on a 16x16x16 block");
+
+
+/**
+ * Each occupied cell of the spatial grid owns a bucket of SpatialChunks, which hold the entities
+ * in the cell as contiguous {spatialInfoId, cached bsphere} entries. The bsphere is stored in SoA
+ * format relative to the cell origin, so the chunk can be passed straight to the
+ * frustumSoA_intersectSpheresSoA kernels. Overflow past the first chunk chains more chunks from
+ * the pool. The front chunk is the only one that may be partially filled, so insert appends to it
+ * and remove swaps the last entry of the front chunk into the hole.
+ */
+const u32 SpatialChunkCapacity = 8;
+
+struct alignas(32) SpatialChunk {
+	r32			x[SpatialChunkCapacity];	// bsphere center relative to the cell origin
+	r32			y[SpatialChunkCapacity];
+	r32			z[SpatialChunkCapacity];
+	r32			r[SpatialChunkCapacity];	// bsphere radius
+	ComponentId	spatialInfoIds[SpatialChunkCapacity];
+	u16			next;						// next (full) chunk in the bucket, or next in the free list
+	u8			_padding[30];
+};
+static_assert_aligned_size(SpatialChunk, 32);
+
+
+struct SpatialBucket {
+	u16		front;		// index of front chunk, 0 is the null chunk
+	u16		length;		// number of entries in the bucket
+};
+
+
+/**
+ * SpatialSlot remembers where an entity's entry lives in the grid so it can be removed without
+ * scanning the bucket.
+ */
+struct SpatialSlot {
+	u32		cellKey;
+	u16		chunk;		// 0 if the slot is not valid
+	u8		lane;
+	u8		_padding;
+};
+
+
+/**
+ * Only occupied cells are stored, in an open addressing hash table keyed by the cell's morton
+ * code. Linear probing with backward shift deletion keeps probe chains short without tombstones.
  */
-typedef h32 SpatialHandle;
+const u32 SpatialCellHashCapacity = SPATIAL_MAX_OCCUPIED_CELLS * 2; // load factor <= 0.5
+static_assert((SpatialCellHashCapacity & (SpatialCellHashCapacity - 1)) == 0,
+			  "SpatialCellHashCapacity must be a power of 2");
 
+constexpr u32 log2_u32(u32 v) { return (v <= 1 ? 0 : 1 + log2_u32(v >> 1)); }
+const u32 SpatialCellHashBits = log2_u32(SpatialCellHashCapacity);
 
-struct SpatialValue {
-	ComponentId		spatialInfoId;
-	SpatialHandle	next;	// handle to next SpatialValue in the grid cell
-	SpatialCell		cell;
-	u8				_padding;
+struct SpatialCellEntry {
+	u32				key;	// morton code + 1, 0 means the entry is empty
+	SpatialBucket	bucket;
+};
+
+
+/**
+ * Occupancy bitmap hierarchy over the grid in morton order. Each bit of cells is one grid cell,
+ * so each 64-bit word covers a 4x4x4 brick. Each bit of blocks marks a non-zero cells word, so
+ * each blocks word covers a 16x16x16 block, and each bit of regions marks a non-zero blocks word.
+ */
+struct SpatialOccupancy {
+	u64		cells[SpatialGridKeySpace / 64];
+	u64		blocks[SpatialGridKeySpace / (64*64)];
+	u64		regions[(SpatialGridKeySpace + (64*64*64) - 1) / (64*64*64)];
 };
 
 
@@ -60,19 +139,20 @@ struct SpatialCellProjections {
 };
 
 
-DenseHandleMap16TypedWithBuffer(
-	SpatialValue,
-	SpatialValueMap,
-	SpatialHandle,
-	0,
-	SCENE_MAX_ENTITIES);
-
-
 // TODO: rename SpatialWorldChunk or something?
+/**
+ * Zeroed memory is a valid empty storage. Chunk 0 is reserved as the null chunk.
+ */
 struct SpatialPersistentStorage {
-	SpatialHandle	cells[SpatialGridSize];	// each cell stores front of linked list of SpatialValues in the map
-	SpatialValueMap	valueMap;				// map stores SpatialValues representing entities in the world
-	SpatialHandle	outsideGrid;			// front of linked list of SpatialValues that exist outside of the grid cells
+	SpatialCellEntry	cells[SpatialCellHashCapacity];	// occupied cells hashed by morton code
+	SpatialOccupancy	occupancy;						// bitmap hierarchy of occupied cells
+	u32					numOccupiedCells;
+	u32					occupancyVersion;		// incremented whenever a cell becomes occupied or empty
+	SpatialBucket		outsideGrid;			// bucket of entities that don't fit in any grid level
+	u16					freeChunk;				// front of the chunk free list
+	u16					numChunks;				// high water mark of chunks taken from the pool
+	SpatialSlot			slots[SCENE_MAX_ENTITIES];	// indexed by spatialInfoId.index
+	SpatialChunk		chunks[SPATIAL_CHUNKS_CAPACITY];
 };
 
 
@@ -80,17 +160,77 @@ struct SpatialPersistentStorage {
  * SpatialTransientStorage is used per-frustum for object culling.
  */
 struct SpatialTransientStorage {
-	SpatialCellProjections	cellProj;					// cell projection data used for frustum visibility check
-	SpatialCell				cellPVS[SpatialGridSize];	// resulting dataset from running cell projection algorithm
+	SpatialCellProjections	cellProj;	// cell projection data used for frustum visibility check
+	u32						cellPVS[SPATIAL_MAX_OCCUPIED_CELLS]; // resulting dataset from running cell projection algorithm, positions in the cell hash table
 	u32						cellPVSLength;
 	u32						numVisibleEntities;
 	EntityId				visibleEntities[SCENE_MAX_ENTITIES]; // resulting dataset after running bsphere checks on the cellPVS
+	ComponentId				visibleSpatialInfoIds[SCENE_MAX_ENTITIES]; // SpatialInfo component of each visible entity
+};
+
+
+/**
+ * Culling state an active camera keeps between frames. Occupied cells near the frustum it was
+ * built with are sorted by their loose bounds: core cells are inside by more than
+ * SpatialCullingCacheMargin, so all of their entities stay visible, and boundary cells are within
+ * the margin of a plane, so their entities are tested every frame. Cells further outside can't
+ * become visible while the frustum drifts less than the margin, past that the cache is rebuilt.
+ * Cells are kept by key, since hash table positions move as cells are erased.
+ */
+const r32 SpatialCullingCacheMargin = 250.0f;
+
+struct SpatialCullingCache {
+	FrustumSoA	frustum;			// camera space frustum the cells were sorted against
+	dvec3		eyePoint;
+	r64			extent;				// distance from the eye to the far corners
+	r32			fovDegreesVertical;
+	r32			aspectRatio;
+	r32			nearClip;
+	r32			farClip;
+	u32			occupancyVersion;	// grid occupancy the cell lists match
+	u32			numCoreCells;
+	u32			numBoundaryCells;
+	u8			valid;
+	u64			occupiedCells[SpatialGridKeySpace / 64];	// copy of the grid occupancy cells bits
+	u32			coreCells[SPATIAL_MAX_OCCUPIED_CELLS];		// cell keys
+	u32			boundaryCells[SPATIAL_MAX_OCCUPIED_CELLS];
 };
 
 
 DenseHandleMap16TypedWithBuffer(Entity, EntityMap, EntityId, 0, SCENE_MAX_ENTITIES);
 
 
+const u16 SceneHierarchyRoot = 0xFFFF; // parent index of the root's children, above any inner index
+
+struct SceneHierarchyEntry {
+	u16		node;		// inner index of the node in sceneNodes
+	u16		parent;		// inner index of the parent node, or SceneHierarchyRoot
+	u16		subtreeEnd;	// entry following the node's last descendant
+	u16		_padding;
+};
+
+/**
+ * SceneHierarchy is the scene graph flattened in depth-first order, so every parent comes before
+ * its children and the transform pass is a single linear sweep. Entries use inner indices, which
+ * only move when scene nodes are inserted or erased, so the scene api flags topologyChanged on
+ * those and on reparenting, and the next updateNodeTransforms rebuilds the array.
+ * Between topology changes the sweep only visits the subtrees listed in dirtySubtrees, skipping
+ * any child subtree with nothing dirty, and clears the worldTransformChanged flags it set last
+ * frame through the changed list.
+ */
+struct SceneHierarchy {
+	SceneHierarchyEntry	entries[SCENE_MAX_ENTITIES];
+	u16					position[SCENE_MAX_ENTITIES];		// entry of each node by inner index
+	SceneNodeId			dirtySubtrees[SCENE_MAX_ENTITIES];	// children of root with dirty nodes below
+	u16					changed[SCENE_MAX_ENTITIES];		// inner index of nodes flagged worldTransformChanged
+	u32					length;
+	u32					numDirtySubtrees;
+	u32					numChanged;
+	u8					topologyChanged;
+	u8					_padding[3];
+};
+
+
 struct Viewport {
 	ComponentId cameraInstId;
 };
@@ -100,6 +240,11 @@ struct Scene {
 	SceneNode 	root;	// root of the scene graph, traversal starts from here
 
 	EntityMap	entities;
+	ComponentSetStorage	componentSets;	// ids of entities with more components than fit inline, and the registered queries
+
+	// stores of the render and game sets by [setType - 1][typeId], set with
+	// scene_registerComponentStore so destroying an entity can erase its components
+	DenseHandleMap16*	componentStores[2][MAX_ENTITY_COMPONENTS];
 
 	struct Components
 	{
@@ -109,14 +254,38 @@ struct Scene {
 		ComponentStore(ModelInstance,  ModelInstanceMap,  ComponentId,  3, modelInstances,  SCENE_MAX_ENTITIES)
 		ComponentStore(LightInstance,  LightInstanceMap,  ComponentId,  4, lightInstances,  SCENE_MAX_LIGHTS)
 		ComponentStore(SpatialInfo,    SpatialInfoMap,    ComponentId,  5, spatialInfo,     SCENE_MAX_ENTITIES)
+		ComponentStore(Occluder,       OccluderMap,       ComponentId,  6, occluders,       SCENE_MAX_OCCLUDERS)
 	}
 	components;
 
+	SceneHierarchy				hierarchy;
+
 	SpatialPersistentStorage	spatial;
 	
 	// TODO: for now allocate one of these, if culling becomes multi threaded will need one per thread
 	SpatialTransientStorage		*culling;
 
+	// per active camera, set by enableCullingCache, frames where the camera barely moved reuse its
+	// culling when set
+	SpatialCullingCache			*cullingCaches[SCENE_MAX_ACTIVE_CAMERAS];
+
+	// software depth buffer for occlusion culling, entities are only tested against occluders when set
+	OcclusionBuffer				*occlusion;
+
+	// overlapping pairs kept across updates, the broadphase only runs when set
+	BroadphaseStorage			*broadphase;
+
+	// meshes of the occluders by Occluder::meshIndex, set with scene_registerOccluderMesh
+	OccluderMesh				occluderMeshes[SCENE_MAX_OCCLUDER_MESHES];
+	u32							numOccluderMeshes;
+
+	// checksums and changes of the stores each update tick, only recorded when set
+	SceneHistory				*history;
+
+	// one bit per movement inner index with dirty flags set, maintained by setMovementDirty and
+	// interpolateSceneNodes, so the interpolation walks active movements in memory order
+	u64			activeMovements[(SCENE_MAX_ENTITIES + 63) / 64];
+
 	ComponentId	activeCameras[32];
 	u8 			numActiveCameras;
 };
@@ -124,70 +293,175 @@ struct Scene {
 
 // Functions
 
-SpatialCell getSpatialCell(
-	r64 x, r64 y, r64 z)
+/**
+ * Cell containing the world space position at the given grid level. Returns false if the position
+ * is outside of the grid.
+ */
+inline bool getSpatialCell(
+	const dvec3& p,
+	u32 level,
+	SpatialCell& outCell)
 {
-	return SpatialCell{
-		// note: trunc behavior for negative numbers here is fine since we are clamping to 0 anyway
-		(u8)clamp((i32)(x / spatialGridSizeXZ), 0, gridSizeX-1),
-		(u8)clamp((i32)(y / spatialGridSizeY),  0, gridSizeY-1),
-		(u8)clamp((i32)(z / spatialGridSizeXZ), 0, gridSizeZ-1)
-	};
+	// multiply by exact power of 2 reciprocals of the level scale, same as the SIMD kernel
+	r64 invScale = 1.0 / (r64)(1 << (2 * level));
+	r64 x = p.x * ((1.0 / spatialGridSizeXZ) * invScale);
+	r64 y = p.y * ((1.0 / spatialGridSizeY) * invScale);
+	r64 z = p.z * ((1.0 / spatialGridSizeXZ) * invScale);
+
+	if (x < 0.0 || y < 0.0 || z < 0.0
+		|| x >= (r64)(gridSizeX >> (2 * level))
+		|| y >= max((r64)(gridSizeY >> (2 * level)), 1.0)
+		|| z >= (r64)(gridSizeZ >> (2 * level)))
+	{
+		return false;
+	}
+	outCell = SpatialCell{ (u8)x, (u8)y, (u8)z };
+	return true;
+}
+
+
+/**
+ * Picks the finest grid level whose loose cells can hold the bsphere.
+ */
+SpatialKey getSpatialKeyForSphere(
+	const dvec3& center,
+	r32 radius)
+{
+	SpatialKey key{ {}, (u8)SpatialGridOutsideLevel };
+	for (u32 level = 0; level < SpatialGridLevels; ++level) {
+		if (radius <= spatialGridSizeXZ * 0.5 * (r64)(1 << (2 * level))) {
+			if (getSpatialCell(center, level, key.cell)) {
+				key.level = (u8)level;
+			}
+			break;
+		}
+	}
+	return key;
 }
 
 
 SpatialKey getSpatialKeyForAABB(
-	const vec3& vs,
-	const vec3& ve)
+	const dvec3& vs,
+	const dvec3& ve)
 {
-	return SpatialKey{
-		getSpatialCell(vs.x, vs.y, vs.z),
-		getSpatialCell(ve.x, ve.y, ve.z)
-	};
+	dvec3 halfExtents = (ve - vs) * 0.5;
+	return getSpatialKeyForSphere(
+		vs + halfExtents,
+		(r32)max(halfExtents.x, max(halfExtents.y, halfExtents.z)));
 }
 
 
-SpatialKey getSpatialKeyForSphere(
-	vec3& center,
-	r32 radius)
+// spread/compact the 4 low bits of v to every 3rd or every 2nd bit, for morton codes
+inline u32 spreadBits3_4(u32 v)   { return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4) | ((v & 8) << 6); }
+inline u32 spreadBits2_4(u32 v)   { return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2) | ((v & 8) << 3); }
+inline u32 compactBits3_4(u32 m)  { return (m & 1) | ((m >> 2) & 2) | ((m >> 4) & 4) | ((m >> 6) & 8); }
+inline u32 compactBits2_4(u32 m)  { return (m & 1) | ((m >> 1) & 2) | ((m >> 2) & 4) | ((m >> 3) & 8); }
+
+/**
+ * Morton code of a cell offset by its level's key base, x/y/z bits are interleaved for the low 4
+ * bits of each coordinate and x/z bits for the high 4 bits of x and z, since the grid is only 16
+ * cells tall. Each 64 codes form a 4x4x4 block and each 4096 codes a 16x16x16 block.
+ */
+inline u32 getSpatialCellKey(
+	const SpatialCell& cell,
+	u32 level)
 {
-	return getSpatialKeyForAABB(
-		center - radius,
-		center + radius);
+	return spatialLevelKeyBase[level]
+		+ (spreadBits3_4(cell.x & 15)
+		| (spreadBits3_4(cell.y & 15) << 1)
+		| (spreadBits3_4(cell.z & 15) << 2)
+		| (spreadBits2_4(cell.x >> 4) << 12)
+		| (spreadBits2_4(cell.z >> 4) << 13));
 }
 
+inline SpatialCell getSpatialCellFromKey(
+	u32 key,
+	u32 level)
+{
+	key -= spatialLevelKeyBase[level];
+	return SpatialCell{
+		(u8)(compactBits3_4(key)      | (compactBits2_4(key >> 12) << 4)),
+		(u8)(compactBits3_4(key >> 1)),
+		(u8)(compactBits3_4(key >> 2) | (compactBits2_4(key >> 13) << 4))
+	};
+}
 
-u32 getSpatialIndex(
-	const SpatialCell& cell)
+inline u32 getSpatialLevelFromKey(
+	u32 key)
 {
-	return (cell.y * gridSizeX * gridSizeZ) + (cell.z * gridSizeX) + cell.x;
+	u32 level = 0;
+	while (level < SpatialGridLevels - 1 && key >= spatialLevelKeyBase[level + 1]) {
+		++level;
+	}
+	return level;
 }
 
 
-void addToSpatialCell(
-	const SpatialCell& cell,
-	ComponentId spatialInfoId,
-	SpatialPersistentStorage& sps);
+/**
+ * Tests whether the box of cells starting at origin with the given size (in cells per side)
+ * overlaps the bounds, all in the coordinates of one grid level.
+ */
+inline bool spatialCellBoxInBounds(
+	const SpatialCell& origin,
+	i32 size,
+	const i32 bounds[6])
+{
+	return (origin.x <= bounds[1] && origin.x + size - 1 >= bounds[0]
+		 && origin.y <= bounds[3] && origin.y + size - 1 >= bounds[2]
+		 && origin.z <= bounds[5] && origin.z + size - 1 >= bounds[4]);
+}
 
 
 /**
- * Add an entity to spatial grid cell(s) based on the key passed in. If the entity has already been
- * added, use the updateSpatialKey function to move it and removeFromSpatialMap to remove it.
+ * Position of the cell in the hash table, or UINT32_MAX if the cell is not occupied.
  */
-void addToSpatialMap(
-	const SpatialKey& key,
-	ComponentId spatialInfoId,
-	SpatialPersistentStorage& sps);
+u32 findSpatialCell(
+	const SpatialPersistentStorage& sps,
+	u32 cellKey);
 
 
-void removeFromSpatialCell(
+/**
+ * World space position of the cell's minimum corner, cached bspheres are stored relative to this.
+ */
+dvec3 getSpatialCellOrigin(
 	const SpatialCell& cell,
+	u32 level)
+{
+	r64 scale = (r64)(1 << (2 * level));
+	return dvec3{
+		cell.x * spatialGridSizeXZ * scale,
+		cell.y * spatialGridSizeY * scale,
+		cell.z * spatialGridSizeXZ * scale
+	};
+}
+
+
+/**
+ * Number of entries in a bucket's front chunk, all other chunks in the bucket are full.
+ */
+inline u32 getSpatialFrontChunkLength(
+	const SpatialBucket& bucket)
+{
+	return ((bucket.length - 1) % SpatialChunkCapacity) + 1;
+}
+
+
+/**
+ * Add an entity to the spatial grid cell based on the key passed in. The world space bsphere
+ * center and radius are cached in the cell for culling. If the entity has already been added,
+ * use the updateSpatialKey function to move it and removeFromSpatialMap to remove it.
+ * Returns false if the chunk pool is exhausted and the entity wasn't added.
+ */
+bool addToSpatialMap(
+	const SpatialKey& key,
 	ComponentId spatialInfoId,
+	const dvec3& center,
+	r32 radius,
 	SpatialPersistentStorage& sps);
 
 
 /**
- * Remove an entity from all cells that contain it, based on the key passed in.
+ * Remove an entity from the cell that contains it, based on the key passed in.
  */
 void removeFromSpatialMap(
 	const SpatialKey& key,
@@ -196,16 +470,55 @@ void removeFromSpatialMap(
 
 
 /**
- * Updates the cell(s) containing an entity by removing based on the old key and adding based on
- * a new key. Overlapping cells in the old and new set are not changed.
+ * Updates the cell containing an entity by removing based on the old key and adding based on a
+ * new key. If the key is unchanged the entity is not relinked, only its cached bsphere is updated.
  */
 void updateSpatialKey(
 	const SpatialKey& prevKey,
 	const SpatialKey& newKey,
 	ComponentId spatialInfoId,
+	const dvec3& center,
+	r32 radius,
 	SpatialPersistentStorage& sps);
 
 
+/**
+ * Flags a scene node's local position and/or orientation as changed so updateNodeTransforms
+ * recalculates it and its descendants. Anything that writes translationLocal or rotationLocal
+ * outside of the scene api must call this, since the transform sweep skips subtrees that were
+ * never flagged.
+ */
+void setSceneNodeDirty(
+	Scene& scene,
+	SceneNodeId sceneNodeId,
+	u8 positionDirty,
+	u8 orientationDirty);
+
+
+/**
+ * Sets the translation and rotation dirty flags of a movement component, call on each update
+ * tick after writing its next values. A flag that was set and is now cleared makes the node snap
+ * to the next value on the following render frame. Marks the movement in scene.activeMovements so
+ * interpolateSceneNodes picks it up.
+ */
+void setMovementDirty(
+	Scene& scene,
+	ComponentId movementId,
+	u8 translationDirty,
+	u8 rotationDirty);
+
+
+/**
+ * Gives an active camera a culling cache, so frustumCullScene reuses its cells across frames while
+ * the camera moves less than the margin. The cache is over 600KB, so it's only allocated for the
+ * cameras that enable it, the first time they do.
+ */
+SpatialCullingCache* enableCullingCache(
+	Scene& scene,
+	u8 cameraIndex,
+	MemoryArena& arena);
+
+
 
 
 /*
@@ -91,7 +91,8 @@ SceneNodeId scene_addSceneNodeToEntity(
 			0,															// numChildren
 			0,															// positionDirty
 			0,															// orientationDirty
-			{},															// padding
+			0,															// worldTransformChanged
+			0,															// descendantDirty
 			translationLocal,											// translationLocal
 			rotationLocal,												// rotationLocal
 			parentNode.positionWorld + translationLocal,				// positionWorld
@@ -107,6 +108,7 @@ SceneNodeId scene_addSceneNodeToEntity(
 	SceneNodeId nodeId = scene.components.sceneNodes.insert(&snc);
 	entity_addComponent(
 		scene.entities[entityId]->sceneComponents,
+		scene.componentSets,
 		nodeId);
 
 	if (nodeId != null_h32) {
@@ -119,6 +121,8 @@ SceneNodeId scene_addSceneNodeToEntity(
 		// make the new node the first child of its parent
 		parentNode.firstChild = nodeId;
 		++parentNode.numChildren;
+
+		scene.hierarchy.topologyChanged = 1;
 	}
 
 	return nodeId;
@@ -130,11 +134,28 @@ NewEntityResult scene_createNewEntity(
 	bool inScene,
 	bool movable,
 	SceneNodeId parentNode)
+{
+	return scene_createReservedEntity(
+		scene,
+		scene.entities.reserve(),
+		inScene,
+		movable,
+		parentNode);
+}
+
+
+NewEntityResult scene_createReservedEntity(
+	Scene& scene,
+	EntityId reservedEntityId,
+	bool inScene,
+	bool movable,
+	SceneNodeId parentNode)
 {
 	NewEntityResult result{};
 
-	Entity* entity = nullptr;
-	result.entityId = scene.entities.insert(nullptr, &entity);
+	Entity* entity = scene.entities.insertReserved(reservedEntityId);
+	result.entityId = reservedEntityId;
+	entity_initComponentSets(*entity, result.entityId);
 
 	if (inScene) {
 		result.sceneNodeId = scene_addSceneNodeToEntity(
@@ -150,7 +171,7 @@ NewEntityResult scene_createNewEntity(
 			mc.data.sceneNodeId = result.sceneNodeId;
 
 			result.movementId = scene.components.movement.insert(&mc);
-			entity_addComponent(entity->sceneComponents, result.movementId);
+			entity_addComponent(entity->sceneComponents, scene.componentSets, result.movementId);
 		}
 	}
 
@@ -181,12 +202,14 @@ bool scene_removeNode(
 	// if this was the firstChild, set the new one
 	if (node.prevSibling == null_h32) {
 		parentNode.firstChild = node.nextSibling;
-		scene.components.sceneNodes[parentNode.firstChild]->data.prevSibling = null_h32;
 	}
 	// fix the node's sibling linked list
 	else {
 		scene.components.sceneNodes[node.prevSibling]->data.nextSibling = node.nextSibling;
 	}
+	if (node.nextSibling != null_h32) {
+		scene.components.sceneNodes[node.nextSibling]->data.prevSibling = node.prevSibling;
+	}
 
 	--parentNode.numChildren;
 
@@ -200,14 +223,18 @@ bool scene_removeNode(
 			SceneNodeIdQueue handleQueue(bufferSize, handleQueueBuffer);
 			
 			collectDescendants(scene, sceneNodeId, handleQueue, frameScoped);
+
+			// deepest first, so each descendant has no children left when it's removed, and erase
+			// may move this node's component so its entity is kept aside
+			EntityId thisEntityId = thisCmp.entityId;
 			
 			if (outRemovedEntities != nullptr) {
 				EntityIdQueue& rmvEnt = *outRemovedEntities;
 				while (!handleQueue.empty())
 				{
-					SceneNodeId descSceneNodeId = *handleQueue.pop_fifo();
+					SceneNodeId descSceneNodeId = *handleQueue.pop_lifo();
 					EntityId entityIdOfRemoved = scene.components.sceneNodes[descSceneNodeId]->entityId;
-					if (entityIdOfRemoved != thisCmp.entityId) {
+					if (entityIdOfRemoved != thisEntityId) {
 						rmvEnt.push(entityIdOfRemoved);
 					}
 					scene_removeNode(
@@ -221,7 +248,7 @@ bool scene_removeNode(
 			else {
 				while (!handleQueue.empty())
 				{
-					SceneNodeId descSceneNodeId = *handleQueue.pop_fifo();
+					SceneNodeId descSceneNodeId = *handleQueue.pop_lifo();
 					scene_removeNode(
 						scene,
 						frameScoped,
@@ -243,9 +270,12 @@ bool scene_removeNode(
 
 	// remove this SceneNode component from the store and entity
 	bool removed =
-		entity_removeComponent(entity.sceneComponents, sceneNodeId)
+		entity_removeComponent(entity.sceneComponents, scene.componentSets, sceneNodeId)
 		&& scene.components.sceneNodes.erase(sceneNodeId);
 	
+	// erase moves the last node's inner index, so the flattened hierarchy is stale either way
+	scene.hierarchy.topologyChanged = 1;
+
 	assert(removed);
 	return removed;
 }
@@ -265,25 +295,207 @@ bool scene_removeEntity(
 
 	bool removed = false;
 
+	// each removal takes the node out of the set, so the next first node is looked up again
 	for (SceneNodeId sceneNodeId =
 			entity_getFirstComponent(
 				entity.sceneComponents,
+				scene.componentSets,
 				Scene::Components::SceneNodeComponentType);
-		sceneNodeId != null_h32;)
+		sceneNodeId != null_h32;
+		sceneNodeId =
+			entity_getFirstComponent(
+				entity.sceneComponents,
+				scene.componentSets,
+				Scene::Components::SceneNodeComponentType))
 	{
-		removed = removed &&
-			scene_removeNode(
+		if (!scene_removeNode(
 				scene,
 				frameScoped,
 				sceneNodeId,
 				cascade,
-				outRemovedEntities);
+				outRemovedEntities))
+		{
+			break;
+		}
+		removed = true;
 	}
 
 	return removed;
 }
 
 
+void scene_eraseComponent(
+	Scene& scene,
+	ComponentId componentId)
+{
+	auto& components = scene.components;
+
+	switch (componentId.typeId) {
+		case Scene::Components::MovementStoreTypeId: {
+			// erase moves the last movement into the erased one's inner index, its active bit too
+			u32 m = components.movement.getInnerIndex(componentId);
+			u32 last = components.movement.length() - 1U;
+			u64 lastActive = (scene.activeMovements[last >> 6] >> (last & 63)) & 1ULL;
+			scene.activeMovements[m >> 6] &= ~(1ULL << (m & 63));
+			scene.activeMovements[last >> 6] &= ~(1ULL << (last & 63));
+			if (m != last) {
+				scene.activeMovements[m >> 6] |= lastActive << (m & 63);
+			}
+			components.movement.erase(componentId);
+			break;
+		}
+		case Scene::Components::SpatialInfoStoreTypeId: {
+			removeFromSpatialMap(
+				components.spatialInfo[componentId]->data.gridKey,
+				componentId,
+				scene.spatial);
+			components.spatialInfo.erase(componentId);
+			break;
+		}
+		case Scene::Components::CameraInstanceStoreTypeId: {
+			for (u32 ac = 0; ac < scene.numActiveCameras; ++ac) {
+				if (scene.activeCameras[ac] == componentId) {
+					--scene.numActiveCameras;
+					memmove(&scene.activeCameras[ac], &scene.activeCameras[ac + 1],
+							(scene.numActiveCameras - ac) * sizeof(ComponentId));
+					break;
+				}
+			}
+			// caches are kept by camera inner index, which erase moves
+			for (u32 c = 0; c < SCENE_MAX_ACTIVE_CAMERAS; ++c) {
+				if (scene.cullingCaches[c]) {
+					scene.cullingCaches[c]->valid = 0;
+				}
+			}
+			components.cameraInstances.erase(componentId);
+			break;
+		}
+		case Scene::Components::ModelInstanceStoreTypeId: {
+			components.modelInstances.erase(componentId);
+			break;
+		}
+		case Scene::Components::LightInstanceStoreTypeId: {
+			components.lightInstances.erase(componentId);
+			break;
+		}
+		case Scene::Components::OccluderStoreTypeId: {
+			components.occluders.erase(componentId);
+			break;
+		}
+		default: {
+			assert(false && "scene component type can't be erased here");
+		}
+	}
+}
+
+
+/**
+ * Queues the entities owning the descendants of each of the entity's SceneNodes that aren't
+ * queued yet.
+ */
+static void queueDescendantEntities(
+	Scene& scene,
+	Entity& entity,
+	EntityIdQueue& destroyQueue,
+	u8* queued,
+	MemoryArena& frameScoped)
+{
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	const u32 bufferSize = scene.components.sceneNodes.length() + 1; // add 1 for root node
+	SceneNodeId* descendantsBuffer = allocArrayOfType(frameScoped, SceneNodeId, bufferSize);
+	SceneNodeIdQueue descendants(bufferSize, descendantsBuffer);
+
+	const ComponentId* ids = entity_getComponents(entity.sceneComponents, scene.componentSets);
+	for (u32 c = 0; c < entity.sceneComponents.componentsSize; ++c) {
+		if (ids[c].typeId != Scene::Components::SceneNodeStoreTypeId) {
+			continue;
+		}
+		collectDescendants(scene, ids[c], descendants, frameScoped);
+
+		while (!descendants.empty()) {
+			SceneNodeId descSceneNodeId = *descendants.pop_fifo();
+			EntityId descEntityId = scene.components.sceneNodes[descSceneNodeId]->entityId;
+			if (!queued[descEntityId.index]) {
+				queued[descEntityId.index] = 1;
+				destroyQueue.push(descEntityId);
+			}
+		}
+	}
+}
+
+
+bool scene_destroyEntity(
+	Scene& scene,
+	MemoryArena& frameScoped,
+	EntityId entityId,
+	bool cascade)
+{
+	if (!scene.entities.has(entityId)) {
+		return false;
+	}
+
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	const u32 bufferSize = scene.entities.length();
+	EntityId* destroyQueueBuffer = allocArrayOfType(frameScoped, EntityId, bufferSize);
+	EntityIdQueue destroyQueue(bufferSize, destroyQueueBuffer);
+	u8* queued = allocArrayOfType(frameScoped, u8, SCENE_MAX_ENTITIES);
+	memset(queued, 0, SCENE_MAX_ENTITIES);
+
+	queued[entityId.index] = 1;
+	destroyQueue.push(entityId);
+
+	while (!destroyQueue.empty()) {
+		EntityId destroyId = *destroyQueue.pop_fifo();
+		Entity& entity = *scene.entities[destroyId];
+
+		// descendants are found before their nodes go, removeNode only takes out the nodes
+		if (cascade) {
+			queueDescendantEntities(scene, entity, destroyQueue, queued, frameScoped);
+		}
+		scene_removeEntity(scene, frameScoped, destroyId, cascade);
+
+		for (u32 s = ComponentSet_Scene; s <= ComponentSet_Game; ++s) {
+			ComponentSet& set = entity_getComponentSet(entity, (ComponentSetType)s);
+			const ComponentId* ids = entity_getComponents(set, scene.componentSets);
+
+			for (u32 c = 0; c < set.componentsSize; ++c) {
+				if (s == ComponentSet_Scene) {
+					scene_eraseComponent(scene, ids[c]);
+				}
+				else {
+					DenseHandleMap16* store = scene.componentStores[s - 1][ids[c].typeId];
+					assert(store && "no store registered for the component type, see scene_registerComponentStore");
+					if (store) {
+						store->erase(ids[c]);
+					}
+				}
+			}
+
+			// emptying the set frees its pool block and takes the entity out of the queries
+			entity_removeComponentsByType(set, scene.componentSets, set.mask);
+		}
+
+		scene.entities.erase(destroyId);
+	}
+
+	return true;
+}
+
+
+void scene_registerComponentStore(
+	Scene& scene,
+	ComponentSetType setType,
+	u8 typeId,
+	DenseHandleMap16& store)
+{
+	assert(setType != ComponentSet_Scene && "scene component stores are known to the scene");
+	assert(typeId < MAX_ENTITY_COMPONENTS);
+	scene.componentStores[setType - 1][typeId] = &store;
+}
+
+
 bool scene_moveNode(
 	Scene& scene,
 	SceneNodeId sceneNodeId,
@@ -309,18 +521,20 @@ bool scene_moveNode(
 	
 	SceneNode& newParent = (moveToParent == null_h32)
 		? scene.root
-		: scene.components.sceneNodes[node.parent]->data;
+		: scene.components.sceneNodes[moveToParent]->data;
 
 	// remove from current parrent
 	// if this was the firstChild, set the new one
 	if (node.prevSibling == null_h32) {
 		currentParent.firstChild = node.nextSibling;
-		scene.components.sceneNodes[currentParent.firstChild]->data.prevSibling = null_h32;
 	}
 	// fix the node's sibling linked list
 	else {
 		scene.components.sceneNodes[node.prevSibling]->data.nextSibling = node.nextSibling;
 	}
+	if (node.nextSibling != null_h32) {
+		scene.components.sceneNodes[node.nextSibling]->data.prevSibling = node.prevSibling;
+	}
 
 	--currentParent.numChildren;
 
@@ -335,6 +549,11 @@ bool scene_moveNode(
 			
 	++newParent.numChildren;
 
+	scene.hierarchy.topologyChanged = 1;
+
+	// world transform follows the new parent
+	setSceneNodeDirty(scene, sceneNodeId, 1, 1);
+
 	return true;
 }
 
@@ -387,6 +606,117 @@ bool scene_moveAllSiblings(
 }
 
 
+void scene_setTranslation(
+	Scene& scene,
+	SceneNodeId sceneNodeId,
+	const dvec3& translationLocal)
+{
+	scene.components.sceneNodes[sceneNodeId]->data.translationLocal = translationLocal;
+	setSceneNodeDirty(scene, sceneNodeId, 1, 0);
+}
+
+
+void scene_setRotation(
+	Scene& scene,
+	SceneNodeId sceneNodeId,
+	const dquat& rotationLocal)
+{
+	scene.components.sceneNodes[sceneNodeId]->data.rotationLocal = rotationLocal;
+	setSceneNodeDirty(scene, sceneNodeId, 0, 1);
+}
+
+
+u32 scene_registerOccluderMesh(
+	Scene& scene,
+	const vec3* vertices,
+	const u16* indices,
+	u32 numIndices)
+{
+	assert(numIndices % 3 == 0 && "occluder mesh must be a triangle list");
+	assert(scene.numOccluderMeshes < SCENE_MAX_OCCLUDER_MESHES && "too many occluder meshes");
+
+	u32 meshIndex = scene.numOccluderMeshes++;
+	OccluderMesh& mesh = scene.occluderMeshes[meshIndex];
+	mesh.vertices = vertices;
+	mesh.indices = indices;
+	mesh.numIndices = numIndices;
+
+	return meshIndex;
+}
+
+
+ComponentId scene_addOccluderToEntity(
+	Scene& scene,
+	EntityId entityId,
+	SceneNodeId sceneNodeId,
+	u32 meshIndex)
+{
+	assert(meshIndex < scene.numOccluderMeshes && "occluder mesh not registered");
+
+	Entity& entity = *scene.entities[entityId];
+
+	Scene::Components::OccluderComponent occ{};
+	occ.entityId = entityId;
+	occ.data.sceneNodeId = sceneNodeId;
+	occ.data.meshIndex = meshIndex;
+
+	ComponentId occluderId = scene.components.occluders.insert(&occ);
+	entity_addComponent(entity.sceneComponents, scene.componentSets, occluderId);
+
+	return occluderId;
+}
+
+
+ComponentQuery* scene_registerComponentQuery(
+	Scene& scene,
+	ComponentSetType setType,
+	u64 mask,
+	MemoryArena& arena)
+{
+	ComponentSetStorage& storage = scene.componentSets;
+
+	for (u32 q = 0; q < storage.numQueries; ++q) {
+		ComponentQuery* query = storage.queries[q];
+		if (query->setType == setType && query->mask == mask) {
+			return query;
+		}
+	}
+	assert(mask != 0 && "a query needs at least one component type");
+	assert(storage.numQueries < SCENE_MAX_COMPONENT_QUERIES
+			&& "component queries are full, consider raising SCENE_MAX_COMPONENT_QUERIES");
+
+	ComponentQuery* query = allocType(arena, ComponentQuery);
+	*query = {};
+	query->mask = mask;
+	query->setType = setType;
+
+	for (u64 bits = mask; bits != 0; bits &= bits - 1) {
+		assert(query->numTypes < COMPONENT_QUERY_MAX_TYPES
+				&& "too many component types in the query, consider raising COMPONENT_QUERY_MAX_TYPES");
+		u32 typeId = 0;
+		BitScanFwd64(&typeId, bits);
+		query->typeIds[query->numTypes++] = (u8)typeId;
+	}
+
+	query->entityIds = allocArrayOfType(arena, EntityId, SCENE_MAX_ENTITIES);
+	query->componentIds = allocArrayOfType(arena, ComponentId, SCENE_MAX_ENTITIES * query->numTypes);
+	query->rows = allocArrayOfType(arena, u16, SCENE_MAX_ENTITIES);
+	memset(query->rows, 0, SCENE_MAX_ENTITIES * sizeof(u16));
+
+	// take in the entities that already match, later changes come through the component sets
+	for (u32 e = 0; e < scene.entities.length(); ++e) {
+		Entity& entity = scene.entities.item((u16)e);
+		const ComponentSet& set = entity_getComponentSet(entity, setType);
+		if (set.entityId != null_h32) {
+			updateComponentQuery(*query, set, storage);
+		}
+	}
+
+	storage.queries[storage.numQueries++] = query;
+	return query;
+}
+
+
 EntityId scene_createCamera(
 	Scene& scene,
 	const CameraParameters& params,
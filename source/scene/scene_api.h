@@ -39,6 +39,17 @@ NewEntityResult scene_createNewEntity(
 	bool movable,
 	SceneNodeId parentNode);
 
+/**
+ * Like scene_createNewEntity, for an id taken ahead of time with scene.entities.reserve(), which
+ * is how deferred scene commands hand out the ids of entities they create.
+ */
+NewEntityResult scene_createReservedEntity(
+	Scene& scene,
+	EntityId reservedEntityId,
+	bool inScene,
+	bool movable,
+	SceneNodeId parentNode);
+
 
 /**
  * Removes the SceneNode component from the entity and also fixes up the scene graph.
@@ -81,6 +92,45 @@ bool scene_removeEntity(
 	EntityIdQueue* outRemovedEntities = nullptr);
 
 
+/**
+ * Removes the entity's SceneNode components like scene_removeEntity, then erases every component
+ * of its three sets from their stores, which also frees its ids from the component set pool and
+ * takes it out of the registered queries, and finally erases the entity itself. Render and game
+ * components are erased from the stores registered with scene_registerComponentStore.
+ * 
+ * @param cascade	If true the entities owning the node's descendants are destroyed along with
+ *			it. If false the descendants are given to the node's parent.
+ * @return true if destroyed, false if the entity doesn't exist
+ */
+bool scene_destroyEntity(
+	Scene& scene,
+	MemoryArena& frameScoped,
+	EntityId entityId,
+	bool cascade);
+
+
+/**
+ * Erases a component of the scene set from its store, along with what the scene keeps about it
+ * outside of the store: the active movement bits, the spatial map, the active cameras and their
+ * culling caches. Doesn't take the component out of the entity's set. SceneNodes are removed with
+ * scene_removeNode, which fixes up the graph.
+ */
+void scene_eraseComponent(
+	Scene& scene,
+	ComponentId componentId);
+
+
+/**
+ * Registers the store of a render or game component type, so scene_destroyEntity can erase the
+ * components of that type. Scene components are known to the scene and need no registration.
+ */
+void scene_registerComponentStore(
+	Scene& scene,
+	ComponentSetType setType,
+	u8 typeId,
+	DenseHandleMap16& store);
+
+
 // TODO: may need a toggle to control switching entity owner to the new parent's entity
 /**
  * Moves a sceneNode referenced by sceneNodeId from its current parent to a new parent.
@@ -121,6 +171,79 @@ bool scene_moveAllSiblings(
 	EntityId excludeEntityId);
 
 
+/**
+ * Sets the translation of a scene node relative to its parent. The world position of the node
+ * and its descendants is recalculated by the next updateNodeTransforms.
+ */
+void scene_setTranslation(
+	Scene& scene,
+	SceneNodeId sceneNodeId,
+	const dvec3& translationLocal);
+
+
+/**
+ * Sets the rotation of a scene node relative to its parent. The world orientation of the node
+ * and its descendants is recalculated by the next updateNodeTransforms.
+ */
+void scene_setRotation(
+	Scene& scene,
+	SceneNodeId sceneNodeId,
+	const dquat& rotationLocal);
+
+
+/**
+ * Registers a mesh occluders can be added with. The mesh data is not copied, it must outlive the
+ * scene. Meshes aren't part of scene snapshots, to load one saved by another run the same meshes
+ * must be registered in the same order first.
+ * 
+ * @param vertices	positions relative to the scene node
+ * @param indices	triangle list, numIndices is a multiple of 3
+ * @return index of the mesh, passed to scene_addOccluderToEntity
+ */
+u32 scene_registerOccluderMesh(
+	Scene& scene,
+	const vec3* vertices,
+	const u16* indices,
+	u32 numIndices);
+
+
+/**
+ * Adds an Occluder component to the entity, positioned by sceneNodeId.
+ * 
+ * @param meshIndex	returned by scene_registerOccluderMesh
+ * @return ComponentId of the Occluder added to the entity
+ */
+ComponentId scene_addOccluderToEntity(
+	Scene& scene,
+	EntityId entityId,
+	SceneNodeId sceneNodeId,
+	u32 meshIndex);
+
+
+/**
+ * Registers a query over the entities whose set of setType has every component type in the mask,
+ * or returns the query already registered for them. Entities that match already are taken in
+ * right away. The rows are allocated from the arena, which must outlive the scene, about
+ * SCENE_MAX_ENTITIES * (numTypes + 1.5) * 4 bytes.
+ *
+ *	ComponentQuery* q = scene_registerComponentQuery(scene, ComponentSet_Scene,
+ *		Scene::Components::SceneNodeComponentType | Scene::Components::ModelInstanceComponentType,
+ *		arena);
+ *	for (u32 r = 0; r < q->length; ++r) {
+ *		SceneNodeId nodeId = entity_getQueryComponent(*q, r, 0);
+ *		ComponentId modelId = entity_getQueryComponent(*q, r, 1);
+ *	}
+ *
+ * @return the query, its rows stay valid while it's iterated as long as no components are added
+ *	to or removed from the entities
+ */
+ComponentQuery* scene_registerComponentQuery(
+	Scene& scene,
+	ComponentSetType setType,
+	u64 mask,
+	MemoryArena& arena);
+
+
 u32 scene_createCamera(
 	Scene& scene,
 	const CameraParameters& cameraParams,
@@ -0,0 +1,234 @@
+#include "scene_commands.h"
+#include "scene_api.h"
+
+
+void reserveSceneCommandHandles(
+	SceneCommandBuffer& buffer,
+	DenseHandleMap16& map,
+	u8 typeId,
+	u32 count,
+	MemoryArena& arena)
+{
+	assert(buffer.numReservations < SceneCommandMaxReservations
+			&& "too many maps reserved for one buffer, consider raising SceneCommandMaxReservations");
+
+	SceneCommandReservation& reservation = buffer.reservations[buffer.numReservations++];
+	reservation.map = &map;
+	reservation.handles = allocArrayOfType(arena, h32, count);
+	reservation.count = count;
+	reservation.used = 0;
+
+	for (u32 h = 0; h < count; ++h) {
+		reservation.handles[h] = map.reserve(typeId);
+	}
+}
+
+
+static h32 takeReservedHandle(
+	SceneCommandBuffer& buffer,
+	DenseHandleMap16& map)
+{
+	for (u32 r = 0; r < buffer.numReservations; ++r) {
+		SceneCommandReservation& reservation = buffer.reservations[r];
+		if (reservation.map == &map) {
+			assert(reservation.used < reservation.count
+					&& "reserved handles used up, reserve more with reserveSceneCommandHandles");
+			return reservation.handles[reservation.used++];
+		}
+	}
+	assert(false && "no handles reserved for the map, reserve with reserveSceneCommandHandles");
+	return null_h32;
+}
+
+
+static SceneCommand& pushSceneCommand(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	SceneCommandType type)
+{
+	if (!buffer.last || buffer.last->numCommands == SceneCommandBlockSize) {
+		SceneCommandBlock* block = allocType(arena, SceneCommandBlock);
+		block->next = nullptr;
+		block->numCommands = 0;
+		if (buffer.last) {
+			buffer.last->next = block;
+		}
+		else {
+			buffer.first = block;
+		}
+		buffer.last = block;
+	}
+	++buffer.numCommands;
+
+	SceneCommand& command = buffer.last->commands[buffer.last->numCommands++];
+	command = {};
+	command.type = type;
+	return command;
+}
+
+
+EntityId recordCreateEntity(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	Scene& scene,
+	bool inScene,
+	bool movable,
+	SceneNodeId parentNode)
+{
+	SceneCommand& command = pushSceneCommand(buffer, arena, SceneCommand_CreateEntity);
+	command.entityId = takeReservedHandle(buffer, scene.entities._map);
+	command.id = parentNode;
+	command.inScene = inScene;
+	command.movable = movable;
+	return command.entityId;
+}
+
+
+void recordRemoveEntity(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	EntityId entityId,
+	bool cascade)
+{
+	SceneCommand& command = pushSceneCommand(buffer, arena, SceneCommand_RemoveEntity);
+	command.entityId = entityId;
+	command.cascade = cascade;
+}
+
+
+ComponentId recordAddComponent(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	DenseHandleMap16& store,
+	ComponentSetType setType,
+	EntityId entityId,
+	const void* component)
+{
+	SceneCommand& command = pushSceneCommand(buffer, arena, SceneCommand_AddComponent);
+	command.setType = setType;
+	command.entityId = entityId;
+	command.id = takeReservedHandle(buffer, store);
+	command.store = &store;
+	command.component = allocBuffer(arena, store.elementSizeB, 8);
+	memcpy(command.component, component, store.elementSizeB);
+	return command.id;
+}
+
+
+void recordRemoveComponent(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	DenseHandleMap16& store,
+	ComponentSetType setType,
+	EntityId entityId,
+	ComponentId componentId)
+{
+	// a raw erase would leave the node linked into the graph
+	bool isSceneNode = (setType == ComponentSet_Scene
+						&& componentId.typeId == Scene::Components::SceneNodeStoreTypeId);
+	assert(!isSceneNode && "SceneNodes can't be removed by command, see scene_removeNode");
+	if (isSceneNode) {
+		return;
+	}
+
+	SceneCommand& command = pushSceneCommand(buffer, arena, SceneCommand_RemoveComponent);
+	command.setType = setType;
+	command.entityId = entityId;
+	command.id = componentId;
+	command.store = &store;
+}
+
+
+void playbackSceneCommands(
+	Scene& scene,
+	SceneCommandBuffer* buffers,
+	u32 numBuffers,
+	MemoryArena& frameScoped)
+{
+	for (u32 b = 0; b < numBuffers; ++b) {
+		for (SceneCommandBlock* block = buffers[b].first; block; block = block->next) {
+			u32 c = 0;
+			while (c < block->numCommands) {
+				SceneCommand& command = block->commands[c];
+
+				switch (command.type) {
+					case SceneCommand_CreateEntity: {
+						scene_createReservedEntity(
+							scene,
+							command.entityId,
+							command.inScene != 0,
+							command.movable != 0,
+							command.id);
+						++c;
+						break;
+					}
+					case SceneCommand_RemoveEntity: {
+						scene_destroyEntity(
+							scene,
+							frameScoped,
+							command.entityId,
+							command.cascade != 0);
+						++c;
+						break;
+					}
+					case SceneCommand_AddComponent: {
+						// components added to the same set one after another go in together
+						ComponentId ids[MAX_ENTITY_COMPONENTS];
+						u32 numIds = 0;
+						do {
+							SceneCommand& add = block->commands[c];
+							add.store->insertReserved(add.id, add.component);
+							ids[numIds++] = add.id;
+							++c;
+						}
+						while (c < block->numCommands
+							   && numIds < MAX_ENTITY_COMPONENTS
+							   && block->commands[c].type == SceneCommand_AddComponent
+							   && block->commands[c].entityId == command.entityId
+							   && block->commands[c].setType == command.setType);
+
+						Entity& entity = *scene.entities[command.entityId];
+						entity_addComponents(
+							entity_getComponentSet(entity, (ComponentSetType)command.setType),
+							scene.componentSets,
+							ids,
+							numIds);
+						break;
+					}
+					case SceneCommand_RemoveComponent: {
+						Entity& entity = *scene.entities[command.entityId];
+						entity_removeComponent(
+							entity_getComponentSet(entity, (ComponentSetType)command.setType),
+							scene.componentSets,
+							command.id);
+						// scene components are also known to the spatial map, cameras and movement
+						if (command.setType == ComponentSet_Scene) {
+							scene_eraseComponent(scene, command.id);
+						}
+						else {
+							command.store->erase(command.id);
+						}
+						++c;
+						break;
+					}
+					default:
+						assert(false && "unknown scene command");
+						++c;
+				}
+			}
+		}
+	}
+
+	// give back what wasn't used in the reverse order it was taken, so the freelists keep their
+	// order less the used handles
+	for (u32 b = numBuffers; b-- > 0;) {
+		SceneCommandBuffer& buffer = buffers[b];
+		for (u32 r = buffer.numReservations; r-- > 0;) {
+			SceneCommandReservation& reservation = buffer.reservations[r];
+			for (u32 h = reservation.count; h-- > reservation.used;) {
+				reservation.map->releaseReserved(reservation.handles[h]);
+			}
+		}
+		buffer = {};
+	}
+}
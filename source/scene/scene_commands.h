@@ -0,0 +1,159 @@
+#ifndef _SCENE_COMMANDS_H
+#define _SCENE_COMMANDS_H
+
+#include "../utility/common.h"
+#include "../utility/dense_handle_map_16.h"
+#include "scene.h"
+
+
+struct MemoryArena;
+
+
+/**
+ * Structural changes to the scene, entities created and removed and components added and
+ * removed, recorded by systems that can't touch the shared handle maps while they run, and
+ * applied together at one sync point per tick by playbackSceneCommands.
+ */
+enum SceneCommandType : u8 {
+	SceneCommand_CreateEntity = 0,		// scene_createReservedEntity
+	SceneCommand_RemoveEntity,			// scene_destroyEntity
+	SceneCommand_AddComponent,			// insert into the store and entity_addComponent
+	SceneCommand_RemoveComponent		// entity_removeComponent and scene_eraseComponent or erase
+};
+
+
+struct SceneCommand {
+	u8					type;			// SceneCommandType
+	u8					setType;		// ComponentSetType of the component added or removed
+	u8					inScene;		// CreateEntity
+	u8					movable;		// CreateEntity
+	EntityId			entityId;
+	h32					id;				// component added or removed, or parent SceneNode of CreateEntity
+	u8					cascade;		// RemoveEntity
+	u8					_padding[3];
+	DenseHandleMap16*	store;			// store of the component added or removed
+	void*				component;		// copied into the store by AddComponent
+};
+
+
+const u32 SceneCommandBlockSize = 256;
+
+struct SceneCommandBlock {
+	SceneCommandBlock*	next;
+	u32					numCommands;
+	u32					_padding;
+	SceneCommand		commands[SceneCommandBlockSize];
+};
+
+
+/**
+ * Handles of one map taken off its freelist before recording, handed out in order.
+ */
+struct SceneCommandReservation {
+	DenseHandleMap16*	map;
+	h32*				handles;
+	u32					count;
+	u32					used;
+};
+
+const u32 SceneCommandMaxReservations = 8;
+
+
+/**
+ * @struct SceneCommandBuffer
+ *	Commands recorded by one work unit of a parallel job, or one serial system. Commands and the
+ *	components they copy live in blocks allocated from the frame arena of the recording thread, so
+ *	they must be played back before that arena is reset. Ids of new entities and components are
+ *	reserved up front, before the job runs, so recording never touches the maps and a recorded
+ *	id can be used by the commands that follow right away. Reserving for the buffers in a fixed
+ *	order, one per work unit rather than per thread, makes the ids and the playback order
+ *	independent of which threads ran the units. Zeroed memory is a valid empty buffer.
+ */
+struct SceneCommandBuffer {
+	SceneCommandBlock*		first;
+	SceneCommandBlock*		last;
+	u32						numCommands;
+	u32						numReservations;
+	SceneCommandReservation	reservations[SceneCommandMaxReservations];
+};
+
+
+/**
+ * Reserves count handles of the map for the buffer. Call on the thread that owns the scene
+ * before recording starts, for each buffer in playback order.
+ * @param typeId	typeId of the map's handles, the TypeId of its ComponentStore
+ * @param arena		holds the reserved handles until playback
+ */
+void reserveSceneCommandHandles(
+	SceneCommandBuffer& buffer,
+	DenseHandleMap16& map,
+	u8 typeId,
+	u32 count,
+	MemoryArena& arena);
+
+
+/**
+ * The record functions may run on any thread, each buffer used by one at a time. Commands are
+ * allocated from the recording thread's arena.
+ */
+
+/**
+ * Records the creation of an entity with the next id reserved from scene.entities.
+ * @return the id the entity will have
+ */
+EntityId recordCreateEntity(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	Scene& scene,
+	bool inScene,
+	bool movable,
+	SceneNodeId parentNode);
+
+/**
+ * Records the removal of an entity along with all of its components, see scene_destroyEntity.
+ */
+void recordRemoveEntity(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	EntityId entityId,
+	bool cascade);
+
+/**
+ * Records the addition of a component, copied now, with the next id reserved from store.
+ * @return the id the component will have
+ */
+ComponentId recordAddComponent(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	DenseHandleMap16& store,
+	ComponentSetType setType,
+	EntityId entityId,
+	const void* component);
+
+/**
+ * Records the removal of a component, erased with scene_eraseComponent when it's in the scene
+ * set. SceneNodes aren't recorded, they are removed with scene_removeNode.
+ */
+void recordRemoveComponent(
+	SceneCommandBuffer& buffer,
+	MemoryArena& arena,
+	DenseHandleMap16& store,
+	ComponentSetType setType,
+	EntityId entityId,
+	ComponentId componentId);
+
+
+/**
+ * Applies the commands of each buffer in order, buffer by buffer, then returns the reserved
+ * handles that weren't used to their maps and empties the buffers. Components added to one
+ * entity by consecutive commands are merged into its set at once. Call on the thread that owns
+ * the scene, once every buffer is recorded.
+ */
+void playbackSceneCommands(
+	Scene& scene,
+	SceneCommandBuffer* buffers,
+	u32 numBuffers,
+	MemoryArena& frameScoped);
+
+
+#endif
@@ -11,6 +11,16 @@ typedef h32 SceneNodeId;
 DenseQueueTyped(SceneNodeId, SceneNodeIdQueue);
 
 
+/**
+ * Flags for SceneNode::worldTransformChanged, children read these from their parent to know
+ * whether to recalculate their own world transform.
+ */
+enum SceneNodeWorldChanged : u8 {
+	WorldPositionChanged	= 1,
+	WorldOrientationChanged	= 2
+};
+
+
 /**
  * SceneNode tracks the transform relative to a parent node and contains ids forming an
  * intrusive hierarchical tree. The SceneGraph is traversed starting at the root to get the
@@ -22,7 +32,8 @@ struct SceneNode {
 	// Flags
 	u8			positionDirty;		// position needs recalc
 	u8			orientationDirty;	// orientation needs recalc
-	u8			_padding[2];
+	u8			worldTransformChanged;	// SceneNodeWorldChanged flags set when recalculated this frame
+	u8			descendantDirty;	// a node in the subtree below is dirty, set by setSceneNodeDirty
 
 	// transform vars
 	dvec3	    translationLocal;	// translation relative to parent
@@ -103,7 +114,9 @@ struct LightInstance {
  * contains prev/next values so the render loop can interpolate between them to get the
  * final rendered position, which is then set in the SceneNode. IT IS UP TO YOU to use this
  * component correctly for movement, in other words you have to set the prev/next values and
- * dirty flags on each update tick so the movement system behaves correctly. It is always an
+ * call setMovementDirty on each update tick so the movement system behaves correctly. The
+ * dirty flags must not be written directly, setMovementDirty keeps the scene's list of active
+ * movements, and only those are interpolated. It is always an
  * option to NOT use this component to achieve movement in special cases, but you would have
  * to handle the interpolation yourself in a renderTick handler and set the SceneNode values
  * directly.
@@ -136,11 +149,16 @@ struct SpatialCell {
 
 
 /**
- * SpatialKey is used for lookups into the spatial hash map. The key holds two cells, a start and
- * end, which represents a 3D block of cells that fall within the range (inclusive).
+ * SpatialKey is used for lookups into the spatial hash map. The spatial grid is a loose grid with
+ * several levels, each 4x coarser than the one below. An entity is stored once, in the cell
+ * containing its bsphere center at the finest level where the bsphere fits within the loose
+ * bounds of the cell.
  */
 struct SpatialKey {
-	SpatialCell cs, ce;
+	SpatialCell	cell;		// cell containing the bsphere center, in the level's coordinates
+	u8			level;		// grid level, or SpatialGridOutsideLevel for the outsideGrid bucket
+
+	bool operator==(const SpatialKey& k) const { return cell == k.cell && level == k.level; }
 };
 
 
@@ -152,10 +170,34 @@ struct SpatialInfo {
 	SceneNodeId	sceneNodeId;			// scene node related to this render culling information
 	u32			visibleFrustumBits;		// bits representing visibility in frustums
 	Sphere		localBSphere;			// bounding sphere x,y,z,r in local coordinates (relative to parent SceneNode)
-	SpatialKey	gridCells;				// grid cell(s) that this object's bounding sphere occupies
+	SpatialKey	gridKey;				// grid level and cell that this object is stored in
 	u8			grid;					// reserved for later use with multiple grids
 	u8			outsideGrid;			// 1 if object's bsphere goes outside the grid boundaries
 };
 
 
+/**
+ * Mesh of one or more occluders, registered with scene_registerOccluderMesh. Vertex and index data
+ * is owned by the caller and must outlive the scene.
+ */
+struct OccluderMesh {
+	const vec3*	vertices;				// positions relative to the scene node
+	const u16*	indices;
+	u32			numIndices;				// triangle list, 3 indices per triangle
+	u32			_padding;
+};
+
+
+/**
+ * Occluder marks a scene node as hiding what is behind it from the occlusion culling pass. The
+ * mesh is a low poly stand-in for the rendered model that should fit inside of it, so it never
+ * hides anything the model wouldn't. The mesh is referenced by index rather than pointer so the
+ * component can be saved in snapshots.
+ */
+struct Occluder {
+	SceneNodeId	sceneNodeId;			// scene node the mesh is positioned by
+	u32			meshIndex;				// into Scene::occluderMeshes
+};
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,721 @@
+#include "scene_history.h"
+#include "../platform/platform_api.h"
+#include "../utility/hash.h"
+
+#define SCENE_HISTORY_CODE		(((u32)'H' << 0) | ((u32)'I' << 8) | ((u32)'S' << 16) | ((u32)'T' << 24))
+#define SCENE_HISTORY_VERSION	3
+
+
+const u32 SceneHistoryChunksPerUnit = 64;
+const u32 SceneHistoryWrapChunk = 0xFFFFFFFF;
+// forces a delta of the chunk the next tick it's in use
+const u64 SceneHistoryStaleHash = 0;
+
+/**
+ * Chunk deltas are a header followed by tokens, each token a u32 with the count of unchanged
+ * words before a run in the low 16 bits and the length of the run in the high 16 bits, followed
+ * by the run's XORed words. Trailing unchanged words aren't written. Deltas are padded to 8 bytes,
+ * so a wrap marker always fits at the end of the buffer.
+ */
+struct SceneHistoryDelta {
+	u32		chunk;				// global chunk index, or SceneHistoryWrapChunk at the end of the buffer
+	u16		size;				// bytes of the chunk in use when the delta was taken
+	u16		numTokens;
+};
+
+// alternate words changed is the worst case
+const u32 SceneHistoryMaxDeltaSize = (u32)_align(
+	sizeof(SceneHistoryDelta)
+	+ (SceneHistoryChunkSize / 16 + 1) * sizeof(u32)
+	+ SceneHistoryChunkSize,
+	8);
+
+
+struct SceneHistoryChecksumsHeader {
+	u32		HIST;				// {'H','I','S','T'}
+	u16		version;
+	u16		numBlocks;
+	u32		numTicks;
+	u32		_padding;
+};
+
+
+/**
+ * Deltas a hash unit encoded while its changed chunks were in cache. Each unit has room for
+ * SceneHistoryUnitDeltaSize bytes, the changed chunks past what fits are left to the calling
+ * thread.
+ */
+struct SceneHistoryUnitDeltas {
+	u32		size;				// bytes of deltas written
+	u32		numChunks;			// chunks with a delta written
+	u32		firstPending;		// first changed chunk that didn't fit, the unit's end when all did
+	u16		changedBlocks;		// one bit per block type with a delta written
+	u16		_padding;
+};
+
+const u32 SceneHistoryUnitDeltaSize = 4 * SceneHistoryMaxDeltaSize;
+
+
+struct SceneHistoryHashJob {
+	SceneHistory*			history;
+	const u32*				regionUsed;		// bytes in use of each region this tick
+	u8*						deltas;			// room of each unit in unit order, nullptr to only hash
+	SceneHistoryUnitDeltas*	units;
+};
+
+
+static u64 hashHistoryChunk(
+	const u8* data,
+	u32 size)
+{
+	u64 h = hash64(data, size);
+	return (h == SceneHistoryStaleHash ? 1 : h);
+}
+
+
+/**
+ * Sets the tick's lengths and the bytes in use of each region, regions are in block and section
+ * order.
+ */
+static void getSceneHistoryLengths(
+	Scene& scene,
+	SceneHistoryTick& tick,
+	u32* outRegionUsed)
+{
+	u32 r = 0;
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		tick.lengths[b] = scene_getSnapshotLength(scene, b);
+
+		DenseHandleMap16* map = scene_getSnapshotStore(scene, b);
+		tick.freeListFronts[b] = (map ? map->freeListFront : 0);
+		tick.highWaters[b] = (map ? map->highWater : 0);
+
+		SceneSnapshotBlock block{};
+		SceneSnapshotSection sections[SceneSnapshotMaxSections];
+		u32 numSections = scene_getSnapshotSections(scene, b, tick.lengths[b], tick.highWaters[b], block, sections);
+		for (u32 s = 0; s < numSections; ++s) {
+			outRegionUsed[r++] = (u32)sections[s].size;
+		}
+	}
+}
+
+
+/**
+ * Hashes the hashes of the chunks in use of each block into its checksum, seeded with the block's
+ * length, free list and high water mark, regions of a block are chained through the seed.
+ */
+static void getSceneHistoryChecksums(
+	const SceneHistory& history,
+	SceneHistoryTick& tick,
+	const u32* regionUsed)
+{
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		u32 layout[3] = { tick.lengths[b], tick.freeListFronts[b], tick.highWaters[b] };
+		tick.checksums[b] = hash64(layout, sizeof(layout));
+	}
+	for (u32 r = 0; r < history.numRegions; ++r) {
+		const SceneHistoryRegion& region = history.regions[r];
+		u32 numUsed = (regionUsed[r] + SceneHistoryChunkSize - 1) / SceneHistoryChunkSize;
+
+		if (numUsed > 0) {
+			u64& checksum = tick.checksums[region.block];
+			checksum = hash64(history.tickHashes + region.firstChunk, numUsed * sizeof(u64), checksum);
+		}
+	}
+}
+
+
+/**
+ * Writes the delta between the shadow and live bytes of a chunk and copies them into the shadow.
+ * @returns bytes written
+ */
+static u32 encodeHistoryDelta(
+	u8* out,
+	u32 chunk,
+	u8* shadow,
+	const u8* live,
+	u32 size)
+{
+	u8* p = out + sizeof(SceneHistoryDelta);
+	u8* token = nullptr;
+	u32 numTokens = 0;
+	u32 zeros = 0;
+	u32 literals = 0;
+
+	// the shadow takes the live word as it's compared, a partial last word is handled apart so the
+	// whole words copy with fixed size moves
+	u32 numWholeWords = size / 8;
+	u32 tail = size - numWholeWords * 8;
+	u32 numWords = numWholeWords + (tail > 0 ? 1 : 0);
+
+	for (u32 w = 0; w < numWords; ++w) {
+		// most of a changed chunk is unchanged, runs of 8 equal words are skipped with one compare
+		if ((w & 7) == 0 && w + 8 <= numWholeWords
+			&& memcmp(shadow + w * 8, live + w * 8, 64) == 0)
+		{
+			if (literals > 0) {
+				u32 t = zeros | (literals << 16);
+				memcpy(token, &t, sizeof(t));
+				zeros = literals = 0;
+			}
+			zeros += 8;
+			w += 7;
+			continue;
+		}
+
+		u64 a = 0, b = 0;
+		if (w < numWholeWords) {
+			memcpy(&a, shadow + w * 8, sizeof(a));
+			memcpy(&b, live + w * 8, sizeof(b));
+			memcpy(shadow + w * 8, &b, sizeof(b));
+		}
+		else {
+			memcpy(&a, shadow + w * 8, tail);
+			memcpy(&b, live + w * 8, tail);
+			memcpy(shadow + w * 8, &b, tail);
+		}
+		u64 x = a ^ b;
+
+		if (x == 0) {
+			if (literals > 0) {
+				u32 t = zeros | (literals << 16);
+				memcpy(token, &t, sizeof(t));
+				zeros = literals = 0;
+			}
+			++zeros;
+		}
+		else {
+			if (literals == 0) {
+				token = p;
+				p += sizeof(u32);
+				++numTokens;
+			}
+			memcpy(p, &x, sizeof(x));
+			p += sizeof(x);
+			++literals;
+		}
+	}
+	if (literals > 0) {
+		u32 t = zeros | (literals << 16);
+		memcpy(token, &t, sizeof(t));
+	}
+
+	SceneHistoryDelta delta{ chunk, (u16)size, (u16)numTokens };
+	memcpy(out, &delta, sizeof(delta));
+
+	u32 written = (u32)(p - out);
+	memset(p, 0, _align(written, 8) - written);
+	return (u32)_align(written, 8);
+}
+
+
+/**
+ * Hashes the chunks of one unit that are in use this tick into tickHashes. When the job takes
+ * deltas, the chunks whose hash changed are encoded into the unit's room right away, while they
+ * are still in cache, and their shadow and hash brought up to date.
+ */
+static void hashSceneHistoryUnit(
+	void* jobData,
+	u32 unit,
+	MemoryArena& frameScoped)
+{
+	SceneHistoryHashJob& job = *(SceneHistoryHashJob*)jobData;
+	SceneHistory& history = *job.history;
+
+	u32 end = min((unit + 1) * SceneHistoryChunksPerUnit, history.numChunks);
+	SceneHistoryUnitDeltas out{ 0, 0, end, 0, 0 };
+	u8* room = (job.deltas ? job.deltas + (size_t)unit * SceneHistoryUnitDeltaSize : nullptr);
+
+	for (u32 c = unit * SceneHistoryChunksPerUnit; c < end; ++c) {
+		u32 r = history.chunkRegions[c];
+		const SceneHistoryRegion& region = history.regions[r];
+
+		u32 offset = (c - region.firstChunk) * SceneHistoryChunkSize;
+		if (offset >= job.regionUsed[r]) {
+			continue;
+		}
+		u32 size = min(SceneHistoryChunkSize, job.regionUsed[r] - offset);
+		u64 hash = hashHistoryChunk(region.live + offset, size);
+		history.tickHashes[c] = hash;
+
+		if (room && hash != history.chunkHashes[c] && out.firstPending == end) {
+			if (out.size + SceneHistoryMaxDeltaSize <= SceneHistoryUnitDeltaSize) {
+				out.size += encodeHistoryDelta(room + out.size, c,
+									region.shadow + offset, region.live + offset, size);
+				history.chunkHashes[c] = hash;
+				++out.numChunks;
+				out.changedBlocks |= 1 << region.block;
+			}
+			else {
+				out.firstPending = c;
+			}
+		}
+	}
+
+	if (job.units) {
+		job.units[unit] = out;
+	}
+}
+
+
+/**
+ * XORs a chunk delta into the shadow, which takes the chunk to the other side of the delta.
+ * @returns bytes read
+ */
+static u32 applyHistoryDelta(
+	SceneHistory& history,
+	const u8* in)
+{
+	SceneHistoryDelta delta;
+	memcpy(&delta, in, sizeof(delta));
+
+	const SceneHistoryRegion& region = history.regions[history.chunkRegions[delta.chunk]];
+	u8* shadow = region.shadow + (delta.chunk - region.firstChunk) * SceneHistoryChunkSize;
+
+	const u8* p = in + sizeof(SceneHistoryDelta);
+	u32 w = 0;
+	for (u32 t = 0; t < delta.numTokens; ++t) {
+		u32 token;
+		memcpy(&token, p, sizeof(token));
+		p += sizeof(token);
+
+		w += token & 0xFFFF;
+		for (u32 l = 0; l < (token >> 16); ++l, ++w) {
+			u64 x;
+			memcpy(&x, p, sizeof(x));
+			p += sizeof(x);
+
+			u32 n = min(8U, delta.size - w * 8);
+			u64 a = 0;
+			memcpy(&a, shadow + w * 8, n);
+			a ^= x;
+			memcpy(shadow + w * 8, &a, n);
+		}
+	}
+	return (u32)_align(p - in, 8);
+}
+
+
+static void dropOldestHistoryTick(
+	SceneHistory& history)
+{
+	assert(history.numTicks > 0);
+	history.bufferUsed -= history.ticks[history.firstTick].deltaSize;
+	history.firstTick = (history.firstTick + 1) % SCENE_HISTORY_MAX_TICKS;
+	--history.numTicks;
+}
+
+
+/**
+ * Drops the oldest ticks until size bytes are free after bufferHead.
+ * @returns false if the tick being recorded takes the whole buffer
+ */
+static bool makeHistoryRoom(
+	SceneHistory& history,
+	u32 size)
+{
+	while (history.bufferSize - history.bufferUsed < size) {
+		if (history.numTicks == 0) {
+			return false;
+		}
+		dropOldestHistoryTick(history);
+	}
+	return true;
+}
+
+
+/**
+ * Makes room for a chunk delta of up to size bytes in one piece at bufferHead, wrapping to the
+ * start of the buffer when it doesn't fit at the end.
+ */
+static bool reserveHistoryDelta(
+	SceneHistory& history,
+	SceneHistoryTick& tick,
+	u32 size)
+{
+	if (history.bufferHead + size > history.bufferSize) {
+		u32 skipped = history.bufferSize - history.bufferHead;
+		if (!makeHistoryRoom(history, skipped)) {
+			return false;
+		}
+		// a head right at the end has no room for the marker, the reader wraps there anyway
+		if (skipped > 0) {
+			SceneHistoryDelta wrap{ SceneHistoryWrapChunk, 0, 0 };
+			memcpy(history.buffer + history.bufferHead, &wrap, sizeof(wrap));
+		}
+
+		history.bufferUsed += skipped;
+		tick.deltaSize += skipped;
+		history.bufferHead = 0;
+	}
+	return makeHistoryRoom(history, size);
+}
+
+
+/**
+ * Makes room for size bytes of the tick's deltas. When this tick's changes alone don't fit in the
+ * buffer, its deltas written so far are dropped and it keeps none.
+ * @returns false once the tick doesn't keep its deltas
+ */
+static bool reserveTickDeltas(
+	SceneHistory& history,
+	SceneHistoryTick& tick,
+	u32 size,
+	bool& keepDeltas)
+{
+	if (keepDeltas && !reserveHistoryDelta(history, tick, size)) {
+		logger::warn("scene history dropped every earlier tick, the changes of tick %llu fill "
+					 "the buffer, consider raising SCENE_HISTORY_BUFFER_MEGABYTES", (unsigned long long)tick.tick);
+		history.bufferHead = tick.deltaOffset;
+		history.bufferUsed -= tick.deltaSize;
+		tick.deltaSize = 0;
+		keepDeltas = false;
+	}
+	return keepDeltas;
+}
+
+
+/**
+ * Appends the tick to the tick records, dropping the oldest tick when they are full.
+ */
+static void pushHistoryTick(
+	SceneHistory& history,
+	const SceneHistoryTick& tick)
+{
+	if (history.numTicks == SCENE_HISTORY_MAX_TICKS) {
+		dropOldestHistoryTick(history);
+	}
+	history.ticks[(history.firstTick + history.numTicks) % SCENE_HISTORY_MAX_TICKS] = tick;
+	++history.numTicks;
+}
+
+
+SceneHistory* makeSceneHistory(
+	Scene& scene,
+	MemoryArena& arena)
+{
+	SceneHistory& history = *allocType(arena, SceneHistory);
+	history = {};
+
+	// a region per section of each block at its full capacity
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		SceneSnapshotBlock block{};
+		SceneSnapshotSection sections[SceneSnapshotMaxSections];
+		scene_getSnapshotSections(scene, b, 0, 0, block, sections);
+		u32 numSections = scene_getSnapshotSections(scene, b, block.capacity, block.capacity, block, sections);
+
+		for (u32 s = 0; s < numSections; ++s) {
+			assert(sections[s].size < UINT_MAX);
+			SceneHistoryRegion& region = history.regions[history.numRegions++];
+			region.live = (u8*)sections[s].data;
+			region.capacity = (u32)sections[s].size;
+			region.firstChunk = history.numChunks;
+			region.block = (u8)b;
+			region.shadow = allocBuffer(arena, region.capacity, 64);
+			memcpy(region.shadow, region.live, region.capacity);
+
+			history.numChunks += (region.capacity + SceneHistoryChunkSize - 1) / SceneHistoryChunkSize;
+		}
+	}
+
+	history.chunkHashes = allocArrayOfType(arena, u64, history.numChunks);
+	history.tickHashes = allocArrayOfType(arena, u64, history.numChunks);
+	history.chunkRegions = allocArrayOfType(arena, u8, history.numChunks);
+	for (u32 r = 0; r < history.numRegions; ++r) {
+		const SceneHistoryRegion& region = history.regions[r];
+		u32 numRegionChunks = (region.capacity + SceneHistoryChunkSize - 1) / SceneHistoryChunkSize;
+		memset(history.chunkRegions + region.firstChunk, r, numRegionChunks);
+	}
+
+	history.bufferSize = megabytes(SCENE_HISTORY_BUFFER_MEGABYTES);
+	history.buffer = allocBuffer(arena, history.bufferSize, 64);
+
+	// the first tick is the shadow as copied, with nothing to rewind
+	SceneHistoryTick tick{};
+	u32 regionUsed[countof(history.regions)];
+	getSceneHistoryLengths(scene, tick, regionUsed);
+
+	SceneHistoryHashJob job{ &history, regionUsed, nullptr, nullptr };
+	u32 numUnits = (history.numChunks + SceneHistoryChunksPerUnit - 1) / SceneHistoryChunksPerUnit;
+	for (u32 u = 0; u < numUnits; ++u) {
+		hashSceneHistoryUnit(&job, u, arena);
+	}
+	getSceneHistoryChecksums(history, tick, regionUsed);
+
+	for (u32 c = 0; c < history.numChunks; ++c) {
+		history.chunkHashes[c] = SceneHistoryStaleHash;
+	}
+	for (u32 r = 0; r < history.numRegions; ++r) {
+		u32 numUsed = (regionUsed[r] + SceneHistoryChunkSize - 1) / SceneHistoryChunkSize;
+		u32 first = history.regions[r].firstChunk;
+		memcpy(history.chunkHashes + first, history.tickHashes + first, numUsed * sizeof(u64));
+	}
+
+	tick.tick = history.nextTick++;
+	pushHistoryTick(history, tick);
+
+	scene.history = &history;
+	return &history;
+}
+
+
+void recordSceneHistory(
+	Scene& scene,
+	WorkerPool& workers,
+	MemoryArena& frameScoped)
+{
+	assert(scene.history);
+	SceneHistory& history = *scene.history;
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(frameScoped);
+
+	SceneHistoryTick tick{};
+	tick.tick = history.nextTick++;
+
+	u32 regionUsed[countof(history.regions)];
+	getSceneHistoryLengths(scene, tick, regionUsed);
+
+	// changed chunks are encoded by the units that hash them, into room of their own
+	u32 numUnits = (history.numChunks + SceneHistoryChunksPerUnit - 1) / SceneHistoryChunksPerUnit;
+	SceneHistoryHashJob job{ &history, regionUsed, nullptr, nullptr };
+	job.deltas = allocBuffer(frameScoped, numUnits * SceneHistoryUnitDeltaSize, 64);
+	job.units = allocArrayOfType(frameScoped, SceneHistoryUnitDeltas, numUnits);
+	runParallel(workers, hashSceneHistoryUnit, &job, numUnits, frameScoped);
+
+	getSceneHistoryChecksums(history, tick, regionUsed);
+
+	const SceneHistoryTick& prev = *getSceneHistoryTick(history, 0);
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		if (tick.lengths[b] != prev.lengths[b]
+			|| tick.freeListFronts[b] != prev.freeListFronts[b]
+			|| tick.highWaters[b] != prev.highWaters[b])
+		{
+			tick.changedBlocks |= 1 << b;
+		}
+	}
+
+	// the deltas go to the buffer, unless this tick's changes alone don't fit in it. The shadow is
+	// already up to date for those the units encoded, a unit's deltas are copied as one piece.
+	if (history.bufferHead == history.bufferSize) {
+		history.bufferHead = 0;
+	}
+	tick.deltaOffset = history.bufferHead;
+	bool keepDeltas = true;
+
+	for (u32 u = 0; u < numUnits; ++u) {
+		const SceneHistoryUnitDeltas& unit = job.units[u];
+		tick.changedBlocks |= unit.changedBlocks;
+		tick.numChangedChunks += unit.numChunks;
+
+		if (unit.size > 0 && reserveTickDeltas(history, tick, unit.size, keepDeltas)) {
+			memcpy(history.buffer + history.bufferHead, job.deltas + (size_t)u * SceneHistoryUnitDeltaSize, unit.size);
+			history.bufferHead += unit.size;
+			history.bufferUsed += unit.size;
+			tick.deltaSize += unit.size;
+		}
+
+		// the changed chunks that didn't fit in the unit's room
+		u32 end = min((u + 1) * SceneHistoryChunksPerUnit, history.numChunks);
+		for (u32 c = unit.firstPending; c < end; ++c) {
+			u32 r = history.chunkRegions[c];
+			const SceneHistoryRegion& region = history.regions[r];
+
+			u32 offset = (c - region.firstChunk) * SceneHistoryChunkSize;
+			if (offset >= regionUsed[r] || history.tickHashes[c] == history.chunkHashes[c]) {
+				continue;
+			}
+			history.chunkHashes[c] = history.tickHashes[c];
+			tick.changedBlocks |= 1 << region.block;
+			++tick.numChangedChunks;
+
+			u32 size = min(SceneHistoryChunkSize, regionUsed[r] - offset);
+			if (reserveTickDeltas(history, tick, SceneHistoryMaxDeltaSize, keepDeltas)) {
+				u32 written = encodeHistoryDelta(history.buffer + history.bufferHead, c,
+									region.shadow + offset, region.live + offset, size);
+				history.bufferHead += written;
+				history.bufferUsed += written;
+				tick.deltaSize += written;
+			}
+			else {
+				memcpy(region.shadow + offset, region.live + offset, size);
+			}
+		}
+	}
+
+	if (!keepDeltas) {
+		// nothing before this tick can be rewound to
+		tick.numChangedChunks = 0;
+	}
+	pushHistoryTick(history, tick);
+}
+
+
+const SceneHistoryTick* getSceneHistoryTick(
+	const SceneHistory& history,
+	u32 ticksBack)
+{
+	if (ticksBack >= history.numTicks) {
+		return nullptr;
+	}
+	u32 t = (history.firstTick + history.numTicks - 1 - ticksBack) % SCENE_HISTORY_MAX_TICKS;
+	return &history.ticks[t];
+}
+
+
+bool rewindSceneHistory(
+	Scene& scene,
+	u32 ticksBack)
+{
+	assert(scene.history);
+	SceneHistory& history = *scene.history;
+
+	if (ticksBack >= history.numTicks) {
+		return false;
+	}
+
+	// take the shadow back one tick at a time
+	for (u32 t = 0; t < ticksBack; ++t) {
+		const SceneHistoryTick& tick = *getSceneHistoryTick(history, 0);
+
+		u32 at = tick.deltaOffset;
+		for (u32 d = 0; d < tick.numChangedChunks; ++d) {
+			u32 chunk = SceneHistoryWrapChunk;
+			if (at < history.bufferSize) {
+				memcpy(&chunk, history.buffer + at, sizeof(chunk));
+			}
+			if (chunk == SceneHistoryWrapChunk) {
+				at = 0;
+			}
+			at += applyHistoryDelta(history, history.buffer + at);
+		}
+
+		history.bufferHead = tick.deltaOffset;
+		history.bufferUsed -= tick.deltaSize;
+		--history.numTicks;
+	}
+
+	const SceneHistoryTick& target = *getSceneHistoryTick(history, 0);
+	history.nextTick = target.tick + 1;
+
+	// copy the sections in use at the target tick back into the scene
+	u32 r = 0;
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		SceneSnapshotBlock block{};
+		SceneSnapshotSection sections[SceneSnapshotMaxSections];
+		u32 numSections = scene_getSnapshotSections(scene, b, target.lengths[b], target.highWaters[b], block, sections);
+		for (u32 s = 0; s < numSections; ++s, ++r) {
+			memcpy(sections[s].data, history.regions[r].shadow, sections[s].size);
+		}
+		scene_setSnapshotStoreLength(scene, b, target.lengths[b], target.freeListFronts[b], target.highWaters[b]);
+	}
+	scene_finishSnapshotRestore(scene);
+
+	// the rewound chunks no longer match their hashes, the next tick takes a delta of every chunk
+	for (u32 c = 0; c < history.numChunks; ++c) {
+		history.chunkHashes[c] = SceneHistoryStaleHash;
+	}
+
+	return true;
+}
+
+
+bool saveSceneHistoryChecksums(
+	const SceneHistory& history,
+	const char* filename)
+{
+	FILE* file = nullptr;
+	_fopen_s(&file, filename, "wb");
+	if (!file) {
+		logger::error("failed to open scene history checksums %s for writing", filename);
+		return false;
+	}
+
+	SceneHistoryChecksumsHeader header{};
+	header.HIST = SCENE_HISTORY_CODE;
+	header.version = SCENE_HISTORY_VERSION;
+	header.numBlocks = _SceneSnapshotBlockTypeCount;
+	header.numTicks = history.numTicks;
+	fwrite(&header, sizeof(header), 1, file);
+
+	for (u32 t = history.numTicks; t > 0; --t) {
+		const SceneHistoryTick& tick = *getSceneHistoryTick(history, t - 1);
+		fwrite(&tick.tick, sizeof(tick.tick), 1, file);
+		fwrite(tick.checksums, sizeof(tick.checksums), 1, file);
+	}
+
+	bool result = (ferror(file) == 0);
+	fclose(file);
+
+	if (!result) {
+		logger::error("failed to write scene history checksums %s", filename);
+	}
+	return result;
+}
+
+
+bool findSceneHistoryDivergence(
+	const SceneHistory& history,
+	const char* filename,
+	u64& outTick,
+	u32& outBlocks)
+{
+	PlatformMappedFile mappedFile = platformApi().mapFile(filename);
+	if (!mappedFile.data) {
+		logger::error("failed to open scene history checksums %s", filename);
+		return false;
+	}
+
+	const u64 tickSize = sizeof(u64) * (1 + _SceneSnapshotBlockTypeCount);
+	const SceneHistoryChecksumsHeader& header = *(const SceneHistoryChecksumsHeader*)mappedFile.data;
+
+	if (mappedFile.size < sizeof(header)
+		|| header.HIST != SCENE_HISTORY_CODE
+		|| header.version != SCENE_HISTORY_VERSION
+		|| header.numBlocks != _SceneSnapshotBlockTypeCount
+		|| sizeof(header) + header.numTicks * tickSize > mappedFile.size)
+	{
+		logger::error("scene history checksums %s don't match the scene layout", filename);
+		platformApi().unmapFile(mappedFile);
+		return false;
+	}
+
+	// both lists are in tick order, walk them together
+	const u8* saved = (const u8*)mappedFile.data + sizeof(header);
+	u32 s = 0;
+	u32 t = history.numTicks;
+	bool diverged = false;
+
+	while (s < header.numTicks && t > 0) {
+		u64 savedTick;
+		memcpy(&savedTick, saved + s * tickSize, sizeof(u64));
+		const SceneHistoryTick& tick = *getSceneHistoryTick(history, t - 1);
+
+		if (savedTick < tick.tick) {
+			++s;
+		}
+		else if (tick.tick < savedTick) {
+			--t;
+		}
+		else {
+			u64 checksums[_SceneSnapshotBlockTypeCount];
+			memcpy(checksums, saved + s * tickSize + sizeof(u64), sizeof(checksums));
+
+			u32 blocks = 0;
+			for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+				if (checksums[b] != tick.checksums[b]) {
+					blocks |= 1 << b;
+				}
+			}
+			if (blocks != 0) {
+				outTick = tick.tick;
+				outBlocks = blocks;
+				diverged = true;
+				break;
+			}
+			++s;
+			--t;
+		}
+	}
+
+	platformApi().unmapFile(mappedFile);
+	return diverged;
+}
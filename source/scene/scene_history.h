@@ -0,0 +1,137 @@
+#ifndef _SCENE_HISTORY_H
+#define _SCENE_HISTORY_H
+
+#include "../utility/common.h"
+#include "../utility/memory.h"
+#include "../utility/worker_pool.h"
+#include "scene_snapshot.h"
+
+/**
+ * The scene history checksums each store of the scene every update tick and keeps the changes
+ * between ticks, to find the tick where two runs diverged and to rewind the scene a number of
+ * ticks. It covers the same memory as a scene snapshot, block by block.
+ *
+ * Each block section is split into chunks of SceneHistoryChunkSize bytes that are hashed on the
+ * worker threads, over the part of the section in use. A block's checksum folds the hashes of its
+ * chunks with its length. The history keeps a shadow copy of every section as of the newest tick,
+ * and the chunks whose hash changed are XORed against the shadow and run-length encoded by the
+ * worker that hashed them, while they are in cache, then copied into the shadow. The calling
+ * thread appends each worker's deltas to a ring buffer. XORing the same delta into the shadow
+ * again takes it back to the tick before, so rewinding walks the ticks back from the newest one
+ * and copies the shadow into the scene like a snapshot load. The oldest ticks are dropped when
+ * the ring buffer or the tick records are full.
+ *
+ * Scene nodes also hold state written by the render frames in between ticks, so checksums only
+ * repeat across runs with the same frame timing, as under record / playback.
+ */
+
+const u32 SceneHistoryChunkSize = 4096;
+
+
+struct SceneHistoryTick {
+	u64		tick;
+	u64		checksums[_SceneSnapshotBlockTypeCount];
+	u32		lengths[_SceneSnapshotBlockTypeCount];
+	u16		freeListFronts[_SceneSnapshotBlockTypeCount];
+	u16		highWaters[_SceneSnapshotBlockTypeCount];
+	u16		changedBlocks;		// one bit per block type with chunks changed since the tick before
+	u32		deltaOffset;		// of the tick's first chunk delta in the ring buffer
+	u32		deltaSize;			// bytes of the ring buffer taken, with the end skipped on wrapping
+	u32		numChangedChunks;
+};
+
+
+/**
+ * A section of the scene and its shadow copy, the capacity is the size of the section when its
+ * block is full.
+ */
+struct SceneHistoryRegion {
+	u8*		live;
+	u8*		shadow;
+	u32		capacity;
+	u32		firstChunk;			// index of the region's first chunk in chunkHashes
+	u8		block;				// SceneSnapshotBlockType
+	u8		_padding[7];
+};
+
+
+struct SceneHistory {
+	SceneHistoryRegion	regions[_SceneSnapshotBlockTypeCount * SceneSnapshotMaxSections];
+	u32					numRegions;
+	u32					numChunks;
+	u64*				chunkHashes;		// of each chunk of the shadow as of the newest tick
+	u64*				tickHashes;			// scratch for the tick being recorded
+	u8*					chunkRegions;		// region of each chunk
+
+	u8*					buffer;				// ring buffer of chunk deltas
+	u32					bufferSize;
+	u32					bufferHead;			// where the next chunk delta is written
+	u32					bufferUsed;
+
+	u32					firstTick;			// oldest of the ticks kept, index into ticks
+	u32					numTicks;
+	u64					nextTick;
+	SceneHistoryTick	ticks[SCENE_HISTORY_MAX_TICKS];
+};
+
+
+/**
+ * Allocates the history with shadow copies of the scene's sections, and records the current state
+ * as its first tick.
+ */
+SceneHistory* makeSceneHistory(
+	Scene& scene,
+	MemoryArena& arena);
+
+
+/**
+ * Checksums the scene's stores and appends the changes since the last tick, call at the end of
+ * each update tick.
+ */
+void recordSceneHistory(
+	Scene& scene,
+	WorkerPool& workers,
+	MemoryArena& frameScoped);
+
+
+/**
+ * @param ticksBack	number of ticks back from the newest, 0 for the newest
+ * @returns the tick's record, or nullptr if it isn't kept anymore
+ */
+const SceneHistoryTick* getSceneHistoryTick(
+	const SceneHistory& history,
+	u32 ticksBack);
+
+
+/**
+ * Restores the scene to its state ticksBack ticks ago and drops the ticks after it from the
+ * history, the derived state is rebuilt as after scene_loadSnapshot.
+ * @returns false if the history doesn't go that far back
+ */
+bool rewindSceneHistory(
+	Scene& scene,
+	u32 ticksBack);
+
+
+/**
+ * Writes the tick number and checksums of every tick kept, for a later run to compare against.
+ */
+bool saveSceneHistoryChecksums(
+	const SceneHistory& history,
+	const char* filename);
+
+
+/**
+ * Compares the ticks kept against the checksums saved by another run, for the ticks both have.
+ * @param outTick	the first tick where any checksum differs
+ * @param outBlocks	one bit per block type that differs at outTick
+ * @returns true if the runs diverged, false if they match or the file can't be read
+ */
+bool findSceneHistoryDivergence(
+	const SceneHistory& history,
+	const char* filename,
+	u64& outTick,
+	u32& outBlocks);
+
+
+#endif
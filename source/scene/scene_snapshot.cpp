@@ -0,0 +1,341 @@
+#include "scene_snapshot.h"
+#include "../platform/platform_api.h"
+
+#define SCENE_SNAPSHOT_CODE		(((u32)'S' << 0) | ((u32)'N' << 8) | ((u32)'A' << 16) | ((u32)'P' << 24))
+#define SCENE_SNAPSHOT_VERSION	3
+
+
+const u64 SceneSnapshotAlignment = 64;
+
+
+static u64 alignSnapshotOffset(u64 offset)
+{
+	return (offset + SceneSnapshotAlignment - 1) & ~(SceneSnapshotAlignment - 1);
+}
+
+
+DenseHandleMap16* scene_getSnapshotStore(
+	Scene& scene,
+	u32 type)
+{
+	switch (type) {
+		case SceneSnapshot_Entities:		return &scene.entities._map;
+		case SceneSnapshot_SceneNodes:		return &scene.components.sceneNodes._map;
+		case SceneSnapshot_Movement:		return &scene.components.movement._map;
+		case SceneSnapshot_CameraInstances:	return &scene.components.cameraInstances._map;
+		case SceneSnapshot_ModelInstances:	return &scene.components.modelInstances._map;
+		case SceneSnapshot_LightInstances:	return &scene.components.lightInstances._map;
+		case SceneSnapshot_SpatialInfo:		return &scene.components.spatialInfo._map;
+		case SceneSnapshot_Occluders:		return &scene.components.occluders._map;
+		default:							return nullptr;
+	}
+}
+
+
+u32 scene_getSnapshotLength(
+	Scene& scene,
+	u32 type)
+{
+	switch (type) {
+		case SceneSnapshot_Scene:			return 1;
+		case SceneSnapshot_ComponentSets:	return scene.componentSets.used;
+		case SceneSnapshot_Spatial:			return scene.spatial.numChunks + 1; // chunk 0 is the null chunk
+		default:							return scene_getSnapshotStore(scene, type)->length;
+	}
+}
+
+
+u32 scene_getSnapshotSections(
+	Scene& scene,
+	u32 type,
+	u32 length,
+	u32 highWater,
+	SceneSnapshotBlock& outBlock,
+	SceneSnapshotSection* outSections)
+{
+	u32 numSections = 0;
+	outBlock.type = type;
+
+	switch (type) {
+		case SceneSnapshot_Scene: {
+			outBlock.elementSize = sizeof(SceneNode);
+			outBlock.capacity = 1;
+			outSections[numSections++] = { &scene.root, sizeof(SceneNode) };
+			outSections[numSections++] = { scene.activeMovements, sizeof(scene.activeMovements) };
+			outSections[numSections++] = {
+				scene.activeCameras,
+				(size_t)((u8*)(&scene.numActiveCameras + 1) - (u8*)scene.activeCameras)
+			};
+			break;
+		}
+		case SceneSnapshot_ComponentSets: {
+			// the pool and its free lists, the queries are not part of the snapshot
+			ComponentSetStorage& storage = scene.componentSets;
+			outBlock.elementSize = sizeof(ComponentId);
+			outBlock.capacity = ENTITY_COMPONENT_POOL_CAPACITY;
+			outSections[numSections++] = { storage.ids, length * sizeof(ComponentId) };
+			outSections[numSections++] = {
+				&storage.used,
+				offsetof(ComponentSetStorage, numQueries) - offsetof(ComponentSetStorage, used)
+			};
+			break;
+		}
+		case SceneSnapshot_Spatial: {
+			// everything up to the chunk pool, then the chunks taken from it
+			outBlock.elementSize = sizeof(SpatialChunk);
+			outBlock.capacity = SPATIAL_CHUNKS_CAPACITY;
+			outSections[numSections++] = { &scene.spatial, offsetof(SpatialPersistentStorage, chunks) };
+			outSections[numSections++] = { scene.spatial.chunks, length * sizeof(SpatialChunk) };
+			break;
+		}
+		default: {
+			DenseHandleMap16& map = *scene_getSnapshotStore(scene, type);
+			outBlock.elementSize = map.elementSizeB;
+			outBlock.capacity = map.capacity;
+			// the sparse array holds the embedded freelist, above the high water mark it's as
+			// reset left it
+			outSections[numSections++] = { map.items, length * map.elementSizeB };
+			outSections[numSections++] = { map.sparseIds, highWater * sizeof(h32) };
+			outSections[numSections++] = { map.denseToSparse, length * sizeof(u16) };
+		}
+	}
+	assert(numSections <= SceneSnapshotMaxSections);
+
+	u64 size = 0;
+	for (u32 s = 0; s < numSections; ++s) {
+		size = alignSnapshotOffset(size) + outSections[s].size;
+	}
+	outBlock.size = size;
+
+	return numSections;
+}
+
+
+bool scene_saveSnapshot(
+	Scene& scene,
+	const char* filename)
+{
+	SceneSnapshot header{};
+	header.SNAP = SCENE_SNAPSHOT_CODE;
+	header.version = SCENE_SNAPSHOT_VERSION;
+	header.numBlocks = _SceneSnapshotBlockTypeCount;
+	header.blocksOffset = sizeof(SceneSnapshot);
+
+	SceneSnapshotBlock blocks[_SceneSnapshotBlockTypeCount] = {};
+	SceneSnapshotSection sections[_SceneSnapshotBlockTypeCount][SceneSnapshotMaxSections] = {};
+	u32 numSections[_SceneSnapshotBlockTypeCount] = {};
+
+	u64 offset = alignSnapshotOffset(header.blocksOffset + sizeof(blocks));
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		SceneSnapshotBlock& block = blocks[b];
+		block.length = scene_getSnapshotLength(scene, b);
+
+		DenseHandleMap16* map = scene_getSnapshotStore(scene, b);
+		if (map) {
+			block.freeListFront = map->freeListFront;
+			block.highWater = map->highWater;
+		}
+		numSections[b] = scene_getSnapshotSections(scene, b, block.length, block.highWater, block, sections[b]);
+		block.offset = offset;
+		offset = alignSnapshotOffset(offset + block.size);
+	}
+	header.totalSize = offset;
+
+	FILE* file = nullptr;
+	_fopen_s(&file, filename, "wb");
+	if (!file) {
+		logger::error("failed to open scene snapshot %s for writing", filename);
+		return false;
+	}
+
+	static const u8 zeros[SceneSnapshotAlignment] = {};
+	u64 written = 0;
+	auto writeAt = [&](u64 at, const void* data, size_t size) {
+		fwrite(zeros, 1, (size_t)(at - written), file);
+		fwrite(data, 1, size, file);
+		written = at + size;
+	};
+
+	writeAt(0, &header, sizeof(header));
+	writeAt(header.blocksOffset, blocks, sizeof(blocks));
+
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		u64 at = blocks[b].offset;
+		for (u32 s = 0; s < numSections[b]; ++s) {
+			at = alignSnapshotOffset(at);
+			writeAt(at, sections[b][s].data, sections[b][s].size);
+			at += sections[b][s].size;
+		}
+	}
+	fwrite(zeros, 1, (size_t)(header.totalSize - written), file);
+
+	bool result = (ferror(file) == 0);
+	fclose(file);
+
+	if (!result) {
+		logger::error("failed to write scene snapshot %s", filename);
+	}
+	return result;
+}
+
+
+/**
+ * Checks every block of the snapshot against the scene before any of them is loaded.
+ */
+static bool validateSceneSnapshot(
+	Scene& scene,
+	const u8* data,
+	u64 dataSize)
+{
+	if (dataSize < sizeof(SceneSnapshot)) {
+		return false;
+	}
+	const SceneSnapshot& header = *(const SceneSnapshot*)data;
+	if (header.SNAP != SCENE_SNAPSHOT_CODE
+		|| header.version != SCENE_SNAPSHOT_VERSION
+		|| header.numBlocks != _SceneSnapshotBlockTypeCount
+		|| header.totalSize > dataSize
+		|| header.blocksOffset + (u64)header.numBlocks * sizeof(SceneSnapshotBlock) > header.totalSize)
+	{
+		return false;
+	}
+
+	const SceneSnapshotBlock* blocks = (const SceneSnapshotBlock*)(data + header.blocksOffset);
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		const SceneSnapshotBlock& block = blocks[b];
+
+		SceneSnapshotBlock expected{};
+		SceneSnapshotSection sections[SceneSnapshotMaxSections];
+		scene_getSnapshotSections(scene, b, block.length, block.highWater, expected, sections);
+
+		if (block.type != expected.type
+			|| block.elementSize != expected.elementSize
+			|| block.capacity != expected.capacity
+			|| block.length > block.capacity
+			|| block.highWater > block.capacity
+			|| (block.type == SceneSnapshot_Scene && block.length != 1)
+			|| block.size != expected.size
+			|| block.offset != alignSnapshotOffset(block.offset)
+			|| block.offset > header.totalSize
+			|| block.size > header.totalSize - block.offset)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+bool scene_loadSnapshot(
+	Scene& scene,
+	const char* filename)
+{
+	PlatformMappedFile mappedFile = platformApi().mapFile(filename);
+	if (!mappedFile.data) {
+		logger::error("failed to open scene snapshot %s", filename);
+		return false;
+	}
+
+	const u8* data = (const u8*)mappedFile.data;
+	if (!validateSceneSnapshot(scene, data, mappedFile.size)) {
+		logger::error("scene snapshot %s doesn't match the scene layout", filename);
+		platformApi().unmapFile(mappedFile);
+		return false;
+	}
+
+	const SceneSnapshot& header = *(const SceneSnapshot*)data;
+	const SceneSnapshotBlock* blocks = (const SceneSnapshotBlock*)(data + header.blocksOffset);
+
+	// copy each block into place
+	for (u32 b = 0; b < _SceneSnapshotBlockTypeCount; ++b) {
+		const SceneSnapshotBlock& block = blocks[b];
+
+		SceneSnapshotBlock layout{};
+		SceneSnapshotSection sections[SceneSnapshotMaxSections];
+		u32 numSections = scene_getSnapshotSections(scene, b, block.length, block.highWater, layout, sections);
+
+		u64 at = block.offset;
+		for (u32 s = 0; s < numSections; ++s) {
+			at = alignSnapshotOffset(at);
+			memcpy(sections[s].data, data + at, sections[s].size);
+			at += sections[s].size;
+		}
+
+		scene_setSnapshotStoreLength(scene, b, block.length, block.freeListFront, block.highWater);
+	}
+
+	platformApi().unmapFile(mappedFile);
+
+	scene_finishSnapshotRestore(scene);
+
+	return true;
+}
+
+
+void scene_setSnapshotStoreLength(
+	Scene& scene,
+	u32 type,
+	u32 length,
+	u32 freeListFront,
+	u32 highWater)
+{
+	DenseHandleMap16* map = scene_getSnapshotStore(scene, type);
+	if (map) {
+		map->setHighWater((u16)highWater);
+		map->length = (u16)length;
+		map->freeListFront = (u16)freeListFront;
+		map->_fragmented = 1;
+	}
+}
+
+
+void scene_finishSnapshotRestore(
+	Scene& scene)
+{
+	// refill the registered queries from the loaded component sets
+	ComponentSetStorage& storage = scene.componentSets;
+	for (u32 q = 0; q < storage.numQueries; ++q) {
+		ComponentQuery& query = *storage.queries[q];
+		for (u32 r = 0; r < query.length; ++r) {
+			query.rows[query.entityIds[r].index] = 0;
+		}
+		query.length = 0;
+	}
+	if (storage.numQueries > 0) {
+		for (u32 e = 0; e < scene.entities.length(); ++e) {
+			Entity& entity = scene.entities.item((u16)e);
+			for (u32 q = 0; q < storage.numQueries; ++q) {
+				ComponentQuery& query = *storage.queries[q];
+				const ComponentSet& set = entity_getComponentSet(entity, (ComponentSetType)query.setType);
+				if (set.entityId != null_h32) {
+					updateComponentQuery(query, set, storage);
+				}
+			}
+		}
+	}
+
+	// the hierarchy is rebuilt by the next updateNodeTransforms, lists of inner indices are stale
+	scene.hierarchy.topologyChanged = 1;
+	scene.hierarchy.numDirtySubtrees = 0;
+	scene.hierarchy.numChanged = 0;
+
+	for (u32 c = 0; c < SCENE_MAX_ACTIVE_CAMERAS; ++c) {
+		if (scene.cullingCaches[c]) {
+			scene.cullingCaches[c]->valid = 0;
+		}
+	}
+	if (scene.broadphase) {
+		memset(scene.broadphase, 0, sizeof(BroadphaseStorage));
+	}
+
+	// occluders are skipped by the occlusion pass until their mesh is registered
+	u32 numUnregistered = 0;
+	for (u32 o = 0; o < scene.components.occluders.length(); ++o) {
+		if (scene.components.occluders.item((u16)o).data.meshIndex >= scene.numOccluderMeshes) {
+			++numUnregistered;
+		}
+	}
+	if (numUnregistered > 0) {
+		logger::warn("%u restored occluders refer to meshes that aren't registered", numUnregistered);
+	}
+}
@@ -0,0 +1,159 @@
+#ifndef _SCENE_SNAPSHOT_H
+#define _SCENE_SNAPSHOT_H
+
+#include "../utility/common.h"
+#include "scene.h"
+
+/**
+ * A scene snapshot is a memory image of the scene's persistent state. Every handle map is written
+ * as its raw inner items, its sparse ids up to the high water mark and its dense-to-sparse
+ * indices, the spatial storage as its hash table, occupancy and slots followed by the chunks in
+ * use, along with the component set pool and the scene root. Sparse ids above the high water
+ * mark are as reset left them, so they are reset again on load instead of being written.
+ * Everything in them refers to other items by handle or index, never by pointer, so the blocks
+ * are relocatable and loading is a copy of each block into place followed by a few fix-ups,
+ * rather than re-inserting entity by entity.
+ *
+ * Snapshots include a 64-byte header, then a table of SceneSnapshotBlock in block type order, then
+ * the block data, each section of which starts on a 64 byte boundary. Snapshots are only loaded
+ * by builds with the same layout, the size and capacity of every block must match the scene. Bump
+ * SCENE_SNAPSHOT_VERSION when any saved struct changes without changing size.
+ *
+ * Derived state isn't saved: the hierarchy is rebuilt and world transforms recomputed by the next
+ * updateNodeTransforms, registered queries are refilled on load, and the culling caches and the
+ * broadphase pairs start over. Occluders reference their mesh by index, the registered meshes
+ * aren't saved and must be registered again in the same order before loading a snapshot from
+ * another run. Game components aren't saved either, only the ids in each entity's game component
+ * set are, so a snapshot from another run leaves them referring to whatever the game's stores
+ * hold. The game's systems must save and restore their own stores alongside the scene.
+ */
+
+
+enum SceneSnapshotBlockType : u32 {
+	SceneSnapshot_Scene = 0,			// root node, active movements and cameras
+	SceneSnapshot_Entities,
+	SceneSnapshot_ComponentSets,
+	SceneSnapshot_SceneNodes,
+	SceneSnapshot_Movement,
+	SceneSnapshot_CameraInstances,
+	SceneSnapshot_ModelInstances,
+	SceneSnapshot_LightInstances,
+	SceneSnapshot_SpatialInfo,
+	SceneSnapshot_Occluders,
+	SceneSnapshot_Spatial,				// SpatialPersistentStorage
+	_SceneSnapshotBlockTypeCount
+};
+
+
+#pragma pack(push, 1)
+
+struct SceneSnapshotBlock {
+	u32		type;				// SceneSnapshotBlockType
+	u32		elementSize;		// size of the items, or of the struct for blocks that aren't a store
+	u32		capacity;			// capacity of the store, or of the pool the items are taken from
+	u32		length;				// items written, the rest of the capacity is left out
+	u32		freeListFront;		// of handle maps
+	u32		highWater;			// of handle maps, the number of sparse ids written
+	u64		offset;				// from the start of the snapshot
+	u64		size;				// of all sections of the block, with the padding between them
+};
+
+
+struct alignas(64) SceneSnapshot {
+	u32		SNAP;				// {'S','N','A','P'}
+	u16		version;
+	u16		numBlocks;
+	u32		blocksOffset;		// offset to the block table
+	u32		_padding0;
+	u64		totalSize;			// of the whole snapshot
+	u8		_padding1[40];
+};
+
+#pragma pack(pop)
+
+static_assert_aligned_size(SceneSnapshot, 64);
+
+
+/**
+ * A contiguous run of scene memory, written as is.
+ */
+struct SceneSnapshotSection {
+	void*	data;
+	size_t	size;
+};
+
+const u32 SceneSnapshotMaxSections = 3;
+
+
+/**
+ * Handle map of the block, or nullptr for blocks that aren't a store.
+ */
+DenseHandleMap16* scene_getSnapshotStore(
+	Scene& scene,
+	u32 type);
+
+
+/**
+ * Number of items of the block the scene holds now.
+ */
+u32 scene_getSnapshotLength(
+	Scene& scene,
+	u32 type);
+
+
+/**
+ * Where the sections of a block with length items are in the scene. Sets the type, elementSize
+ * and capacity of the block to the scene's layout, and its size to the sections laid out in the
+ * snapshot.
+ * @param highWater	sparse ids of a handle map included, ignored by the other blocks
+ * @returns the number of sections
+ */
+u32 scene_getSnapshotSections(
+	Scene& scene,
+	u32 type,
+	u32 length,
+	u32 highWater,
+	SceneSnapshotBlock& outBlock,
+	SceneSnapshotSection* outSections);
+
+
+/**
+ * Sets the length, free list and high water mark of the block's handle map after its sections
+ * were copied into place, does nothing for blocks that aren't a store.
+ */
+void scene_setSnapshotStoreLength(
+	Scene& scene,
+	u32 type,
+	u32 length,
+	u32 freeListFront,
+	u32 highWater);
+
+
+/**
+ * Rebuilds the derived state once every block was copied into place, see above.
+ */
+void scene_finishSnapshotRestore(
+	Scene& scene);
+
+
+/**
+ * Writes the scene's persistent state to a snapshot file.
+ * @returns false if the file couldn't be written
+ */
+bool scene_saveSnapshot(
+	Scene& scene,
+	const char* filename);
+
+
+/**
+ * Restores the scene to the state saved in the snapshot file. The file is mapped and validated
+ * whole before anything is copied, so the scene is left as it was when the snapshot can't be
+ * loaded. Registered queries stay registered and are refilled from the loaded entities.
+ * @returns false if the file is missing or doesn't match the scene's layout
+ */
+bool scene_loadSnapshot(
+	Scene& scene,
+	const char* filename);
+
+
+#endif
@@ -0,0 +1,1101 @@
+#include "spatial_query.h"
+#include "../utility/intrinsics.h"
+#include "../utility/memory.h"
+#include "intersection.h"
+#include <algorithm>
+
+
+// cell boxes up to this many cells are looked up cell by cell, larger ones walk the occupancy
+// hierarchy so the cost is bound by the number of occupied cells instead of the box volume
+const u32 SpatialQueryDirectCells = 64;
+
+
+enum SpatialQueryShapeType : u8 {
+	SpatialQueryShape_Sphere = 0,
+	SpatialQueryShape_AABB,
+	SpatialQueryShape_Frustum
+};
+
+/**
+ * A query translated to be relative to a world space origin, so bucket tests only need the float
+ * offset between the cell origin and the query origin.
+ */
+struct SpatialQueryShape {
+	const FrustumSoA*		frustum;
+	dvec3					origin;
+	dvec3					boundsMin;	// world space bounds of the shape
+	dvec3					boundsMax;
+	vec3					lo;			// sphere center or box min corner, relative to origin
+	vec3					hi;			// box max corner relative to origin
+	r32						radius;
+	SpatialQueryShapeType	type;
+	u8						_padding[3];
+};
+
+
+/**
+ * Matches are appended to an array that doubles in the arena when full. The abandoned arrays are
+ * only freed with the arena, which is meant to be a frame scoped or temporary one.
+ */
+struct SpatialQueryOutput {
+	ComponentId*	ids;
+	u32				length;
+	u32				capacity;
+	MemoryArena*	arena;
+};
+
+
+inline void reserveSpatialQueryOutput(
+	SpatialQueryOutput& out,
+	u32 count)
+{
+	if (out.length + count > out.capacity) {
+		u32 capacity = max(out.capacity * 2, out.length + count);
+		ComponentId* ids = allocArrayOfType(*out.arena, ComponentId, capacity);
+		if (out.length > 0) {
+			memcpy(ids, out.ids, out.length * sizeof(ComponentId));
+		}
+		out.ids = ids;
+		out.capacity = capacity;
+	}
+}
+
+
+/**
+ * Tests the cached bspheres of every entity in the bucket against the shape and appends those
+ * that overlap. Bspheres are relative to cellOrigin, adding offset moves them relative to the
+ * shape's origin.
+ */
+void querySpatialBucket(
+	const SpatialQueryShape& shape,
+	const SpatialBucket& bucket,
+	const dvec3& cellOrigin,
+	const SpatialPersistentStorage& sps,
+	SpatialQueryOutput& out)
+{
+	vec3 offset = make_vec3(cellOrigin - shape.origin);
+
+	// move the shape into the bucket's space instead, so the chunks are tested in place
+	const __m128 lox = _mm_set1_ps(shape.lo.x - offset.x);
+	const __m128 loy = _mm_set1_ps(shape.lo.y - offset.y);
+	const __m128 loz = _mm_set1_ps(shape.lo.z - offset.z);
+	const __m128 hix = _mm_set1_ps(shape.hi.x - offset.x);
+	const __m128 hiy = _mm_set1_ps(shape.hi.y - offset.y);
+	const __m128 hiz = _mm_set1_ps(shape.hi.z - offset.z);
+	const __m128 radius = _mm_set1_ps(shape.radius);
+	const __m128 zero = _mm_setzero_ps();
+
+	FrustumSoA f_local;
+	if (shape.type == SpatialQueryShape_Frustum) {
+		// n*(p + offset) - d = n*p - (d - n*offset), same as cullSpatialBucket
+		f_local = *shape.frustum;
+		for (int p = 0; p < 6; ++p) {
+			f_local.d[p] -= f_local.nx[p] * offset.x
+						  + f_local.ny[p] * offset.y
+						  + f_local.nz[p] * offset.z;
+		}
+	}
+
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		const SpatialChunk& chunk = sps.chunks[c];
+		u32 hits = 0;
+
+		if (shape.type == SpatialQueryShape_Frustum) {
+			alignas(16) u8 objResults[SpatialChunkCapacity];
+			frustumSoA_intersectSpheresSoA(
+				f_local, chunkLength,
+				chunk.x, chunk.y, chunk.z, chunk.r,
+				objResults);
+
+			for (u32 l = 0; l < chunkLength; ++l) {
+				hits |= (objResults[l] != Outside ? 1U : 0U) << l;
+			}
+		}
+		else {
+			for (u32 l = 0; l < SpatialChunkCapacity; l += 4) {
+				__m128 x = _mm_load_ps(chunk.x + l);
+				__m128 y = _mm_load_ps(chunk.y + l);
+				__m128 z = _mm_load_ps(chunk.z + l);
+				__m128 r = _mm_load_ps(chunk.r + l);
+				__m128 dx, dy, dz, rr;
+
+				if (shape.type == SpatialQueryShape_Sphere) {
+					dx = _mm_sub_ps(x, lox);
+					dy = _mm_sub_ps(y, loy);
+					dz = _mm_sub_ps(z, loz);
+					rr = _mm_add_ps(r, radius);
+				}
+				else {
+					// distance from the box to the center along each axis, 0 when inside its slab
+					dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(lox, x), _mm_sub_ps(x, hix)), zero);
+					dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(loy, y), _mm_sub_ps(y, hiy)), zero);
+					dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(loz, z), _mm_sub_ps(z, hiz)), zero);
+					rr = r;
+				}
+				__m128 distSq = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+				hits |= (u32)_mm_movemask_ps(_mm_cmple_ps(distSq, _mm_mul_ps(rr, rr))) << l;
+			}
+			// lanes past the front chunk's length hold stale entries
+			hits &= (1U << chunkLength) - 1;
+		}
+
+		if (hits) {
+			reserveSpatialQueryOutput(out, SpatialChunkCapacity);
+			while (hits) {
+				u32 l = 0;
+				BitScanFwd(&l, hits);
+				hits &= hits - 1;
+				out.ids[out.length++] = chunk.spatialInfoIds[l];
+			}
+		}
+
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+}
+
+
+inline void querySpatialCell(
+	const SpatialQueryShape& shape,
+	u32 level,
+	u32 cellKey,
+	const SpatialPersistentStorage& sps,
+	SpatialQueryOutput& out)
+{
+	const SpatialCellEntry& entry = sps.cells[findSpatialCell(sps, cellKey)];
+	querySpatialBucket(
+		shape, entry.bucket,
+		getSpatialCellOrigin(getSpatialCellFromKey(cellKey, level), level),
+		sps, out);
+}
+
+
+/**
+ * Visits the occupied cells of one grid level whose loose bounds can hold an entity overlapping
+ * the shape. An entity's bsphere center lies in its cell and its radius is at most the half cell
+ * of looseness, so only cells whose center range, grown by that half cell, overlaps the shape's
+ * bounds are visited.
+ */
+void querySpatialLevel(
+	const SpatialQueryShape& shape,
+	u32 level,
+	const SpatialPersistentStorage& sps,
+	SpatialQueryOutput& out)
+{
+	r64 scale = (r64)(1 << (2 * level));
+	r64 cellSizeXZ = spatialGridSizeXZ * scale;
+	r64 cellSizeY = spatialGridSizeY * scale;
+	// a little past the half cell, so rounding can't drop a cell an entity on its edge is in
+	r64 loose = cellSizeXZ * 0.5 + 0.01;
+	i32 dimX = gridSizeX >> (2 * level);
+	i32 dimY = max(gridSizeY >> (2 * level), 1);
+	i32 dimZ = gridSizeZ >> (2 * level);
+
+	dvec3 lo = shape.boundsMin - loose;
+	dvec3 hi = shape.boundsMax + loose;
+	if (hi.x < 0.0 || hi.y < 0.0 || hi.z < 0.0
+		|| lo.x >= dimX * cellSizeXZ || lo.y >= dimY * cellSizeY || lo.z >= dimZ * cellSizeXZ)
+	{
+		return;
+	}
+
+	i32 bounds[6] = {
+		(i32)max(lo.x / cellSizeXZ, 0.0), (i32)min(hi.x / cellSizeXZ, (r64)(dimX - 1)),
+		(i32)max(lo.y / cellSizeY,  0.0), (i32)min(hi.y / cellSizeY,  (r64)(dimY - 1)),
+		(i32)max(lo.z / cellSizeXZ, 0.0), (i32)min(hi.z / cellSizeXZ, (r64)(dimZ - 1))
+	};
+
+	const SpatialOccupancy& occ = sps.occupancy;
+	u32 numCells = (u32)(bounds[1] - bounds[0] + 1)
+				 * (u32)(bounds[3] - bounds[2] + 1)
+				 * (u32)(bounds[5] - bounds[4] + 1);
+
+	if (numCells <= SpatialQueryDirectCells) {
+		for (i32 z = bounds[4]; z <= bounds[5]; ++z) {
+			for (i32 y = bounds[2]; y <= bounds[3]; ++y) {
+				for (i32 x = bounds[0]; x <= bounds[1]; ++x) {
+					u32 cellKey = getSpatialCellKey(SpatialCell{ (u8)x, (u8)y, (u8)z }, level);
+					if (occ.cells[cellKey >> 6] & (1ULL << (cellKey & 63))) {
+						querySpatialCell(shape, level, cellKey, sps, out);
+					}
+				}
+			}
+		}
+		return;
+	}
+
+	// same walk as getLevelCellPVS, without the projection masks
+	const u32 blockWordBegin = spatialLevelKeyBase[level] >> 12;
+	const u32 blockWordEnd = spatialLevelKeyBase[level + 1] >> 12;
+
+	for (u32 r = blockWordBegin >> 6; r <= (blockWordEnd - 1) >> 6; ++r)
+	{
+		u32 first = max(blockWordBegin, r << 6) - (r << 6);
+		u32 last = min(blockWordEnd, (r + 1) << 6) - (r << 6);
+		u64 levelMask = (last - first == 64 ? ~0ULL : ((1ULL << (last - first)) - 1) << first);
+
+		u64 regionBits = occ.regions[r] & levelMask;
+		while (regionBits)
+		{
+			u32 rb = 0;
+			BitScanFwd64(&rb, regionBits);
+			regionBits &= regionBits - 1;
+
+			u32 blockWord = (r << 6) | rb;
+			if (!spatialCellBoxInBounds(getSpatialCellFromKey(blockWord << 12, level), 16, bounds)) {
+				continue;
+			}
+
+			u64 blockBits = occ.blocks[blockWord];
+			while (blockBits)
+			{
+				u32 bb = 0;
+				BitScanFwd64(&bb, blockBits);
+				blockBits &= blockBits - 1;
+
+				u32 cellWord = (blockWord << 6) | bb;
+				if (!spatialCellBoxInBounds(getSpatialCellFromKey(cellWord << 6, level), 4, bounds)) {
+					continue;
+				}
+
+				u64 cellBits = occ.cells[cellWord];
+				while (cellBits)
+				{
+					u32 cb = 0;
+					BitScanFwd64(&cb, cellBits);
+					cellBits &= cellBits - 1;
+
+					u32 cellKey = (cellWord << 6) | cb;
+					SpatialCell cell = getSpatialCellFromKey(cellKey, level);
+					if (cell.x >= bounds[0] && cell.x <= bounds[1]
+						&& cell.y >= bounds[2] && cell.y <= bounds[3]
+						&& cell.z >= bounds[4] && cell.z <= bounds[5])
+					{
+						querySpatialCell(shape, level, cellKey, sps, out);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+void querySpatialShape(
+	const SpatialQueryShape& shape,
+	const SpatialPersistentStorage& sps,
+	SpatialQueryOutput& out)
+{
+	for (u32 level = 0; level < SpatialGridLevels; ++level) {
+		querySpatialLevel(shape, level, sps, out);
+	}
+
+	// entities that don't fit in the grid are stored relative to the world origin
+	if (sps.outsideGrid.length > 0) {
+		querySpatialBucket(shape, sps.outsideGrid, dvec3{ 0.0, 0.0, 0.0 }, sps, out);
+	}
+}
+
+
+SpatialQueryOutput beginSpatialQueries(
+	u32 numQueries,
+	MemoryArena& arena,
+	SpatialQueryResults& results)
+{
+	results = SpatialQueryResults{};
+	results.offsets = allocArrayOfType(arena, u32, numQueries + 1);
+	results.numQueries = numQueries;
+	results.offsets[0] = 0;
+
+	SpatialQueryOutput out{};
+	out.arena = &arena;
+	reserveSpatialQueryOutput(out, max(numQueries * 8, 256U));
+	return out;
+}
+
+
+void endSpatialQuery(
+	u32 q,
+	const SpatialQueryOutput& out,
+	SpatialQueryResults& results)
+{
+	results.offsets[q + 1] = out.length;
+	results.spatialInfoIds = out.ids;
+	results.numResults = out.length;
+}
+
+
+SpatialFrustumQuery makeSpatialFrustumQuery(
+	const dvec3& eyePoint,
+	const mat4& viewProjection)
+{
+	SpatialFrustumQuery query{};
+	r32 m[16];
+	memcpy(m, viewProjection.E, sizeof(m));
+	query.frustum = frustum_extractFromMatrixGL(m);
+	query.eyePoint = eyePoint;
+
+	// the corners are where a near/far, left/right and top/bottom plane meet, n*p = d for each
+	const FrustumSoA& f = query.frustum;
+	dvec3 n[6];
+	for (u32 p = 0; p < 6; ++p) {
+		n[p] = dvec3{ f.nx[p], f.ny[p], f.nz[p] };
+	}
+
+	query.boundsMin = dvec3{ DBL_MAX, DBL_MAX, DBL_MAX };
+	query.boundsMax = dvec3{ -DBL_MAX, -DBL_MAX, -DBL_MAX };
+	for (u32 c = 0; c < 8; ++c) {
+		u32 a = Near + (c & 1);
+		u32 b = Left + ((c >> 1) & 1);
+		u32 d = Top + ((c >> 2) & 1);
+		dvec3 bxd = cross(n[b], n[d]);
+		dvec3 dxa = cross(n[d], n[a]);
+		dvec3 axb = cross(n[a], n[b]);
+		dvec3 corner = (bxd * (r64)f.d[a] + dxa * (r64)f.d[b] + axb * (r64)f.d[d])
+					 * (1.0 / dot(n[a], bxd));
+
+		query.boundsMin = dvec3{ min(query.boundsMin.x, corner.x), min(query.boundsMin.y, corner.y), min(query.boundsMin.z, corner.z) };
+		query.boundsMax = dvec3{ max(query.boundsMax.x, corner.x), max(query.boundsMax.y, corner.y), max(query.boundsMax.z, corner.z) };
+	}
+	return query;
+}
+
+
+SpatialQueryResults querySpatialSpheres(
+	const SpatialPersistentStorage& sps,
+	const SpatialSphereQuery* queries,
+	u32 numQueries,
+	MemoryArena& arena)
+{
+	SpatialQueryResults results;
+	SpatialQueryOutput out = beginSpatialQueries(numQueries, arena, results);
+
+	for (u32 q = 0; q < numQueries; ++q) {
+		const SpatialSphereQuery& sq = queries[q];
+		SpatialQueryShape shape{};
+		shape.type = SpatialQueryShape_Sphere;
+		shape.origin = sq.center;
+		shape.boundsMin = sq.center - (r64)sq.radius;
+		shape.boundsMax = sq.center + (r64)sq.radius;
+		shape.radius = sq.radius;
+
+		querySpatialShape(shape, sps, out);
+		endSpatialQuery(q, out, results);
+	}
+	return results;
+}
+
+
+SpatialQueryResults querySpatialAABBs(
+	const SpatialPersistentStorage& sps,
+	const SpatialAABBQuery* queries,
+	u32 numQueries,
+	MemoryArena& arena)
+{
+	SpatialQueryResults results;
+	SpatialQueryOutput out = beginSpatialQueries(numQueries, arena, results);
+
+	for (u32 q = 0; q < numQueries; ++q) {
+		const SpatialAABBQuery& aq = queries[q];
+		dvec3 halfExtents = (aq.maxCorner - aq.minCorner) * 0.5;
+		SpatialQueryShape shape{};
+		shape.type = SpatialQueryShape_AABB;
+		shape.origin = aq.minCorner + halfExtents;
+		shape.boundsMin = aq.minCorner;
+		shape.boundsMax = aq.maxCorner;
+		shape.hi = make_vec3(halfExtents);
+		shape.lo = -shape.hi;
+
+		querySpatialShape(shape, sps, out);
+		endSpatialQuery(q, out, results);
+	}
+	return results;
+}
+
+
+SpatialQueryResults querySpatialFrustums(
+	const SpatialPersistentStorage& sps,
+	const SpatialFrustumQuery* queries,
+	u32 numQueries,
+	MemoryArena& arena)
+{
+	SpatialQueryResults results;
+	SpatialQueryOutput out = beginSpatialQueries(numQueries, arena, results);
+
+	for (u32 q = 0; q < numQueries; ++q) {
+		const SpatialFrustumQuery& fq = queries[q];
+		SpatialQueryShape shape{};
+		shape.type = SpatialQueryShape_Frustum;
+		shape.frustum = &fq.frustum;
+		shape.origin = fq.eyePoint;
+		shape.boundsMin = fq.eyePoint + fq.boundsMin;
+		shape.boundsMax = fq.eyePoint + fq.boundsMax;
+
+		querySpatialShape(shape, sps, out);
+		endSpatialQuery(q, out, results);
+	}
+	return results;
+}
+
+
+// Ray casts
+
+/**
+ * Walks the cells of one grid level whose loose bounds the ray passes through, in the order it
+ * reaches them. An entity's bsphere lies within the half cell of looseness around its cell, so on
+ * each axis the cells that can hold an entity under the ray form a window one to two cells wide,
+ * from the cell containing p-loose to the cell containing p+loose. The window only slides along
+ * the ray, so each cell enters it once, when its last axis does. Events where the window's
+ * leading edge enters a cell or its trailing edge leaves one are stepped in time order like a
+ * regular DDA, and the occupied cells entering the window are queued with the time they entered.
+ */
+// rounding can step an enter event just before the leave event it ties with, so the window can
+// briefly be three cells wide on an axis, and queue a box of 3x2x3 cells at worst
+const u32 SpatialRayMaxPendingCells = 18;
+
+struct SpatialRayWalk {
+	r64			origin[3];
+	r64			direction[3];
+	r64			cellSize[3];
+	r64			tEnter[3];		// time the window's leading edge enters the next cell on each axis
+	r64			tLeave[3];		// time the window's trailing edge leaves its cell on each axis
+	r64			tEnd;
+	r64			pendingT;		// time the pending cells entered the window
+	r64			loose;
+	i32			dim[3];
+	i32			lo[3];			// window of cells on each axis
+	i32			hi[3];
+	u32			level;
+	u32			numPending;
+	u32			pendingPos;
+	u32			pendingKeys[SpatialRayMaxPendingCells];
+	const SpatialOccupancy* occ;
+};
+
+
+inline void updateSpatialRayEvents(
+	SpatialRayWalk& w,
+	u32 a)
+{
+	r64 d = w.direction[a];
+	r64 s = w.cellSize[a];
+	if (d > 0.0) {
+		w.tEnter[a] = (w.hi[a] + 1 < w.dim[a]
+					   ? ((w.hi[a] + 1) * s - w.loose - w.origin[a]) / d
+					   : DBL_MAX);
+		w.tLeave[a] = ((w.lo[a] + 1) * s + w.loose - w.origin[a]) / d;
+	}
+	else if (d < 0.0) {
+		w.tEnter[a] = (w.lo[a] > 0
+					   ? (w.lo[a] * s + w.loose - w.origin[a]) / d
+					   : DBL_MAX);
+		w.tLeave[a] = (w.hi[a] * s - w.loose - w.origin[a]) / d;
+	}
+	else {
+		w.tEnter[a] = DBL_MAX;
+		w.tLeave[a] = DBL_MAX;
+	}
+}
+
+
+/**
+ * Queues the occupied cells of the window box, with the given range on axis a and the current
+ * window on the other two axes.
+ */
+void queueSpatialRayCells(
+	SpatialRayWalk& w,
+	u32 a,
+	i32 first,
+	i32 last,
+	r64 t)
+{
+	i32 lo[3] = { w.lo[0], w.lo[1], w.lo[2] };
+	i32 hi[3] = { w.hi[0], w.hi[1], w.hi[2] };
+	lo[a] = first;
+	hi[a] = last;
+
+	w.numPending = 0;
+	w.pendingPos = 0;
+	w.pendingT = t;
+	for (i32 z = lo[2]; z <= hi[2]; ++z) {
+		for (i32 y = lo[1]; y <= hi[1]; ++y) {
+			for (i32 x = lo[0]; x <= hi[0]; ++x) {
+				u32 cellKey = getSpatialCellKey(SpatialCell{ (u8)x, (u8)y, (u8)z }, w.level);
+				if (w.occ->cells[cellKey >> 6] & (1ULL << (cellKey & 63))) {
+					assert(w.numPending < SpatialRayMaxPendingCells && "ray walk window is too wide");
+					w.pendingKeys[w.numPending++] = cellKey;
+				}
+			}
+		}
+	}
+}
+
+
+void beginSpatialRayWalk(
+	SpatialRayWalk& w,
+	const SpatialRay& ray,
+	u32 level,
+	const SpatialPersistentStorage& sps)
+{
+	r64 scale = (r64)(1 << (2 * level));
+	w.level = level;
+	w.occ = &sps.occupancy;
+	w.loose = spatialGridSizeXZ * scale * 0.5 + 0.01; // slack as in querySpatialLevel
+	w.cellSize[0] = w.cellSize[2] = spatialGridSizeXZ * scale;
+	w.cellSize[1] = spatialGridSizeY * scale;
+	w.dim[0] = gridSizeX >> (2 * level);
+	w.dim[1] = max(gridSizeY >> (2 * level), 1);
+	w.dim[2] = gridSizeZ >> (2 * level);
+	w.numPending = w.pendingPos = 0;
+
+	// clip the ray to the loose bounds of the whole level
+	r64 tStart = 0.0;
+	w.tEnd = ray.maxDistance;
+	for (u32 a = 0; a < 3; ++a) {
+		w.origin[a] = ray.origin[a];
+		w.direction[a] = ray.direction[a];
+
+		r64 low = -w.loose;
+		r64 high = w.dim[a] * w.cellSize[a] + w.loose;
+		if (w.direction[a] == 0.0) {
+			if (w.origin[a] < low || w.origin[a] > high) {
+				w.tEnd = -1.0;
+			}
+			continue;
+		}
+		r64 t0 = (low - w.origin[a]) / w.direction[a];
+		r64 t1 = (high - w.origin[a]) / w.direction[a];
+		tStart = max(tStart, min(t0, t1));
+		w.tEnd = min(w.tEnd, max(t0, t1));
+	}
+	if (tStart > w.tEnd) {
+		w.tEnd = -1.0;
+		return;
+	}
+
+	for (u32 a = 0; a < 3; ++a) {
+		r64 p = w.origin[a] + w.direction[a] * tStart;
+		w.lo[a] = clamp((i32)floor((p - w.loose) / w.cellSize[a]), 0, w.dim[a] - 1);
+		w.hi[a] = clamp((i32)floor((p + w.loose) / w.cellSize[a]), 0, w.dim[a] - 1);
+		updateSpatialRayEvents(w, a);
+	}
+	queueSpatialRayCells(w, 0, w.lo[0], w.hi[0], tStart);
+}
+
+
+/**
+ * Gets the next occupied cell entering the window and the time it entered, false when the ray
+ * leaves the level or passes its max distance.
+ */
+bool nextSpatialRayCell(
+	SpatialRayWalk& w,
+	u32& outCellKey,
+	r64& outT)
+{
+	while (w.pendingPos == w.numPending) {
+		u32 enterAxis = 0;
+		u32 leaveAxis = 0;
+		for (u32 a = 1; a < 3; ++a) {
+			if (w.tEnter[a] < w.tEnter[enterAxis]) { enterAxis = a; }
+			if (w.tLeave[a] < w.tLeave[leaveAxis]) { leaveAxis = a; }
+		}
+		r64 tEnter = w.tEnter[enterAxis];
+		r64 tLeave = w.tLeave[leaveAxis];
+
+		if (min(tEnter, tLeave) > w.tEnd) {
+			return false;
+		}
+		if (tLeave <= tEnter) {
+			u32 a = leaveAxis;
+			if (w.direction[a] > 0.0) { ++w.lo[a]; }
+			else { --w.hi[a]; }
+
+			if (w.lo[a] > w.hi[a]) {
+				return false; // left the last cell of the level
+			}
+			updateSpatialRayEvents(w, a);
+		}
+		else {
+			u32 a = enterAxis;
+			i32 entered = (w.direction[a] > 0.0 ? ++w.hi[a] : --w.lo[a]);
+			updateSpatialRayEvents(w, a);
+			queueSpatialRayCells(w, a, entered, entered, tEnter);
+		}
+	}
+
+	outCellKey = w.pendingKeys[w.pendingPos++];
+	outT = w.pendingT;
+	return true;
+}
+
+
+/**
+ * Intersects the ray with the chunk's bspheres 4 at a time. The ray origin is relative to the
+ * cell origin. Sets the bit of each sphere hit within maxDistance and writes where the ray enters
+ * it to tHits.
+ */
+inline u32 intersectRaySpatialChunk(
+	const SpatialChunk& chunk,
+	u32 chunkLength,
+	const vec3& origin,
+	const vec3& direction,
+	r32 maxDistance,
+	r32 tHits[SpatialChunkCapacity])
+{
+	const __m128 ox = _mm_set1_ps(origin.x);
+	const __m128 oy = _mm_set1_ps(origin.y);
+	const __m128 oz = _mm_set1_ps(origin.z);
+	const __m128 dx = _mm_set1_ps(direction.x);
+	const __m128 dy = _mm_set1_ps(direction.y);
+	const __m128 dz = _mm_set1_ps(direction.z);
+	const __m128 tMax = _mm_set1_ps(maxDistance);
+	const __m128 zero = _mm_setzero_ps();
+
+	u32 hits = 0;
+	for (u32 l = 0; l < SpatialChunkCapacity; l += 4) {
+		// with m the center relative to the origin and b its distance along the ray, the ray
+		// enters at b - sqrt(r*r - |m - b*d|^2), using the distance from the center to the ray
+		// rather than b*b - (m*m - r*r) keeps far grazing hits from cancelling out
+		__m128 mx = _mm_sub_ps(_mm_load_ps(chunk.x + l), ox);
+		__m128 my = _mm_sub_ps(_mm_load_ps(chunk.y + l), oy);
+		__m128 mz = _mm_sub_ps(_mm_load_ps(chunk.z + l), oz);
+		__m128 r = _mm_load_ps(chunk.r + l);
+
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, dx), _mm_mul_ps(my, dy)), _mm_mul_ps(mz, dz));
+		__m128 px = _mm_sub_ps(mx, _mm_mul_ps(b, dx));
+		__m128 py = _mm_sub_ps(my, _mm_mul_ps(b, dy));
+		__m128 pz = _mm_sub_ps(mz, _mm_mul_ps(b, dz));
+		__m128 disc = _mm_sub_ps(
+			_mm_mul_ps(r, r),
+			_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz)));
+		__m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+		__m128 tNear = _mm_max_ps(_mm_sub_ps(b, sq), zero);
+
+		__m128 hit = _mm_and_ps(
+			_mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_cmpge_ps(_mm_add_ps(b, sq), zero)),
+			_mm_cmple_ps(tNear, tMax));
+
+		_mm_store_ps(tHits + l, tNear);
+		hits |= (u32)_mm_movemask_ps(hit) << l;
+	}
+	// lanes past the front chunk's length hold stale entries
+	return hits & ((1U << chunkLength) - 1);
+}
+
+
+/**
+ * All hits of a ray, grown in the arena like SpatialQueryOutput.
+ */
+struct SpatialRayHitOutput {
+	SpatialRayHit*	hits;
+	u32				length;
+	u32				capacity;
+	MemoryArena*	arena;
+};
+
+
+inline void reserveSpatialRayHitOutput(
+	SpatialRayHitOutput& out,
+	u32 count)
+{
+	if (out.length + count > out.capacity) {
+		u32 capacity = max(max(out.capacity * 2, out.length + count), 64U);
+		SpatialRayHit* hits = allocArrayOfType(*out.arena, SpatialRayHit, capacity);
+		if (out.length > 0) {
+			memcpy(hits, out.hits, out.length * sizeof(SpatialRayHit));
+		}
+		out.hits = hits;
+		out.capacity = capacity;
+	}
+}
+
+
+/**
+ * Tests the ray against every entity in the bucket. The nearest hit is kept in outHit, or when
+ * allHits is passed every hit is appended to it instead.
+ */
+void castRaySpatialBucket(
+	const SpatialRay& ray,
+	const SpatialBucket& bucket,
+	const dvec3& cellOrigin,
+	const SpatialPersistentStorage& sps,
+	SpatialRayHit& outHit,
+	SpatialRayHitOutput* allHits)
+{
+	vec3 origin = make_vec3(ray.origin - cellOrigin);
+	alignas(16) r32 tHits[SpatialChunkCapacity];
+
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		const SpatialChunk& chunk = sps.chunks[c];
+		u32 hits = intersectRaySpatialChunk(
+			chunk, chunkLength,
+			origin, ray.direction,
+			(allHits ? ray.maxDistance : outHit.distance),
+			tHits);
+
+		if (allHits && hits) {
+			reserveSpatialRayHitOutput(*allHits, SpatialChunkCapacity);
+		}
+		while (hits) {
+			u32 l = 0;
+			BitScanFwd(&l, hits);
+			hits &= hits - 1;
+
+			if (allHits) {
+				allHits->hits[allHits->length++] = SpatialRayHit{ chunk.spatialInfoIds[l], tHits[l] };
+			}
+			else if (tHits[l] < outHit.distance || outHit.spatialInfoId == null_h32) {
+				outHit = SpatialRayHit{ chunk.spatialInfoIds[l], tHits[l] };
+			}
+		}
+
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+}
+
+
+bool castSpatialRay(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay& ray,
+	SpatialRayHit& outHit)
+{
+	outHit = SpatialRayHit{ null_h32, ray.maxDistance };
+
+	for (u32 level = 0; level < SpatialGridLevels; ++level) {
+		SpatialRayWalk w;
+		beginSpatialRayWalk(w, ray, level, sps);
+
+		u32 cellKey = 0;
+		r64 t = 0.0;
+		while (nextSpatialRayCell(w, cellKey, t) && t <= outHit.distance) {
+			const SpatialCellEntry& entry = sps.cells[findSpatialCell(sps, cellKey)];
+			castRaySpatialBucket(
+				ray, entry.bucket,
+				getSpatialCellOrigin(getSpatialCellFromKey(cellKey, level), level),
+				sps, outHit, nullptr);
+		}
+	}
+
+	if (sps.outsideGrid.length > 0) {
+		castRaySpatialBucket(ray, sps.outsideGrid, dvec3{ 0.0, 0.0, 0.0 }, sps, outHit, nullptr);
+	}
+	return (outHit.spatialInfoId != null_h32);
+}
+
+
+u32 castSpatialRayAllHits(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay& ray,
+	MemoryArena& arena,
+	SpatialRayHit*& outHits)
+{
+	SpatialRayHitOutput out{};
+	out.arena = &arena;
+	SpatialRayHit nearest{};
+
+	for (u32 level = 0; level < SpatialGridLevels; ++level) {
+		SpatialRayWalk w;
+		beginSpatialRayWalk(w, ray, level, sps);
+
+		u32 cellKey = 0;
+		r64 t = 0.0;
+		while (nextSpatialRayCell(w, cellKey, t)) {
+			const SpatialCellEntry& entry = sps.cells[findSpatialCell(sps, cellKey)];
+			castRaySpatialBucket(
+				ray, entry.bucket,
+				getSpatialCellOrigin(getSpatialCellFromKey(cellKey, level), level),
+				sps, nearest, &out);
+		}
+	}
+
+	if (sps.outsideGrid.length > 0) {
+		castRaySpatialBucket(ray, sps.outsideGrid, dvec3{ 0.0, 0.0, 0.0 }, sps, nearest, &out);
+	}
+
+	// each level's hits come out nearly sorted, the levels are merged by the sort
+	std::sort(out.hits, out.hits + out.length, [](const SpatialRayHit& a, const SpatialRayHit& b) {
+		return a.distance < b.distance;
+	});
+
+	outHits = out.hits;
+	return out.length;
+}
+
+
+/**
+ * Nearest hits of a packet of rays, one ray per lane. Lanes without a ray have a negative max
+ * distance so they never hit.
+ */
+struct SpatialRayPacket {
+	dvec3		origins[SpatialRayPacketSize];
+	__m128		dx, dy, dz;
+	__m128		best;		// nearest hit so far, or max distance
+	__m128		found;		// lanes that hit anything
+	__m128i		bestIds;
+	vec3		axis;		// mean direction of the rays, from the first ray's origin
+	r32			spread;		// distance of the farthest ray origin from the first
+	r32			chord;		// largest |direction - axis| of the rays
+	u32			numRays;
+	u8			useCone;	// rays are close enough to the axis for the cone test to pay off
+	u8			_padding[3];
+};
+
+// largest chord between a ray direction and the packet axis for the cone test, about 29 degrees
+const r32 SpatialRayPacketMaxChord = 0.5f;
+
+
+/**
+ * Tests each bsphere in the bucket against all rays of the packet. Spheres are first tested 4 at
+ * a time against a cone around the packet axis that holds every ray: a point at distance t along
+ * ray i is within spread + t*chord of the axis point at t, so a sphere hit at t has its center
+ * within r + spread + t*chord of the axis, with t no more than (b + r + spread) / (1 - chord)
+ * where b is the center's distance along the axis. The spheres left are splatted across the lanes
+ * to test each ray, using the same math as intersectRaySpatialChunk so both find the same
+ * distances.
+ */
+void castRayPacketSpatialBucket(
+	SpatialRayPacket& p,
+	const SpatialBucket& bucket,
+	const dvec3& cellOrigin,
+	const SpatialPersistentStorage& sps)
+{
+	alignas(16) r32 o[3][SpatialRayPacketSize] = {};
+	for (u32 i = 0; i < p.numRays; ++i) {
+		vec3 origin = make_vec3(p.origins[i] - cellOrigin);
+		o[0][i] = origin.x;
+		o[1][i] = origin.y;
+		o[2][i] = origin.z;
+	}
+	const __m128 ox = _mm_load_ps(o[0]);
+	const __m128 oy = _mm_load_ps(o[1]);
+	const __m128 oz = _mm_load_ps(o[2]);
+	const __m128 zero = _mm_setzero_ps();
+
+	// the cone reaches no further than the farthest nearest hit or max distance of the rays
+	alignas(16) r32 best[SpatialRayPacketSize];
+	_mm_store_ps(best, p.best);
+	r32 reach = 0.0f;
+	for (u32 i = 0; i < p.numRays; ++i) {
+		reach = max(reach, best[i]);
+	}
+	const __m128 aox = _mm_set1_ps(o[0][0]);
+	const __m128 aoy = _mm_set1_ps(o[1][0]);
+	const __m128 aoz = _mm_set1_ps(o[2][0]);
+	const __m128 ax = _mm_set1_ps(p.axis.x);
+	const __m128 ay = _mm_set1_ps(p.axis.y);
+	const __m128 az = _mm_set1_ps(p.axis.z);
+	const __m128 spread = _mm_set1_ps(p.spread);
+	const __m128 chord = _mm_set1_ps(p.chord);
+	const __m128 invOneMinusChord = _mm_set1_ps(1.0f / (1.0f - p.chord));
+	const __m128 reach4 = _mm_set1_ps(reach);
+	const __m128 slack = _mm_set1_ps(1.001f);
+
+	u16 c = bucket.front;
+	u32 chunkLength = getSpatialFrontChunkLength(bucket);
+	u32 remaining = bucket.length;
+	while (remaining > 0) {
+		const SpatialChunk& chunk = sps.chunks[c];
+
+		u32 candidates = (1U << chunkLength) - 1;
+		if (p.useCone) {
+			u32 inCone = 0;
+			for (u32 l = 0; l < SpatialChunkCapacity; l += 4) {
+				__m128 mx = _mm_sub_ps(_mm_load_ps(chunk.x + l), aox);
+				__m128 my = _mm_sub_ps(_mm_load_ps(chunk.y + l), aoy);
+				__m128 mz = _mm_sub_ps(_mm_load_ps(chunk.z + l), aoz);
+				__m128 r = _mm_load_ps(chunk.r + l);
+
+				__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, ax), _mm_mul_ps(my, ay)), _mm_mul_ps(mz, az));
+				__m128 px = _mm_sub_ps(mx, _mm_mul_ps(b, ax));
+				__m128 py = _mm_sub_ps(my, _mm_mul_ps(b, ay));
+				__m128 pz = _mm_sub_ps(mz, _mm_mul_ps(b, az));
+				__m128 perpSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz));
+
+				__m128 rs = _mm_add_ps(r, spread);
+				__m128 t = _mm_min_ps(reach4, _mm_mul_ps(_mm_max_ps(_mm_add_ps(b, rs), zero), invOneMinusChord));
+				__m128 bound = _mm_mul_ps(_mm_add_ps(rs, _mm_mul_ps(chord, t)), slack);
+
+				inCone |= (u32)_mm_movemask_ps(_mm_cmple_ps(perpSq, _mm_mul_ps(bound, bound))) << l;
+			}
+			candidates &= inCone;
+		}
+
+		while (candidates) {
+			u32 l = 0;
+			BitScanFwd(&l, candidates);
+			candidates &= candidates - 1;
+
+			__m128 mx = _mm_sub_ps(_mm_set1_ps(chunk.x[l]), ox);
+			__m128 my = _mm_sub_ps(_mm_set1_ps(chunk.y[l]), oy);
+			__m128 mz = _mm_sub_ps(_mm_set1_ps(chunk.z[l]), oz);
+			__m128 r = _mm_set1_ps(chunk.r[l]);
+
+			__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, p.dx), _mm_mul_ps(my, p.dy)), _mm_mul_ps(mz, p.dz));
+			__m128 px = _mm_sub_ps(mx, _mm_mul_ps(b, p.dx));
+			__m128 py = _mm_sub_ps(my, _mm_mul_ps(b, p.dy));
+			__m128 pz = _mm_sub_ps(mz, _mm_mul_ps(b, p.dz));
+			__m128 disc = _mm_sub_ps(
+				_mm_mul_ps(r, r),
+				_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz)));
+			__m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+			__m128 tNear = _mm_max_ps(_mm_sub_ps(b, sq), zero);
+
+			__m128 hit = _mm_and_ps(
+				_mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_cmpge_ps(_mm_add_ps(b, sq), zero)),
+				_mm_cmple_ps(tNear, p.best));
+			// the first hit may be at max distance, later ones must be nearer
+			hit = _mm_and_ps(hit, _mm_or_ps(_mm_cmplt_ps(tNear, p.best), _mm_andnot_ps(p.found, hit)));
+
+			if (_mm_movemask_ps(hit)) {
+				__m128i hitMask = _mm_castps_si128(hit);
+				p.best = _mm_or_ps(_mm_and_ps(hit, tNear), _mm_andnot_ps(hit, p.best));
+				p.bestIds = _mm_or_si128(
+					_mm_and_si128(hitMask, _mm_set1_epi32((i32)chunk.spatialInfoIds[l].value)),
+					_mm_andnot_si128(hitMask, p.bestIds));
+				p.found = _mm_or_ps(p.found, hit);
+			}
+		}
+
+		remaining -= chunkLength;
+		c = chunk.next;
+		chunkLength = SpatialChunkCapacity;
+	}
+}
+
+
+// cells a packet remembers having tested, past this a cell reached by several rays may be tested
+// again, which costs time but doesn't change the hits
+const u32 SpatialRayPacketMaxTestedCells = 64;
+
+void castSpatialRayPacket(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay* rays,
+	u32 numRays,
+	SpatialRayHit* outHits)
+{
+	assert(numRays > 0 && numRays <= SpatialRayPacketSize);
+
+	SpatialRayPacket p{};
+	p.numRays = numRays;
+	alignas(16) r32 d[3][SpatialRayPacketSize] = {};
+	alignas(16) r32 tMax[SpatialRayPacketSize] = { -1.0f, -1.0f, -1.0f, -1.0f };
+	for (u32 i = 0; i < numRays; ++i) {
+		p.origins[i] = rays[i].origin;
+		d[0][i] = rays[i].direction.x;
+		d[1][i] = rays[i].direction.y;
+		d[2][i] = rays[i].direction.z;
+		tMax[i] = rays[i].maxDistance;
+	}
+	p.dx = _mm_load_ps(d[0]);
+	p.dy = _mm_load_ps(d[1]);
+	p.dz = _mm_load_ps(d[2]);
+	p.best = _mm_load_ps(tMax);
+	p.found = _mm_setzero_ps();
+	p.bestIds = _mm_setzero_si128();
+
+	dvec3 axis{};
+	for (u32 i = 0; i < numRays; ++i) {
+		axis += make_dvec3(rays[i].direction);
+	}
+	if (dot(axis, axis) > 0.0) {
+		p.axis = make_vec3(normalize(axis));
+		for (u32 i = 0; i < numRays; ++i) {
+			p.spread = max(p.spread, (r32)length(rays[i].origin - rays[0].origin));
+			p.chord = max(p.chord, length(rays[i].direction - p.axis));
+		}
+		p.useCone = (p.chord <= SpatialRayPacketMaxChord ? 1 : 0);
+	}
+
+	for (u32 level = 0; level < SpatialGridLevels; ++level) {
+		SpatialRayWalk walks[SpatialRayPacketSize];
+		bool hasCell[SpatialRayPacketSize] = {};
+		u32 cellKeys[SpatialRayPacketSize] = {};
+		r64 cellT[SpatialRayPacketSize] = {};
+		for (u32 i = 0; i < numRays; ++i) {
+			beginSpatialRayWalk(walks[i], rays[i], level, sps);
+			hasCell[i] = nextSpatialRayCell(walks[i], cellKeys[i], cellT[i]);
+		}
+
+		u32 tested[SpatialRayPacketMaxTestedCells];
+		u32 numTested = 0;
+
+		for (;;) {
+			// the ray reaching its next cell first goes next, rays stop once past their nearest hit
+			alignas(16) r32 best[SpatialRayPacketSize];
+			_mm_store_ps(best, p.best);
+			u32 next = SpatialRayPacketSize;
+			for (u32 i = 0; i < numRays; ++i) {
+				if (hasCell[i] && cellT[i] <= best[i]
+					&& (next == SpatialRayPacketSize || cellT[i] < cellT[next]))
+				{
+					next = i;
+				}
+			}
+			if (next == SpatialRayPacketSize) {
+				break;
+			}
+
+			u32 cellKey = cellKeys[next];
+			hasCell[next] = nextSpatialRayCell(walks[next], cellKeys[next], cellT[next]);
+
+			bool seen = false;
+			for (u32 t = 0; t < numTested && !seen; ++t) {
+				seen = (tested[t] == cellKey);
+			}
+			if (seen) {
+				continue;
+			}
+			if (numTested < SpatialRayPacketMaxTestedCells) {
+				tested[numTested++] = cellKey;
+			}
+
+			const SpatialCellEntry& entry = sps.cells[findSpatialCell(sps, cellKey)];
+			castRayPacketSpatialBucket(
+				p, entry.bucket,
+				getSpatialCellOrigin(getSpatialCellFromKey(cellKey, level), level),
+				sps);
+		}
+	}
+
+	if (sps.outsideGrid.length > 0) {
+		castRayPacketSpatialBucket(p, sps.outsideGrid, dvec3{ 0.0, 0.0, 0.0 }, sps);
+	}
+
+	alignas(16) r32 best[SpatialRayPacketSize];
+	alignas(16) u32 bestIds[SpatialRayPacketSize];
+	_mm_store_ps(best, p.best);
+	_mm_store_si128((__m128i*)bestIds, p.bestIds);
+	u32 found = (u32)_mm_movemask_ps(p.found);
+	for (u32 i = 0; i < numRays; ++i) {
+		outHits[i].spatialInfoId = null_h32;
+		if (found & (1U << i)) {
+			outHits[i].spatialInfoId.value = bestIds[i];
+		}
+		outHits[i].distance = best[i];
+	}
+}
+
+
+void castSpatialRays(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay* rays,
+	u32 numRays,
+	SpatialRayHit* outHits)
+{
+	for (u32 r = 0; r < numRays; r += SpatialRayPacketSize) {
+		castSpatialRayPacket(
+			sps, rays + r,
+			min(numRays - r, SpatialRayPacketSize),
+			outHits + r);
+	}
+}
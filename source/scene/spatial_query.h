@@ -0,0 +1,146 @@
+#ifndef _SPATIAL_QUERY_H
+#define _SPATIAL_QUERY_H
+
+#include "../utility/common.h"
+#include "../math/qmath.h"
+#include "geometry.h"
+#include "scene.h"
+
+
+struct MemoryArena;
+
+
+struct SpatialSphereQuery {
+	dvec3		center;
+	r32			radius;
+	u32			_padding;
+};
+
+
+struct SpatialAABBQuery {
+	dvec3		minCorner;
+	dvec3		maxCorner;
+};
+
+
+/**
+ * Frustum planes in camera space, world axes with the eye at the origin like frustum culling uses,
+ * along with the camera space bounds of its corners which limit the cells visited. Build with
+ * makeSpatialFrustumQuery.
+ */
+struct SpatialFrustumQuery {
+	FrustumSoA	frustum;
+	dvec3		eyePoint;
+	dvec3		boundsMin;
+	dvec3		boundsMax;
+};
+
+
+/**
+ * Results of a batch of queries, the matches of query i are
+ * spatialInfoIds[offsets[i]] up to spatialInfoIds[offsets[i+1]]. Look up the entity through
+ * scene.components.spatialInfo[id]->entityId.
+ */
+struct SpatialQueryResults {
+	u32*			offsets;			// numQueries + 1 entries
+	ComponentId*	spatialInfoIds;
+	u32				numQueries;
+	u32				numResults;
+};
+
+
+/**
+ * Ray cast into the grid, direction must be normalized. Entities are hit where the ray enters
+ * their cached bsphere, at distance 0 if the origin is inside of it.
+ */
+struct SpatialRay {
+	dvec3		origin;
+	vec3		direction;
+	r32			maxDistance;
+};
+
+
+struct SpatialRayHit {
+	ComponentId	spatialInfoId;	// null_h32 if nothing was hit
+	r32			distance;
+};
+
+
+// rays traced together by castSpatialRays, coherent rays share the cells and chunks they load
+const u32 SpatialRayPacketSize = 4;
+
+
+/**
+ * Builds a frustum query from a view projection matrix in camera space, see
+ * cullEntitiesInCellPVS for how one is made from a camera.
+ */
+SpatialFrustumQuery makeSpatialFrustumQuery(
+	const dvec3& eyePoint,
+	const mat4& viewProjection);
+
+
+/**
+ * The query functions find every entity in the spatial grid whose cached bsphere overlaps each
+ * query in the batch. The grid is loose, so each entity is stored in exactly one cell and appears
+ * at most once per query, in grid order. Results are allocated from the arena, which must belong
+ * to the calling thread. The grid is only read, so queries may run from worker threads as long
+ * as nothing modifies the grid at the same time.
+ */
+SpatialQueryResults querySpatialSpheres(
+	const SpatialPersistentStorage& sps,
+	const SpatialSphereQuery* queries,
+	u32 numQueries,
+	MemoryArena& arena);
+
+SpatialQueryResults querySpatialAABBs(
+	const SpatialPersistentStorage& sps,
+	const SpatialAABBQuery* queries,
+	u32 numQueries,
+	MemoryArena& arena);
+
+SpatialQueryResults querySpatialFrustums(
+	const SpatialPersistentStorage& sps,
+	const SpatialFrustumQuery* queries,
+	u32 numQueries,
+	MemoryArena& arena);
+
+
+/**
+ * The ray casts walk the cells of each grid level in the order the ray reaches them with a 3D
+ * DDA. Like the queries, they only read the grid and may run from worker threads.
+ */
+
+/**
+ * Finds the nearest entity hit by the ray. Cells the ray reaches past the nearest hit so far are
+ * never visited.
+ * @return true if anything was hit
+ */
+bool castSpatialRay(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay& ray,
+	SpatialRayHit& outHit);
+
+/**
+ * Finds every entity hit by the ray, allocated from the arena and sorted by distance.
+ * @return number of hits
+ */
+u32 castSpatialRayAllHits(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay& ray,
+	MemoryArena& arena,
+	SpatialRayHit*& outHits);
+
+/**
+ * Finds the nearest hit of each ray, tracing packets of SpatialRayPacketSize rays at a time. Each
+ * cell any ray of the packet reaches is tested once against all of them, so use it for bundles
+ * of rays that start near each other and point the same way, like visibility checks from one
+ * agent. Each ray finds the same nearest distance castSpatialRay would.
+ */
+void castSpatialRays(
+	const SpatialPersistentStorage& sps,
+	const SpatialRay* rays,
+	u32 numRays,
+	SpatialRayHit* outHits);
+
+
+#endif
@@ -0,0 +1,238 @@
+#include "spatial_query.h"
+#include "camera.h"
+#include "../utility/logger.h"
+#include "../utility/memory.h"
+#include <SDL_timer.h>
+#include <cstring>
+
+
+const u32 SpatialQueryBenchmarkEntities = 65000;
+const u32 SpatialQueryBenchmarkQueries = 10000;
+const u32 SpatialQueryBenchmarkFrustums = 16;
+const u32 SpatialQueryBenchmarkChecked = 500;	// queries checked against a brute force search, at most
+
+
+struct SpatialQueryBenchmarkEntity {
+	dvec3		center;
+	r32			radius;
+	ComponentId	spatialInfoId;
+};
+
+
+static r64 spatialQueryBenchmarkRandom(u64& rnd)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return (r64)(rnd >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * Checks the results of the first queries against a brute force search of every entity, given the
+ * signed gap between each query and entity (negative when they overlap). An entity must be found
+ * when the gap is negative and must not be found when the conservative gap, which may be smaller,
+ * is positive. Bspheres are cached as floats relative to their cell, so overlaps within 1mm of
+ * touching may go either way.
+ * @returns number of missed, false and duplicate results
+ */
+template <typename GapFunc, typename ConservativeGapFunc>
+static u32 checkSpatialQueryResults(
+	const SpatialQueryResults& results,
+	const SpatialQueryBenchmarkEntity* entities,
+	u32* marks,
+	GapFunc gap,
+	ConservativeGapFunc conservativeGap)
+{
+	u32 numWrong = 0;
+	u32 numChecked = min(results.numQueries, SpatialQueryBenchmarkChecked);
+	memset(marks, 0, SCENE_MAX_ENTITIES * sizeof(u32));
+
+	for (u32 q = 0; q < numChecked; ++q) {
+		for (u32 r = results.offsets[q]; r < results.offsets[q + 1]; ++r) {
+			u32 index = results.spatialInfoIds[r].index;
+			numWrong += (marks[index] == q + 1) ? 1 : 0;
+			marks[index] = q + 1;
+		}
+		for (u32 e = 0; e < SpatialQueryBenchmarkEntities; ++e) {
+			bool found = (marks[entities[e].spatialInfoId.index] == q + 1);
+			bool missed = !found && gap(q, entities[e]) < -1.0e-3;
+			bool falseHit = found && conservativeGap(q, entities[e]) > 1.0e-3;
+			numWrong += (missed || falseHit) ? 1 : 0;
+		}
+	}
+	return numWrong;
+}
+
+
+/**
+ * Runs a frame's worth of queries repeatedly, logging the best time of the batch and per query.
+ */
+template <typename QueryFunc>
+static SpatialQueryResults timeSpatialQueries(
+	const char* name,
+	u32 numQueries,
+	MemoryArena& scratch,
+	QueryFunc query)
+{
+	const u64 frequency = SDL_GetPerformanceFrequency();
+	u64 best = ~0ULL;
+	SpatialQueryResults results{};
+
+	for (u32 rep = 0; rep < 20; ++rep) {
+		TemporaryMemory temp = beginTemporaryMemory(scratch);
+		u64 start = SDL_GetPerformanceCounter();
+		results = query();
+		best = min(best, SDL_GetPerformanceCounter() - start);
+		// keep the results of the last run for checking
+		if (rep < 19) {
+			endTemporaryMemory(temp);
+		}
+		else {
+			keepTemporaryMemory(temp);
+		}
+	}
+
+	r64 us = (r64)best * 1.0e6 / frequency;
+	logger::test("%-8s x%-5u %8.1f us per frame, %.3f us per query, %u results",
+				 name, numQueries, us, us / numQueries, results.numResults);
+	return results;
+}
+
+
+/**
+ * Fills a spatial grid with 65K entities spread over 20km, mostly small with a few large enough
+ * for the coarser levels and some outside of the grid, then runs 10K sphere and 10K AABB queries
+ * as one frame's batch of each, and 16 street level frustums 3km deep. Logs the best time of each
+ * batch and checks the first queries of each against a brute force search. Development only,
+ * takes about a second.
+ * @param scratch	needs 16 MB free
+ * @returns false if any checked query missed an entity, found one it shouldn't, or found one twice
+ */
+bool spatialQuery_runBenchmark(
+	MemoryArena& scratch)
+{
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(scratch);
+
+	SpatialPersistentStorage& sps = *allocType(scratch, SpatialPersistentStorage);
+	memset(&sps, 0, sizeof(SpatialPersistentStorage));
+
+	SpatialQueryBenchmarkEntity* entities = allocArrayOfType(scratch, SpatialQueryBenchmarkEntity, SpatialQueryBenchmarkEntities);
+	SpatialSphereQuery* sphereQueries = allocArrayOfType(scratch, SpatialSphereQuery, SpatialQueryBenchmarkQueries);
+	SpatialAABBQuery* aabbQueries = allocArrayOfType(scratch, SpatialAABBQuery, SpatialQueryBenchmarkQueries);
+	SpatialFrustumQuery* frustumQueries = allocArrayOfType(scratch, SpatialFrustumQuery, SpatialQueryBenchmarkFrustums);
+	u32* marks = allocArrayOfType(scratch, u32, SCENE_MAX_ENTITIES);
+
+	const dvec3 origin{ 100000.0, 0.0, 100000.0 };
+	const dvec3 extent{ 20000.0, 300.0, 20000.0 };
+	u64 rnd = 0x2545F4914F6CDD1DULL;
+
+	for (u32 e = 0; e < SpatialQueryBenchmarkEntities; ++e) {
+		SpatialQueryBenchmarkEntity& ent = entities[e];
+		ent.center = origin + dvec3{
+			spatialQueryBenchmarkRandom(rnd) * extent.x,
+			spatialQueryBenchmarkRandom(rnd) * extent.y,
+			spatialQueryBenchmarkRandom(rnd) * extent.z };
+		r64 size = spatialQueryBenchmarkRandom(rnd);
+		ent.radius = (r32)(size < 0.98 ? 0.5 + size * 5.0
+						   : size < 0.996 ? 600.0 + (size - 0.98) * 60000.0
+						   : 3000.0 + (size - 0.996) * 1500000.0);
+		if (e < 20) {
+			ent.center = dvec3{ -5000.0 + e, 0.0, origin.z };
+		}
+		ent.spatialInfoId = ComponentId{};
+		ent.spatialInfoId.index = (u16)(e + 1);
+
+		addToSpatialMap(
+			getSpatialKeyForSphere(ent.center, ent.radius),
+			ent.spatialInfoId, ent.center, ent.radius,
+			sps);
+	}
+
+	for (u32 q = 0; q < SpatialQueryBenchmarkQueries; ++q) {
+		dvec3 center = origin + dvec3{
+			spatialQueryBenchmarkRandom(rnd) * extent.x,
+			spatialQueryBenchmarkRandom(rnd) * extent.y,
+			spatialQueryBenchmarkRandom(rnd) * extent.z };
+		sphereQueries[q] = SpatialSphereQuery{ center, (r32)(10.0 + spatialQueryBenchmarkRandom(rnd) * 90.0), 0 };
+
+		dvec3 half{
+			5.0 + spatialQueryBenchmarkRandom(rnd) * 60.0,
+			5.0 + spatialQueryBenchmarkRandom(rnd) * 60.0,
+			5.0 + spatialQueryBenchmarkRandom(rnd) * 60.0 };
+		aabbQueries[q] = SpatialAABBQuery{ center - half, center + half };
+	}
+
+	for (u32 q = 0; q < SpatialQueryBenchmarkFrustums; ++q) {
+		dvec3 eye = origin + dvec3{
+			spatialQueryBenchmarkRandom(rnd) * extent.x,
+			2.0,
+			spatialQueryBenchmarkRandom(rnd) * extent.z };
+		dvec3 direction{ spatialQueryBenchmarkRandom(rnd) - 0.5, 0.0, spatialQueryBenchmarkRandom(rnd) - 0.5 };
+
+		Camera cam{};
+		calcPerspProjection(cam, 60.0f, 16.0f / 9.0f, 1.0f, 3000.0f);
+		lookAt(cam, eye, eye + direction, dvec3{ 0.0, 1.0, 0.0 });
+		calcView(cam);
+
+		// camera space, the view rotation without the translation
+		mat4 viewRotation = make_mat4(cam.frame.view);
+		viewRotation[3] = vec4{ 0.0f, 0.0f, 0.0f, 1.0f };
+		frustumQueries[q] = makeSpatialFrustumQuery(eye, cam.frame.projection * viewRotation);
+	}
+
+	SpatialQueryResults sphereResults = timeSpatialQueries("sphere", SpatialQueryBenchmarkQueries, scratch, [&]() {
+		return querySpatialSpheres(sps, sphereQueries, SpatialQueryBenchmarkQueries, scratch);
+	});
+	SpatialQueryResults aabbResults = timeSpatialQueries("aabb", SpatialQueryBenchmarkQueries, scratch, [&]() {
+		return querySpatialAABBs(sps, aabbQueries, SpatialQueryBenchmarkQueries, scratch);
+	});
+	SpatialQueryResults frustumResults = timeSpatialQueries("frustum", SpatialQueryBenchmarkFrustums, scratch, [&]() {
+		return querySpatialFrustums(sps, frustumQueries, SpatialQueryBenchmarkFrustums, scratch);
+	});
+
+	auto sphereGap = [&](u32 q, const SpatialQueryBenchmarkEntity& e) {
+		return length(e.center - sphereQueries[q].center) - (e.radius + sphereQueries[q].radius);
+	};
+	auto aabbGap = [&](u32 q, const SpatialQueryBenchmarkEntity& e) {
+		const dvec3& lo = aabbQueries[q].minCorner;
+		const dvec3& hi = aabbQueries[q].maxCorner;
+		dvec3 d{
+			max(max(lo.x - e.center.x, e.center.x - hi.x), 0.0),
+			max(max(lo.y - e.center.y, e.center.y - hi.y), 0.0),
+			max(max(lo.z - e.center.z, e.center.z - hi.z), 0.0) };
+		return length(d) - e.radius;
+	};
+	// planes are normalized, the farthest the sphere is behind any of them. Spheres near the
+	// frustum's corners can be outside without being behind any one plane, so this is conservative.
+	auto frustumPlaneGap = [&](u32 q, const SpatialQueryBenchmarkEntity& e) {
+		const FrustumSoA& f = frustumQueries[q].frustum;
+		dvec3 p = e.center - frustumQueries[q].eyePoint;
+		r64 g = -DBL_MAX;
+		for (u32 i = 0; i < 6; ++i) {
+			g = max(g, f.d[i] - (f.nx[i] * p.x + f.ny[i] * p.y + f.nz[i] * p.z) - e.radius);
+		}
+		return g;
+	};
+	// the query only visits cells near the frustum's bounds, so a sphere must also reach the bounds
+	auto frustumGap = [&](u32 q, const SpatialQueryBenchmarkEntity& e) {
+		const SpatialFrustumQuery& fq = frustumQueries[q];
+		dvec3 p = e.center - fq.eyePoint;
+		dvec3 d{
+			max(max(fq.boundsMin.x - p.x, p.x - fq.boundsMax.x), 0.0),
+			max(max(fq.boundsMin.y - p.y, p.y - fq.boundsMax.y), 0.0),
+			max(max(fq.boundsMin.z - p.z, p.z - fq.boundsMax.z), 0.0) };
+		return max(frustumPlaneGap(q, e), length(d) - e.radius);
+	};
+
+	u32 sphereWrong = checkSpatialQueryResults(sphereResults, entities, marks, sphereGap, sphereGap);
+	u32 aabbWrong = checkSpatialQueryResults(aabbResults, entities, marks, aabbGap, aabbGap);
+	u32 frustumWrong = checkSpatialQueryResults(frustumResults, entities, marks, frustumGap, frustumPlaneGap);
+
+	if (sphereWrong > 0 || aabbWrong > 0 || frustumWrong > 0) {
+		logger::error("spatial queries don't match brute force: %u sphere, %u aabb and %u frustum results wrong",
+					  sphereWrong, aabbWrong, frustumWrong);
+		return false;
+	}
+	return true;
+}
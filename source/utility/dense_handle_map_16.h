@@ -29,6 +29,8 @@ struct DenseHandleMap16 {
 	u16		elementSizeB : 14;			// size in bytes of individual stored objects
 	u16		_fragmented  : 1;			// set to 1 if modified by insert or erase since last complete defragment
 	u16		_memoryOwned : 1;			// set to 1 if buffer memory is owned by DenseHandleMap16
+	u16		highWater = 0;				// sparseIds at and above were never taken off the freelist since reset
+	u16		_padding[3] = {};
 	
 	// Functions
 	
@@ -94,6 +96,42 @@ struct DenseHandleMap16 {
 		void** out = nullptr,
 		u8 typeId = 0);
 
+	/**
+	 * Adds count items at once, each a copy of src or zeroed if src is null, writing their handles
+	 * to outHandles. The new items are contiguous in the inner array starting at the returned
+	 * inner index, so they can be initialized in one pass with item().
+	 * @param		typeId	typeId used by the h32::typeId variable for this container
+	 * @returns inner index of the first new item
+	 */
+	u16 insertN(
+		u32 count,
+		const void* src,
+		h32* outHandles,
+		u8 typeId = 0);
+
+	/**
+	 * Takes a handle off the freelist without adding an item, so the handle can be handed out
+	 * before its item exists. The handle stays invalid until insertReserved adds the item, or it
+	 * goes back to the freelist with releaseReserved. Reserved handles are kept by clear.
+	 * @param		typeId	typeId used by the h32::typeId variable for this container
+	 * @returns the handle, or null_h32 if there are no free handles left
+	 */
+	h32 reserve(u8 typeId = 0);
+
+	/**
+	 * Adds the item of a handle returned by reserve, the handle becomes valid.
+	 * @param[in]	src		optional pointer to an object to copy into inner storage
+	 * @returns pointer to the new object
+	 */
+	void* insertReserved(
+		h32 handle,
+		void* src = nullptr);
+
+	/**
+	 * Returns a reserved handle that won't be used to the freelist.
+	 */
+	void releaseReserved(h32 handle);
+
 	/**
 	 * Removes all items, leaving the sparseIds set intact by adding each entry to the free-
 	 * list and keeping its generation. This operation is slower than @c reset, but safer for the
@@ -112,6 +150,13 @@ struct DenseHandleMap16 {
 	 */
 	void reset();
 
+	/**
+	 * Sets the high water mark after the sparseIds below it were copied back from an earlier
+	 * state of the map, e.g. from a snapshot. Lowering it returns the sparseIds above to the state
+	 * reset leaves them in, which they were in when the copy was taken.
+	 */
+	void setHighWater(u16 newHighWater);
+
 	/**
 	* @returns true if handle handle refers to a valid item
 	*/
@@ -181,6 +226,9 @@ struct DenseHandleMap16 {
 };
 static_assert_aligned_size(DenseHandleMap16,8);
 
+// inner index of a reserved slot, distinct from freelist links which are < capacity or USHRT_MAX
+const u16 DenseHandleMap16ReservedIndex = USHRT_MAX-1;
+
 
 size_t DenseHandleMap16::getTotalBufferSize(u16 elementSizeB, u16 capacity)
 {
@@ -198,12 +246,16 @@ h32 DenseHandleMap16::insert(
 	void** out,
 	u8 typeId)
 {
-	assert(length < capacity && "DenseHandleMap16 is full");
+	assert(length < capacity && freeListFront != USHRT_MAX && "DenseHandleMap16 is full");
 	h32 handle = null_h32;
 	
-	if (length < capacity) {
+	// reserved handles are off the freelist, so it can run out before length reaches capacity
+	if (length < capacity && freeListFront != USHRT_MAX) {
 		u16 sparseIndex = freeListFront;
 		h32 innerId = sparseIds[sparseIndex];
+		if (sparseIndex >= highWater) {
+			highWater = sparseIndex + 1;
+		}
 
 		freeListFront = innerId.index; // the index of a free slot refers to the next free slot
 
@@ -238,6 +290,137 @@ h32 DenseHandleMap16::insert(
 }
 
 
+u16 DenseHandleMap16::insertN(
+	u32 count,
+	const void* src,
+	h32* outHandles,
+	u8 typeId)
+{
+	assert(length + count <= capacity && "DenseHandleMap16 is full");
+	u16 first = length;
+
+	for (u32 i = 0; i < count; ++i) {
+		assert(freeListFront != USHRT_MAX && "DenseHandleMap16 is full");
+		u16 sparseIndex = freeListFront;
+		h32 innerId = sparseIds[sparseIndex];
+		if (sparseIndex >= highWater) {
+			highWater = sparseIndex + 1;
+		}
+
+		freeListFront = innerId.index;
+
+		innerId.free = 0;
+		++innerId.generation;
+		innerId.index = (u16)(first + i);
+		innerId.typeId = typeId;
+		sparseIds[sparseIndex] = innerId;
+
+		h32 handle = innerId;
+		handle.index = sparseIndex;
+		outHandles[i] = handle;
+
+		denseToSparse[first + i] = sparseIndex;
+	}
+
+	// fill the new items by doubling the copied range
+	if (count > 0) {
+		u8* items0 = (u8*)item(first);
+		size_t total = (size_t)count * elementSizeB;
+		if (src) {
+			memcpy(items0, src, elementSizeB);
+			for (size_t filled = elementSizeB; filled < total; filled *= 2) {
+				memcpy(items0 + filled, items0, (filled < total - filled ? filled : total - filled));
+			}
+		}
+		else {
+			memset(items0, 0, total);
+		}
+	}
+
+	length = (u16)(length + count);
+	_fragmented = 1;
+
+	return first;
+}
+
+
+h32 DenseHandleMap16::reserve(u8 typeId)
+{
+	assert(freeListFront != USHRT_MAX && "DenseHandleMap16 is full");
+	h32 handle = null_h32;
+
+	if (freeListFront != USHRT_MAX) {
+		u16 sparseIndex = freeListFront;
+		h32 innerId = sparseIds[sparseIndex];
+		if (sparseIndex >= highWater) {
+			highWater = sparseIndex + 1;
+		}
+
+		freeListFront = innerId.index;
+
+		// the slot stays free until its item is inserted, but is off the freelist
+		++innerId.generation;
+		innerId.index = DenseHandleMap16ReservedIndex;
+		innerId.typeId = typeId;
+		sparseIds[sparseIndex] = innerId;
+
+		handle = innerId;
+		handle.free = 0;
+		handle.index = sparseIndex;
+	}
+
+	return handle;
+}
+
+
+void* DenseHandleMap16::insertReserved(
+	h32 handle,
+	void* src)
+{
+	assert(handle.index < capacity && "handle index out of range");
+	assert(length < capacity && "DenseHandleMap16 is full");
+
+	h32 innerId = sparseIds[handle.index];
+	assert(innerId.free == 1 && innerId.index == DenseHandleMap16ReservedIndex
+			&& innerId.typeId == handle.typeId && innerId.generation == handle.generation
+			&& "handle is not reserved");
+
+	innerId.free = 0;
+	innerId.index = length;
+	sparseIds[handle.index] = innerId;
+
+	denseToSparse[length] = handle.index;
+
+	void* pItem = item(length);
+	if (src) {
+		itemcpy(pItem, src);
+	}
+	else {
+		itemzero(pItem);
+	}
+
+	++length;
+	_fragmented = 1;
+
+	return pItem;
+}
+
+
+void DenseHandleMap16::releaseReserved(h32 handle)
+{
+	assert(handle.index < capacity && "handle index out of range");
+
+	h32 innerId = sparseIds[handle.index];
+	assert(innerId.free == 1 && innerId.index == DenseHandleMap16ReservedIndex
+			&& innerId.generation == handle.generation && "handle is not reserved");
+
+	// push onto the freelist, keeping the generation so the handle stays stale
+	innerId.index = freeListFront;
+	sparseIds[handle.index] = innerId;
+	freeListFront = handle.index;
+}
+
+
 bool DenseHandleMap16::erase(h32 handle)
 {
 	if (!has(handle)) {
@@ -312,6 +495,7 @@ void DenseHandleMap16::reset()
 	sparseIds[capacity-1].index = USHRT_MAX;
 	
 	length = 0;
+	highWater = 0;
 	_fragmented = 0;
 
 	#if defined(QUAGMIRE_SLOWCHECKS) && QUAGMIRE_SLOWCHECKS != 0
@@ -321,6 +505,19 @@ void DenseHandleMap16::reset()
 }
 
 
+void DenseHandleMap16::setHighWater(u16 newHighWater)
+{
+	assert(newHighWater <= capacity && "high water mark out of range");
+
+	h32 innerId = { 0, 0, 0, 1 };
+	for (u32 i = newHighWater; i < highWater; ++i) {
+		innerId.index = (i + 1 < capacity ? (u16)(i + 1) : USHRT_MAX);
+		sparseIds[i].value = innerId.value;
+	}
+	highWater = newHighWater;
+}
+
+
 void* DenseHandleMap16::at(h32 handle)
 {
 	void* pItem = nullptr;
@@ -481,6 +678,14 @@ void DenseHandleMap16::deinit()
 		HndType insert(Type* src = nullptr, Type** out = nullptr, u8 typeId = TypeId) {\
 			return _map.insert((void*)src, (void**)out, typeId);\
 		}\
+		u16 insertN(u32 count, const Type* src, HndType* outHandles, u8 typeId = TypeId) {\
+			return _map.insertN(count, (const void*)src, outHandles, typeId);\
+		}\
+		HndType reserve(u8 typeId = TypeId)	{ return _map.reserve(typeId); }\
+		Type* insertReserved(HndType handle, Type* src = nullptr) {\
+			return (Type*)_map.insertReserved(handle, (void*)src);\
+		}\
+		void releaseReserved(HndType handle)	{ _map.releaseReserved(handle); }\
 		void clear()						{ _map.clear(); }\
 		void reset()						{ _map.reset(); }\
 		bool has(HndType handle)			{ return _map.has(handle); }\
@@ -519,6 +724,14 @@ void DenseHandleMap16::deinit()
 		HndType insert(Type* src = nullptr, Type** out = nullptr, u8 typeId = TypeId) {\
 			return _map.insert((void*)src, (void**)out, typeId);\
 		}\
+		u16 insertN(u32 count, const Type* src, HndType* outHandles, u8 typeId = TypeId) {\
+			return _map.insertN(count, (const void*)src, outHandles, typeId);\
+		}\
+		HndType reserve(u8 typeId = TypeId)	{ return _map.reserve(typeId); }\
+		Type* insertReserved(HndType handle, Type* src = nullptr) {\
+			return (Type*)_map.insertReserved(handle, (void*)src);\
+		}\
+		void releaseReserved(HndType handle)	{ _map.releaseReserved(handle); }\
 		void clear()						{ _map.clear(); }\
 		void reset()						{ _map.reset(); }\
 		bool has(HndType handle)			{ return _map.has(handle); }\
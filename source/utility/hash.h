@@ -2,47 +2,9 @@
 #define _HASH_H
 
 #include "common.h"
+#include "intrinsics.h"
 
 
-static const u32 crcTable[256] = {
-	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
-	0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
-	0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
-	0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-	0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
-	0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
-	0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
-	0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-	0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
-	0xB6662D3D, 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F,
-	0x9FBFE4A5, 0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB,
-	0x086D3D2D, 0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA,
-	0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE,
-	0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A,
-	0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-	0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409,
-	0xCE61E49F, 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
-	0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739,
-	0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
-	0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268,
-	0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0,
-	0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8,
-	0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF,
-	0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703,
-	0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7,
-	0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D, 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
-	0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE,
-	0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
-	0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6,
-	0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-	0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D,
-	0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5,
-	0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605,
-	0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D};
-
 // Generate CRC lookup table
 template <u32 c, int k = 8>
 struct _f : _f<((c & 1) ? 0xedb88320 : 0U) ^ (c >> 1), k - 1> {};
@@ -87,18 +49,226 @@ constexpr u32 CRC32(const char* str)
 	return crc32_c(str, strlen_c(str));
 }
 
+
+/**
+ * Runtime crc and hash functions are dispatched to the widest kernel the cpu supports once
+ * hash_selectKernels is called, every kernel of a function produces the same output. The crc32
+ * functions use the same polynomial as crc32_c, so ids computed at compile time and at runtime
+ * match. crc32cUpdate uses the Castagnoli polynomial of the SSE4.2 crc32 instruction and doesn't
+ * match crc32.
+ */
+
+struct CrcSliceTables {
+	u32		t[8][256];
+};
+
+/**
+ * Tables for slicing by 8, t[0] is the byte-wise table and t[s] advances t[s-1] by a zero byte.
+ */
+constexpr CrcSliceTables makeCrcSliceTables(
+	u32 poly)
+{
+	CrcSliceTables r{};
+	for (u32 i = 0; i < 256; ++i) {
+		u32 c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? (c >> 1) ^ poly : (c >> 1);
+		}
+		r.t[0][i] = c;
+	}
+	for (u32 s = 1; s < 8; ++s) {
+		for (u32 i = 0; i < 256; ++i) {
+			r.t[s][i] = (r.t[s-1][i] >> 8) ^ r.t[0][r.t[s-1][i] & 0xFF];
+		}
+	}
+	return r;
+}
+
+static constexpr CrcSliceTables crc32Tables  = makeCrcSliceTables(0xEDB88320);
+static constexpr CrcSliceTables crc32cTables = makeCrcSliceTables(0x82F63B78);
+
+
+/**
+ * Kernels take and return the running crc, which is the crc inverted.
+ */
+typedef u32 CrcUpdateFunc(u32 crc, const u8* data, size_t len);
+
+
+/**
+ * Slicing by 8, the portable kernel of both polynomials, 8 table lookups per 8 bytes.
+ */
+inline u32 crcUpdate_slice8(
+	const CrcSliceTables& tables,
+	u32 crc,
+	const u8* data,
+	size_t len)
+{
+	const u32 (&t)[8][256] = tables.t;
+	for (; len >= 8; len -= 8, data += 8) {
+		u64 w;
+		memcpy(&w, data, sizeof(w));
+		w ^= crc;
+		crc = t[7][w & 0xFF]         ^ t[6][(w >> 8) & 0xFF]
+			^ t[5][(w >> 16) & 0xFF] ^ t[4][(w >> 24) & 0xFF]
+			^ t[3][(w >> 32) & 0xFF] ^ t[2][(w >> 40) & 0xFF]
+			^ t[1][(w >> 48) & 0xFF] ^ t[0][w >> 56];
+	}
+	for (; len > 0; --len, ++data) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+	}
+	return crc;
+}
+
+static u32 crc32Update_slice8(
+	u32 crc,
+	const u8* data,
+	size_t len)
+{
+	return crcUpdate_slice8(crc32Tables, crc, data, len);
+}
+
+static u32 crc32cUpdate_slice8(
+	u32 crc,
+	const u8* data,
+	size_t len)
+{
+	return crcUpdate_slice8(crc32cTables, crc, data, len);
+}
+
+
+/**
+ * Folds 64 bytes at a time with carry-less multiplies and reduces to 32 bits with Barrett
+ * reduction, see Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction". The constants are powers of x modulo the bit-reflected IEEE polynomial. Inputs
+ * shorter than 64 bytes and the tail under 16 bytes go through slicing by 8. Only call when
+ * cpuFeatures.pclmul and cpuFeatures.sse41 are set.
+ */
+SIMD_TARGET("pclmul,sse4.1")
+static u32 crc32Update_pclmul(
+	u32 crc,
+	const u8* data,
+	size_t len)
+{
+	if (len < 64) {
+		return crc32Update_slice8(crc, data, len);
+	}
+
+	alignas(16) static const u64 k1k2[2] = { 0x0154442BD4, 0x01C6E41596 };
+	alignas(16) static const u64 k3k4[2] = { 0x01751997D0, 0x00CCAA009E };
+	alignas(16) static const u64 k5k0[2] = { 0x0163CD6124, 0x0000000000 };
+	alignas(16) static const u64 poly[2] = { 0x01DB710641, 0x01F7011641 };
+
+	__m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+
+	__m128i k = _mm_load_si128((const __m128i*)k1k2);
+	data += 64;
+	len -= 64;
+
+	// fold 4 lanes of 128 bits each forward by 512 bits
+	for (; len >= 64; len -= 64, data += 64) {
+		__m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+	}
+
+	// fold the 4 lanes into one
+	k = _mm_load_si128((const __m128i*)k3k4);
+
+	__m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// fold the remaining whole 128 bit blocks
+	for (; len >= 16; len -= 16, data += 16) {
+		x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+	}
+
+	// fold 128 bits to 64
+	__m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	k = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduce to 32 bits
+	k = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	crc = (u32)_mm_extract_epi32(x1, 1);
+
+	return crc32Update_slice8(crc, data, len);
+}
+
+
+/**
+ * The SSE4.2 crc32 instruction, 8 bytes per instruction. Only call when cpuFeatures.sse42 is set.
+ */
+SIMD_TARGET("sse4.2")
+static u32 crc32cUpdate_sse42(
+	u32 crc,
+	const u8* data,
+	size_t len)
+{
+	u64 c = crc;
+	for (; len >= 8; len -= 8, data += 8) {
+		u64 w;
+		memcpy(&w, data, sizeof(w));
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = (u32)c;
+	for (; len > 0; --len, ++data) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+
+
+static CrcUpdateFunc* crc32Update  = crc32Update_slice8;
+static CrcUpdateFunc* crc32cUpdate = crc32cUpdate_slice8;
+
+
+/**
+ * @param inCrc	the crc of the data before, to continue it across buffers
+ */
 static u32 crc32(
 	const u8* data,
 	size_t len,
 	u32 inCrc = 0U)
 {
-	u32 crc32 = inCrc ^ 0xFFFFFFFF;
-	//u8* byteBuf = (u8*)data;
-	for (size_t i = 0; i < len; ++i)
-	{
-		crc32 = (crc32 >> 8) ^ crcTable[(crc32 ^ data[i]) & 0xFF];
-	}
-	return (crc32 ^ 0xFFFFFFFF);
+	return ~crc32Update(~inCrc, data, len);
 }
 
 static u32 crc32(
@@ -211,4 +381,276 @@ u32 superFastHash(
 }
 
 
+/**
+ * Fast 64 bit non-cryptographic hash for content deduplication and state checksums, in the style
+ * of XXH3. Input is read in 64 byte stripes into 8 accumulators, each word is XORed with a secret
+ * word and the product of its two halves is added to its own accumulator while the word itself
+ * goes to its neighbor. The 32x32 bit multiplies map to SIMD lanes, so the vector kernels do the
+ * same math as the scalar one. Every 16 stripes the accumulators are scrambled, and at the end
+ * they're merged with 128 bit multiplies and the length.
+ */
+
+const u32 Hash64StripeSize		= 64;
+const u32 Hash64StripesPerBlock	= 16;
+const u32 Hash64ScrambleKey		= 16;	// word of the secret where each key starts
+const u32 Hash64LastStripeKey	= 13;
+const u32 Hash64MergeKey		= 24;
+
+const u64 Hash64Prime32_1 = 0x9E3779B1U;
+const u64 Hash64Prime64_1 = 0x9E3779B185EBCA87ULL;
+
+struct Hash64Secret {
+	u64		words[32];
+};
+
+/**
+ * Splitmix64 sequence, stripe n of a block is keyed by words n to n+7.
+ */
+constexpr Hash64Secret makeHash64Secret(
+	u64 seed)
+{
+	Hash64Secret r{};
+	for (u32 i = 0; i < 32; ++i) {
+		seed += 0x9E3779B97F4A7C15ULL;
+		u64 z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		r.words[i] = z ^ (z >> 31);
+	}
+	return r;
+}
+
+static constexpr Hash64Secret hash64Secret = makeHash64Secret(0x51A3C4B2D9E8F716ULL);
+
+
+typedef void Hash64AccumulateFunc(u64* acc, const u8* data, size_t numStripes, const u64* key);
+typedef void Hash64ScrambleFunc(u64* acc, const u64* key);
+
+
+static void hash64Accumulate_scalar(
+	u64* acc,
+	const u8* data,
+	size_t numStripes,
+	const u64* key)
+{
+	for (size_t n = 0; n < numStripes; ++n) {
+		const u8* stripe = data + n * Hash64StripeSize;
+		for (u32 i = 0; i < 8; ++i) {
+			u64 d;
+			memcpy(&d, stripe + i * 8, sizeof(d));
+			u64 k = d ^ key[n + i];
+			acc[i ^ 1] += d;
+			acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+		}
+	}
+}
+
+static void hash64Scramble_scalar(
+	u64* acc,
+	const u64* key)
+{
+	for (u32 i = 0; i < 8; ++i) {
+		u64 a = acc[i];
+		a ^= a >> 47;
+		a ^= key[i];
+		acc[i] = a * Hash64Prime32_1;
+	}
+}
+
+
+static void hash64Accumulate_sse2(
+	u64* acc,
+	const u8* data,
+	size_t numStripes,
+	const u64* key)
+{
+	__m128i a[4];
+	for (u32 j = 0; j < 4; ++j) {
+		a[j] = _mm_loadu_si128((const __m128i*)acc + j);
+	}
+
+	for (size_t n = 0; n < numStripes; ++n) {
+		const u8* stripe = data + n * Hash64StripeSize;
+		for (u32 j = 0; j < 4; ++j) {
+			__m128i d = _mm_loadu_si128((const __m128i*)stripe + j);
+			__m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)(key + n + j*2)));
+			__m128i product = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+			// swap the 64 bit halves so each word goes to its neighbor's accumulator
+			__m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+			a[j] = _mm_add_epi64(a[j], _mm_add_epi64(swapped, product));
+		}
+	}
+
+	for (u32 j = 0; j < 4; ++j) {
+		_mm_storeu_si128((__m128i*)acc + j, a[j]);
+	}
+}
+
+static void hash64Scramble_sse2(
+	u64* acc,
+	const u64* key)
+{
+	const __m128i prime = _mm_set1_epi32((int)Hash64Prime32_1);
+	for (u32 j = 0; j < 4; ++j) {
+		__m128i a = _mm_loadu_si128((const __m128i*)acc + j);
+		a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+		a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(key + j*2)));
+		// 64 bit by 32 bit multiply from the products of both halves
+		__m128i lo = _mm_mul_epu32(a, prime);
+		__m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+		_mm_storeu_si128((__m128i*)acc + j, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+	}
+}
+
+
+/**
+ * Same as the sse2 kernels with 4 words per register. Only call when cpuFeatures.avx2 is set.
+ */
+SIMD_TARGET("avx2")
+static void hash64Accumulate_avx2(
+	u64* acc,
+	const u8* data,
+	size_t numStripes,
+	const u64* key)
+{
+	__m256i a0 = _mm256_loadu_si256((const __m256i*)acc);
+	__m256i a1 = _mm256_loadu_si256((const __m256i*)acc + 1);
+
+	for (size_t n = 0; n < numStripes; ++n) {
+		const u8* stripe = data + n * Hash64StripeSize;
+		__m256i d0 = _mm256_loadu_si256((const __m256i*)stripe);
+		__m256i d1 = _mm256_loadu_si256((const __m256i*)stripe + 1);
+		__m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i*)(key + n)));
+		__m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i*)(key + n + 4)));
+
+		a0 = _mm256_add_epi64(a0, _mm256_add_epi64(
+				_mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)),
+				_mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32))));
+		a1 = _mm256_add_epi64(a1, _mm256_add_epi64(
+				_mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)),
+				_mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32))));
+	}
+
+	_mm256_storeu_si256((__m256i*)acc, a0);
+	_mm256_storeu_si256((__m256i*)acc + 1, a1);
+}
+
+SIMD_TARGET("avx2")
+static void hash64Scramble_avx2(
+	u64* acc,
+	const u64* key)
+{
+	const __m256i prime = _mm256_set1_epi32((int)Hash64Prime32_1);
+	for (u32 j = 0; j < 2; ++j) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)acc + j);
+		a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+		a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)(key + j*4)));
+		__m256i lo = _mm256_mul_epu32(a, prime);
+		__m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+		_mm256_storeu_si256((__m256i*)acc + j, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+	}
+}
+
+
+static Hash64AccumulateFunc*	hash64Accumulate = hash64Accumulate_sse2;
+static Hash64ScrambleFunc*		hash64Scramble = hash64Scramble_sse2;
+
+
+inline u64 mul128Fold64(
+	u64 a,
+	u64 b)
+{
+	#ifdef _MSC_VER
+	u64 hi;
+	u64 lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+	#else
+	__uint128_t p = (__uint128_t)a * b;
+	return (u64)p ^ (u64)(p >> 64);
+	#endif
+}
+
+
+/**
+ * Hashes with the kernels passed, hash64 uses the dispatched ones.
+ */
+inline u64 hash64_kernels(
+	Hash64AccumulateFunc* accumulate,
+	Hash64ScrambleFunc* scramble,
+	const void* data,
+	size_t len,
+	u64 seed)
+{
+	const u8* p = (const u8*)data;
+	const u64* key = hash64Secret.words;
+
+	u64 acc[8] = {
+		0xC2B2AE3DULL + seed,		 0x9E3779B185EBCA87ULL + seed,
+		0xC2B2AE3D27D4EB4FULL + seed, 0x165667B19E3779F9ULL + seed,
+		0x85EBCA77C2B2AE63ULL + seed, 0x85EBCA77ULL + seed,
+		0x27D4EB2F165667C5ULL + seed, 0x9E3779B1ULL + seed
+	};
+
+	if (len <= Hash64StripeSize) {
+		u8 stripe[Hash64StripeSize] = {};
+		memcpy(stripe, p, len);
+		accumulate(acc, stripe, 1, key);
+	}
+	else {
+		// the last stripe is always hashed on its own, ending at the end of the data and
+		// overlapping the stripe before when the length isn't a multiple of the stripe size
+		size_t numStripes = (len - 1) / Hash64StripeSize;
+		size_t numBlocks = numStripes / Hash64StripesPerBlock;
+		const size_t blockSize = Hash64StripeSize * Hash64StripesPerBlock;
+
+		for (size_t b = 0; b < numBlocks; ++b) {
+			accumulate(acc, p + b * blockSize, Hash64StripesPerBlock, key);
+			scramble(acc, key + Hash64ScrambleKey);
+		}
+		accumulate(acc, p + numBlocks * blockSize, numStripes % Hash64StripesPerBlock, key);
+		accumulate(acc, p + len - Hash64StripeSize, 1, key + Hash64LastStripeKey);
+	}
+
+	u64 h = len * Hash64Prime64_1;
+	for (u32 i = 0; i < 8; i += 2) {
+		h += mul128Fold64(acc[i] ^ key[Hash64MergeKey + i], acc[i+1] ^ key[Hash64MergeKey + i+1]);
+	}
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+
+static u64 hash64(
+	const void* data,
+	size_t len,
+	u64 seed = 0)
+{
+	return hash64_kernels(hash64Accumulate, hash64Scramble, data, len, seed);
+}
+
+
+/**
+ * Points the runtime dispatched crc and hash functions to the widest kernels supported by the
+ * cpu, call after cpu_detectFeatures. Function pointers are reset on each module load.
+ */
+void hash_selectKernels(
+	const CpuFeatures& cf)
+{
+	crc32Update = (cf.pclmul && cf.sse41
+		? crc32Update_pclmul
+		: crc32Update_slice8);
+	crc32cUpdate = (cf.sse42
+		? crc32cUpdate_sse42
+		: crc32cUpdate_slice8);
+	hash64Accumulate = (cf.avx2
+		? hash64Accumulate_avx2
+		: hash64Accumulate_sse2);
+	hash64Scramble = (cf.avx2
+		? hash64Scramble_avx2
+		: hash64Scramble_sse2);
+}
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "hash.h"
+#include "logger.h"
+#include "memory.h"
+#include <SDL_timer.h>
+
+
+typedef u64 HashBenchmarkFunc(const u8* data, size_t len);
+
+struct HashBenchmarkKernel {
+	const char*			name;
+	HashBenchmarkFunc*	func;
+	HashBenchmarkFunc*	reference;		// portable kernel the output must match
+	bool				supported;
+};
+
+
+static u64 benchCrc32Bytewise(const u8* data, size_t len)
+{
+	u32 crc = ~0U;
+	for (size_t i = 0; i < len; ++i) {
+		crc = (crc >> 8) ^ crcTable_c[(crc ^ data[i]) & 0xFF];
+	}
+	return ~crc;
+}
+
+static u64 benchCrc32Slice8(const u8* data, size_t len)	{ return ~crc32Update_slice8(~0U, data, len); }
+static u64 benchCrc32Pclmul(const u8* data, size_t len)	{ return ~crc32Update_pclmul(~0U, data, len); }
+static u64 benchCrc32cSlice8(const u8* data, size_t len)	{ return ~crc32cUpdate_slice8(~0U, data, len); }
+static u64 benchCrc32cSse42(const u8* data, size_t len)	{ return ~crc32cUpdate_sse42(~0U, data, len); }
+
+static u64 benchHash64Scalar(const u8* data, size_t len)
+{
+	return hash64_kernels(hash64Accumulate_scalar, hash64Scramble_scalar, data, len, 0);
+}
+
+static u64 benchHash64Sse2(const u8* data, size_t len)
+{
+	return hash64_kernels(hash64Accumulate_sse2, hash64Scramble_sse2, data, len, 0);
+}
+
+static u64 benchHash64Avx2(const u8* data, size_t len)
+{
+	return hash64_kernels(hash64Accumulate_avx2, hash64Scramble_avx2, data, len, 0);
+}
+
+
+/**
+ * Checks every kernel the cpu supports against the portable one over all lengths up to a few
+ * stripes and at odd alignments, then logs the throughput of each in GB/s for short keys, scene
+ * chunks and a buffer larger than the L2 cache. Development only, takes about a second.
+ * @param scratch	needs 4 MB free
+ * @returns false if any kernel's output differs from the portable one
+ */
+bool hash_runBenchmark(
+	MemoryArena& scratch,
+	const CpuFeatures& cf)
+{
+	ScopedTemporaryMemory temp = scopedTemporaryMemory(scratch);
+
+	const size_t bufferSize = megabytes(4);
+	u8* buffer = allocArrayOfType(scratch, u8, bufferSize);
+
+	u64 x = 0x2545F4914F6CDD1DULL;
+	for (size_t i = 0; i < bufferSize; ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buffer[i] = (u8)x;
+	}
+
+	HashBenchmarkKernel kernels[] = {
+		{ "crc32 bytewise",	benchCrc32Bytewise,	benchCrc32Bytewise,	true },
+		{ "crc32 slice8",	benchCrc32Slice8,	benchCrc32Bytewise,	true },
+		{ "crc32 pclmul",	benchCrc32Pclmul,	benchCrc32Bytewise,	cf.pclmul && cf.sse41 },
+		{ "crc32c slice8",	benchCrc32cSlice8,	benchCrc32cSlice8,	true },
+		{ "crc32c sse42",	benchCrc32cSse42,	benchCrc32cSlice8,	cf.sse42 != 0 },
+		{ "hash64 scalar",	benchHash64Scalar,	benchHash64Scalar,	true },
+		{ "hash64 sse2",	benchHash64Sse2,	benchHash64Scalar,	true },
+		{ "hash64 avx2",	benchHash64Avx2,	benchHash64Scalar,	cf.avx2 != 0 }
+	};
+	const u32 numKernels = countof(kernels);
+
+	bool match = (crc32((const u8*)"123456789", 9) == CRC32("123456789"));
+
+	for (u32 k = 0; k < numKernels; ++k) {
+		HashBenchmarkKernel& kernel = kernels[k];
+		if (!kernel.supported) {
+			continue;
+		}
+		for (size_t len = 0; len <= 1100; ++len) {
+			for (size_t offset = 0; offset < 8; offset += 3) {
+				if (kernel.func(buffer + offset, len) != kernel.reference(buffer + offset, len)) {
+					logger::error("%s doesn't match at length %llu offset %llu",
+								  kernel.name, (u64)len, (u64)offset);
+					match = false;
+					len = 1100;
+					break;
+				}
+			}
+		}
+	}
+
+	const size_t lengths[] = { 64, 4096, bufferSize };
+	const u64 frequency = SDL_GetPerformanceFrequency();
+
+	for (u32 l = 0; l < countof(lengths); ++l) {
+		size_t len = lengths[l];
+		for (u32 k = 0; k < numKernels; ++k) {
+			HashBenchmarkKernel& kernel = kernels[k];
+			if (!kernel.supported) {
+				continue;
+			}
+			// repeat for at least 40ms
+			volatile u64 sink = 0;
+			u64 bytes = 0;
+			u64 start = SDL_GetPerformanceCounter();
+			u64 elapsed = 0;
+			do {
+				for (u32 r = 0; r < 16; ++r) {
+					sink += kernel.func(buffer, len);
+				}
+				bytes += len * 16;
+				elapsed = SDL_GetPerformanceCounter() - start;
+			}
+			while (elapsed * 25 < frequency);
+
+			double gbPerSecond = (double)bytes * frequency / elapsed / 1.0e9;
+			logger::test("%-16s %8llu bytes: %6.2f GB/s", kernel.name, (u64)len, gbPerSecond);
+		}
+	}
+
+	return match;
+}
@@ -6,9 +6,90 @@
 #include <intrin.h>
 #else
 #include <x86intrin.h>
+#include <cpuid.h>
 #endif
 
 
+/**
+ * Functions using instruction sets above the SSE2 baseline are compiled with a target attribute
+ * on gcc/clang so they can live in the same translation unit, and must only be called after
+ * checking the matching cpuFeatures flag. MSVC emits any intrinsic without a flag.
+ */
+#ifdef _MSC_VER
+#define SIMD_TARGET(isa)
+#else
+#define SIMD_TARGET(isa)	__attribute__((target(isa)))
+#endif
+
+
+struct CpuFeatures {
+	u8	sse41;
+	u8	sse42;
+	u8	pclmul;
+	u8	popcnt;
+	u8	avx;		// also requires OS support for saving ymm registers
+	u8	avx2;
+	u8	fma;
+	u8	bmi1;
+	u8	bmi2;
+	u8	detected;
+};
+
+static CpuFeatures cpuFeatures = {};
+
+/**
+ * Queries cpuid for the instruction sets used by runtime dispatched functions. Call once at
+ * startup (and on module reload) before selecting any dispatched function.
+ */
+const CpuFeatures& cpu_detectFeatures()
+{
+	u32 r1[4] = {}; // eax, ebx, ecx, edx of leaf 1
+	u32 r7[4] = {}; // eax, ebx, ecx, edx of leaf 7 subleaf 0
+	u64 xcr0 = 0;
+
+	#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuidex((int*)r1, 1, 0);
+	if (maxLeaf >= 7) {
+		__cpuidex((int*)r7, 7, 0);
+	}
+	if (r1[2] & (1 << 27)) { // osxsave
+		xcr0 = _xgetbv(0);
+	}
+	#else
+	u32 maxLeaf = __get_cpuid_max(0, nullptr);
+	__get_cpuid(1, &r1[0], &r1[1], &r1[2], &r1[3]);
+	if (maxLeaf >= 7) {
+		__get_cpuid_count(7, 0, &r7[0], &r7[1], &r7[2], &r7[3]);
+	}
+	if (r1[2] & (1 << 27)) { // osxsave
+		u32 lo, hi;
+		__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		xcr0 = ((u64)hi << 32) | lo;
+	}
+	#endif
+
+	// the OS must preserve xmm and ymm state for the avx family to be usable
+	bool osAvx = (xcr0 & 0x6) == 0x6;
+
+	CpuFeatures& cf = cpuFeatures;
+	cf.sse41  = (r1[2] >> 19) & 1;
+	cf.sse42  = (r1[2] >> 20) & 1;
+	cf.pclmul = (r1[2] >> 1) & 1;
+	cf.popcnt = (r1[2] >> 23) & 1;
+	cf.avx    = ((r1[2] >> 28) & 1) && osAvx;
+	cf.fma    = ((r1[2] >> 12) & 1) && cf.avx;
+	cf.avx2   = ((r7[1] >> 5) & 1) && cf.avx;
+	cf.bmi1   = (r7[1] >> 3) & 1;
+	cf.bmi2   = (r7[1] >> 8) & 1;
+	cf.detected = 1;
+
+	return cf;
+}
+
+
 
 inline __m128 simd_set(float x, float y, float z, float w)
 {
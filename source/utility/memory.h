@@ -320,7 +320,7 @@ char* allocStringCopy(
 	(Type*)_allocSize(arena, sizeof(Type), alignof(Type))
 
 #define allocArrayOfType(arena, Type, n) \
-	(Type*)_allocSize(arena, sizeof(Type)*n, alignof(Type))
+	(Type*)_allocSize(arena, sizeof(Type)*(n), alignof(Type))
 
 #define allocBuffer(arena, size, align) \
 	(u8*)_allocSize(arena, size, align)
@@ -444,7 +444,7 @@ char* heapAllocStringCopy(
 	(Type*)_heapAllocSize(arena, sizeof(Type), true)
 
 #define heapAllocArrayOfType(arena, Type, n) \
-	(Type*)_heapAllocSize(arena, sizeof(Type)*n, true)
+	(Type*)_heapAllocSize(arena, sizeof(Type)*(n), true)
 
 #define heapAllocBuffer(arena, size, clearToZero) \
 	(u8*)_heapAllocSize(arena, size, clearToZero)
@@ -15,6 +15,7 @@ MemoryBlock* pushBlock(
 	newBlock->prev = arena.lastBlock;
 	if (arena.lastBlock) {
 		arena.lastBlock->next = newBlock;
+		arena.lastBlock = newBlock;
 	}
 	else {
 		// pushing first block in the arena
@@ -166,12 +167,13 @@ void clearForwardOf(
 	assert(blockStart && usedStart <= blockStart->used);
 	assert(blockStart->blockType == MemoryBlock::ArenaBlock);
 
-	// clear all memory forward of the start block/position
-	blockStart->used = usedStart;
+	// clear all memory forward of the start block/position, only the used part needs zeroing since
+	// memory past it was never handed out
 	memset(
 		(void*)((uintptr_t)blockStart->base + usedStart),
 		0,
-		blockStart->size - blockStart->used);
+		blockStart->used - usedStart);
+	blockStart->used = usedStart;
 	
 	// clear block(s) forward of a start index until the end or an unused block is reached
 	for (;;)
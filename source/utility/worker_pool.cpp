@@ -0,0 +1,123 @@
+#include "worker_pool.h"
+#include <emmintrin.h>
+#include <SDL_timer.h>
+
+
+const u32 WorkerPoolJoinSpins = 4096;
+
+
+/**
+ * Takes units from the current job until none are left.
+ */
+void runWorkUnits(
+	WorkerPool& pool,
+	MemoryArena& frameScoped)
+{
+	for (;;) {
+		u32 unit = (u32)SDL_AtomicAdd(&pool.nextUnit, 1);
+		if (unit >= pool.numUnits) {
+			break;
+		}
+		pool.job(pool.jobData, unit, frameScoped);
+	}
+}
+
+
+int workerThreadProcess(
+	void* ctx)
+{
+	WorkerThread& worker = *(WorkerThread*)ctx;
+	WorkerPool& pool = *worker.pool;
+
+	// the arena must be made on this thread, arenas assert they are only used by their creator
+	worker.frameScoped = makeMemoryArena();
+	_allocSize(worker.frameScoped, megabytes(INIT_WORKER_FRAMESCOPED_BLOCK_MEGABYTES), 16);
+
+	for (;;) {
+		SDL_SemWait(pool.wake);
+		if (SDL_AtomicGet(&pool.quit)) {
+			break;
+		}
+
+		runWorkUnits(pool, worker.frameScoped);
+		SDL_AtomicAdd(&pool.workersBusy, -1);
+	}
+
+	clearArena(worker.frameScoped);
+	return 0;
+}
+
+
+void startWorkerPool(
+	WorkerPool& pool,
+	u32 numWorkers)
+{
+	assert(pool.numWorkers == 0 && "worker pool already started");
+
+	pool.numWorkers = min(numWorkers, (u32)WORKER_POOL_MAX_THREADS);
+	pool.wake = SDL_CreateSemaphore(0);
+	SDL_AtomicSet(&pool.quit, 0);
+
+	for (u32 w = 0; w < pool.numWorkers; ++w) {
+		WorkerThread& worker = pool.workers[w];
+		worker.pool = &pool;
+		worker.thread = SDL_CreateThread(workerThreadProcess, "WorkerThread", (void*)&worker);
+		assert(worker.thread);
+	}
+}
+
+
+void stopWorkerPool(
+	WorkerPool& pool)
+{
+	if (!pool.wake) {
+		return;
+	}
+
+	SDL_AtomicSet(&pool.quit, 1);
+	for (u32 w = 0; w < pool.numWorkers; ++w) {
+		SDL_SemPost(pool.wake);
+	}
+	for (u32 w = 0; w < pool.numWorkers; ++w) {
+		SDL_WaitThread(pool.workers[w].thread, nullptr);
+		pool.workers[w].thread = nullptr;
+	}
+
+	SDL_DestroySemaphore(pool.wake);
+	pool.wake = nullptr;
+	pool.numWorkers = 0;
+}
+
+
+void runParallel(
+	WorkerPool& pool,
+	WorkerPoolJobFunc* job,
+	void* jobData,
+	u32 numUnits,
+	MemoryArena& callerFrameScoped)
+{
+	pool.job = job;
+	pool.jobData = jobData;
+	pool.numUnits = numUnits;
+	SDL_AtomicSet(&pool.nextUnit, 0);
+
+	// wake no more workers than there are units for the calling thread to share
+	u32 numWoken = (numUnits > 1) ? min(pool.numWorkers, numUnits - 1) : 0;
+	SDL_AtomicSet(&pool.workersBusy, (int)numWoken);
+	for (u32 w = 0; w < numWoken; ++w) {
+		SDL_SemPost(pool.wake);
+	}
+
+	runWorkUnits(pool, callerFrameScoped);
+
+	// join, the remaining units are already running so spin rather than sleep, but yield once the
+	// spin gets long in case the workers are waiting for this core
+	for (u32 spins = 0; SDL_AtomicGet(&pool.workersBusy) > 0; ++spins) {
+		if (spins < WorkerPoolJoinSpins) {
+			_mm_pause();
+		}
+		else {
+			SDL_Delay(0);
+		}
+	}
+}
@@ -0,0 +1,80 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <SDL_thread.h>
+#include <SDL_mutex.h>
+#include <SDL_atomic.h>
+#include "common.h"
+#include "memory.h"
+
+
+/**
+ * Function run for each work unit of a parallel job. frameScoped is the arena of the thread
+ * running the unit, use it with scopedTemporaryMemory for scratch memory that doesn't outlive
+ * the unit.
+ */
+typedef void WorkerPoolJobFunc(
+	void* jobData,
+	u32 unit,
+	MemoryArena& frameScoped);
+
+
+struct WorkerPool;
+
+struct WorkerThread {
+	WorkerPool*		pool;
+	SDL_Thread*		thread;
+	MemoryArena		frameScoped;	// created on and only used by this worker thread
+};
+
+
+/**
+ * @struct WorkerPool
+ *	Fixed set of worker threads that run fork/join parallel jobs. A job is split by the caller into
+ *	independent work units, which the workers and the calling thread take in order from a shared
+ *	counter until none are left. runParallel returns once every unit is finished. Units must not
+ *	depend on which thread runs them or on their completion order, so results are deterministic.
+ */
+struct WorkerPool {
+	WorkerThread		workers[WORKER_POOL_MAX_THREADS];
+	u32					numWorkers;
+
+	SDL_sem*			wake;			// posted once per worker for each job
+	SDL_atomic_t		nextUnit;		// next work unit to take
+	SDL_atomic_t		workersBusy;	// workers that haven't finished the current job
+	SDL_atomic_t		quit;
+
+	WorkerPoolJobFunc*	job;
+	void*				jobData;
+	u32					numUnits;
+	u32					_padding;
+};
+
+
+/**
+ * Starts numWorkers threads, clamped to WORKER_POOL_MAX_THREADS. Passing 0 starts no threads, in
+ * which case runParallel runs every unit on the calling thread.
+ */
+void startWorkerPool(
+	WorkerPool& pool,
+	u32 numWorkers);
+
+/**
+ * Signals the workers to exit and joins them. Must not be called while a job is running.
+ */
+void stopWorkerPool(
+	WorkerPool& pool);
+
+/**
+ * Runs job for units [0, numUnits) on the worker threads and the calling thread, and returns when
+ * all units are finished. Jobs don't nest, only call this from the thread that owns the pool.
+ */
+void runParallel(
+	WorkerPool& pool,
+	WorkerPoolJobFunc* job,
+	void* jobData,
+	u32 numUnits,
+	MemoryArena& callerFrameScoped);
+
+
+#endif